@@ -124,6 +124,11 @@ void arch_pgdir_clear(pgdir_t *pd)
 	*pd = 0;
 }
 
+void arch_load_addr_space(struct proc *p)
+{
+	lcr3(p->env_cr3);
+}
+
 /* Returns the page shift of the largest jumbo supported */
 int arch_max_jumbo_page_shift(void)
 {
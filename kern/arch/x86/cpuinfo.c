@@ -189,12 +189,15 @@ void print_cpuinfo(void)
 	#define CPUID_XSAVEOPT_SUPPORT      (1 << 0)
 	#define CPUID_MONITOR_MWAIT         (1 << 3)
 	#define CPUID_MWAIT_PWR_MGMT        (1 << 0)
+	#define CPUID_PCID_SUPPORT          (1 << 17)
 
 	cpuid(0x01, 0x00, 0, 0, &ecx, &edx);
 	if (CPUID_FXSR_SUPPORT & edx)
 		cpu_set_feat(CPU_FEAT_X86_FXSR);
 	if (CPUID_XSAVE_SUPPORT & ecx)
 		cpu_set_feat(CPU_FEAT_X86_XSAVE);
+	if (CPUID_PCID_SUPPORT & ecx)
+		cpu_set_feat(CPU_FEAT_X86_PCID);
 
 	cpuid(0x0d, 0x01, &eax, 0, 0, 0);
 	if (CPUID_XSAVEOPT_SUPPORT & eax)
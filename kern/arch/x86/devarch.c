@@ -67,6 +67,7 @@ enum {
 	Qperf,
 	Qcstate,
 	Qpstate,
+	Qpcid,
 
 	Qmax,
 };
@@ -88,6 +89,7 @@ static struct dirtab archdir[Qmax] = {
 	{"perf", {Qperf, 0}, 0, 0666},
 	{"c-state", {Qcstate, 0}, 0, 0666},
 	{"p-state", {Qpstate, 0}, 0, 0666},
+	{"pcid", {Qpcid, 0}, 0, 0666},
 };
 
 /* White list entries must not overlap. */
@@ -497,6 +499,21 @@ static void archclose(struct chan *c)
 	}
 }
 
+static size_t pcid_read(void *va, size_t n, off64_t off)
+{
+	struct pcid_stats stats;
+	char buf[160];
+
+	pcid_fetch_stats(&stats);
+	snprintf(buf, sizeof(buf),
+		 "supported: %d\nenabled: %d\nreused: %lu\nstale: %lu\n"
+		 "evicted: %lu\nuntagged: %lu\n",
+		 cpu_has_feat(CPU_FEAT_X86_PCID), pcid_enabled,
+		 stats.nr_reused, stats.nr_stale, stats.nr_evicted,
+		 stats.nr_untagged);
+	return readstr(off, va, n, buf);
+}
+
 static size_t archread(struct chan *c, void *a, size_t n, off64_t offset)
 {
 	char *buf, *p;
@@ -600,6 +617,8 @@ static size_t archread(struct chan *c, void *a, size_t n, off64_t offset)
 		return readnum_hex(offset, a, n, get_cstate(), NUMSIZE32);
 	case Qpstate:
 		return readnum_hex(offset, a, n, get_pstate(), NUMSIZE32);
+	case Qpcid:
+		return pcid_read(a, n, offset);
 	}
 	default:
 		error(EINVAL, ERROR_FIXME);
@@ -642,6 +661,19 @@ static ssize_t cstate_write(void *ubuf, size_t len, off64_t off)
 	return len;
 }
 
+/* Turning PCIDs off just loads everyone into PCID 0.  The per-core PCIDs keep
+ * their tlb_gens, so if we turn them back on, any shootdowns in the meantime
+ * still flush. */
+static ssize_t pcid_write(void *ubuf, size_t len, off64_t off)
+{
+	unsigned long val = strtoul_from_ubuf(ubuf, len, off);
+
+	if (val && !cpu_has_feat(CPU_FEAT_X86_PCID))
+		error(ENODEV, "This CPU does not support PCIDs");
+	pcid_enabled = val ? TRUE : FALSE;
+	return len;
+}
+
 static void __smp_set_pstate(void *arg)
 {
 	unsigned int val = (unsigned int)(unsigned long)arg;
@@ -742,6 +774,8 @@ static size_t archwrite(struct chan *c, void *a, size_t n, off64_t offset)
 		return cstate_write(a, n, 0);
 	case Qpstate:
 		return pstate_write(a, n, 0);
+	case Qpcid:
+		return pcid_write(a, n, 0);
 	default:
 		error(EINVAL, ERROR_FIXME);
 	}
@@ -18,14 +18,14 @@ static inline bool kpte_is_unmapped(kpte_t *kpte)
 	return *kpte == 0;
 }
 
-static inline bool kpte_is_mapped(kpte_t *kpte)
+static inline bool kpte_is_paged_out(kpte_t *kpte)
 {
-	return *kpte != 0;
+	return PAGE_PAGED_OUT(*kpte);
 }
 
-static inline bool kpte_is_paged_out(kpte_t *kpte)
+static inline bool kpte_is_mapped(kpte_t *kpte)
 {
-	return *kpte != 0;
+	return *kpte != 0 && !kpte_is_paged_out(kpte);
 }
 
 static inline bool kpte_is_dirty(kpte_t *kpte)
@@ -43,6 +43,11 @@ static inline bool kpte_is_jumbo(kpte_t *kpte)
 	return *kpte & PTE_PS ? TRUE : FALSE;
 }
 
+static inline bool kpte_is_cow(kpte_t *kpte)
+{
+	return *kpte & PTE_COW ? TRUE : FALSE;
+}
+
 static inline physaddr_t kpte_get_paddr(kpte_t *kpte)
 {
 	return (physaddr_t)*kpte & ~(PGSIZE - 1);
@@ -72,6 +77,24 @@ static inline void kpte_clear_dirty(kpte_t *kpte)
 	*kpte &= ~PTE_D;
 }
 
+static inline void kpte_clear_accessed(kpte_t *kpte)
+{
+	*kpte &= ~PTE_A;
+}
+
+/* Paged-out PTEs hold a value for the pager above PGSHIFT.  The hardware
+ * ignores everything but PTE_P. */
+static inline void kpte_write_paged_out(kpte_t *kpte, unsigned long val)
+{
+	assert(val < (1UL << (52 - PGSHIFT)));
+	*kpte = (val << PGSHIFT) | PTE_SWAP;
+}
+
+static inline unsigned long kpte_get_paged_out(kpte_t *kpte)
+{
+	return *kpte >> PGSHIFT;
+}
+
 static inline void kpte_clear(kpte_t *kpte)
 {
 	*kpte = 0;
@@ -4,3 +4,13 @@ void x86_cleanup_bootmem(void);
 void setup_default_mtrrs(barrier_t *smp_barrier);
 physaddr_t get_boot_pml4(void);
 uintptr_t get_gdt64(void);
+
+extern bool pcid_enabled;
+
+struct pcid_stats {
+	unsigned long nr_reused;	/* loads that kept the PCID's TLB */
+	unsigned long nr_stale;		/* flushed, since the AS was shot down */
+	unsigned long nr_evicted;	/* flushed, took another AS's PCID */
+	unsigned long nr_untagged;	/* flushed, PCID 0 */
+};
+void pcid_fetch_stats(struct pcid_stats *stats);
@@ -410,6 +410,42 @@ pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create)
 	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
 }
 
+/* Same as pgdir_walk, but for PML2 jumbo PTEs: with create, it'll walk to the
+ * PML2, even if there is already a page table there.  Check with pte_is_jumbo()
+ * or pte_is_unmapped() for what you got back. */
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int create)
+{
+	int flags = PML2_SHIFT;
+
+	if (create == 1)
+		flags |= PG_WALK_CREATE;
+	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
+}
+
+/* Splits the PML2 jumbo PTE mapping va, if there is one, into a new PML1 page
+ * table whose PTEs map the same memory with the same settings.  Returns TRUE if
+ * we split.  The caller needs to lock the page tables and flush the TLB. */
+bool pgdir_split_jumbo(pgdir_t pgdir, const void *va)
+{
+	kpte_t *kpte, *new_pml;
+	physaddr_t pa;
+	int settings;
+
+	kpte = pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, PML2_SHIFT);
+	if (!kpte || !kpte_is_jumbo(kpte))
+		return FALSE;
+	/* Same as in __pml_walk: KPT, then EPT, and we can't fail */
+	new_pml = kpages_alloc(2 * PGSIZE, MEM_WAIT);
+	pa = kpte_get_paddr(kpte);
+	settings = kpte_get_settings(kpte) & ~PTE_PS;
+	for (int i = 0; i < NPTENTRIES; i++)
+		pte_write(&new_pml[i], pa + i * PGSIZE, settings);
+	*kpte = PADDR(new_pml) | PTE_P | PTE_U | PTE_W;
+	*kpte_to_epte(kpte) = (PADDR(new_pml) + PGSIZE) | EPTE_R | EPTE_X |
+			      EPTE_W;
+	return TRUE;
+}
+
 static int pml_perm_walk(kpte_t *pml, const void *va, int pml_shift)
 {
 	kpte_t *kpte;
@@ -514,8 +550,8 @@ void x86_cleanup_bootmem(void)
 }
 
 /* Walks len bytes from start, executing 'callback' on every PTE, passing it a
- * specific VA and whatever arg is passed in.  Note, this cannot handle jumbo
- * pages.
+ * specific VA and whatever arg is passed in.  Jumbo PTEs are passed once, with
+ * the VA of the start of the jumbo page, which may be below start.
  *
  * This is just a clumsy wrapper around the more powerful pml_for_each, which
  * can handle jumbo and intermediate pages. */
@@ -532,9 +568,9 @@ int env_user_mem_walk(struct proc *p, void *start, size_t len,
 	{
 		struct tramp_package *tp = (struct tramp_package*)data;
 		assert(tp->cb);
-		/* memwalk CBs don't know how to handle intermediates or jumbos
-		 */
-		if (shift != PML1_SHIFT)
+		/* memwalk CBs don't know how to handle intermediates.  Jumbos
+		 * are passed through; CBs can check with pte_is_jumbo(). */
+		if (!pte_is_final(kpte, shift))
 			return 0;
 		return tp->cb(tp->p, kpte, (void*)kva, tp->cb_arg);
 	}
@@ -688,6 +724,101 @@ void arch_pgdir_clear(pgdir_t *pd)
 	pd->eptp = 0;
 }
 
+/* PCIDs tag TLB entries with the address space that made them, so a core can
+ * switch between address spaces without flushing its TLB.  Each core hands out
+ * NR_PCIDS PCIDs (1 through NR_PCIDS) to the address spaces it runs, recycling
+ * them round-robin.  PCID 0 is for boot_cr3 and for anything we don't want to
+ * tag; loads of PCID 0 always flush it.
+ *
+ * The catch is that a core keeps a proc's TLB entries after it switches away,
+ * and proc_tlbshootdown() only messages the cores that have the proc loaded
+ * right now.  So each proc has a tlb_gen, which the shooter bumps before it
+ * looks at p->tlb_cores, and each PCID remembers the tlb_gen of its proc when
+ * we last flushed it.  If they still match when we switch back, nothing was
+ * shot down in the meantime and we can keep the TLB entries.  Otherwise, we
+ * flush the PCID on the load.  We don't know if a shootdown we handled while
+ * loaded covered everything that changed, so those leave the gen stale too.
+ *
+ * We read tlb_gen after switch_addr_space() set our bit in tlb_cores.  Either
+ * the shooter saw our bit and will message us once our cr3 is loaded (IRQs
+ * are off until then), or we see its new gen.
+ *
+ * Procs are identified by as_id, not the pointer or cr3, since both get
+ * reused.
+ *
+ * VMMs don't get PCIDs: the VMCS's HOST_CR3 is set once per guest pcore, and
+ * the PCID for the VMM could differ by core or change after an eviction. */
+#define NR_PCIDS	8
+
+struct pcid_slot {
+	unsigned long			as_id;
+	long				tlb_gen;
+};
+
+struct pcid_pcpu {
+	struct pcid_slot		slots[NR_PCIDS];
+	unsigned int			next_victim;
+	struct pcid_stats		stats;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct pcid_pcpu pcid_pcpu[MAX_NUM_CORES];
+bool pcid_enabled;
+
+void arch_load_addr_space(struct proc *p)
+{
+	struct pcid_pcpu *pc;
+	struct pcid_slot *slot;
+	int8_t irq_state = 0;
+	long gen;
+	int i;
+
+	if (!pcid_enabled || p->vmm.vmmcp) {
+		if (pcid_enabled)
+			pcid_pcpu[core_id()].stats.nr_untagged++;
+		lcr3(p->env_cr3);
+		return;
+	}
+	disable_irqsave(&irq_state);
+	pc = &pcid_pcpu[core_id()];
+	gen = atomic_read(&p->tlb_gen);
+	for (i = 0; i < NR_PCIDS; i++) {
+		if (pc->slots[i].as_id == p->as_id)
+			break;
+	}
+	if (i < NR_PCIDS) {
+		slot = &pc->slots[i];
+		if (slot->tlb_gen == gen) {
+			pc->stats.nr_reused++;
+			lcr3(p->env_cr3 | (i + 1) | CR3_NOFLUSH);
+			enable_irqsave(&irq_state);
+			return;
+		}
+		pc->stats.nr_stale++;
+	} else {
+		i = pc->next_victim++ % NR_PCIDS;
+		slot = &pc->slots[i];
+		slot->as_id = p->as_id;
+		pc->stats.nr_evicted++;
+	}
+	slot->tlb_gen = gen;
+	lcr3(p->env_cr3 | (i + 1));
+	enable_irqsave(&irq_state);
+}
+
+void pcid_fetch_stats(struct pcid_stats *stats)
+{
+	struct pcid_stats *s;
+
+	memset(stats, 0, sizeof(struct pcid_stats));
+	for (int i = 0; i < num_cores; i++) {
+		s = &pcid_pcpu[i].stats;
+		stats->nr_reused += s->nr_reused;
+		stats->nr_stale += s->nr_stale;
+		stats->nr_evicted += s->nr_evicted;
+		stats->nr_untagged += s->nr_untagged;
+	}
+}
+
 /* Returns the page shift of the largest jumbo supported */
 int arch_max_jumbo_page_shift(void)
 {
@@ -762,7 +893,7 @@ static int print_pte(kpte_t *kpte, uintptr_t kva, int shift, bool visited_subs,
 void debug_print_pgdir(kpte_t *pgdir)
 {
 	if (! pgdir)
-		pgdir = KADDR(rcr3());
+		pgdir = KADDR(rcr3() & ~CR3_PCID_MASK);
 	printk("Printing the entire page table set for %p, DFS\n", pgdir);
 	/* Need to be careful we avoid VPT/UVPT, o/w we'll recurse */
 	pml_for_each(pgdir, 0, UVPT, print_pte, 0);
@@ -34,10 +34,11 @@ static inline bool pte_walk_okay(pte_t pte)
  *   page, but with no access permissions, which is the main distinction between
  *   present and mapped.
  *
- * - paged_out: we don't actually use this yet.  Since mapped vs present is
- *   based on the PTE present bits, we'd need to use reserved bits in the PTE to
- *   differentiate between other states.  Right now, paged_out == mapped, as far
- *   as the code is concerned.
+ * - paged_out: the PTE's page was swapped out (see zswap.c).  It is not
+ *   present, and instead of a physaddr, it holds a value for the pager.  We
+ *   tell it apart with PTE_SWAP, a software bit.  Paged out PTEs are not
+ *   mapped, so code that looks at a mapped PTE's page needs to check for
+ *   paged_out separately.
  *
  * - unmapped: completely unused. (0 value) */
 static inline bool pte_is_present(pte_t pte)
@@ -78,6 +79,13 @@ static inline bool pte_is_jumbo(pte_t pte)
 	return kpte_is_jumbo(pte);
 }
 
+/* CoW PTEs point to a page that might be shared with other PTEs.  They are
+ * never writable; write faults on them copy the page (see mm.c). */
+static inline bool pte_is_cow(pte_t pte)
+{
+	return kpte_is_cow(pte);
+}
+
 static inline physaddr_t pte_get_paddr(pte_t pte)
 {
 	return kpte_get_paddr(pte);
@@ -107,6 +115,24 @@ static inline void pte_clear_dirty(pte_t pte)
 	epte_clear_dirty(kpte_to_epte(pte));
 }
 
+static inline void pte_clear_accessed(pte_t pte)
+{
+	kpte_clear_accessed(pte);
+	epte_clear_accessed(kpte_to_epte(pte));
+}
+
+/* Guest-physical mappings of paged out memory are just not present. */
+static inline void pte_write_paged_out(pte_t pte, unsigned long val)
+{
+	kpte_write_paged_out(pte, val);
+	epte_clear(kpte_to_epte(pte));
+}
+
+static inline unsigned long pte_get_paged_out(pte_t pte)
+{
+	return kpte_get_paged_out(pte);
+}
+
 static inline void pte_clear(pte_t pte)
 {
 	kpte_clear(pte);
@@ -133,7 +159,8 @@ static inline bool pte_has_perm_urw(pte_t pte)
  * jumbo, dirty, accessed, etc.  Whatever this returns can get fed back to
  * pte_write.
  *
- * Arch-indep settings include: PTE_PERM (U, W, P, etc), PTE_D, PTE_A, PTE_PS.
+ * Arch-indep settings include: PTE_PERM (U, W, P, etc), PTE_D, PTE_A, PTE_PS,
+ * PTE_COW.
  * Other OSs (x86) may include others. */
 static inline int pte_get_settings(pte_t pte)
 {
@@ -26,6 +26,8 @@
 // These two relate to the cacheability (L1, etc) of the page directory
 #define CR3_PWT		0x00000008	// Page directory caching write through
 #define CR3_PCD		0x00000010	// Page directory caching disabled
+#define CR3_PCID_MASK	0x00000fff	// PCID, if CR4_PCIDE
+#define CR3_NOFLUSH	(1UL << 63)	// Keep the PCID's TLB entries on load
 
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
@@ -41,6 +43,7 @@
 #define CR4_VMXE	0x00002000	// VMX enable
 #define CR4_SMXE	0x00004000	// SMX enable
 #define CR4_FSGSBASE	0x00010000	// RD/WR FS/GS Base enabled
+#define CR4_PCIDE	0x00020000	// Process-context identifiers enabled
 #define CR4_OSXSAVE	0x00040000	// XSAVE and processor extended states-enabled
 
 // Eflags register
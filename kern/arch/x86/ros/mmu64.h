@@ -284,6 +284,8 @@ typedef struct x86_pgdir {
 #define PTE_PS			(1 << 7)	/* Page Size */
 #define __PTE_PAT		(1 << 7)	/* Page attribute table */
 #define PTE_G			(1 << 8)	/* Global Page */
+#define PTE_COW			(1 << 9)	/* Software: Copy-on-write */
+#define PTE_SWAP		(1 << 10)	/* Software: paged out, if !P */
 #define __PTE_JPAT		(1 << 12)	/* Jumbo PAT */
 #define PTE_XD			(1 << 63)	/* Execute disabled */
 #define PTE_NOCACHE		(__PTE_PWT | __PTE_PCD)
@@ -309,7 +311,7 @@ typedef struct x86_pgdir {
 /* we must guarantee that for any PTE, exactly one of the following is true */
 #define PAGE_PRESENT(pte) ((pte) & PTE_P)
 #define PAGE_UNMAPPED(pte) ((pte) == 0)
-#define PAGE_PAGED_OUT(pte) (0)	/* Need to use an OS reserved PTE bit */
+#define PAGE_PAGED_OUT(pte) (((pte) & (PTE_P | PTE_SWAP)) == PTE_SWAP)
 
 
 /* **************************************** */
@@ -314,6 +314,12 @@ void __arch_pcpu_init(uint32_t coreid)
 
 	if (cpu_has_feat(CPU_FEAT_X86_FSGSBASE))
 		lcr4(rcr4() | CR4_FSGSBASE);
+	/* Requires PCID 0 in the current cr3, which boot_cr3 has. */
+	if (cpu_has_feat(CPU_FEAT_X86_PCID)) {
+		lcr4(rcr4() | CR4_PCIDE);
+		if (coreid == 0)
+			pcid_enabled = TRUE;
+	}
 
 	/*
 	 * Enable SSE instructions.
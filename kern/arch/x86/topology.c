@@ -97,6 +97,18 @@ static int find_numa_domain(int apic_id)
 	return -1;
 }
 
+/* Returns the numa_id of the cores in SRAT proximity domain dom, or -1 if there
+ * are none, e.g. for a memory-only domain.  Only valid for a non-flat
+ * topology, after we squashed the numa_ids in init_core_list(). */
+static int dom_to_numa_id(int dom)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (find_numa_domain(core_list[i].apic_id) == dom)
+			return core_list[i].numa_id;
+	}
+	return -1;
+}
+
 /* Figure out the maximum number of cores we actually have and set it in our
  * cpu_topology_info struct. */
 static void set_num_cores(void)
@@ -380,6 +392,28 @@ void topology_init(void)
 		build_flat_topology();
 }
 
+/* Calls func on each enabled memory range in the SRAT, along with the numa_id
+ * of the range's domain.  Does nothing on a flat topology, where all memory is
+ * in numa_id 0.  Ranges in domains without cores are skipped. */
+void numa_foreach_mem_range(void (*func)(int numa_id, physaddr_t start,
+                                         size_t len, void *arg), void *arg)
+{
+	struct Srat *st;
+	int numa_id;
+
+	if (srat == NULL || num_numa <= 1)
+		return;
+	for (int i = 0; i < srat->nchildren; i++) {
+		st = srat->children[i]->tbl;
+		if (st == NULL || st->type != SRmem)
+			continue;
+		numa_id = dom_to_numa_id(st->mem.dom);
+		if (numa_id < 0)
+			continue;
+		func(numa_id, st->mem.addr, st->mem.len, arg);
+	}
+}
+
 void print_cpu_topology(void)
 {
 	printk("num_numa: %d, num_sockets: %d, num_cpus: %d, num_cores: %d\n",
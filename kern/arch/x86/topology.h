@@ -38,6 +38,8 @@ extern int *os_coreid_lookup;
 
 void topology_init();
 void print_cpu_topology();
+void numa_foreach_mem_range(void (*func)(int numa_id, physaddr_t start,
+                                         size_t len, void *arg), void *arg);
 
 static inline int get_hw_coreid(uint32_t coreid)
 {
@@ -61,6 +63,12 @@ static inline int numa_id(void)
 	return cpu_topology_info.core_list[os_coreid].numa_id;
 }
 
+/* NUMA node of an OS coreid, e.g. for picking memory near a core. */
+static inline int core_numa_id(int coreid)
+{
+	return cpu_topology_info.core_list[coreid].numa_id;
+}
+
 static inline int core_id(void)
 {
 	int coreid;
@@ -299,7 +299,9 @@ static bool __handler_kernel_page_fault(struct hw_trapframe *hw_tf,
 	pcpui->__lock_checking_enabled--;
 	/* It is a bug for the kernel to access user memory while holding locks
 	 * that are used by handle_page_fault.  At a minimum, this includes
-	 * p->vmr_lock and memory allocation locks.
+	 * p->pte_lock, p->proc_lock (for CoW shootdowns), and memory allocation
+	 * locks.  (The fault handler looks up VMRs locklessly, so p->vmr_lock
+	 * is OK.)
 	 *
 	 * In an effort to reduce the number of locks (both now and in the
 	 * future), the kernel will not attempt to handle faults on file-back
@@ -124,6 +124,11 @@ static inline void epte_clear_dirty(epte_t *epte)
 	*epte &= ~EPTE_D;
 }
 
+static inline void epte_clear_accessed(epte_t *epte)
+{
+	*epte &= ~EPTE_A;
+}
+
 static inline void epte_clear(epte_t *epte)
 {
 	*epte = 0;
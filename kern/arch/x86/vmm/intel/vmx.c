@@ -743,7 +743,8 @@ static void vmx_setup_constant_host_state(void)
 
 	vmcs_writel(HOST_CR0, rcr0() & ~X86_CR0_TS);	/* 22.2.3 */
 	vmcs_writel(HOST_CR4, rcr4());	/* 22.2.3, 22.2.5 */
-	vmcs_writel(HOST_CR3, rcr3());	/* 22.2.3 */
+	/* VMMs run untagged, in PCID 0.  See arch_load_addr_space(). */
+	vmcs_writel(HOST_CR3, rcr3() & ~CR3_PCID_MASK);	/* 22.2.3 */
 
 	vmcs_write16(HOST_CS_SELECTOR, GD_KT);	/* 22.2.4 */
 	vmcs_write16(HOST_DS_SELECTOR, GD_KD);	/* 22.2.4 */
@@ -78,6 +78,11 @@ void __vmm_struct_init(struct proc *p)
 	if (!x86_supports_vmx)
 		error(ENODEV, "This CPU does not support VMX");
 	vmm->vmmcp = TRUE;
+	/* VMMs run in PCID 0, which is what the VMCS's HOST_CR3 will have.
+	 * Reload our address space so it is untagged on this core; other cores
+	 * get it on their next load. */
+	if (p == current)
+		switch_addr_space(p, p);
 	vmm->amd = 0;
 	vmx_setup_vmx_vmm(&vmm->vmx);
 	for (int i = 0; i < VMM_VMEXIT_NR_TYPES; i++)
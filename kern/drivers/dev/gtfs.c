@@ -15,6 +15,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <tree_file.h>
+#include <reclaim.h>
 
 struct dev gtfs_devtab;
 
@@ -26,8 +27,11 @@ static char *devname(void)
 struct gtfs {
 	struct tree_filesystem		tfs;
 	struct kref			users;
+	struct reclaimer		reclaimer;
 };
 
+static void gtfs_reclaim(struct reclaimer *r, int level);
+
 /* Blob hanging off the fs_file->priv.  The backend chans are only accessed,
  * (changed or used) with the corresponding fs_file qlock held.  That's the
  * primary use of the qlock - we might be able to avoid qlocking with increfs
@@ -195,6 +199,7 @@ static void gtfs_release(struct kref *kref)
 {
 	struct gtfs *gtfs = container_of(kref, struct gtfs, users);
 
+	unregister_reclaimer(&gtfs->reclaimer);
 	tfs_frontend_purge(&gtfs->tfs, purge_cb);
 	/* this is the ref from attach */
 	assert(kref_refcnt(&gtfs->tfs.root->kref) == 1);
@@ -376,7 +381,7 @@ static size_t gtfs_read(struct chan *c, void *ubuf, size_t n, off64_t off)
 
 	if (tree_file_is_dir(tf))
 		return gtfs_fsf_read(&tf->file, ubuf, n, off);
-	return fs_file_read(&tf->file, ubuf, n, off);
+	return fs_file_read(&tf->file, ubuf, n, off, &c->ra);
 }
 
 /* Given a file (with dir->name set), couple it and sync to the backend chan.
@@ -616,6 +621,46 @@ static int gtfs_pm_writepage(struct page_map *pm, struct page *pg)
 	return 0;
 }
 
+/* Writes nr pages with consecutive indexes to the backend as one write, so
+ * the backend sees one big op instead of nr page-sized ones.  If we can't get a
+ * buffer to gather them, we write them one at a time. */
+static int gtfs_pm_writepages(struct page_map *pm, struct page **pages, int nr)
+{
+	ERRSTACK(1);
+	struct fs_file *f = pm->pm_file;
+	off64_t offset = pages[0]->pg_index << PGSHIFT;
+	size_t amt;
+	void *buf;
+	int ret = 0;
+
+	buf = kmalloc(nr * PGSIZE, MEM_ATOMIC);
+	if (!buf) {
+		for (int i = 0; i < nr; i++) {
+			if (gtfs_pm_writepage(pm, pages[i]))
+				ret = -EIO;
+		}
+		return ret;
+	}
+	qlock(&f->qlock);
+	if (waserror()) {
+		qunlock(&f->qlock);
+		kfree(buf);
+		poperror();
+		return -get_errno();
+	}
+	/* Same as writepage: don't writeback beyond the length of the file. */
+	if (offset < fs_file_get_length(f)) {
+		amt = MIN(nr * PGSIZE, fs_file_get_length(f) - offset);
+		for (int i = 0; i < ROUNDUP(amt, PGSIZE) / PGSIZE; i++)
+			memcpy(buf + i * PGSIZE, page2kva(pages[i]), PGSIZE);
+		__gtfs_fsf_write(f, buf, amt, offset);
+	}
+	qunlock(&f->qlock);
+	poperror();
+	kfree(buf);
+	return 0;
+}
+
 /* Caller holds the file's qlock */
 static void __trunc_to(struct fs_file *f, off64_t begin)
 {
@@ -700,6 +745,7 @@ static bool gtfs_fs_can_grow_to(struct fs_file *f, size_t len)
 struct fs_file_ops gtfs_fs_ops = {
 	.readpage = gtfs_pm_readpage,
 	.writepage = gtfs_pm_writepage,
+	.writepages = gtfs_pm_writepages,
 	.punch_hole = gtfs_fs_punch_hole,
 	.can_grow_to = gtfs_fs_can_grow_to,
 };
@@ -773,6 +819,9 @@ static struct chan *gtfs_attach(char *arg)
 	tf_kref_get(tfs->root);
 	chan_set_tree_file(frontend, tfs->root);
 	poperror();
+	gtfs->reclaimer.name = "gtfs";
+	gtfs->reclaimer.func = gtfs_reclaim;
+	register_reclaimer(&gtfs->reclaimer);
 	return frontend;
 }
 
@@ -815,6 +864,18 @@ static void gtfs_free_memory(struct gtfs *gtfs)
 	tfs_frontend_for_each(&gtfs->tfs, pressure_dfs_cb);
 }
 
+/* Reclaim hook.  Periodically, we drop the negative TFs.  Under memory
+ * pressure, we do everything we can. */
+static void gtfs_reclaim(struct reclaimer *r, int level)
+{
+	struct gtfs *gtfs = container_of(r, struct gtfs, reclaimer);
+
+	if (level == RECLAIM_LOW_MEM)
+		gtfs_free_memory(gtfs);
+	else
+		tfs_lru_prune_neg(&gtfs->tfs);
+}
+
 static void gtfs_sync_tf(struct tree_file *tf)
 {
 	writeback_file(&tf->file);
@@ -106,13 +106,6 @@ static int kfs_pm_readpage(struct page_map *pm, struct page *pg)
 	return 0;
 }
 
-/* Meant to take the page from PM and flush to backing store.  There is no
- * backing store. */
-static int kfs_pm_writepage(struct page_map *pm, struct page *pg)
-{
-	return 0;
-}
-
 static void kfs_fs_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 {
 }
@@ -125,7 +118,7 @@ static bool kfs_fs_can_grow_to(struct fs_file *f, size_t len)
 
 struct fs_file_ops kfs_fs_ops = {
 	.readpage = kfs_pm_readpage,
-	.writepage = kfs_pm_writepage,
+	/* No writepage: there is no backing store. */
 	.punch_hole = kfs_fs_punch_hole,
 	.can_grow_to = kfs_fs_can_grow_to,
 };
@@ -7,6 +7,10 @@
 
 #include <ns.h>
 #include <kmalloc.h>
+#include <page_alloc.h>
+#include <reclaim.h>
+#include <zswap.h>
+#include <mm.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
@@ -28,6 +32,15 @@ enum {
 	Qfree,
 	Qkmemstat,
 	Qslab_trace,
+	Qzpool_stats,
+	Qnuma,
+	Qreclaim,
+	Qmagazines,
+	Qkmalloc,
+	Qreadahead,
+	Qwriteback,
+	Qzswap,
+	Qfault_around,
 };
 
 static struct dirtab mem_dir[] = {
@@ -37,6 +50,15 @@ static struct dirtab mem_dir[] = {
 	{"free", {Qfree, 0, QTFILE}, 0, 0444},
 	{"kmemstat", {Qkmemstat, 0, QTFILE}, 0, 0444},
 	{"slab_trace", {Qslab_trace, 0, QTFILE}, 0, 0444},
+	{"zpool_stats", {Qzpool_stats, 0, QTFILE}, 0, 0444},
+	{"numa", {Qnuma, 0, QTFILE}, 0, 0444},
+	{"reclaim", {Qreclaim, 0, QTFILE}, 0, 0644},
+	{"magazines", {Qmagazines, 0, QTFILE}, 0, 0444},
+	{"kmalloc", {Qkmalloc, 0, QTFILE}, 0, 0644},
+	{"readahead", {Qreadahead, 0, QTFILE}, 0, 0444},
+	{"writeback", {Qwriteback, 0, QTFILE}, 0, 0644},
+	{"zswap", {Qzswap, 0, QTFILE}, 0, 0644},
+	{"fault_around", {Qfault_around, 0, QTFILE}, 0, 0644},
 };
 
 /* Protected by the arenas_and_slabs_lock */
@@ -59,6 +81,31 @@ static size_t mem_stat(struct chan *c, uint8_t *db, size_t n)
 	return devstat(c, db, n, mem_dir, ARRAY_SIZE(mem_dir), devgen);
 }
 
+/* Prints how well arena's qcaches absorb allocations.  A qcache alloc is a hit
+ * if it didn't need a new slab from the arena. */
+static void fetch_qcache_stats(struct arena *arena, struct sized_alloc *sza)
+{
+	int nr_qcaches = arena->qcache_max / arena->quantum;
+	struct kmem_cache *kc;
+	size_t nr_allocs = 0, nr_grows = 0;
+
+	if (!nr_qcaches)
+		return;
+	for (int i = 0; i < nr_qcaches; i++) {
+		kc = &arena->qcaches[i];
+		/* Lockless peek, these are just stats */
+		nr_allocs += kc->nr_direct_allocs_ever;
+		nr_grows += kc->nr_grows;
+		for (int j = 0; j < kmc_nr_pcpu_caches(); j++)
+			nr_allocs += kc->pcpu_caches[j].nr_allocs_ever;
+	}
+	sza_printf(sza, "\t\tQcache allocs: %llu, slab imports: %llu\n",
+	           nr_allocs, nr_grows);
+	sza_printf(sza, "\t\tQcache hit rate: %llu%%\n",
+	           nr_allocs ? (nr_allocs - MIN(nr_grows, nr_allocs)) * 100 /
+	                       nr_allocs : 0);
+}
+
 /* Prints arena's stats to the sza, adjusting the sza's sofar. */
 static void fetch_arena_stats(struct arena *arena, struct sized_alloc *sza)
 {
@@ -74,6 +121,8 @@ static void fetch_arena_stats(struct arena *arena, struct sized_alloc *sza)
 	size_t amt_imported = 0;
 	size_t empty_hash_chain = 0;
 	size_t longest_hash_chain = 0;
+	size_t largest_free = 0;
+	size_t nr_free_segs = 0;
 
 	sza_printf(sza, "Arena: %s (%p)\n--------------\n", arena->name, arena);
 	sza_printf(sza, "\tquantum: %d, qcache_max: %d\n", arena->quantum,
@@ -81,15 +130,22 @@ static void fetch_arena_stats(struct arena *arena, struct sized_alloc *sza)
 	sza_printf(sza, "\tsource: %s\n",
 	           arena->source ? arena->source->name : "none");
 	spin_lock_irqsave(&arena->lock);
+	/* Histogram of free segments, one row per free list */
+	sza_printf(sza, "\tFree segs:\n\t--------------\n");
 	for (int i = 0; i < ARENA_NR_FREE_LISTS; i++) {
-		int j = 0;
+		size_t nr = 0, amt = 0;
 
-		if (!BSD_LIST_EMPTY(&arena->free_segs[i])) {
-			sza_printf(sza, "\tList of [2^%d - 2^%d):\n", i, i + 1);
-			BSD_LIST_FOREACH(bt_i, &arena->free_segs[i], misc_link)
-				j++;
-			sza_printf(sza, "\t\tNr free segs: %d\n", j);
+		if (BSD_LIST_EMPTY(&arena->free_segs[i]))
+			continue;
+		BSD_LIST_FOREACH(bt_i, &arena->free_segs[i], misc_link) {
+			nr++;
+			amt += bt_i->size;
+			largest_free = MAX(largest_free, bt_i->size);
 		}
+		nr_free_segs += nr;
+		sza_printf(sza,
+		           "\t\t[2^%2d - 2^%2d): %8llu segs, %16llu bytes\n",
+		           i, i + 1, nr, amt);
 	}
 	for (int i = 0; i < arena->hh.nr_hash_lists; i++) {
 		int j = 0;
@@ -125,7 +181,19 @@ static void fetch_arena_stats(struct arena *arena, struct sized_alloc *sza)
 	sza_printf(sza, "\t\tNr hash %d, empty hash: %d, longest hash %d\n",
 	           arena->hh.nr_hash_lists, empty_hash_chain,
 	           longest_hash_chain);
+	/* Fragmentation: how much of the free space can't be used by the
+	 * biggest request we could satisfy. */
+	sza_printf(sza, "\t\tNr free segs: %llu, largest: %llu, frag: %llu%%\n",
+	           nr_free_segs, largest_free,
+	           amt_free ? (amt_free - largest_free) * 100 / amt_free : 0);
+	sza_printf(sza, "\t\tAllocs failed despite enough free: %llu\n",
+	           arena->nr_frag_fails);
+	sza_printf(sza, "\t\tImported from source: %llu spans, %llu bytes\n",
+	           arena->nr_imports, arena->amt_imported);
+	sza_printf(sza, "\t\tReturned to source: %llu spans, %llu bytes\n",
+	           arena->nr_exports, arena->amt_exported);
 	spin_unlock_irqsave(&arena->lock);
+	fetch_qcache_stats(arena, sza);
 	sza_printf(sza, "\tImporting Arenas:\n\t-----------------\n");
 	TAILQ_FOREACH(a_i, &arena->__importing_arenas, import_link)
 		sza_printf(sza, "\t\t%s\n", a_i->name);
@@ -143,7 +211,7 @@ static struct sized_alloc *build_arena_stats(void)
 	qlock(&arenas_and_slabs_lock);
 	/* Rough guess about how many chars per arena we'll need. */
 	TAILQ_FOREACH(a_i, &all_arenas, next)
-		alloc_amt += 1000;
+		alloc_amt += 2500;
 	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
 	TAILQ_FOREACH(a_i, &all_arenas, next)
 		fetch_arena_stats(a_i, sza);
@@ -174,6 +242,7 @@ static void fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza)
 		nr_unalloc_objs += s_i->num_total_obj - s_i->num_busy_obj;
 	sza_printf(sza, "Nr unallocated in slab layer: %lu\n", nr_unalloc_objs);
 	sza_printf(sza, "Nr allocated from slab layer: %d\n", kc->nr_cur_alloc);
+	sza_printf(sza, "Nr slabs imported from source: %lu\n", kc->nr_grows);
 	for (int i = 0; i < kc->hh.nr_hash_lists; i++) {
 		int j = 0;
 
@@ -189,9 +258,16 @@ static void fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza)
 	           longest_hash_chain, kc->hh.load_limit);
 	spin_unlock_irqsave(&kc->cache_lock);
 	spin_lock_irqsave(&kc->depot.lock);
-	sza_printf(sza, "Depot magsize: %d\n", kc->depot.magsize);
+	sza_printf(sza, "Depot magsize: %d (grown %u, shrunk %u)\n",
+	           kc->depot.magsize, kc->depot.nr_grows, kc->depot.nr_shrinks);
+	sza_printf(sza, "Depot locks: %llu, contended %llu\n",
+	           kc->depot.nr_acquires, kc->depot.nr_contended);
 	sza_printf(sza, "Nr empty mags: %d\n", kc->depot.nr_empty);
 	sza_printf(sza, "Nr non-empty mags: %d\n", kc->depot.nr_not_empty);
+	sza_printf(sza, "Working set: empty %d-%d, non-empty %d-%d\n",
+	           kc->depot.ws_min_empty, kc->depot.ws_max_empty,
+	           kc->depot.ws_min_not_empty, kc->depot.ws_max_not_empty);
+	sza_printf(sza, "Nr mags trimmed: %llu\n", kc->depot.nr_mags_trimmed);
 	spin_unlock_irqsave(&kc->depot.lock);
 }
 
@@ -233,6 +309,109 @@ static struct sized_alloc *build_free(void)
 	return sza;
 }
 
+static struct sized_alloc *build_zpool_stats(void)
+{
+	struct sized_alloc *sza;
+
+	sza = sized_kzmalloc(100 + 100 * cpu_topology_info.num_numa,
+	                     MEM_WAIT);
+	zpool_fetch_stats(sza);
+	return sza;
+}
+
+static struct sized_alloc *build_reclaim(void)
+{
+	struct sized_alloc *sza;
+
+	sza = sized_kzmalloc(2000, MEM_WAIT);
+	reclaim_fetch_stats(sza);
+	return sza;
+}
+
+static struct sized_alloc *build_numa(void)
+{
+	struct sized_alloc *sza;
+
+	sza = sized_kzmalloc(100 + 500 * cpu_topology_info.num_numa,
+	                     MEM_WAIT);
+	numa_fetch_stats(sza);
+	return sza;
+}
+
+static struct sized_alloc *build_kmalloc(void)
+{
+	struct sized_alloc *sza;
+
+	sza = sized_kzmalloc(100 * (NUM_KMALLOC_CACHES + 3), MEM_WAIT);
+	kmalloc_fetch_stats(sza);
+	return sza;
+}
+
+static struct sized_alloc *build_readahead(void)
+{
+	struct sized_alloc *sza;
+
+	sza = sized_kzmalloc(500, MEM_WAIT);
+	pm_fetch_ra_stats(sza);
+	return sza;
+}
+
+/* The list of dirty page maps gets cut off if there are too many of them */
+static struct sized_alloc *build_writeback(void)
+{
+	struct sized_alloc *sza;
+
+	sza = sized_kzmalloc(8192, MEM_WAIT);
+	pm_fetch_wb_stats(sza);
+	return sza;
+}
+
+static struct sized_alloc *build_zswap(void)
+{
+	struct sized_alloc *sza;
+
+	sza = sized_kzmalloc(1000, MEM_WAIT);
+	zswap_fetch_stats(sza);
+	return sza;
+}
+
+static struct sized_alloc *build_fault_around(void)
+{
+	struct sized_alloc *sza;
+
+	sza = sized_kzmalloc(500, MEM_WAIT);
+	fault_around_fetch_stats(sza);
+	return sza;
+}
+
+static struct sized_alloc *build_magazines(void)
+{
+	struct kmem_cache *kc_i;
+	struct kmem_depot *depot;
+	struct sized_alloc *sza;
+	size_t alloc_amt = 200;
+
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
+		alloc_amt += 120;
+	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
+	sza_printf(sza, "Resize: threshold %u per %llu nsec\n",
+	           resize_threshold, resize_timeout_ns);
+	sza_printf(sza, "%-30s:%8s:%15s:%12s:%6s:%6s\n", "Slab Name", "Magsize",
+	           "Depot Locks", "Contended", "Grows", "Shrnks");
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link) {
+		depot = &kc_i->depot;
+		spin_lock_irqsave(&depot->lock);
+		sza_printf(sza, "%-30s:%8u:%15llu:%12llu:%6u:%6u\n",
+		           kc_i->name, depot->magsize, depot->nr_acquires,
+		           depot->nr_contended, depot->nr_grows,
+		           depot->nr_shrinks);
+		spin_unlock_irqsave(&depot->lock);
+	}
+	qunlock(&arenas_and_slabs_lock);
+	return sza;
+}
+
 #define KMEMSTAT_NAME			30
 #define KMEMSTAT_OBJSIZE		8
 #define KMEMSTAT_TOTAL			15
@@ -364,6 +543,33 @@ static struct chan *mem_open(struct chan *c, int omode)
 	case Qkmemstat:
 		c->synth_buf = build_kmemstat();
 		break;
+	case Qzpool_stats:
+		c->synth_buf = build_zpool_stats();
+		break;
+	case Qnuma:
+		c->synth_buf = build_numa();
+		break;
+	case Qreclaim:
+		c->synth_buf = build_reclaim();
+		break;
+	case Qmagazines:
+		c->synth_buf = build_magazines();
+		break;
+	case Qkmalloc:
+		c->synth_buf = build_kmalloc();
+		break;
+	case Qreadahead:
+		c->synth_buf = build_readahead();
+		break;
+	case Qwriteback:
+		c->synth_buf = build_writeback();
+		break;
+	case Qzswap:
+		c->synth_buf = build_zswap();
+		break;
+	case Qfault_around:
+		c->synth_buf = build_fault_around();
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -380,6 +586,15 @@ static void mem_close(struct chan *c)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qzpool_stats:
+	case Qnuma:
+	case Qreclaim:
+	case Qmagazines:
+	case Qkmalloc:
+	case Qreadahead:
+	case Qwriteback:
+	case Qzswap:
+	case Qfault_around:
 		kfree(c->synth_buf);
 		c->synth_buf = NULL;
 		break;
@@ -410,6 +625,15 @@ static size_t mem_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qzpool_stats:
+	case Qnuma:
+	case Qreclaim:
+	case Qmagazines:
+	case Qkmalloc:
+	case Qreadahead:
+	case Qwriteback:
+	case Qzswap:
+	case Qfault_around:
 		sza = c->synth_buf;
 		return readstr(offset, ubuf, n, sza->buf);
 	case Qslab_trace:
@@ -472,6 +696,95 @@ static void slab_trace_cmd(struct chan *c, struct cmdbuf *cb)
 	kfree(old_sza);
 }
 
+#define RECLAIM_USAGE "trim|lowmem"
+
+static void reclaim_cmd(struct chan *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 1)
+		error(EFAIL, RECLAIM_USAGE);
+	if (!strcmp(cb->f[0], "trim"))
+		reclaim_now(RECLAIM_TRIM);
+	else if (!strcmp(cb->f[0], "lowmem"))
+		reclaim_now(RECLAIM_LOW_MEM);
+	else
+		error(EFAIL, RECLAIM_USAGE);
+}
+
+#define WRITEBACK_USAGE "expire_ms|bg_ratio|throttle_ratio VAL"
+
+static void writeback_cmd(struct chan *c, struct cmdbuf *cb)
+{
+	unsigned long val;
+
+	if (cb->nf < 2)
+		error(EFAIL, WRITEBACK_USAGE);
+	val = strtoul(cb->f[1], 0, 0);
+	if (!strcmp(cb->f[0], "expire_ms")) {
+		WRITE_ONCE(pm_dirty_expire_ms, val);
+	} else if (!strcmp(cb->f[0], "bg_ratio")) {
+		if (!val || val > 100)
+			error(EINVAL, "bg_ratio must be 1-100");
+		WRITE_ONCE(pm_dirty_bg_ratio, val);
+	} else if (!strcmp(cb->f[0], "throttle_ratio")) {
+		if (!val || val > 100)
+			error(EINVAL, "throttle_ratio must be 1-100");
+		WRITE_ONCE(pm_dirty_throttle_ratio, val);
+	} else {
+		error(EFAIL, WRITEBACK_USAGE);
+	}
+}
+
+#define ZSWAP_USAGE "enabled 0|1, or max_pool_pct VAL"
+
+static void zswap_cmd(struct chan *c, struct cmdbuf *cb)
+{
+	unsigned long val;
+
+	if (cb->nf < 2)
+		error(EFAIL, ZSWAP_USAGE);
+	val = strtoul(cb->f[1], 0, 0);
+	if (!strcmp(cb->f[0], "enabled")) {
+		WRITE_ONCE(zswap_enabled, !!val);
+	} else if (!strcmp(cb->f[0], "max_pool_pct")) {
+		if (val > 100)
+			error(EINVAL, "max_pool_pct must be 0-100");
+		WRITE_ONCE(zswap_max_pool_pct, val);
+	} else {
+		error(EFAIL, ZSWAP_USAGE);
+	}
+}
+
+#define KMALLOC_USAGE "headerless 0|1"
+
+static void kmalloc_cmd(struct chan *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		error(EFAIL, KMALLOC_USAGE);
+	if (!strcmp(cb->f[0], "headerless"))
+		WRITE_ONCE(kmalloc_headerless, !!strtoul(cb->f[1], 0, 0));
+	else
+		error(EFAIL, KMALLOC_USAGE);
+}
+
+#define FAULT_AROUND_USAGE "pages VAL"
+
+static void fault_around_cmd(struct chan *c, struct cmdbuf *cb)
+{
+	unsigned long val;
+
+	if (cb->nf < 2)
+		error(EFAIL, FAULT_AROUND_USAGE);
+	val = strtoul(cb->f[1], 0, 0);
+	if (!strcmp(cb->f[0], "pages")) {
+		if (val > FAULT_AROUND_MAX_PGS)
+			error(EINVAL, "pages must be 0-%d",
+			      FAULT_AROUND_MAX_PGS);
+		WRITE_ONCE(fault_around_pgs, val);
+	} else {
+		error(EFAIL, FAULT_AROUND_USAGE);
+	}
+}
+
 static size_t mem_write(struct chan *c, void *ubuf, size_t n, off64_t unused)
 {
 	ERRSTACK(1);
@@ -485,6 +798,21 @@ static size_t mem_write(struct chan *c, void *ubuf, size_t n, off64_t unused)
 	case Qslab_trace:
 		slab_trace_cmd(c, cb);
 		break;
+	case Qreclaim:
+		reclaim_cmd(c, cb);
+		break;
+	case Qwriteback:
+		writeback_cmd(c, cb);
+		break;
+	case Qzswap:
+		zswap_cmd(c, cb);
+		break;
+	case Qkmalloc:
+		kmalloc_cmd(c, cb);
+		break;
+	case Qfault_around:
+		fault_around_cmd(c, cb);
+		break;
 	default:
 		error(EFAIL, "Unable to write to %s", devname());
 	}
@@ -75,6 +75,7 @@ enum { CMclose,
        CMstraceme,
        CMstraceall,
        CMstrace_drop,
+       CMjumbo,
 };
 
 enum { Nevents = 0x4000,
@@ -119,6 +120,7 @@ static struct cmdtab proccmd[] = {
     {CMclose, "close", 2},         {CMclosefiles, "closefiles", 0},
     {CMhang, "hang", 0},           {CMstraceme, "straceme", 0},
     {CMstraceall, "straceall", 0}, {CMstrace_drop, "strace_drop", 2},
+    {CMjumbo, "jumbo", 2},
 };
 
 /*
@@ -963,6 +965,8 @@ static size_t procread(struct chan *c, void *va, size_t n, off64_t off)
 			s = seprintf(s, e, " %d trace users %d traced procs",
 			             kref_refcnt(&p->strace->users),
 			             kref_refcnt(&p->strace->procs));
+		s = seprintf(s, e, " %lu jumbo pages %lu jumbo fallbacks",
+		             p->nr_jumbo_pgs, p->nr_jumbo_fallbacks);
 		proc_decref(p);
 		i = readstr(off, va, n, buf);
 		kfree(buf);
@@ -1396,6 +1400,15 @@ static void procctlreq(struct proc *p, char *va, size_t n)
 		else
 			error(EINVAL, "strace_drop takes on|off %s", cb->f[1]);
 		break;
+	case CMjumbo:
+		/* Only affects future anonymous mmaps */
+		if (!strcmp(cb->f[1], "on"))
+			p->jumbo_anon = TRUE;
+		else if (!strcmp(cb->f[1], "off"))
+			p->jumbo_anon = FALSE;
+		else
+			error(EINVAL, "jumbo takes on|off %s", cb->f[1]);
+		break;
 	}
 	poperror();
 	kfree(cb);
@@ -139,13 +139,6 @@ static int tmpfs_pm_readpage(struct page_map *pm, struct page *pg)
 	return 0;
 }
 
-/* Meant to take the page from PM and flush to backing store.  There is no
- * backing store. */
-static int tmpfs_pm_writepage(struct page_map *pm, struct page *pg)
-{
-	return 0;
-}
-
 static void tmpfs_fs_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 {
 }
@@ -158,7 +151,7 @@ static bool tmpfs_fs_can_grow_to(struct fs_file *f, size_t len)
 
 struct fs_file_ops tmpfs_fs_ops = {
 	.readpage = tmpfs_pm_readpage,
-	.writepage = tmpfs_pm_writepage,
+	/* No writepage: there is no backing store. */
 	.punch_hole = tmpfs_fs_punch_hole,
 	.can_grow_to = tmpfs_fs_can_grow_to,
 };
@@ -604,7 +604,7 @@ static void dump_packet(struct mlx4_en_priv *priv,
 static void recv_packet(struct mlx4_en_priv *priv,
 			struct mlx4_en_rx_desc *rx_desc,
 			struct mlx4_en_rx_alloc *frags,
-			unsigned int length)
+			unsigned int length, struct mlx4_cqe *cqe)
 {
 	struct block *block;
 	void *va;
@@ -621,6 +621,10 @@ static void recv_packet(struct mlx4_en_priv *priv,
 	va = page_address(rp2page(frags[0].page)) + frags[0].page_offset;
 	memcpy(block->wp, va, length);
 	block->wp += length;
+	if (priv->dev->feat & NETIF_F_RXHASH) {
+		block->rx_hash = be32_to_cpu(cqe->immed_rss_invalid);
+		block->flag |= Brxhash;
+	}
 
 	etheriq(priv->dev, block, 1 /* fromwire */);
 }
@@ -939,7 +943,7 @@ int mlx4_en_process_rx_cq(struct ether *dev, struct mlx4_en_cq *cq,
 		printd("length %d ring %p bytes %d packets %d ip_summed %d\n",
 		       length, ring, ring->bytes, ring->packets, ip_summed);
 		//dump_packet(priv, rx_desc, frags, length);
-		recv_packet(priv, rx_desc, frags, length);
+		recv_packet(priv, rx_desc, frags, length, cqe);
 		goto next;
 
 #if 0 // AKAROS_PORT
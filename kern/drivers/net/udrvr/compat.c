@@ -12,6 +12,8 @@
 #include <assert.h>
 #include <error.h>
 #include <pmap.h>
+#include <mm.h>
+#include <pagemap.h>
 #include <smp.h>
 #include <linux/rdma/ib_user_verbs.h>
 #include "uverbs.h"
@@ -79,7 +81,11 @@ int map_upage_at_addr(struct proc *p, physaddr_t paddr, uintptr_t addr,
 
 void set_page_dirty_lock(struct page *pagep)
 {
-	atomic_or(&pagep->pg_flags, PG_DIRTY);
+	/* The PM counts its dirty pages, so it needs to see this one */
+	if (page_is_pagemap(pagep))
+		pm_page_set_dirty(pagep->pg_mapping, pagep);
+	else
+		atomic_or(&pagep->pg_flags, PG_DIRTY);
 }
 
 void put_page(struct page *pagep)
@@ -94,8 +100,10 @@ int get_user_page(struct proc *p, unsigned long uvastart, int write, int force,
 {
 	pte_t		pte;
 	int		ret = -1;
+	int		nr_faults = 0;
 	struct page	*pp;
 
+again:
 	spin_lock(&p->pte_lock);
 
 	pte = pgdir_walk(p->env_pgdir, (void*)uvastart, TRUE);
@@ -103,6 +111,24 @@ int get_user_page(struct proc *p, unsigned long uvastart, int write, int force,
 	if (!pte_walk_okay(pte))
 		goto err1;
 
+	/*
+	 * zswap has the user's data; a paged-out PTE is not present, but we
+	 * can't just drop a new page over it.  Fault it back in and look again.
+	 * After a fork, a writable private page is a read-only CoW PTE; the
+	 * write fault gives us our own copy, so the device writes to our page
+	 * and not the one we share.  zswap could take the page again before we
+	 * relock, so don't try forever.
+	 */
+	if (pte_is_paged_out(pte) || (write && pte_is_cow(pte))) {
+		spin_unlock(&p->pte_lock);
+		if (nr_faults++ == 3)
+			return -1;
+		if (handle_page_fault(p, uvastart,
+				      write ? PROT_WRITE : PROT_READ))
+			return -1;
+		goto again;
+	}
+
 	if (!pte_is_present(pte)) {
 		unsigned long prot = PTE_P | PTE_U | PTE_A | PTE_W | PTE_D;
 #if 0
@@ -113,11 +139,14 @@ int get_user_page(struct proc *p, unsigned long uvastart, int write, int force,
 		 * TODO: ok to allocate with pte_lock? "prot" needs to be
 		 * based on VMR writability, refer to pgprot_noncached().
 		 */
-		if (upage_alloc(p, &pp, 0))
+		if (upage_alloc(p, &pp, 1))
 			goto err1;
 		pte_write(pte, page2pa(pp), prot);
 	} else {
 		pp = pa2page(pte_get_paddr(pte));
+		/* Jumbo PTEs point to the first page of the jumbo */
+		if (pte_is_jumbo(pte))
+			pp += (uvastart & (PML2_PTE_REACH - 1)) >> PGSHIFT;
 
 		/* __vmr_free_pgs() refcnt's pagemap pages differently */
 		if (atomic_read(&pp->pg_flags) & PG_PAGEMAP) {
@@ -69,6 +69,13 @@ struct arena {
 	size_t				amt_total_segs;	/* not include qcache */
 	size_t				amt_alloc_segs;
 	size_t				nr_allocs_ever;
+	/* Allocs that failed, but had enough free segs in total */
+	size_t				nr_frag_fails;
+	/* Traffic with our source: spans imported and returned */
+	size_t				nr_imports;
+	size_t				amt_imported;
+	size_t				nr_exports;
+	size_t				amt_exported;
 	uintptr_t			last_nextfit_alloc;
 	struct btag_list		free_segs[ARENA_NR_FREE_LISTS];
 	struct btag_list		static_hash[HASH_INIT_SZ];
@@ -119,6 +126,7 @@ void arena_xfree(struct arena *arena, void *addr, size_t size);
 
 size_t arena_amt_free(struct arena *arena);
 size_t arena_amt_total(struct arena *arena);
+size_t arena_largest_free(struct arena *arena);
 void kmemstat(void);
 
 /* All lists that track the existence of arenas, slabs, and the connections
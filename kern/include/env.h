@@ -23,6 +23,7 @@
 #include <arch/vmm/vmm.h>
 #include <arch/pci.h>
 #include <dma.h>
+#include <core_set.h>
 
 TAILQ_HEAD(vcore_tailq, vcore);
 /* 'struct proc_list' declared in sched.h (not ideal...) */
@@ -92,7 +93,16 @@ struct proc {
 	spinlock_t vmr_lock;		/* Protects VMR tree (mem mgmt) */
 	spinlock_t pte_lock;		/* Protects page tables (mem mgmt) */
 	struct vmr_tailq vm_regions;
+	struct rb_root vm_tree;		/* same VMRs, indexed by vm_base */
+	seq_ctr_t vmr_seq;		/* for lockless readers of vm_tree */
 	int vmr_history;
+	bool jumbo_anon;		/* anon mmaps default to MAP_JUMBO */
+	unsigned long nr_jumbo_pgs;	/* jumbo PTEs, protected by pte_lock */
+	unsigned long nr_jumbo_fallbacks; /* jumbo faults that got 4K pages */
+	struct core_set tlb_cores;	/* cores with env_cr3 loaded */
+	unsigned long as_id;		/* unique, never reused */
+	atomic_t tlb_gen;		/* bumped by every TLB shootdown */
+	uintptr_t zswap_hand;		/* where zswap resumes its scan */
 
 	// Per process info and data pages
  	procinfo_t *procinfo;       // KVA of per-process shared info table (RO)
@@ -10,15 +10,36 @@
 #include <ros/common.h>
 #include <kref.h>
 
-#define NUM_KMALLOC_CACHES 6
+/* Size classes: KMALLOC_SMALLEST, then KMALLOC_CLASSES_PER_PWR2 evenly spaced
+ * classes per power of two, up to KMALLOC_LARGEST.  e.g. 64, 80, 96, 112, 128,
+ * 160, 192, 224, 256, 320...  Larger allocations come from kpages. */
+#define KMALLOC_CLASS_SHIFT 2
+#define KMALLOC_CLASSES_PER_PWR2 (1 << KMALLOC_CLASS_SHIFT)
+#define NUM_KMALLOC_PWR2 7
+#define NUM_KMALLOC_CACHES (1 + NUM_KMALLOC_PWR2 * KMALLOC_CLASSES_PER_PWR2)
 #define KMALLOC_ALIGNMENT 16
 #define KMALLOC_SMALLEST (sizeof(struct kmalloc_tag) << 1)
-#define KMALLOC_LARGEST KMALLOC_SMALLEST << NUM_KMALLOC_CACHES
+#define KMALLOC_LARGEST (KMALLOC_SMALLEST << NUM_KMALLOC_PWR2)
+
+/* Headerless classes, for small kmallocs: KMALLOC_ALIGNMENT steps up to
+ * KMALLOC_SMALLEST, then the regular classes up to KMALLOC_HL_LARGEST.  These
+ * objects have no kmalloc_tag; kfree finds their cache from their page.  They
+ * can't be kmalloc_incref()d - use kmalloc_refd() for buffers that need it. */
+#define KMALLOC_HL_NR_SMALL (KMALLOC_SMALLEST / KMALLOC_ALIGNMENT)
+#define NUM_KMALLOC_HL_PWR2 3
+#define NUM_KMALLOC_HL_CACHES (KMALLOC_HL_NR_SMALL +                           \
+                               NUM_KMALLOC_HL_PWR2 * KMALLOC_CLASSES_PER_PWR2)
+#define KMALLOC_HL_LARGEST (KMALLOC_SMALLEST << NUM_KMALLOC_HL_PWR2)
+
+extern bool kmalloc_headerless;
 
 void kmalloc_init(void);
 void *kmalloc(size_t size, int flags);
 void *kmalloc_array(size_t nmemb, size_t size, int flags);
 void *kzmalloc(size_t size, int flags);
+/* Always have a tag, and thus a refcnt for kmalloc_incref(). */
+void *kmalloc_refd(size_t size, int flags);
+void *kzmalloc_refd(size_t size, int flags);
 void *kmalloc_align(size_t size, int flags, size_t align);
 void *kzmalloc_align(size_t size, int flags, size_t align);
 void *krealloc(void *buf, size_t size, int flags);
@@ -27,6 +48,8 @@ int kmalloc_refcnt(void *buf);
 void kmalloc_incref(void *buf);
 void kfree(void *buf);
 void kmalloc_canary_check(char *str);
+struct sized_alloc;
+void kmalloc_fetch_stats(struct sized_alloc *sza);
 void *debug_canary;
 
 #define MEM_ATOMIC		(1 << 1)
@@ -29,6 +29,7 @@ TAILQ_HEAD(kth_db_tailq, kth_db_info);
 #define KTH_IS_KTASK			(1 << 0)
 #define KTH_SAVE_ADDR_SPACE		(1 << 1)
 #define KTH_IS_RCU_KTASK		(1 << 2)
+#define KTH_IS_PINNED			(1 << 3)
 
 /* These flag sets are for toggling between ktasks and default/process ktasks */
 /* These are the flags for *any* ktask */
@@ -48,6 +49,7 @@ struct kthread {
 	TAILQ_ENTRY(kthread)		link;
 	/* ID, other shit, etc */
 	int				flags;
+	int				pinned_core;	/* if KTH_IS_PINNED */
 	char				*name;
 	char				generic_buf[GENBUF_SZ];
 	int				errno;
@@ -132,6 +134,7 @@ void kthread_runnable(struct kthread *kthread);
 void kthread_yield(void);
 void kthread_usleep(uint64_t usec);
 void ktask(char *name, void (*fn)(void*), void *arg);
+void ktask_on_core(char *name, void (*fn)(void*), void *arg, int coreid);
 
 static inline bool is_ktask(struct kthread *kthread)
 {
@@ -143,6 +146,11 @@ static inline bool is_rcu_ktask(struct kthread *kthread)
 	return kthread->flags & KTH_IS_RCU_KTASK;
 }
 
+static inline bool is_pinned_ktask(struct kthread *kthread)
+{
+	return kthread->flags & KTH_IS_PINNED;
+}
+
 void sem_init(struct semaphore *sem, int signals);
 void sem_init_irqsave(struct semaphore *sem, int signals);
 bool sem_trydown_bulk(struct semaphore *sem, int nr_signals);
@@ -14,6 +14,7 @@
 #include <slab.h>
 #include <kref.h>
 #include <rcu.h>
+#include <rbtree.h>
 
 struct chan;
 struct fd_table;
@@ -43,10 +44,19 @@ size_t foc_get_len(struct file_or_chan *foc);
  * don't refcnt these.  Either they are in the TAILQ/tree, or they should be
  * freed.  There should be no other references floating around.  We still need
  * to sort out how we share memory and how we'll do private memory with these
- * VMRs. */
+ * VMRs.
+ *
+ * VMRs are on both the TAILQ (sorted, for walking neighbors) and the proc's
+ * rbtree (for lookups).  The tree is augmented with the largest free gap after
+ * any VMR in a subtree, which vmr_insert() uses to find space.  Lookups from the
+ * page fault handler are lockless: they are protected by RCU and the proc's
+ * vmr_seq, and VMRs are freed after a grace period. */
 struct vm_region {
 	TAILQ_ENTRY(vm_region)		vm_link;
 	TAILQ_ENTRY(vm_region)		vm_pm_link;
+	struct rb_node			vm_rb;
+	uintptr_t			vm_max_gap; /* max gap in subtree */
+	struct rcu_head			vm_rcu;
 	struct proc			*vm_proc;
 	uintptr_t			vm_base;
 	uintptr_t			vm_end;
@@ -56,6 +66,7 @@ struct vm_region {
 	size_t				vm_foff;
 	bool				vm_ready; /* racy, for the PM checks */
 	bool				vm_shootdown_needed;
+	bool				vm_dying; /* set under the pte_lock */
 };
 TAILQ_HEAD(vmr_tailq, vm_region);	/* Declares 'struct vmr_tailq' */
 
@@ -76,6 +87,9 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p);
 void print_vmrs(struct proc *p);
 void enumerate_vmrs(struct proc *p, void (*func)(struct vm_region *vmr, void
 						 *opaque), void *opaque);
+int anon_mem_walk(struct proc *p, uintptr_t start, uintptr_t end,
+                  int (*cb)(struct proc *p, pte_t pte, void *va, void *arg),
+                  void *arg);
 
 /* mmap() related functions.  These manipulate VMRs and change the hardware page
  * tables.  Any requests below the LOWEST_VA will silently be upped.  This may
@@ -92,6 +106,11 @@ int handle_page_fault(struct proc *p, uintptr_t va, int prot);
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot);
 unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs);
 
+#define FAULT_AROUND_MAX_PGS 64
+extern unsigned int fault_around_pgs;
+struct sized_alloc;
+void fault_around_fetch_stats(struct sized_alloc *sza);
+
 /* These assume the mm_lock is held already */
 int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
 int __do_munmap(struct proc *p, uintptr_t addr, size_t len);
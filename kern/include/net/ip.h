@@ -29,6 +29,7 @@
 
 #pragma once
 #include <ns.h>
+#include <siphash.h>
 
 enum {
 	Addrlen = 64,
@@ -55,6 +56,9 @@ enum {
 	/* 2^Lroot trees in the root table */
 	Lroot = 10,
 
+	/* most convs a protocol can grow to, limited by devip's qids */
+	Maxconv = 1 << 19,
+
 	Maxpath = 64,
 };
 
@@ -73,6 +77,30 @@ enum {
 	SHUT_RDWR = 2,
 };
 
+/*
+ *  hash table for 2 ip addresses + 2 ports
+ */
+enum {
+	IPmatchexact = 0,	/* match on 4 tuple */
+	IPmatchany,	/* *!* */
+	IPmatchport,	/* *!port */
+	IPmatchaddr,	/* addr!* */
+	IPmatchpa,	/* addr!port */
+};
+
+/* Embedded in the conv.  We keep our own copy of the tuple we hashed, so that
+ * lookups don't need to touch the conv and so that removal finds the right
+ * bucket even if the conv's addresses changed since it was added. */
+struct Iphash {
+	struct hlist_node link;
+	uint8_t raddr[IPaddrlen];
+	uint8_t laddr[IPaddrlen];
+	uint16_t rport;
+	uint16_t lport;
+	uint32_t hv;
+	int match;
+};
+
 /*
  *  one per conversation directory
  */
@@ -130,8 +158,15 @@ struct conv {
 	void *ptcl;		/* Protocol specific stuff */
 
 	struct route *r;	/* last route used */
-	uint32_t rgen;		/* routetable generation for *r */
+	uint32_t rgen;		/* r->rt.gen when we looked up *r */
+
+	struct Iphash ipht;	/* our entry in the proto's Ipht */
+
+	uint16_t held_lport;	/* lport counted in p->lport_refs */
+	bool on_free_list;	/* protected by p->free_lock */
+	TAILQ_ENTRY(conv) free_link;
 };
+TAILQ_HEAD(conv_tailq, conv);
 
 struct Ipifc;
 struct Fs;
@@ -145,6 +180,8 @@ struct medium {
 	void (*bind) (struct Ipifc * unused_Ipifc, int unused_int,
 		      char **unused_char_pp_t);
 	void (*unbind) (struct Ipifc * unused_Ipifc);
+	/* medium-specific ctl messages, optional */
+	void (*ctl) (struct Ipifc * ifc, char **argv, int argc);
 	void (*bwrite) (struct Ipifc * ifc, struct block * b, int version,
 			uint8_t * ip);
 
@@ -171,6 +208,8 @@ struct medium {
 		      uint8_t *, int, int);	/* resolve */
 	void (*areg) (struct Ipifc * unused_Ipifc,
 		      uint8_t * unused_uint8_p_t);	/* register */
+	/* ask for ip's mac again, for v4 retransmits.  optional. */
+	void (*areq) (struct Ipifc *ifc, uint8_t *ip);
 
 	/* v6 address generation */
 	void (*pref2addr) (uint8_t * pref, uint8_t * ea);
@@ -231,6 +270,7 @@ struct Ipifc {
 	unsigned int feat;	/* Offload features */
 	void *arg;		/* medium specific */
 	int reassemble;		/* reassemble IP packets before forwarding */
+	int gro;		/* medium may merge rx TCP segments, ip.c */
 
 	/* these are used so that we can unbind on the fly */
 	spinlock_t idlock;
@@ -262,34 +302,50 @@ struct Ipmulti {
 	struct Ipmulti *next;
 };
 
-/*
- *  hash table for 2 ip addresses + 2 ports
- */
-enum {
-	Nipht = 521,		/* convenient prime */
-
-	IPmatchexact = 0,	/* match on 4 tuple */
-	IPmatchany,	/* *!* */
-	IPmatchport,	/* *!port */
-	IPmatchaddr,	/* addr!* */
-	IPmatchpa,	/* addr!port */
-};
-struct Iphash {
-	struct Iphash *next;
-	struct conv *c;
-	int match;
+/* The conversation hash table.  Lookups happen for every packet we receive, on
+ * whatever cores are doing IP input, so they take no locks: they walk a bucket
+ * under RCU and use a seq counter to catch concurrent changes.  Writers lock
+ * one of NIPHT_STRIPES stripes, picked by the low bits of the hash, which also
+ * pick the bucket, so every bucket belongs to one stripe.  The table doubles
+ * when it gets too full.
+ *
+ * The hash is SipHash over the whole tuple, keyed per table, so a remote host
+ * can't aim its packets at one bucket. */
+#define NIPHT_STRIPES		64
+#define IPHT_INIT_BITS		10
+
+struct ipht_table {
+	struct rcu_head			rcu;
+	unsigned int			nr_bits;
+	struct hlist_head		buckets[];
 };
 
-struct Iphash;
+struct ipht_stripe {
+	spinlock_t			lock;
+	seq_ctr_t			seq;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 struct Ipht {
-	spinlock_t lock;
-	struct Iphash *tab[Nipht];
+	struct ipht_table		*tbl;
+	struct siphash_key		key;
+	atomic_t			nr_items;
+	qlock_t				resize_qlock;
+	unsigned long			nr_resizes;
+	struct ipht_stripe		stripes[NIPHT_STRIPES];
 };
+
+void iphtinit(struct Ipht *ht);
 void iphtadd(struct Ipht *, struct conv *);
 void iphtrem(struct Ipht *, struct conv *);
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 		      uint16_t dp);
 void dump_ipht(struct Ipht *ht);
+/* Guts of the above, for users (and tests) that manage their own entries */
+void __iphtadd(struct Ipht *ht, struct Iphash *h, uint8_t *raddr,
+	       uint16_t rport, uint8_t *laddr, uint16_t lport);
+void __iphtrem(struct Ipht *ht, struct Iphash *h);
+struct Iphash *__iphtlook(struct Ipht *ht, uint8_t *sa, uint16_t sp,
+			  uint8_t *da, uint16_t dp);
 
 /*
  *  one per multiplexed Protocol
@@ -322,10 +378,14 @@ struct Proto {
 	struct conv **conv;	/* array of conversations */
 	int ptclsize;		/* size of per protocol ctl block */
 	int nc;			/* number of conversations */
+	int maxnc;		/* nc can grow up to this */
 	int ac;
 	struct qid qid;		/* qid for protocol directory */
-	uint16_t nextport;
 	uint16_t nextrport;
+	uint32_t *lport_refs;	/* convs holding each local port */
+
+	spinlock_t free_lock;
+	struct conv_tailq free_convs;	/* closed convs, oldest first */
 
 	void *priv;
 };
@@ -339,6 +399,27 @@ struct IProuter {
 	struct queue *q;
 };
 
+/*
+ *  Longest-prefix-match table for route lookups, see ipfib.c
+ */
+struct fib_node;
+
+struct fib {
+	struct fib_node			*root;
+	seq_ctr_t			seq;
+	unsigned long			nr_prefixes;
+	unsigned long			nr_nodes;
+};
+
+extern void fib_init(struct fib *fib);
+extern void fib_destroy(struct fib *fib);
+extern size_t fib_memory(struct fib *fib);
+extern struct route *fib_lookup(struct fib *fib, const uint8_t *key);
+extern void fib_insert(struct fib *fib, const uint8_t *key, int plen,
+		       struct route *r);
+extern void fib_remove(struct fib *fib, const uint8_t *key, int plen,
+		       struct route *cover, int cover_plen);
+
 /*
  *  one per IP protocol stack
  */
@@ -361,6 +442,8 @@ struct Fs {
 	struct route *v4root[1 << Lroot];	/* v4 routing forest */
 	struct route *v6root[1 << Lroot];	/* v6 routing forest */
 	struct route *queue;	/* used as temp when reinjecting routes */
+	struct fib v4fib;	/* lookup tables built from the forests */
+	struct fib v6fib;
 
 	struct Netlog *alog;
 	struct Ifclog *ilog;
@@ -480,6 +563,7 @@ struct RouteTree {
 	struct Ipifc *ifc;
 	char tag[4];
 	struct kref kref;
+	uint32_t gen;		/* changes when the route does */
 };
 
 struct V4route {
@@ -502,6 +586,7 @@ struct route {
 		struct V4route v4;
 	};
 };
+extern void routeinit(struct Fs *f);
 extern void v4addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		       uint8_t * gate, int type);
 extern void v6addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
@@ -540,13 +625,17 @@ struct arpent {
 	uint8_t ip[IPaddrlen];
 	uint8_t mac[MAClen];
 	struct medium *type;	/* media type */
-	struct arpent *hash;
+	struct hlist_node hash;
+	struct list_head lru;
+	struct rcu_head rcu;
+	seq_ctr_t seq;		/* for lockless readers of mac, state, ctime */
+	bool referenced;	/* used since the last eviction sweep */
 	struct block *hold;
 	struct block *last;
+	int nr_hold;
 	uint64_t ctime;		/* time entry was created or refreshed */
-	uint64_t utime;		/* time entry was last used */
 	uint8_t state;
-	struct arpent *nextrxt;	/* re-transmit chain */
+	struct list_head rxmt_link;	/* re-transmit chain */
 	uint64_t rtime;		/* time for next retransmission */
 	uint8_t rxtsrem;
 	struct Ipifc *ifc;
@@ -554,7 +643,8 @@ struct arpent {
 };
 
 extern void arpinit(struct Fs *);
-extern int arpread(struct arp *, char *unused_char_p_t, uint32_t, int);
+struct sized_alloc;
+extern struct sized_alloc *arpopen(struct arp *);
 extern int arpwrite(struct Fs *, char *unused_char_p_t, long);
 extern struct arpent *arpget(struct arp *, struct block *bp, int version,
 			     struct Ipifc *ifc, uint8_t * ip, uint8_t * h);
@@ -659,6 +749,27 @@ extern void ipsendra6(struct Fs *f, int on);
 /*
  *  ip.c
  */
+enum {
+	IPGRO_MAX_FLOWS = 8,	/* flows one ipgro can hold at a time */
+	IPGRO_MAX_SEGS = 64,	/* segments merged into one packet */
+};
+
+struct ipgro_flow {
+	struct block *head;	/* first segment, NULL if unused */
+	uint32_t next_seq;
+	uint16_t seg_len;	/* head's original payload length */
+	uint16_t nr_segs;
+	uint64_t start;		/* tsc when we started holding head */
+};
+
+/* Software GRO state for one receive loop.  Caller syncs. */
+struct ipgro {
+	struct Fs *f;
+	struct Ipifc *ifc;
+	unsigned int nr_held;
+	struct ipgro_flow flows[IPGRO_MAX_FLOWS];
+};
+
 extern void iprouting(struct Fs *, int);
 extern void icmpnoconv(struct Fs *, struct block *);
 extern void icmpcantfrag(struct Fs *, struct block *, int);
@@ -669,6 +780,9 @@ uint16_t ipchecksum(uint8_t *addr, int len);
 extern uint16_t ipcsum(uint8_t * unused_uint8_p_t);
 extern void ipiput4(struct Fs *, struct Ipifc *unused_ipifc, struct block *);
 extern void ipiput6(struct Fs *, struct Ipifc *unused_ipifc, struct block *);
+void ipgro_init(struct ipgro *g, struct Fs *f, struct Ipifc *ifc);
+void ipgro_input(struct ipgro *g, struct block *bp);
+void ipgro_flush(struct ipgro *g);
 extern int ipoput4(struct Fs *, struct block *, int unused_int, int, int,
 		   struct conv *);
 extern int ipoput6(struct Fs *, struct block *, int unused_int, int, int,
@@ -1018,6 +1132,7 @@ struct netaddr {
 #define NETF_SG_SHIFT		(NETF_BASE_SHIFT + 1)
 #define NETF_LRO_SHIFT		(NETF_BASE_SHIFT + 2)
 #define NETF_RXCSUM_SHIFT	(NETF_BASE_SHIFT + 3)
+#define NETF_RXHASH_SHIFT	(NETF_BASE_SHIFT + 4)
 enum {
 	NETF_IPCK = (1 << NS_IPCK_SHIFT),	/* xmit ip checksum */
 	NETF_UDPCK = (1 << NS_UDPCK_SHIFT),	/* xmit udp checksum */
@@ -1027,6 +1142,7 @@ enum {
 	NETF_TSO = (1 << NS_TSO_SHIFT),		/* device can do TSO */
 	NETF_LRO = (1 << NETF_LRO_SHIFT),	/* device can do LRO */
 	NETF_RXCSUM = (1 << NETF_RXCSUM_SHIFT),	/* device can do rx checksums */
+	NETF_RXHASH = (1 << NETF_RXHASH_SHIFT),	/* device hashes rx flows */
 };
 
 /* Linux's rtnl_link_stats64 */
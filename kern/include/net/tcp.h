@@ -50,6 +50,12 @@ enum {
 	TcptimerON = 1,
 	TcptimerDONE = 2,
 	MAX_TIME = (1 << 20),	/* Forever */
+	/* Timer wheel: TW_LEVELS levels of TW_SIZE slots, covering 2^24
+	 * ticks, which is more than MAX_TIME. */
+	TW_BITS = 6,
+	TW_SIZE = 1 << TW_BITS,
+	TW_MASK = TW_SIZE - 1,
+	TW_LEVELS = 4,
 	TCP_ACK = 50,	/* Timed ack sequence in ms */
 	MAXBACKMS = 9 * 60 * 1000, /* longest backoff time (ms) before hangup */
 
@@ -86,6 +92,7 @@ enum {
 	TCP_LISTEN = 0,	/* Listen connection */
 	TCP_CONNECT = 1,	/* Outgoing connection */
 	SYNACK_RXTIMER = 250,	/* ms between SYNACK retransmits */
+	SYNACK_RXMITS = 5,	/* SYNACK retransmits before giving up */
 
 	TCPREXMTTHRESH = 3,	/* dupack threshold for recovery */
 	SACK_RETRANS_RECOVERY = 1,
@@ -114,24 +121,42 @@ enum {
 	Time_wait,
 
 	Maxlimbo = 1000,/* maximum procs waiting for response to SYN ACK */
-	NLHT = 256,	/* hash table size, must be a power of 2 */
+	NLHT = 1024,	/* hash table size, must be a power of 2 */
 	LHTMASK = NLHT - 1,
 
+	/* SYN cookies: the ISS is a 5 bit counter of SYNCOOKIE_PERIOD ms
+	 * periods, a 3 bit MSS index, and a 24 bit hash.  Options that don't
+	 * fit go in the low bits of our TS val. */
+	SYNCOOKIE_PERIOD = 64000,
+	SYNCOOKIE_COUNT_SHIFT = 27,
+	SYNCOOKIE_MSS_SHIFT = 24,
+	SYNCOOKIE_HASH_MASK = (1 << SYNCOOKIE_MSS_SHIFT) - 1,
+	SYNCOOKIE_TS_BITS = 5,
+	SYNCOOKIE_TS_MASK = (1 << SYNCOOKIE_TS_BITS) - 1,
+	SYNCOOKIE_TS_NOWS = 0xf,	/* in place of a window scale */
+	SYNCOOKIE_TS_SACK = 0x10,
+
 	HaveWS = 1 << 8,
 };
 
 typedef struct tcptimer Tcptimer;
 struct tcptimer {
-	Tcptimer *next;
-	Tcptimer *prev;
+	struct list_head link;	/* on a wheel slot, if ON */
 	Tcptimer *readynext;
 	int state;
 	uint64_t start;
-	uint64_t count;
+	uint64_t count;		/* ticks left when last halted or fired */
+	uint64_t expires;	/* wheel tick we fire on, if ON */
 	void (*func) (void *);
 	void *arg;
 };
 
+/* Hierarchical timing wheel, see tcp.c */
+struct tcp_timer_wheel {
+	uint64_t now;		/* next tick to run */
+	struct list_head slots[TW_LEVELS][TW_SIZE];
+};
+
 struct tcphdr {
 	uint8_t tcpsport[2];
 	uint8_t tcpdport[2];
@@ -203,6 +228,7 @@ struct tcp {
 	uint16_t len;		/* size of data */
 	uint32_t ts_val;	/* timestamp val from sender */
 	uint32_t ts_ecr;	/* timestamp echo response from sender */
+	uint32_t ts_ours;	/* timestamp val to send, if not our clock */
 	bool sack_ok;		/* header had/should have SACK_PERMITTED */
 	uint8_t nr_sacks;
 	struct sack_block sacks[MAX_NR_SACKS_PER_PACKET];
@@ -220,6 +246,17 @@ struct reseq {
 	uint16_t length;
 };
 
+struct tcp_cc_ops;
+
+/* CUBIC's per-conv state.  Windows are in bytes, times in ms. */
+struct cubic_state {
+	uint32_t w_max;		/* cwind before the last loss */
+	uint32_t origin;	/* plateau of the cubic function */
+	uint32_t w_est_start;	/* cwind when this epoch started */
+	uint32_t k;		/* time from epoch_start to the plateau */
+	uint64_t epoch_start;	/* start of growth since the last loss, or 0 */
+};
+
 /*
  *  the qlock in the Conv locks this structure
  */
@@ -260,6 +297,11 @@ struct tcpctl {
 	uint32_t cwind;		/* Congestion window */
 	int scale;		/* desired snd.scale */
 	uint32_t ssthresh;	/* Slow start threshold */
+	struct tcp_cc_ops *cc;	/* Congestion control algorithm */
+	struct tcp_cc_ops *cc_chosen;	/* by ctl, kept across opens */
+	union {
+		struct cubic_state cubic;
+	} cc_state;
 	int irs;		/* Initial received squence */
 	uint16_t mss;		/* Max segment size */
 	uint16_t typical_mss;	/* MSS for most packets (< MSS for some opts) */
@@ -292,21 +334,49 @@ struct tcpctl {
 	} protohdr;		/* prototype header */
 };
 
+/* Congestion control algorithms, see tcpcc.c.  A conv gets the stack's
+ * default algorithm (or its listener's, for passive opens), and can change it
+ * with a "cc" ctl.  The ops run with the conv qlocked. */
+struct tcp_cc_ops {
+	char *name;
+	/* Resets the algorithm's state, not cwind or ssthresh */
+	void (*init)(Tcpctl *tcb);
+	/* Returns how much to open cwind by, for acked newly ACKed bytes.
+	 * Only called when cwind is below the send window and we are not
+	 * recovering. */
+	uint32_t (*on_ack)(Tcpctl *tcb, uint32_t acked);
+	/* Sets cwind and ssthresh after a loss found by dupacks or SACKs */
+	void (*on_loss)(Tcpctl *tcb);
+	/* ... and after a retransmit timeout */
+	void (*on_rto)(Tcpctl *tcb);
+};
+
+extern struct tcp_cc_ops tcp_cc_reno;
+extern struct tcp_cc_ops tcp_cc_cubic;
+struct tcp_cc_ops *tcp_cc_lookup(char *name);
+uint32_t tcp_cubic_cbrt(uint64_t x);
+
 /* New calls are put in limbo rather than having a conversation structure
  *  allocated.  Thus, a SYN attack results in lots of limbo'd calls but not any
  *  real Conv structures mucking things up.  Calls in limbo rexmit their SYN ACK
- *  every SYNACK_RXTIMER ms up to 4 times, i.e., they disappear after 1 second.
+ *  up to SYNACK_RXMITS times, waiting one more SYNACK_RXTIMER each time.
  *
  *  In particular they aren't on a listener's queue so that they don't figure in
  *  the input queue limit.
  *
- *  If 1/2 of a T3 was attacking SYN packets, we'ld have a permanent queue of
- *  70000 limbo'd calls.  Not great for a linear list but doable.  Therefore
- *  there is no hashing of this list.
+ *  Limbo is a hash table, keyed with a secret so that an attacker can't pick
+ *  the bucket.  Each call is also on the limbo_rx list for its number of
+ *  rexmits, in the order they are due, and a single timer goes off for the
+ *  earliest one.
+ *
+ *  Once there are Maxlimbo calls, we stop keeping state for new ones and
+ *  answer with a SYN cookie instead.  The ACK to a cookie SYN ACK has
+ *  everything we need to make the conv.
  */
 typedef struct limbo Limbo;
 struct limbo {
-	Limbo *next;
+	struct hlist_node hlink;	/* on lht */
+	struct list_head rxlink;	/* on limbo_rx[rexmits] */
 
 	uint8_t laddr[IPaddrlen];
 	uint8_t raddr[IPaddrlen];
@@ -318,6 +388,7 @@ struct limbo {
 	uint16_t rcvscale;		/* how much to scale rcvd windows */
 	uint16_t sndscale;		/* how much to scale sent windows */
 	uint64_t lastsend;		/* last time we sent a synack */
+	uint64_t rxstart;		/* when we started waiting to rexmit */
 	uint8_t version;		/* v4 or v6 */
 	uint8_t rexmits;		/* number of retransmissions */
 	bool sack_ok;			/* other side said SACK_OK */
@@ -344,22 +415,42 @@ enum {
 	HlenErrs,
 	LenErrs,
 	OutOfOrder,
+	LimboOverflows,
+	SynCookiesSent,
+	SynCookiesAccepted,
+	SynCookiesFailed,
+	TimerTicks,
+	TimersExpired,
+	TimersCascaded,
+	TimerTickUs,
 
 	Nstats
 };
 
 typedef struct tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
+	/* Active timers */
 	qlock_t tl;
-	Tcptimer *timers;
+	struct tcp_timer_wheel wheel;
+	uint64_t tick_nsec;	/* time spent running the wheel */
 
 	/* hash table for matching conversations */
 	struct Ipht ht;
 
 	/* calls in limbo waiting for an ACK to our SYN ACK */
 	int nlimbo;
-	Limbo *lht[NLHT];
+	struct hlist_head lht[NLHT];
+	struct siphash_key limbo_key;
+	struct list_head limbo_rx[SYNACK_RXMITS + 1];
+	Tcptimer limbo_timer;
+	uint64_t limbo_deadline;	/* when limbo_timer goes off */
+
+	/* SYN cookies */
+	struct siphash_key cookie_key;
+	uint64_t last_cookie;		/* when we last sent one */
+
+	/* congestion control for new convs */
+	struct tcp_cc_ops *cc_default;
 
 	/* for keeping track of tcpackproc */
 	qlock_t apl;
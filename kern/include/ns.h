@@ -37,6 +37,7 @@
 #include <ros/fs.h>
 #include <bitmask.h>
 #include <mm.h>
+#include <pagemap.h>
 #include <sys/uio.h>
 #include <time.h>
 
@@ -405,7 +406,8 @@ enum {
 #define NS_TCPCK_SHIFT 4
 #define NS_PKTCK_SHIFT 5
 #define NS_TSO_SHIFT 6
-#define NS_SHIFT_MAX 6
+#define NS_RXHASH_SHIFT 7
+#define NS_SHIFT_MAX 7
 
 enum {
 	BFREE = (1 << 1),
@@ -414,8 +416,9 @@ enum {
 	Btcpck = (1 << NS_TCPCK_SHIFT),	/* tcp checksum (rx), needed (tx) */
 	Bpktck = (1 << NS_PKTCK_SHIFT),	/* packet checksum (rx, maybe) */
 	Btso = (1 << NS_TSO_SHIFT),	/* TSO desired (tx) */
+	Brxhash = (1 << NS_RXHASH_SHIFT),	/* rx_hash is the NIC's flow hash */
 };
-#define BLOCK_META_FLAGS (Bipck | Budpck | Btcpck | Bpktck | Btso)
+#define BLOCK_META_FLAGS (Bipck | Budpck | Btcpck | Bpktck | Btso | Brxhash)
 #define BLOCK_TRANS_TX_CSUM (Budpck | Btcpck)
 #define BLOCK_RX_CSUM (Bipck | Budpck | Btcpck)
 
@@ -439,6 +442,7 @@ struct block {
 	uint16_t network_offset;	/* offset from rp */
 	uint16_t transport_offset;	/* offset from rp */
 	uint16_t tx_csum_offset;	/* offset from tx_offset to store csum */
+	uint32_t rx_hash;		/* flow hash, if Brxhash */
 	/* might want something to track the next free extra_data slot */
 	size_t extra_len;
 	unsigned int nr_extra_bufs;
@@ -488,6 +492,8 @@ struct chan {
 	 * the user can read from (including offsets) while the underlying file
 	 * changes.  Hang that buffer here. */
 	void *synth_buf;
+	/* For page-cached files: sequential readahead, per open chan. */
+	struct file_ra_state ra;
 };
 
 extern struct chan *kern_slash;
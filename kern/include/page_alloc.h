@@ -32,6 +32,10 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_JUMBO_SPLIT		0x040	/* part of a jumbo mapped by 4K PTEs */
+#define PG_READAHEAD		0x080	/* page map, read ahead and not used yet */
+
+#define NR_PGS_PER_JUMBO	(PML2_PTE_REACH >> PGSHIFT)
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -41,12 +45,14 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 struct page {
 	BSD_LIST_ENTRY(page)		pg_link;
 	atomic_t			pg_flags;
-	struct page_map			*pg_mapping;	/* for debugging... */
+	struct page_map			*pg_mapping;	/* if PG_PAGEMAP */
 	unsigned long			pg_index;
 	void				**pg_tree_slot;
-	void				*pg_private;
+	void				*pg_private;	/* KMC_PGLOOKUP slab's kc */
 	struct semaphore 		pg_sem;	
 	uint64_t			gpa;	/* physical address in guest */
+	atomic_t			pg_extra_refs;	/* e.g. CoW sharers */
+	uint8_t				pg_kpages_node;	/* NUMA node + 1, or 0 */
 
 	bool				pg_is_free;	/* TODO: will remove */
 };
@@ -59,6 +65,7 @@ extern page_list_t page_free_list;
 void base_arena_init(struct multiboot_info *mbi);
 
 error_t upage_alloc(struct proc *p, page_t **page, bool zero);
+error_t upage_alloc_node(struct proc *p, page_t **page, bool zero, int node);
 error_t kpage_alloc(page_t **page);
 void *kpage_alloc_addr(void);
 void *kpage_zalloc_addr(void);
@@ -66,13 +73,29 @@ void *kpage_zalloc_addr(void);
 /* Direct allocation from the kpages arena (instead of kmalloc).  These will
  * give you PGSIZE quantum. */
 void *kpages_alloc(size_t size, int flags);
+void *kpages_alloc_node(size_t size, int flags, int node);
 void *kpages_zalloc(size_t size, int flags);
 void kpages_free(void *addr, size_t size);
 
 void *get_cont_pages(size_t order, int flags);
 void free_cont_pages(void *buf, size_t order);
 
+struct sized_alloc;
+void numa_init(void);
+int numa_nr_nodes(void);
+void numa_fetch_stats(struct sized_alloc *sza);
+bool zpool_refill_idle(void);
+void zpool_fetch_stats(struct sized_alloc *sza);
+
+void page_incref(page_t *page);
 void page_decref(page_t *page);
+bool page_is_shared(page_t *page);
+
+void jumbo_arena_init(void);
+void *jumbo_page_alloc(size_t nr, int flags);
+void jumbo_page_free(void *buf, size_t nr);
+void jumbo_page_decref(page_t *page);
+void jumbo_page_split(page_t *page);
 
 int page_is_free(size_t ppn);
 void lock_page(struct page *page);
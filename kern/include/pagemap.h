@@ -29,6 +29,34 @@ struct page_map {
 	struct page_map_operations	*pm_op;
 	spinlock_t			pm_lock;	/* for the VMR list */
 	struct vmr_tailq		pm_vmrs;
+	atomic_t			pm_async_users;	/* readahead, writeback */
+	/* Dirty page accounting, only for PMs with a backing store */
+	atomic_t			pm_nr_dirty;
+	atomic_t			pm_nr_writeback;
+	unsigned long			pm_nr_shared_vmrs; /* pm_lock */
+	/* Protected by the writeback lock in pagemap.c */
+	TAILQ_ENTRY(page_map)		pm_dirty_link;
+	bool				pm_on_dirty_list;
+	uint64_t			pm_dirtied_at;	/* nsec, first dirty */
+	TAILQ_ENTRY(page_map)		pm_mapped_link;
+	bool				pm_on_mapped_list;
+	/* Stats, racy */
+	unsigned long			pm_nr_written;
+	unsigned long			pm_nr_wb_errors;
+	unsigned long			pm_nr_throttled;
+};
+TAILQ_HEAD(page_map_tailq, page_map);
+
+/* Sequential readahead state, one per reader (e.g. per open chan).  Zero it to
+ * start.  See pagemap.c. */
+struct file_ra_state {
+	unsigned long			prev_idx;	/* last page loaded */
+	unsigned long			size;		/* 0: not sequential */
+	struct {
+		unsigned long		start;
+		unsigned long		nr;
+		unsigned long		nr_hits;
+	} win[2];					/* older, newer */
 };
 
 /* Operations performed on a page_map.  These are usually FS specific, which
@@ -36,10 +64,12 @@ struct page_map {
  * Will fill these in as they are created/needed/used. */
 struct page_map_operations {
 	int (*readpage) (struct page_map *, struct page *);
+	/* NULL if there is no backing store.  Those PMs' pages are never
+	 * written back, and don't count as dirty for writeback. */
 	int (*writepage) (struct page_map *, struct page *);
+	/* Optional.  Writes nr pages with consecutive indexes as one op. */
+	int (*writepages) (struct page_map *, struct page **, int nr);
 /*	readpages: read a list of pages
-	writepage: write from a page to its backing store
-	writepages: write a list of pages
 	sync_page: start the IO of already scheduled ops
 	set_page_dirty: mark the given page dirty
 	prepare_write: prepare to write (disk backed pages)
@@ -55,7 +85,14 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
+int pm_load_page_ra(struct page_map *pm, unsigned long index,
+                    struct page **pp, struct file_ra_state *ra);
+int pm_load_page_nowait_ra(struct page_map *pm, unsigned long index,
+                           struct page **pp, struct file_ra_state *ra);
+void pm_wait_async(struct page_map *pm);
 void pm_put_page(struct page *page);
+void pm_page_set_dirty(struct page_map *pm, struct page *page);
+void pm_throttle_dirty(struct page_map *pm);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_or_zero_pages(struct page_map *pm, unsigned long start_idx,
@@ -65,3 +102,12 @@ void pm_free_unused_pages(struct page_map *pm);
 void pm_destroy(struct page_map *pm);
 void pm_page_asserter(struct page *page, char *str);
 void print_page_map_info(struct page_map *pm);
+struct sized_alloc;
+void pm_fetch_ra_stats(struct sized_alloc *sza);
+void pm_fetch_wb_stats(struct sized_alloc *sza);
+void pm_writeback_init(void);
+
+/* Writeback thresholds, settable in #mem/writeback */
+extern unsigned int pm_dirty_expire_ms;
+extern unsigned int pm_dirty_bg_ratio;
+extern unsigned int pm_dirty_throttle_ratio;
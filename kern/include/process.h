@@ -169,7 +169,39 @@ uintptr_t switch_to(struct proc *new_p);
 void switch_back(struct proc *new_p, uintptr_t old_ret);
 bool abandon_core(void);
 void clear_owning_proc(uint32_t coreid);
+void switch_addr_space(struct proc *old, struct proc *new);
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end);
+void proc_tlbshootdown_sync(struct proc *p, uintptr_t start, uintptr_t end);
+
+/* Shootdowns of more than this many pages flush the whole TLB */
+#define TLB_SHOOTDOWN_MAX_PGS		32
+
+/* Collects the TLB shootdowns of one pass over p's address space, e.g. an
+ * munmap or a writeback, into one range, so we interrupt each core once. */
+struct tlb_gather {
+	struct proc			*p;
+	uintptr_t			start;
+	uintptr_t			end;
+};
+
+static inline void tlb_gather_init(struct tlb_gather *tlb, struct proc *p)
+{
+	tlb->p = p;
+	tlb->start = (uintptr_t)-1;
+	tlb->end = 0;
+}
+
+static inline void tlb_gather_add(struct tlb_gather *tlb, uintptr_t start,
+                                  uintptr_t end)
+{
+	tlb->start = MIN(tlb->start, start);
+	tlb->end = MAX(tlb->end, end);
+}
+
+/* Shoots down the gathered range, if any, and resets tlb. */
+void tlb_gather_flush(struct tlb_gather *tlb);
+/* Same, but waits for every core to flush.  See proc_tlbshootdown_sync(). */
+void tlb_gather_flush_sync(struct tlb_gather *tlb);
 
 /* Kernel message handlers for process management */
 void __startcore(uint32_t srcid, long a0, long a1, long a2);
@@ -0,0 +1,41 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Memory reclaim.  Subsystems that cache memory (slabs, page caches, etc.)
+ * register a reclaimer.  A ktask calls them periodically to trim their caches
+ * down to their working sets, and calls them harder when memory is low. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <list.h>
+
+/* Reclaim levels, passed to the reclaimer's func */
+#define RECLAIM_TRIM		1	/* periodic; free what you aren't using */
+#define RECLAIM_LOW_MEM		2	/* memory is low; free whatever you can */
+
+struct reclaimer {
+	const char		*name;
+	/* Called from a ktask.  May block, but must not (un)register. */
+	void (*func)(struct reclaimer *r, int level);
+	struct list_head	link;
+	uint64_t		nr_trims;
+	uint64_t		nr_low_mem;
+};
+
+/* Reclaimers run in the order they registered.  Register cheap ones (e.g. free
+ * memory sitting in caches) before expensive ones (e.g. write back and drop
+ * file pages). */
+void register_reclaimer(struct reclaimer *r);
+/* Waits for any run of r->func to finish */
+void unregister_reclaimer(struct reclaimer *r);
+
+/* Asks the reclaim ktask to run at RECLAIM_LOW_MEM.  Safe from any context,
+ * including allocation failure paths. */
+void reclaim_poke(void);
+/* Runs all reclaimers at level, from a context that can block. */
+void reclaim_now(int level);
+void reclaim_init(void);
+
+struct sized_alloc;
+void reclaim_fetch_stats(struct sized_alloc *sza);
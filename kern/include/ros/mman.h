@@ -26,5 +26,6 @@
 
 #define MAP_LOCKED		0x02000
 #define MAP_POPULATE		0x08000
+#define MAP_JUMBO		0x40000	/* use jumbo pages for anon memory */
 
 #define MAP_FAILED		((void*)-1)
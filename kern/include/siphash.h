@@ -0,0 +1,18 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * SipHash-2-4, a keyed hash for short inputs (Aumasson and Bernstein).  Use it
+ * for hash tables whose keys come off the network, where an attacker who can
+ * predict the hash can put everything in one bucket.  Get the key from
+ * urandom_read() when you set up the table.  The output is only as secret as
+ * the key, so don't hand it out. */
+
+#pragma once
+
+#include <ros/common.h>
+
+struct siphash_key {
+	uint64_t			k[2];
+};
+
+uint64_t siphash(const void *data, size_t len, const struct siphash_key *key);
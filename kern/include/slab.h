@@ -47,6 +47,7 @@
 #define KMC_NOTOUCH		0x0001	/* Can't use source/object's memory */
 #define KMC_QCACHE		0x0002	/* Cache is an arena's qcache */
 #define KMC_NOTRACE		0x0004	/* Do not trace allocations */
+#define KMC_PGLOOKUP		0x0008	/* Find the cache from an obj's page */
 #define __KMC_USE_BUFCTL	0x1000	/* Internal use */
 #define __KMC_TRACED		0x2000	/* Internal use */
 #define __KMC_EVER_TRACED	0x3000	/* Internal use */
@@ -75,6 +76,19 @@ struct kmem_depot {
 	unsigned int			nr_not_empty;
 	unsigned int			busy_count;
 	uint64_t			busy_start;
+	/* Contention stats, for magazine resizing */
+	uint64_t			nr_acquires;
+	uint64_t			nr_contended;
+	uint64_t			nr_contended_last_trim;
+	unsigned int			nr_grows;
+	unsigned int			nr_shrinks;
+	/* Working set: the fewest and most mags on each list since the last
+	 * trim.  The 'min' mags weren't needed during that interval. */
+	unsigned int			ws_min_not_empty;
+	unsigned int			ws_min_empty;
+	unsigned int			ws_max_not_empty;
+	unsigned int			ws_max_empty;
+	uint64_t			nr_mags_trimmed;
 };
 
 struct kmem_slab;
@@ -137,6 +151,7 @@ struct kmem_cache {
 	void *priv;
 	unsigned long nr_cur_alloc;
 	unsigned long nr_direct_allocs_ever;
+	unsigned long nr_grows;		/* slabs imported from source */
 	struct hash_helper hh;
 	struct kmem_bufctl_slist *alloc_hash;
 	struct kmem_bufctl_slist static_hash[HASH_INIT_SZ];
@@ -146,6 +161,9 @@ struct kmem_cache {
 };
 
 extern struct kmem_cache_tailq all_kmem_caches;
+/* Magazine resize tunables */
+extern uint64_t resize_timeout_ns;
+extern unsigned int resize_threshold;
 
 /* Cache management */
 struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
@@ -159,9 +177,11 @@ void kmem_cache_destroy(struct kmem_cache *cp);
 void *kmem_cache_alloc(struct kmem_cache *cp, int flags);
 void *kmem_cache_zalloc(struct kmem_cache *cp, int flags);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
+struct kmem_cache *kmem_obj_cache(void *obj);
 /* Back end: internal functions */
 void kmem_cache_init(void);
 void kmem_cache_reap(struct kmem_cache *cp);
+void kmem_cache_trim(struct kmem_cache *kc, bool all);
 unsigned int kmc_nr_pcpu_caches(void);
 /* Low-level interface for creating/destroying; caller manages kc's memory */
 void __kmem_cache_create(struct kmem_cache *kc, const char *name,
@@ -0,0 +1,34 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Compressed, in-memory swap for anonymous memory.  Cold anonymous pages get
+ * compressed into a pool in kernel memory, and their PTEs point at the
+ * compressed copy instead of the page.  Page faults decompress them.
+ *
+ * Other than the fault and the reclaimer, the rest of the kernel just needs to
+ * deal with paged-out PTEs when it copies, frees, or changes the permissions
+ * of PTEs.  All of the zswap_*_pte() functions need p's pte_lock held. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <arch/mmu.h>
+
+struct proc;
+struct sized_alloc;
+
+/* Tunables, see #mem/zswap */
+extern bool zswap_enabled;
+extern unsigned int zswap_max_pool_pct;	/* pool limit, % of total memory */
+
+/* Brings pte's page back from the pool.  0 on success, or -ENOMEM. */
+int zswap_fault_in_pte(struct proc *p, pte_t pte);
+/* Gives new_p its own copy of p's paged-out pte at new_pte, for fork(). */
+int zswap_dup_pte(struct proc *new_p, pte_t pte, pte_t new_pte);
+/* Frees pte's page from the pool.  The caller clears the PTE. */
+void zswap_free_pte(pte_t pte);
+/* Changes the permissions pte's page will have when it comes back. */
+void zswap_set_perm_pte(pte_t pte, int perm);
+
+void zswap_init(void);
+void zswap_fetch_stats(struct sized_alloc *sza);
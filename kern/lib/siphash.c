@@ -0,0 +1,56 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * SipHash-2-4, from the reference implementation in "SipHash: a fast
+ * short-input PRF", Aumasson and Bernstein, 2012. */
+
+#include <siphash.h>
+#include <endian.h>
+#include <string.h>
+
+static inline uint64_t rotl64(uint64_t x, int b)
+{
+	return (x << b) | (x >> (64 - b));
+}
+
+#define SIPROUND(v0, v1, v2, v3)					\
+do {									\
+	v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);	\
+	v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;			\
+	v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;			\
+	v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);	\
+} while (0)
+
+uint64_t siphash(const void *data, size_t len, const struct siphash_key *key)
+{
+	const uint8_t *in = data;
+	const uint8_t *end = in + (len & ~7);
+	uint64_t v0 = key->k[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = key->k[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = key->k[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = key->k[1] ^ 0x7465646279746573ULL;
+	uint64_t m, b;
+
+	for (; in != end; in += 8) {
+		memcpy(&m, in, sizeof(m));
+		m = le64_to_cpu(m);
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	/* The last word has the leftover bytes and the length in the top byte */
+	b = (uint64_t)len << 56;
+	for (int i = len & 7; i > 0; i--)
+		b |= (uint64_t)in[i - 1] << (8 * (i - 1));
+	v3 ^= b;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -49,8 +49,9 @@
  *   help us get out of OOM.  So we might block when we're at low-mem, not at 0.
  *   We probably should have a sorted list of desired amounts, and unblockers
  *   poke the CV if the first waiter is likely to succeed.
- * - Reclaim: have a ktask that sleeps on a rendez.  We poke it, even from IRQ
- *   context.  It qlocks arenas_and_slabs_lock, then does the reclaim.
+ * - Reclaim: base arenas poke the reclaim ktask when they run out (see
+ *   reclaim.c), but an allocation still fails or panics instead of waiting for
+ *   reclaim to free something.
  * - There's an issue with when slab objects get deconstructed, and how that
  *   interacts with what I wanted to do with kstacks and TLB shootdowns.  I
  *   think right now (2019-09) there is a problem with it.
@@ -103,6 +104,7 @@
 #include <hash.h>
 #include <slab.h>
 #include <kthread.h>
+#include <reclaim.h>
 
 struct arena_tailq all_arenas = TAILQ_HEAD_INITIALIZER(all_arenas);
 qlock_t arenas_and_slabs_lock = QLOCK_INITIALIZER(arenas_and_slabs_lock);
@@ -222,6 +224,11 @@ void __arena_create(struct arena *arena, const char *name, size_t quantum,
 	arena->amt_total_segs = 0;
 	arena->amt_alloc_segs = 0;
 	arena->nr_allocs_ever = 0;
+	arena->nr_frag_fails = 0;
+	arena->nr_imports = 0;
+	arena->amt_imported = 0;
+	arena->nr_exports = 0;
+	arena->amt_exported = 0;
 
 	arena->all_segs = RB_ROOT;
 	BSD_LIST_INIT(&arena->unused_btags);
@@ -506,7 +513,8 @@ static struct btag *__add_more_btags(struct arena *arena, int mem_flags)
 		if (!bt) {
 			/* TODO: block / reclaim if not MEM_ATOMIC.  Remember,
 			 * we hold the lock!  We might need to rework this or
-			 * get a reserved page. */
+			 * get a reserved page.  Poking is OK under the lock. */
+			reclaim_poke();
 			if (!(mem_flags & MEM_ATOMIC))
 				panic("Base failed to alloc its own btag, OOM");
 			return 0;
@@ -706,6 +714,8 @@ static void *alloc_from_arena(struct arena *arena, size_t size, int flags)
 		ret = __alloc_nextfit(arena, size);
 	else
 		ret = __alloc_instantfit(arena, size);
+	if (!ret && arena_amt_free(arena) >= size)
+		arena->nr_frag_fails++;
 	/* Careful, this will unlock and relock.  It's OK right before an
 	 * unlock. */
 	__try_hash_resize(arena, flags, &to_free_addr, &to_free_sz);
@@ -758,6 +768,8 @@ static void *__arena_add(struct arena *arena, void *base, size_t size,
 		/* Note the btag span is not on any list, but it is in all_segs
 		 */
 		__insert_btag(&arena->all_segs, span_bt);
+		arena->nr_imports++;
+		arena->amt_imported += size;
 	}
 	arena->amt_total_segs += bt->size;
 	__track_free_seg(arena, bt);
@@ -805,6 +817,8 @@ static bool get_more_resources(struct arena *arena, size_t size, int flags)
 			return FALSE;
 		}
 	} else {
+		/* Let the reclaim ktask know, so the next attempt might work */
+		reclaim_poke();
 		/* TODO: allow blocking */
 		if (!(flags & MEM_ATOMIC))
 			panic("OOM!");
@@ -1097,6 +1111,8 @@ static void *xalloc_from_arena(struct arena *arena, size_t size,
 						      nocross, TRUE);
 		}
 	}
+	if (!ret && arena_amt_free(arena) >= size)
+		arena->nr_frag_fails++;
 	/* Careful, this will unlock and relock.  It's OK right before an
 	 * unlock. */
 	__try_hash_resize(arena, flags, &to_free_addr, &to_free_sz);
@@ -1363,6 +1379,10 @@ static void free_from_arena(struct arena *arena, void *addr, size_t size)
 	__track_free_seg(arena, bt);
 	__coalesce_free_seg(arena, bt, &to_free_addr, &to_free_sz);
 	arena->amt_total_segs -= to_free_sz;
+	if (to_free_addr) {
+		arena->nr_exports++;
+		arena->amt_exported += to_free_sz;
+	}
 	spin_unlock_irqsave(&arena->lock);
 	if (to_free_addr)
 		arena->ffunc(arena->source, to_free_addr, to_free_sz);
@@ -1452,6 +1472,24 @@ size_t arena_amt_total(struct arena *arena)
 	return arena->amt_total_segs;
 }
 
+/* Returns the size of the largest free segment.  Compared to arena_amt_free(),
+ * this tells us how fragmented the arena is.  Doesn't count the qcaches. */
+size_t arena_largest_free(struct arena *arena)
+{
+	struct btag *bt_i;
+	size_t ret = 0;
+
+	spin_lock_irqsave(&arena->lock);
+	for (int i = ARENA_NR_FREE_LISTS - 1; i >= 0; i--) {
+		BSD_LIST_FOREACH(bt_i, &arena->free_segs[i], misc_link)
+			ret = MAX(ret, bt_i->size);
+		if (ret)
+			break;
+	}
+	spin_unlock_irqsave(&arena->lock);
+	return ret;
+}
+
 void add_importing_arena(struct arena *source, struct arena *importer)
 {
 	qlock(&arenas_and_slabs_lock);
@@ -34,9 +34,10 @@ syscall_sring_t* sys_init_arsc(struct proc *p)
 	syscall_sring_t* sring;
 	void * va;
 
-	// TODO: need to pin this page in the future when swapping happens
+	/* We hold on to the KVA, so MAP_LOCKED keeps zswap from paging it out */
 	va = do_mmap(p,MMAP_LOWEST_VA, SYSCALLRINGSIZE, PROT_READ | PROT_WRITE,
-	             MAP_ANONYMOUS | MAP_POPULATE | MAP_PRIVATE, NULL, 0);
+	             MAP_ANONYMOUS | MAP_POPULATE | MAP_PRIVATE | MAP_LOCKED,
+	             NULL, 0);
 	pte_t pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
 	assert(pte_walk_okay(pte));
 	sring = (syscall_sring_t*) KADDR(pte_get_paddr(pte));
@@ -228,8 +228,10 @@ static void *user_pages_a(struct arena *a, size_t amt, int flags)
 	struct proc *p = da->data;
 	void *uaddr;
 
+	/* Devices DMA to these pages, so they can't be paged out */
 	uaddr = mmap(p, 0, amt, PROT_READ | PROT_WRITE,
-		     MAP_ANONYMOUS | MAP_POPULATE | MAP_PRIVATE, -1, 0);
+		     MAP_ANONYMOUS | MAP_POPULATE | MAP_PRIVATE | MAP_LOCKED,
+		     -1, 0);
 
 	/* TODO: think about OOM for user dma arenas, and MEM_ flags. */
 	if (uaddr == MAP_FAILED) {
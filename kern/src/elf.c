@@ -341,7 +341,8 @@ static int load_one_elf(struct proc *p, struct file_or_chan *foc,
 					 * be a PF right away if someone tries
 					 * to use this.  check out do_mmap for
 					 * more info. */
-					if (pte_walk_okay(pte)) {
+					if (pte_walk_okay(pte) &&
+					    pte_is_present(pte)) {
 						void *last_page_kva =
 						    KADDR(pte_get_paddr(pte));
 						memset(last_page_kva + partial,
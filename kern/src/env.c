@@ -17,6 +17,7 @@
 #include <schedule.h>
 #include <kmalloc.h>
 #include <mm.h>
+#include <zswap.h>
 
 #include <ros/syscall.h>
 #include <error.h>
@@ -103,6 +104,11 @@ void env_user_mem_free(env_t* e, void* start, size_t len)
 	assert((uintptr_t)start + len <= UVPT);
 	int user_page_free(env_t* e, pte_t pte, void* va, void* arg)
 	{
+		if (pte_is_paged_out(pte)) {
+			zswap_free_pte(pte);
+			pte_clear(pte);
+			return 0;
+		}
 		if (!pte_is_mapped(pte))
 			return 0;
 		page_t *page = pa2page(pte_get_paddr(pte));
@@ -115,8 +121,11 @@ void env_user_mem_free(env_t* e, void* start, size_t len)
 		return 0;
 	}
 
+	spin_lock(&e->pte_lock);
 	env_user_mem_walk(e,start,len,&user_page_free,NULL);
-	tlbflush();
+	spin_unlock(&e->pte_lock);
+	/* Not just a tlbflush(): other cores may have tagged TLB entries. */
+	proc_tlbshootdown(e, (uintptr_t)start, (uintptr_t)start + len);
 }
 
 void set_username(struct username *u, char *name)
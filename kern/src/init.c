@@ -38,7 +38,10 @@
 #include <acpi.h>
 #include <coreboot_tables.h>
 #include <rcu.h>
+#include <reclaim.h>
+#include <pagemap.h>
 #include <dma.h>
+#include <zswap.h>
 
 #define MAX_BOOT_CMDLINE_SIZE 4096
 
@@ -139,8 +142,10 @@ void kernel_init(multiboot_info_t *mboot_info)
 	hashtable_init();
 	radix_init();
 	dma_arena_init();
+	jumbo_arena_init();
 	acpiinit();
 	topology_init();
+	numa_init();
 	percpu_init();
 	kthread_init();		/* might need to tweak when this happens */
 	vmr_init();
@@ -157,6 +162,9 @@ static void __kernel_init_part_deux(void *arg)
 	time_init();
 	arch_init();
 	rcu_init();
+	reclaim_init();
+	pm_writeback_init();
+	zswap_init();
 	enable_irq();
 	run_linker_funcs();
 	/* reset/init devtab after linker funcs 3 and 4.  these run NIC and
@@ -12,6 +12,8 @@
 #include <stdio.h>
 #include <slab.h>
 #include <assert.h>
+#include <arena.h>
+#include <smp.h>
 
 #define kmallocdebug(args...)  //printk(args)
 
@@ -20,41 +22,172 @@ static spinlock_t pages_list_lock = SPINLOCK_INITIALIZER;
 static page_list_t pages_list;
 
 struct kmem_cache *kmalloc_caches[NUM_KMALLOC_CACHES];
+struct kmem_cache *kmalloc_hl_caches[NUM_KMALLOC_HL_CACHES];
+
+/* Small kmallocs skip the tag.  This can be toggled at runtime, since kfree
+ * tells the two apart by the page the object is on. */
+bool kmalloc_headerless = true;
+
+/* Per-core, per-class accounting: how many bytes callers asked for (including
+ * the tag), so we can compare with what the classes gave them.  After the
+ * tagged classes, there's one for kpages allocations, then the headerless
+ * classes.  Headerless classes also track how much more the tagged classes
+ * would have handed out for the same requests.  These are racy with IRQs on the
+ * same core, which at worst loses a count. */
+#define KMALLOC_STATS_PAGES NUM_KMALLOC_CACHES
+#define KMALLOC_STATS_HL(id) (KMALLOC_STATS_PAGES + 1 + (id))
+#define KMALLOC_NR_STATS KMALLOC_STATS_HL(NUM_KMALLOC_HL_CACHES)
+
+struct kmalloc_class_stats {
+	uint64_t			nr_allocs;
+	uint64_t			amt_requested;
+	uint64_t			amt_alloced;
+	uint64_t			amt_saved;
+};
+
+struct kmalloc_pcpu_stats {
+	struct kmalloc_class_stats	classes[KMALLOC_NR_STATS];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct kmalloc_pcpu_stats *kmalloc_stats;
 
 static void __kfree_release(struct kref *kref);
 
+/* Returns the object size of class id, which includes the tag. */
+static size_t kmalloc_class_size(int id)
+{
+	size_t base;
+
+	if (!id)
+		return KMALLOC_SMALLEST;
+	id--;
+	base = KMALLOC_SMALLEST << (id / KMALLOC_CLASSES_PER_PWR2);
+	return base + (id % KMALLOC_CLASSES_PER_PWR2 + 1) *
+	              (base >> KMALLOC_CLASS_SHIFT);
+}
+
+/* Returns the smallest class that fits ksize, which might be past the last
+ * class.  ksize is in (2^(pwr - 1), 2^pwr], which we split into
+ * KMALLOC_CLASSES_PER_PWR2 steps. */
+static int kmalloc_class(size_t ksize)
+{
+	int pwr, step_shift;
+	size_t base;
+
+	if (ksize <= KMALLOC_SMALLEST)
+		return 0;
+	pwr = LOG2_UP(ksize);
+	base = 1UL << (pwr - 1);
+	step_shift = pwr - 1 - KMALLOC_CLASS_SHIFT;
+	return (pwr - 1 - LOG2_UP(KMALLOC_SMALLEST)) * KMALLOC_CLASSES_PER_PWR2
+	       + ((ksize - base + (1UL << step_shift) - 1) >> step_shift);
+}
+
+/* Returns the object size of headerless class id. */
+static size_t kmalloc_hl_class_size(int id)
+{
+	if (id < KMALLOC_HL_NR_SMALL)
+		return (id + 1) * KMALLOC_ALIGNMENT;
+	return kmalloc_class_size(id - KMALLOC_HL_NR_SMALL + 1);
+}
+
+/* Returns the headerless class for size, which must be <= KMALLOC_HL_LARGEST.
+ * Class KMALLOC_HL_NR_SMALL - 1 is the same size as tagged class 0. */
+static int kmalloc_hl_class(size_t size)
+{
+	if (size <= KMALLOC_SMALLEST)
+		return size ? (size - 1) / KMALLOC_ALIGNMENT : 0;
+	return kmalloc_class(size) + KMALLOC_HL_NR_SMALL - 1;
+}
+
+static void kmalloc_account(int id, size_t ksize, size_t amt_alloc,
+                            size_t amt_saved)
+{
+	struct kmalloc_class_stats *cs;
+
+	if (!kmalloc_stats)
+		return;
+	cs = &kmalloc_stats[core_id_early()].classes[id];
+	cs->nr_allocs++;
+	cs->amt_requested += ksize;
+	cs->amt_alloced += amt_alloc;
+	cs->amt_saved += amt_saved;
+}
+
 void kmalloc_init(void)
 {
 	char kc_name[KMC_NAME_SZ];
+	size_t ksize;
 
 	/* we want at least a 16 byte alignment of the tag so that the bufs
 	 * kmalloc returns are 16 byte aligned.  we used to check the actual
 	 * size == 16, since we adjusted the KMALLOC_SMALLEST based on that. */
 	static_assert(ALIGNED(sizeof(struct kmalloc_tag), 16));
+	/* every class must keep that alignment too */
+	static_assert(ALIGNED(KMALLOC_SMALLEST >> KMALLOC_CLASS_SHIFT,
+	                      KMALLOC_ALIGNMENT));
 	/* build caches of common sizes.  this size will later include the tag
 	 * and the actual returned buffer. */
-	size_t ksize = KMALLOC_SMALLEST;
-
 	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
+		ksize = kmalloc_class_size(i);
+		assert(kmalloc_class(ksize) == i);
 		snprintf(kc_name, KMC_NAME_SZ, "kmalloc_%d", ksize);
 		kmalloc_caches[i] = kmem_cache_create(kc_name, ksize,
 						      KMALLOC_ALIGNMENT, 0,
 						      NULL, 0, 0, NULL);
-		ksize <<= 1;
 	}
+	assert(kmalloc_class_size(NUM_KMALLOC_CACHES - 1) == KMALLOC_LARGEST);
+	/* Headerless objects need single-page slabs, so that kfree can find
+	 * the cache from the object's struct page. */
+	static_assert(KMALLOC_HL_LARGEST <= SLAB_LARGE_CUTOFF);
+	for (int i = 0; i < NUM_KMALLOC_HL_CACHES; i++) {
+		ksize = kmalloc_hl_class_size(i);
+		assert(kmalloc_hl_class(ksize) == i);
+		snprintf(kc_name, KMC_NAME_SZ, "kmalloc_hl_%d", ksize);
+		kmalloc_hl_caches[i] = kmem_cache_create(kc_name, ksize,
+		                                         KMALLOC_ALIGNMENT,
+		                                         KMC_PGLOOKUP, NULL, 0,
+		                                         0, NULL);
+	}
+	assert(kmalloc_hl_class_size(NUM_KMALLOC_HL_CACHES - 1) ==
+	       KMALLOC_HL_LARGEST);
+	kmalloc_stats = base_alloc(NULL, sizeof(struct kmalloc_pcpu_stats) *
+	                           num_cores, MEM_WAIT);
+	memset(kmalloc_stats, 0, sizeof(struct kmalloc_pcpu_stats) *
+	       num_cores);
+}
+
+static void *kmalloc_hl(size_t size, int flags)
+{
+	int cache_id = kmalloc_hl_class(size);
+	struct kmem_cache *kc = kmalloc_hl_caches[cache_id];
+	void *buf;
+
+	buf = kmem_cache_alloc(kc, flags);
+	if (!buf)
+		panic("Kmalloc failed!  Handle me!");
+	kmalloc_account(KMALLOC_STATS_HL(cache_id), size, kc->obj_size,
+	                kmalloc_class_size(kmalloc_class(size +
+	                                   sizeof(struct kmalloc_tag)))
+	                - kc->obj_size);
+	return buf;
 }
 
 void *kmalloc(size_t size, int flags)
+{
+	if (size <= KMALLOC_HL_LARGEST && READ_ONCE(kmalloc_headerless))
+		return kmalloc_hl(size, flags);
+	return kmalloc_refd(size, flags);
+}
+
+void *kmalloc_refd(size_t size, int flags)
 {
 	// reserve space for bookkeeping and preserve alignment
 	size_t ksize = size + sizeof(struct kmalloc_tag);
 	void *buf;
 	int cache_id;
 	// determine cache to pull from
-	if (ksize <= KMALLOC_SMALLEST)
-		cache_id = 0;
-	else
-		cache_id = LOG2_UP(ksize) - LOG2_UP(KMALLOC_SMALLEST);
+	cache_id = kmalloc_class(ksize);
 	// if we don't have a cache to handle it, alloc cont pages
 	if (cache_id >= NUM_KMALLOC_CACHES) {
 		/* The arena allocator will round up too, but we want to know in
@@ -65,6 +198,7 @@ void *kmalloc(size_t size, int flags)
 		buf = kpages_alloc(amt_alloc, flags);
 		if (!buf)
 			panic("Kmalloc failed!  Handle me!");
+		kmalloc_account(KMALLOC_STATS_PAGES, ksize, amt_alloc, 0);
 		// fill in the kmalloc tag
 		struct kmalloc_tag *tag = buf;
 		tag->flags = KMALLOC_TAG_PAGES;
@@ -77,6 +211,8 @@ void *kmalloc(size_t size, int flags)
 	buf = kmem_cache_alloc(kmalloc_caches[cache_id], flags);
 	if (!buf)
 		panic("Kmalloc failed!  Handle me!");
+	kmalloc_account(cache_id, ksize, kmalloc_caches[cache_id]->obj_size,
+	                0);
 	// store a pointer to the buffers kmem_cache in it's bookkeeping space
 	struct kmalloc_tag *tag = buf;
 	tag->flags = KMALLOC_TAG_CACHE;
@@ -96,6 +232,16 @@ void *kzmalloc(size_t size, int flags)
 	return v;
 }
 
+void *kzmalloc_refd(size_t size, int flags)
+{
+	void *v = kmalloc_refd(size, flags);
+
+	if (!v)
+		return v;
+	memset(v, 0, size);
+	return v;
+}
+
 void *kmalloc_align(size_t size, int flags, size_t align)
 {
 	void *addr, *retaddr;
@@ -108,7 +254,9 @@ void *kmalloc_align(size_t size, int flags, size_t align)
 	 * most 'align'. */
 	assert(align < (1 << (32 - KMALLOC_ALIGN_SHIFT)));
 	assert(IS_PWR2(align));
-	addr = kmalloc(size + align, flags);
+	/* The UNALIGN flags need a tag to land in, or at least the space for
+	 * one, so these never come from the headerless classes. */
+	addr = kmalloc_refd(size + align, flags);
 	if (!addr)
 		return 0;
 	if (ALIGNED(addr, align))
@@ -166,8 +314,15 @@ void *krealloc(void* buf, size_t size, int flags)
 	void *nbuf;
 	size_t osize = 0;
 	struct kmalloc_tag *tag;
+	struct kmem_cache *kc = NULL;
 
-	if (buf){
+	if (buf)
+		kc = kmem_obj_cache(buf);
+	if (kc) {
+		osize = kc->obj_size;
+		if (osize >= size)
+			return buf;
+	} else if (buf) {
 		if (__get_unaligned_orig_buf(buf))
 			panic("krealloc of a kmalloc_align not supported");
 		tag = __get_km_tag(buf);
@@ -186,7 +341,8 @@ void *krealloc(void* buf, size_t size, int flags)
 			return buf;
 	}
 
-	nbuf = kmalloc(size, flags);
+	/* Tagged bufs might be kmalloc_incref()d, so keep them tagged. */
+	nbuf = (buf && !kc) ? kmalloc_refd(size, flags) : kmalloc(size, flags);
 
 	/* would be more interesting to user error(...) here. */
 	/* but in any event, NEVER destroy buf! */
@@ -202,7 +358,15 @@ void *krealloc(void* buf, size_t size, int flags)
 	return nbuf;
 }
 
-/* Grabs a reference on a buffer.  Release with kfree().
+static void __assert_not_headerless(void *buf, const char *func)
+{
+	if (kmem_obj_cache(buf))
+		panic("%s on headerless buf %p, use kmalloc_refd()", func, buf);
+}
+
+/* Grabs a reference on a buffer.  Release with kfree().  The buffer must have
+ * come from kmalloc_refd() (or something else that has a tag, e.g.
+ * kmalloc_align()).
  *
  * Note that a krealloc on a buffer with ref > 1 that needs a new, underlying
  * buffer will result in two buffers existing.  In this case, the krealloc is a
@@ -210,8 +374,10 @@ void *krealloc(void* buf, size_t size, int flags)
  * original ref > 1. */
 void kmalloc_incref(void *buf)
 {
-	void *orig_buf = __get_unaligned_orig_buf(buf);
+	void *orig_buf;
 
+	__assert_not_headerless(buf, __func__);
+	orig_buf = __get_unaligned_orig_buf(buf);
 	buf = orig_buf ? orig_buf : buf;
 	/* if we want a smaller tag, we can extract the code from kref and
 	 * manually set the release method in kfree. */
@@ -220,8 +386,10 @@ void kmalloc_incref(void *buf)
 
 int kmalloc_refcnt(void *buf)
 {
-	void *orig_buf = __get_unaligned_orig_buf(buf);
+	void *orig_buf;
 
+	__assert_not_headerless(buf, __func__);
+	orig_buf = __get_unaligned_orig_buf(buf);
 	buf = orig_buf ? orig_buf : buf;
 	return kref_refcnt(&__get_km_tag(buf)->kref);
 }
@@ -240,9 +408,16 @@ static void __kfree_release(struct kref *kref)
 
 void kfree(void *buf)
 {
+	struct kmem_cache *kc;
 	void *orig_buf;
+
 	if (buf == NULL)
 		return;
+	kc = kmem_obj_cache(buf);
+	if (kc) {
+		kmem_cache_free(kc, buf);
+		return;
+	}
 	orig_buf = __get_unaligned_orig_buf(buf);
 	buf = orig_buf ? orig_buf : buf;
 	kref_put(&__get_km_tag(buf)->kref);
@@ -259,6 +434,58 @@ void kmalloc_canary_check(char *str)
 		panic("\t\t KMALLOC CANARY CHECK FAILED %s\n", str);
 }
 
+static void kmalloc_fetch_class(struct sized_alloc *sza, int id,
+                                struct kmalloc_class_stats *tot)
+{
+	struct kmalloc_class_stats *cs;
+	uint64_t nr_allocs = 0, amt_req = 0, amt_alloc = 0, amt_saved = 0;
+
+	for (int j = 0; j < num_cores; j++) {
+		cs = &kmalloc_stats[j].classes[id];
+		nr_allocs += READ_ONCE(cs->nr_allocs);
+		amt_req += READ_ONCE(cs->amt_requested);
+		amt_alloc += READ_ONCE(cs->amt_alloced);
+		amt_saved += READ_ONCE(cs->amt_saved);
+	}
+	tot->nr_allocs += nr_allocs;
+	tot->amt_requested += amt_req;
+	tot->amt_alloced += amt_alloc;
+	tot->amt_saved += amt_saved;
+	sza_printf(sza, "%14llu:%16llu:%16llu:%6llu:%16llu\n", nr_allocs,
+	           amt_req, amt_alloc,
+	           amt_alloc ? (amt_alloc - amt_req) * 100 / amt_alloc : 0,
+	           amt_saved);
+}
+
+/* Prints, for each class, how many bytes were requested (including tags) and
+ * how many the class handed out, since boot.  The difference is internal
+ * fragmentation.  For the headerless classes, 'Saved' is how many more bytes
+ * the tagged classes would have handed out for the same requests. */
+void kmalloc_fetch_stats(struct sized_alloc *sza)
+{
+	struct kmalloc_class_stats tot = {0};
+
+	sza_printf(sza, "Headerless: %s\n\n",
+	           kmalloc_headerless ? "on" : "off");
+	sza_printf(sza, "%10s:%14s:%16s:%16s:%6s:%16s\n", "Class", "Allocs",
+	           "Requested", "Allocated", "Waste%", "Saved");
+	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
+		sza_printf(sza, "%10lu:", kmalloc_class_size(i));
+		kmalloc_fetch_class(sza, i, &tot);
+	}
+	sza_printf(sza, "%10s:", "pages");
+	kmalloc_fetch_class(sza, KMALLOC_STATS_PAGES, &tot);
+	for (int i = 0; i < NUM_KMALLOC_HL_CACHES; i++) {
+		sza_printf(sza, "%7lu-hl:", kmalloc_hl_class_size(i));
+		kmalloc_fetch_class(sza, KMALLOC_STATS_HL(i), &tot);
+	}
+	sza_printf(sza, "%10s:%14llu:%16llu:%16llu:%6llu:%16llu\n", "total",
+	           tot.nr_allocs, tot.amt_requested, tot.amt_alloced,
+	           tot.amt_alloced ? (tot.amt_alloced - tot.amt_requested) * 100
+	                             / tot.amt_alloced : 0,
+	           tot.amt_saved);
+}
+
 struct sized_alloc *sized_kzmalloc(size_t size, int flags)
 {
 	struct sized_alloc *sza;
@@ -432,6 +432,132 @@ static bool test_accounting(void)
 	return true;
 }
 
+/* Replayable allocation trace, to compare the fit policies.  The trace is a
+ * deterministic (seeded) sequence of allocs and frees over a set of slots, with
+ * mostly small objects and the occasional big one.  We replay the same trace
+ * against a fixed-size arena with each policy and report how long it took, how
+ * many allocs failed, and how fragmented the arena ended up.
+ *
+ * The trace is generated assuming every alloc succeeds.  During replay, a free
+ * of a slot whose alloc failed is skipped, so the policies still see the same
+ * sequence of requests. */
+#define TRACE_NR_OPS		20000
+#define TRACE_NR_SLOTS		512
+#define TRACE_ARENA_SZ		8192
+#define TRACE_SEED		0x5eed
+
+struct trace_op {
+	uint16_t			slot;
+	uint16_t			size;	/* 0 for a free */
+};
+
+static uint32_t trace_rand(uint32_t *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+/* Mostly small, some medium, rarely large. */
+static uint16_t trace_size(uint32_t *state)
+{
+	uint32_t r = trace_rand(state);
+
+	switch (r % 20) {
+	case 0:
+		return 64 + (r >> 5) % 449;
+	case 1:
+	case 2:
+	case 3:
+		return 9 + (r >> 5) % 56;
+	default:
+		return 1 + (r >> 5) % 8;
+	}
+}
+
+static void trace_gen(struct trace_op *ops)
+{
+	uint32_t state = TRACE_SEED;
+	bool live[TRACE_NR_SLOTS] = {0};
+	int slot;
+
+	for (int i = 0; i < TRACE_NR_OPS; i++) {
+		slot = trace_rand(&state) % TRACE_NR_SLOTS;
+		ops[i].slot = slot;
+		ops[i].size = live[slot] ? 0 : trace_size(&state);
+		live[slot] = !live[slot];
+	}
+}
+
+static bool trace_replay(struct trace_op *ops, int policy, const char *name)
+{
+	struct arena *a;
+	void **objs;
+	size_t *sizes;
+	size_t nr_fails = 0, nr_free_segs = 0, largest, amt_free;
+	uint64_t start, nsec;
+	struct btag *bt_i;
+
+	objs = kzmalloc(sizeof(void*) * TRACE_NR_SLOTS, MEM_WAIT);
+	sizes = kzmalloc(sizeof(size_t) * TRACE_NR_SLOTS, MEM_WAIT);
+	a = arena_create(name, (void*)PGSIZE, TRACE_ARENA_SZ, 1, NULL, NULL,
+			 NULL, 0, MEM_WAIT);
+
+	start = read_tsc();
+	for (int i = 0; i < TRACE_NR_OPS; i++) {
+		int slot = ops[i].slot;
+
+		if (!ops[i].size) {
+			if (objs[slot])
+				arena_free(a, objs[slot], sizes[slot]);
+			objs[slot] = NULL;
+			continue;
+		}
+		objs[slot] = arena_alloc(a, ops[i].size, MEM_ATOMIC | policy);
+		sizes[slot] = ops[i].size;
+		if (!objs[slot])
+			nr_fails++;
+	}
+	nsec = tsc2nsec(read_tsc() - start);
+
+	largest = arena_largest_free(a);
+	amt_free = arena_amt_free(a);
+	spin_lock_irqsave(&a->lock);
+	for (int i = 0; i < ARENA_NR_FREE_LISTS; i++)
+		BSD_LIST_FOREACH(bt_i, &a->free_segs[i], misc_link)
+			nr_free_segs++;
+	spin_unlock_irqsave(&a->lock);
+	printk("%s: %llu nsec, %lu failed allocs (%lu frag fails)\n", name,
+	       nsec, nr_fails, a->nr_frag_fails);
+	printk("\t%lu free segs, largest %lu of %lu free\n", nr_free_segs,
+	       largest, amt_free);
+
+	for (int i = 0; i < TRACE_NR_SLOTS; i++) {
+		if (objs[i])
+			arena_free(a, objs[i], sizes[i]);
+	}
+	KT_ASSERT(arena_amt_free(a) == TRACE_ARENA_SZ);
+	arena_destroy(a);
+	kfree(objs);
+	kfree(sizes);
+
+	return true;
+}
+
+static bool test_fit_trace(void)
+{
+	struct trace_op *ops;
+	bool ret = true;
+
+	ops = kmalloc(sizeof(struct trace_op) * TRACE_NR_OPS, MEM_WAIT);
+	trace_gen(ops);
+	ret &= trace_replay(ops, ARENA_INSTANTFIT, "fit_trace-instantfit");
+	ret &= trace_replay(ops, ARENA_BESTFIT, "fit_trace-bestfit");
+	ret &= trace_replay(ops, ARENA_NEXTFIT, "fit_trace-nextfit");
+	kfree(ops);
+
+	return ret;
+}
+
 static void *tssaf(struct arena *a, size_t amt, int flags)
 {
 	static uintptr_t store = PGSIZE;
@@ -534,6 +660,7 @@ static struct ktest ktests[] = {
 	KTEST_REG(xalloc,		CONFIG_KTEST_ARENA),
 	KTEST_REG(xalloc_minmax,	CONFIG_KTEST_ARENA),
 	KTEST_REG(accounting,		CONFIG_KTEST_ARENA),
+	KTEST_REG(fit_trace,		CONFIG_KTEST_ARENA),
 	KTEST_REG(self_source,		CONFIG_KTEST_ARENA),
 	KTEST_REG(dma_pool,		CONFIG_KTEST_ARENA),
 	KTEST_REG(user_dma,		CONFIG_KTEST_ARENA),
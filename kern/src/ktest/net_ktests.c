@@ -1,5 +1,8 @@
 #include <net/ip.h>
+#include <net/tcp.h>
 #include <ktest.h>
+#include <mm.h>
+#include <rcu.h>
 #include <linker_func.h>
 
 KTEST_SUITE("NET")
@@ -80,10 +83,572 @@ bool test_ptclbsum_bench(void)
 	return true;
 }
 
+static struct Ipht *ipht_create(void)
+{
+	struct Ipht *ht = kzmalloc(sizeof(struct Ipht), MEM_WAIT);
+
+	iphtinit(ht);
+	return ht;
+}
+
+/* Only call this once the table is empty */
+static void ipht_destroy(struct Ipht *ht)
+{
+	kfree(ht->tbl);
+	kfree(ht);
+}
+
+/* Makes the IPv4 address 10.x.y.z from the low 24 bits of n */
+static void ipht_test_addr(uint8_t *ip, uint32_t n)
+{
+	uint8_t v4[IPv4addrlen];
+
+	hnputl(v4, (10 << 24) | (n & 0xffffff));
+	v4tov6(ip, v4);
+}
+
+bool test_ipht(void)
+{
+	struct Ipht *ht = ipht_create();
+	struct Iphash any, port, addr, pa, exact;
+	uint8_t ra[IPaddrlen], la[IPaddrlen], other[IPaddrlen];
+
+	memset(&any, 0, sizeof(struct Iphash));
+	memset(&port, 0, sizeof(struct Iphash));
+	memset(&addr, 0, sizeof(struct Iphash));
+	memset(&pa, 0, sizeof(struct Iphash));
+	memset(&exact, 0, sizeof(struct Iphash));
+	ipht_test_addr(ra, 1);
+	ipht_test_addr(la, 2);
+	ipht_test_addr(other, 3);
+
+	/* Each one we add is more specific, and should take over */
+	__iphtadd(ht, &any, IPnoaddr, 0, IPnoaddr, 0);
+	KT_ASSERT(__iphtlook(ht, ra, 1000, la, 80) == &any);
+	__iphtadd(ht, &addr, IPnoaddr, 0, la, 0);
+	KT_ASSERT(__iphtlook(ht, ra, 1000, la, 80) == &addr);
+	KT_ASSERT(__iphtlook(ht, ra, 1000, other, 80) == &any);
+	__iphtadd(ht, &port, IPnoaddr, 0, IPnoaddr, 80);
+	KT_ASSERT(__iphtlook(ht, ra, 1000, la, 80) == &port);
+	KT_ASSERT(__iphtlook(ht, ra, 1000, la, 81) == &addr);
+	__iphtadd(ht, &pa, IPnoaddr, 0, la, 80);
+	KT_ASSERT(__iphtlook(ht, ra, 1000, la, 80) == &pa);
+	KT_ASSERT(__iphtlook(ht, ra, 1000, other, 80) == &port);
+	__iphtadd(ht, &exact, ra, 1000, la, 80);
+	KT_ASSERT(__iphtlook(ht, ra, 1000, la, 80) == &exact);
+	KT_ASSERT(__iphtlook(ht, ra, 1001, la, 80) == &pa);
+	KT_ASSERT(atomic_read(&ht->nr_items) == 5);
+
+	/* Adding again moves the entry */
+	__iphtadd(ht, &exact, ra, 1001, la, 80);
+	KT_ASSERT(__iphtlook(ht, ra, 1000, la, 80) == &pa);
+	KT_ASSERT(__iphtlook(ht, ra, 1001, la, 80) == &exact);
+	KT_ASSERT(atomic_read(&ht->nr_items) == 5);
+
+	__iphtrem(ht, &exact);
+	__iphtrem(ht, &pa);
+	__iphtrem(ht, &port);
+	KT_ASSERT(__iphtlook(ht, ra, 1001, la, 80) == &addr);
+	__iphtrem(ht, &addr);
+	KT_ASSERT(__iphtlook(ht, ra, 1001, la, 80) == &any);
+	__iphtrem(ht, &any);
+	/* Removing twice is OK */
+	__iphtrem(ht, &any);
+	KT_ASSERT(!__iphtlook(ht, ra, 1001, la, 80));
+	KT_ASSERT(atomic_read(&ht->nr_items) == 0);
+	ipht_destroy(ht);
+	return true;
+}
+
+#define IPHT_BENCH_NR		(1 << 20)
+/* Relatively prime to IPHT_BENCH_NR, so we look everything up, out of order */
+#define IPHT_BENCH_STRIDE	7919
+
+/* One listener on port 80, and IPHT_BENCH_NR connections to it from different
+ * hosts and ports, all in one table.  We look up every connection, then look
+ * up as many new connections, which miss and fall back to the listener. */
+bool test_ipht_bench(void)
+{
+	struct Ipht *ht = ipht_create();
+	struct Iphash *entries, listener;
+	uint8_t ra[IPaddrlen], la[IPaddrlen];
+	uint64_t start, add_nsec, hit_nsec, miss_nsec;
+	unsigned long nr_bad = 0;
+	uint32_t n;
+
+	entries = kzmalloc(sizeof(struct Iphash) * IPHT_BENCH_NR, MEM_ATOMIC);
+	if (!entries) {
+		printk("Not enough memory for %d entries, skipping\n",
+		       IPHT_BENCH_NR);
+		ipht_destroy(ht);
+		return true;
+	}
+	memset(&listener, 0, sizeof(struct Iphash));
+	ipht_test_addr(la, 1);
+	__iphtadd(ht, &listener, IPnoaddr, 0, IPnoaddr, 80);
+
+	start = read_tsc();
+	for (uint32_t i = 0; i < IPHT_BENCH_NR; i++) {
+		ipht_test_addr(ra, i / 64 + 2);
+		__iphtadd(ht, &entries[i], ra, 1024 + i % 64, la, 80);
+	}
+	add_nsec = tsc2nsec(read_tsc() - start);
+
+	start = read_tsc();
+	for (uint32_t i = 0; i < IPHT_BENCH_NR; i++) {
+		n = (i * IPHT_BENCH_STRIDE) % IPHT_BENCH_NR;
+		ipht_test_addr(ra, n / 64 + 2);
+		if (__iphtlook(ht, ra, 1024 + n % 64, la, 80) != &entries[n])
+			nr_bad++;
+	}
+	hit_nsec = tsc2nsec(read_tsc() - start);
+
+	start = read_tsc();
+	for (uint32_t i = 0; i < IPHT_BENCH_NR; i++) {
+		n = (i * IPHT_BENCH_STRIDE) % IPHT_BENCH_NR;
+		ipht_test_addr(ra, n / 64 + 2);
+		if (__iphtlook(ht, ra, 2048 + n % 64, la, 80) != &listener)
+			nr_bad++;
+	}
+	miss_nsec = tsc2nsec(read_tsc() - start);
+
+	printk("ipht: %ld convs, %u buckets, %lu resizes\n",
+	       atomic_read(&ht->nr_items), 1U << ht->tbl->nr_bits,
+	       ht->nr_resizes);
+	printk("ipht: %llu ns/add, %llu ns/lookup, %llu ns/listener lookup\n",
+	       add_nsec / IPHT_BENCH_NR, hit_nsec / IPHT_BENCH_NR,
+	       miss_nsec / IPHT_BENCH_NR);
+
+	for (uint32_t i = 0; i < IPHT_BENCH_NR; i++)
+		__iphtrem(ht, &entries[i]);
+	__iphtrem(ht, &listener);
+	KT_ASSERT_M("Every lookup should find its entry", !nr_bad);
+	KT_ASSERT(atomic_read(&ht->nr_items) == 0);
+	kfree(entries);
+	ipht_destroy(ht);
+	return true;
+}
+
+static uint64_t fib_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+#define FIB_TEST_NR		500
+#define FIB_TEST_LOOKUPS	20000
+
+struct fib_test_pfx {
+	uint8_t				key[IPaddrlen];
+	int				plen;
+	bool				present;
+	struct route			r;
+};
+
+static bool fib_test_match(const uint8_t *a, const uint8_t *key, int plen)
+{
+	int i;
+
+	for (i = 0; i < plen / 8; i++) {
+		if (a[i] != key[i])
+			return false;
+	}
+	if (plen % 8)
+		return !((a[i] ^ key[i]) & (0xff << (8 - plen % 8)));
+	return true;
+}
+
+/* Brute force LPM over the present prefixes shorter than maxlen */
+static struct fib_test_pfx *fib_test_lpm(struct fib_test_pfx *pfx,
+					 const uint8_t *a, int maxlen)
+{
+	struct fib_test_pfx *best = NULL;
+
+	for (int i = 0; i < FIB_TEST_NR; i++) {
+		if (!pfx[i].present || pfx[i].plen >= maxlen)
+			continue;
+		if (best && best->plen >= pfx[i].plen)
+			continue;
+		if (fib_test_match(a, pfx[i].key, pfx[i].plen))
+			best = &pfx[i];
+	}
+	return best;
+}
+
+/* Address bytes from a small alphabet, so that prefixes overlap a lot */
+static void fib_test_addr(uint8_t *a, int keylen, uint64_t *rs, bool anybyte)
+{
+	static const uint8_t alphabet[] = {0x00, 0x0a, 0x80, 0xff};
+
+	for (int i = 0; i < keylen; i++) {
+		if (anybyte && fib_rand(rs) % 2)
+			a[i] = fib_rand(rs);
+		else
+			a[i] = alphabet[fib_rand(rs) % ARRAY_SIZE(alphabet)];
+	}
+}
+
+/* Returns the number of lookups that disagree with the brute force LPM */
+static int fib_test_check(struct fib *fib, struct fib_test_pfx *pfx,
+			  int keylen, uint64_t *rs)
+{
+	uint8_t a[IPaddrlen];
+	struct fib_test_pfx *best;
+	struct route *r;
+	int nr_bad = 0;
+
+	for (int i = 0; i < FIB_TEST_LOOKUPS + FIB_TEST_NR; i++) {
+		if (i < FIB_TEST_NR)
+			memcpy(a, pfx[i].key, keylen);
+		else
+			fib_test_addr(a, keylen, rs, true);
+		best = fib_test_lpm(pfx, a, keylen * 8 + 1);
+		rcu_read_lock();
+		r = fib_lookup(fib, a);
+		rcu_read_unlock();
+		if (r != (best ? &best->r : NULL))
+			nr_bad++;
+	}
+	return nr_bad;
+}
+
+static void fib_test_remove(struct fib *fib, struct fib_test_pfx *pfx,
+			    struct fib_test_pfx *p)
+{
+	struct fib_test_pfx *cover;
+
+	p->present = false;
+	cover = fib_test_lpm(pfx, p->key, p->plen);
+	fib_remove(fib, p->key, p->plen, cover ? &cover->r : NULL,
+		   cover ? cover->plen : -1);
+}
+
+static bool fib_test_one(int keylen, uint64_t seed)
+{
+	struct fib fib = {0};
+	struct fib_test_pfx *pfx;
+	uint64_t rs = seed;
+	int nr_bits = keylen * 8;
+	int nr_bad;
+
+	pfx = kzmalloc(sizeof(struct fib_test_pfx) * FIB_TEST_NR, MEM_WAIT);
+	fib_init(&fib);
+	for (int i = 0; i < FIB_TEST_NR; i++) {
+		struct fib_test_pfx *p = &pfx[i];
+
+		fib_test_addr(p->key, keylen, &rs, false);
+		p->plen = fib_rand(&rs) % (nr_bits + 1);
+		for (int j = 0; j < keylen; j++) {
+			if (j * 8 >= p->plen)
+				p->key[j] = 0;
+			else if (j * 8 + 8 > p->plen)
+				p->key[j] &= 0xff << (8 - p->plen % 8);
+		}
+		/* The FIB wants new prefixes */
+		for (int j = 0; j < i; j++) {
+			if (pfx[j].present && pfx[j].plen == p->plen &&
+			    !memcmp(pfx[j].key, p->key, keylen)) {
+				p->plen = -1;
+				break;
+			}
+		}
+		if (p->plen < 0)
+			continue;
+		p->present = true;
+		fib_insert(&fib, p->key, p->plen, &p->r);
+	}
+	nr_bad = fib_test_check(&fib, pfx, keylen, &rs);
+	KT_ASSERT_M("Lookups should match brute force after inserts", !nr_bad);
+
+	for (int i = 0; i < FIB_TEST_NR; i += 2) {
+		if (pfx[i].present)
+			fib_test_remove(&fib, pfx, &pfx[i]);
+	}
+	nr_bad = fib_test_check(&fib, pfx, keylen, &rs);
+	KT_ASSERT_M("Lookups should match brute force after removals", !nr_bad);
+
+	for (int i = 0; i < FIB_TEST_NR; i++) {
+		if (pfx[i].present)
+			fib_test_remove(&fib, pfx, &pfx[i]);
+	}
+	nr_bad = fib_test_check(&fib, pfx, keylen, &rs);
+	KT_ASSERT_M("Lookups should all fail when empty", !nr_bad);
+	KT_ASSERT_M("Empty FIB should have no prefixes", !fib.nr_prefixes);
+	KT_ASSERT_M("Empty FIB should collapse to its root", fib.nr_nodes == 1);
+
+	fib_destroy(&fib);
+	kfree(pfx);
+	return true;
+}
+
+bool test_fib(void)
+{
+	if (!fib_test_one(IPv4addrlen, 0x1234567))
+		return false;
+	return fib_test_one(IPaddrlen, 0x89abcdef);
+}
+
+/* One "a.b.c.d/len" per line, e.g. from a BGP table dump.  Without it, we make
+ * up a table of FIB_BENCH_NR prefixes. */
+#define FIB_BENCH_FILE		"/lib/fib_bench_prefixes"
+#define FIB_BENCH_NR		900000
+#define FIB_BENCH_NR_ROUTES	1024
+#define FIB_BENCH_LOOKUPS	(1 << 23)
+
+struct fib_bench_pfx {
+	uint8_t				key[IPv4addrlen];
+	uint8_t				plen;
+};
+
+static uint32_t fib_bench_hostmask(int plen)
+{
+	return plen >= 32 ? 0 : 0xffffffff >> plen;
+}
+
+static int fib_bench_load(struct fib_bench_pfx *pfx, int max)
+{
+	struct file_or_chan *foc;
+	char *buf, *p, *end;
+	int nr = 0;
+
+	foc = foc_open(FIB_BENCH_FILE, O_READ, 0);
+	if (!foc)
+		return 0;
+	buf = kread_whole_file(foc);
+	if (!buf) {
+		foc_decref(foc);
+		return 0;
+	}
+	end = buf + foc_get_len(foc);
+	foc_decref(foc);
+	for (p = buf; p < end && nr < max; p++) {
+		char line[64];
+		char *eol = memchr(p, '\n', end - p) ?: end;
+		char *slash;
+
+		if (eol - p >= sizeof(line)) {
+			p = eol;
+			continue;
+		}
+		memcpy(line, p, eol - p);
+		line[eol - p] = 0;
+		p = eol;
+		slash = strchr(line, '/');
+		if (!slash)
+			continue;
+		v4parseip(pfx[nr].key, line);
+		pfx[nr].plen = MIN(strtoul(slash + 1, NULL, 10), 32);
+		nr++;
+	}
+	kfree(buf);
+	return nr;
+}
+
+/* A rough mix of prefix lengths from the IPv4 Internet table: mostly /24s,
+ * spread over the unicast /16s, and nothing longer than /24. */
+static void fib_bench_make(struct fib_bench_pfx *pfx, int nr, uint64_t *rs)
+{
+	uint32_t addr, r, plen;
+
+	for (int i = 0; i < nr; i++) {
+		r = fib_rand(rs) % 100;
+		if (r < 58)
+			plen = 24;
+		else if (r < 70)
+			plen = 23;
+		else if (r < 80)
+			plen = 22;
+		else if (r < 86)
+			plen = 21;
+		else if (r < 90)
+			plen = 20;
+		else if (r < 98)
+			plen = 16 + r % 4;
+		else
+			plen = 8 + r % 8;
+		addr = fib_rand(rs);
+		addr = (1 + (addr >> 24) % 223) << 24 | (addr & 0xffffff);
+		hnputl(pfx[i].key, addr & ~fib_bench_hostmask(plen));
+		pfx[i].plen = plen;
+	}
+}
+
+bool test_fib_bench(void)
+{
+	struct fib fib = {0};
+	struct fib_bench_pfx *pfx;
+	struct route *routes;
+	uint8_t a[IPv4addrlen];
+	uint64_t rs = 0xfeedface;
+	uint64_t start, insert_nsec, in_nsec, any_nsec;
+	unsigned long nr_miss = 0, nr_found = 0;
+	struct fib_bench_pfx *p;
+	int nr;
+
+	pfx = kzmalloc(sizeof(struct fib_bench_pfx) * FIB_BENCH_NR, MEM_ATOMIC);
+	routes = kzmalloc(sizeof(struct route) * FIB_BENCH_NR_ROUTES,
+			  MEM_ATOMIC);
+	if (!pfx || !routes) {
+		printk("Not enough memory for %d prefixes, skipping\n",
+		       FIB_BENCH_NR);
+		kfree(pfx);
+		kfree(routes);
+		return true;
+	}
+	nr = fib_bench_load(pfx, FIB_BENCH_NR);
+	if (nr) {
+		printk("fib: loaded %d prefixes from %s\n", nr, FIB_BENCH_FILE);
+	} else {
+		nr = FIB_BENCH_NR;
+		fib_bench_make(pfx, nr, &rs);
+		printk("fib: no %s, made up %d prefixes\n", FIB_BENCH_FILE, nr);
+	}
+
+	fib_init(&fib);
+	start = read_tsc();
+	for (int i = 0; i < nr; i++)
+		fib_insert(&fib, pfx[i].key, pfx[i].plen,
+			   &routes[i % FIB_BENCH_NR_ROUTES]);
+	insert_nsec = tsc2nsec(read_tsc() - start);
+
+	/* Addresses inside the table's prefixes, which go deeper in the trie */
+	start = read_tsc();
+	rcu_read_lock();
+	for (int i = 0; i < FIB_BENCH_LOOKUPS; i++) {
+		p = &pfx[fib_rand(&rs) % nr];
+		hnputl(a, nhgetl(p->key) |
+			  (fib_rand(&rs) & fib_bench_hostmask(p->plen)));
+		if (!fib_lookup(&fib, a))
+			nr_miss++;
+	}
+	rcu_read_unlock();
+	in_nsec = tsc2nsec(read_tsc() - start);
+
+	start = read_tsc();
+	rcu_read_lock();
+	for (int i = 0; i < FIB_BENCH_LOOKUPS; i++) {
+		hnputl(a, fib_rand(&rs));
+		if (fib_lookup(&fib, a))
+			nr_found++;
+	}
+	rcu_read_unlock();
+	any_nsec = tsc2nsec(read_tsc() - start);
+
+	printk("fib: %lu nodes, %lu KB, %llu ns/insert\n", fib.nr_nodes,
+	       fib_memory(&fib) / 1024, insert_nsec / nr);
+	printk("fib: %llu ns/lookup in the table's prefixes\n",
+	       in_nsec / FIB_BENCH_LOOKUPS);
+	printk("fib: %llu ns/lookup of any address, %lu%% had routes\n",
+	       any_nsec / FIB_BENCH_LOOKUPS,
+	       nr_found * 100 / FIB_BENCH_LOOKUPS);
+
+	fib_destroy(&fib);
+	kfree(routes);
+	kfree(pfx);
+	KT_ASSERT_M("Every address in the table should have a route",
+		    !nr_miss);
+	return true;
+}
+
+/* A Tcpctl that just lost a packet with a 100 MSS cwind, under CUBIC.  The
+ * expected values come from RFC 9438's formulas, in MSS and seconds, with an
+ * MSS of 1000 bytes. */
+static void cubic_test_loss(Tcpctl *tcb, uint32_t srtt)
+{
+	memset(tcb, 0, sizeof(Tcpctl));
+	tcb->typical_mss = 1000;
+	tcb->srtt = srtt;
+	tcb->cc = &tcp_cc_cubic;
+	tcb->cc->init(tcb);
+	tcb->ssthresh = UINT32_MAX;
+	tcb->cwind = 100000;
+	tcb->cc->on_loss(tcb);
+}
+
+bool test_tcp_cubic(void)
+{
+	static const uint64_t cubes[][2] = {
+		{0, 0}, {1, 1}, {7, 1}, {8, 2}, {26, 2}, {27, 3},
+		{999999999, 999}, {1000000000, 1000}, {27000000000, 3000},
+		{18446724184312856125ULL, 2642245},
+		{18446724184312856124ULL, 2642244},
+		{UINT64_MAX, 2642245},
+	};
+	struct cubic_state *cs;
+	Tcpctl *tcb;
+	uint32_t expand;
+
+	for (int i = 0; i < ARRAY_SIZE(cubes); i++)
+		KT_ASSERT_M("Cube roots should round down",
+			    tcp_cubic_cbrt(cubes[i][0]) == cubes[i][1]);
+
+	tcb = kzmalloc(sizeof(Tcpctl), MEM_WAIT);
+	cs = &tcb->cc_state.cubic;
+
+	/* A loss backs off by beta = 0.7 and remembers the old cwind */
+	cubic_test_loss(tcb, 100);
+	KT_ASSERT_M("Loss should cut cwind to 0.7", tcb->cwind == 70000);
+	KT_ASSERT_M("Loss should set ssthresh to cwind",
+		    tcb->ssthresh == 70000);
+	KT_ASSERT_M("Loss should remember w_max", cs->w_max == 100000);
+
+	/* The first ACK starts the epoch.  K = cbrt(100 * 0.3 / 0.4) = 4.217s.
+	 * Acking a whole cwind grows it all the way to the target, which is an
+	 * RTT out: W(0.1s) = 0.4 * (0.1 - 4.217)^3 + 100 = 72.088 MSS. */
+	expand = tcb->cc->on_ack(tcb, tcb->cwind);
+	KT_ASSERT_M("K should be when we get back to w_max", cs->k == 4217);
+	KT_ASSERT_M("Target should be on the concave cubic", expand == 2088);
+
+	/* With a 10ms RTT, Reno would be ahead: W_est(0.01s) = 70 + 3 * 0.3 /
+	 * 1.7 * 0.01 / 0.01 = 70.529 MSS, vs W(0.01s) = 70.217 MSS. */
+	cubic_test_loss(tcb, 10);
+	expand = tcb->cc->on_ack(tcb, tcb->cwind);
+	KT_ASSERT_M("Target should be the Reno-friendly w_est", expand == 529);
+
+	/* With a 5s RTT, the target is past K: W(5s) = 0.4 * 0.783^3 + 100 =
+	 * 100.192 MSS */
+	cubic_test_loss(tcb, 5000);
+	expand = tcb->cc->on_ack(tcb, tcb->cwind);
+	KT_ASSERT_M("Target should be on the convex cubic", expand == 30192);
+
+	/* Partial ACKs get a share of the way to the target */
+	cubic_test_loss(tcb, 100);
+	expand = tcb->cc->on_ack(tcb, tcb->cwind / 2);
+	KT_ASSERT_M("Half a cwind of ACKs should grow half way",
+		    expand == 1044);
+
+	/* Fast convergence: losing again below w_max gives up some room */
+	cubic_test_loss(tcb, 100);
+	tcb->cc->on_loss(tcb);
+	KT_ASSERT_M("Fast convergence should lower w_max",
+		    cs->w_max == 59500);
+	KT_ASSERT_M("Second loss should cut cwind to 0.7 again",
+		    tcb->cwind == 49000);
+
+	/* Never below 2 MSS */
+	tcb->cwind = 1000;
+	tcb->cc->on_loss(tcb);
+	KT_ASSERT_M("Loss shouldn't cut cwind below 2 MSS",
+		    tcb->cwind == 2000);
+
+	kfree(tcb);
+	return true;
+}
+
 static struct ktest ktests[] = {
 	KTEST_REG(ptclbsum,		CONFIG_TEST_ptclbsum),
 	KTEST_REG(simplesum_bench,	CONFIG_TEST_simplesum_bench),
 	KTEST_REG(ptclbsum_bench,	CONFIG_TEST_ptclbsum_bench),
+	KTEST_REG(ipht,			CONFIG_TEST_ipht),
+	KTEST_REG(ipht_bench,		CONFIG_TEST_ipht_bench),
+	KTEST_REG(fib,			CONFIG_TEST_fib),
+	KTEST_REG(fib_bench,		CONFIG_TEST_fib_bench),
+	KTEST_REG(tcp_cubic,		CONFIG_TEST_tcp_cubic),
 };
 
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
@@ -1646,7 +1646,7 @@ bool test_kmalloc_incref(void)
 	struct kmalloc_tag *b1tag, *b2tag;
 
 	/* no realigned case */
-	b1 = kmalloc(55, 0);
+	b1 = kmalloc_refd(55, 0);
 	KT_ASSERT(!__get_unaligned_orig_buf(b1));
 	b1tag = (struct kmalloc_tag*)(b1 - sizeof(struct kmalloc_tag));
 
@@ -168,11 +168,11 @@ void restart_kthread(struct kthread *kthread)
 			 * without first removing the old GPC, which ultimately
 			 * will result in a flushed EPT (on x86, this actually
 			 * happens when we clear_owning_proc()). */
-			lcr3(kthread->proc->env_cr3);
+			old_proc = pcpui->cur_proc;
+			switch_addr_space(old_proc, kthread->proc);
 			/* Might have to clear out an existing current.  If they
 			 * need to be set later (like in restartcore), it'll be
 			 * done on demand. */
-			old_proc = pcpui->cur_proc;
 			/* Transfer our counted ref from kthread->proc to
 			 * cur_proc. */
 			pcpui->cur_proc = kthread->proc;
@@ -231,8 +231,13 @@ void kthread_runnable(struct kthread *kthread)
 	 *
 	 * We could consider some sort of core affinity, but for now, we can
 	 * just route all ktasks to core 0.  Note this may hide some bugs that
-	 * would otherwise be exposed by running in parallel. */
-	if (is_ktask(kthread))
+	 * would otherwise be exposed by running in parallel.
+	 *
+	 * The exception is ktasks that asked for a specific core, e.g. per-core
+	 * network receive workers.  Those always go back to their core. */
+	if (is_pinned_ktask(kthread))
+		dst = kthread->pinned_core;
+	else if (is_ktask(kthread))
 		dst = 0;
 	else
 		dst = core_id();
@@ -308,6 +313,26 @@ void ktask(char *name, void (*fn)(void*), void *arg)
 	                    (long)name, KMSG_ROUTINE);
 }
 
+static void __pinned_ktask_wrapper(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+
+	/* trap.c resets the flags for every routine kmsg, so this only lasts
+	 * for this ktask. */
+	kth->flags |= KTH_IS_PINNED;
+	kth->pinned_core = core_id();
+	__ktask_wrapper(srcid, a0, a1, a2);
+}
+
+/* Like ktask(), but the ktask runs on coreid, and whenever it blocks, it wakes
+ * up on coreid too, instead of on core 0.  Use this for work that wants to be
+ * spread across cores and stay there. */
+void ktask_on_core(char *name, void (*fn)(void*), void *arg, int coreid)
+{
+	send_kernel_message(coreid, __pinned_ktask_wrapper, (long)fn,
+			    (long)arg, (long)name, KMSG_ROUTINE);
+}
+
 /* Semaphores, using kthreads directly */
 static void db_blocked_kth(struct kth_db_info *db);
 static void db_unblocked_kth(struct kth_db_info *db);
@@ -26,10 +26,13 @@
 #include <umem.h>
 #include <ns.h>
 #include <tree_file.h>
+#include <rbtree_augmented.h>
+#include <zswap.h>
 
 /* These are the only mmap flags that are saved in the VMR.  If we implement
  * more of the mmap interface, we may need to grow this. */
-#define MAP_PERSIST_FLAGS	(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS)
+#define MAP_PERSIST_FLAGS	(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | \
+				 MAP_JUMBO | MAP_LOCKED)
 
 struct kmem_cache *vmr_kcache;
 
@@ -262,15 +265,173 @@ static void vmr_free(struct vm_region *vmr)
 	kmem_cache_free(vmr_kcache, vmr);
 }
 
+static void __vmr_free_rcu(struct rcu_head *head)
+{
+	vmr_free(container_of(head, struct vm_region, vm_rcu));
+}
+
+/* VMRs that were in a proc's tree could still be seen by lockless lookups. */
+static void vmr_free_rcu(struct vm_region *vmr)
+{
+	call_rcu(&vmr->vm_rcu, __vmr_free_rcu);
+}
+
+/* The free space between vmr and the next VMR (or the top of the user's address
+ * space).  Caller holds the vmr_lock. */
+static uintptr_t vmr_gap(struct vm_region *vmr)
+{
+	struct vm_region *next = TAILQ_NEXT(vmr, vm_link);
+
+	return (next ? next->vm_base : UMAPTOP) - vmr->vm_end;
+}
+
+static uintptr_t vmr_compute_max_gap(struct vm_region *vmr)
+{
+	uintptr_t max_gap = vmr_gap(vmr);
+	struct vm_region *child;
+
+	if (vmr->vm_rb.rb_left) {
+		child = rb_entry(vmr->vm_rb.rb_left, struct vm_region, vm_rb);
+		max_gap = MAX(max_gap, child->vm_max_gap);
+	}
+	if (vmr->vm_rb.rb_right) {
+		child = rb_entry(vmr->vm_rb.rb_right, struct vm_region, vm_rb);
+		max_gap = MAX(max_gap, child->vm_max_gap);
+	}
+	return max_gap;
+}
+
+RB_DECLARE_CALLBACKS(static, vmr_gap_cb, struct vm_region, vm_rb, uintptr_t,
+                     vm_max_gap, vmr_compute_max_gap)
+
+/* Recomputes the max gaps from vmr up to the root.  Call this whenever vmr's gap
+ * changed, i.e. its vm_end moved or its successor came or went.
+ *
+ * We don't stop early, like the rbtree's propagate callback does.  A rotation
+ * could have already recomputed vmr, but not its new ancestors. */
+static void vmr_update_gaps(struct vm_region *vmr)
+{
+	struct rb_node *node;
+
+	for (node = &vmr->vm_rb; node; node = rb_parent(node)) {
+		vmr = rb_entry(node, struct vm_region, vm_rb);
+		vmr->vm_max_gap = vmr_compute_max_gap(vmr);
+	}
+}
+
+/* Adds vmr to p's tree.  vmr must already be in the TAILQ, with its base and end
+ * set.  Caller holds the vmr_lock and is in a vmr_seq write section. */
+static void vmr_tree_insert(struct proc *p, struct vm_region *vmr)
+{
+	struct rb_node **link = &p->vm_tree.rb_node, *parent = NULL;
+	struct vm_region *vmr_i, *prev;
+
+	while (*link) {
+		parent = *link;
+		vmr_i = rb_entry(parent, struct vm_region, vm_rb);
+		if (vmr->vm_base < vmr_i->vm_base)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	vmr->vm_max_gap = vmr_gap(vmr);
+	rb_link_node_rcu(&vmr->vm_rb, parent, link);
+	rb_insert_augmented(&vmr->vm_rb, &p->vm_tree, &vmr_gap_cb);
+	vmr_update_gaps(vmr);
+	/* Our predecessor's gap now ends at our base */
+	prev = TAILQ_PREV(vmr, vmr_tailq, vm_link);
+	if (prev)
+		vmr_update_gaps(prev);
+}
+
+/* Removes vmr from p's TAILQ and tree.  Caller holds the vmr_lock and is in a
+ * vmr_seq write section. */
+static void vmr_unlink(struct proc *p, struct vm_region *vmr)
+{
+	struct vm_region *prev = TAILQ_PREV(vmr, vmr_tailq, vm_link);
+
+	TAILQ_REMOVE(&p->vm_regions, vmr, vm_link);
+	rb_erase_augmented(&vmr->vm_rb, &p->vm_tree, &vmr_gap_cb);
+	if (prev)
+		vmr_update_gaps(prev);
+}
+
+/* Helper: returns the leftmost VMR in node's subtree with a gap of at least
+ * len, or 0. */
+static struct vm_region *__vmr_first_fit(struct rb_node *node, size_t len)
+{
+	struct vm_region *vmr;
+
+	while (node) {
+		if (node->rb_left &&
+		    rb_entry(node->rb_left, struct vm_region,
+			     vm_rb)->vm_max_gap >= len) {
+			node = node->rb_left;
+			continue;
+		}
+		vmr = rb_entry(node, struct vm_region, vm_rb);
+		if (vmr_gap(vmr) >= len)
+			return vmr;
+		node = node->rb_right;
+	}
+	return 0;
+}
+
+/* Returns the first VMR at or after vmr (in address order) with a gap of at
+ * least len after it, or 0 if there is none.  O(log n), thanks to the gaps. */
+static struct vm_region *vmr_next_fit(struct vm_region *vmr, size_t len)
+{
+	struct rb_node *node = &vmr->vm_rb, *parent;
+
+	while (node) {
+		vmr = rb_entry(node, struct vm_region, vm_rb);
+		if (vmr_gap(vmr) >= len)
+			return vmr;
+		if (node->rb_right &&
+		    rb_entry(node->rb_right, struct vm_region,
+			     vm_rb)->vm_max_gap >= len)
+			return __vmr_first_fit(node->rb_right, len);
+		/* Climb til we come up from a left child.  That parent is the
+		 * next VMR in order. */
+		while ((parent = rb_parent(node)) && (node == parent->rb_right))
+			node = parent;
+		node = parent;
+	}
+	return 0;
+}
+
+/* Helper: finds the VMR holding va.  If there isn't one and or_next is set,
+ * finds the first VMR after va.  This is safe for lockless readers, so long as
+ * they are in an RCU read-side section and check the vmr_seq. */
+static struct vm_region *__find_vmr(struct proc *p, uintptr_t va, bool or_next)
+{
+	struct rb_node *node = READ_ONCE(p->vm_tree.rb_node);
+	struct vm_region *vmr, *ret = 0;
+
+	while (node) {
+		vmr = rb_entry(node, struct vm_region, vm_rb);
+		if (va < READ_ONCE(vmr->vm_end)) {
+			if (READ_ONCE(vmr->vm_base) <= va)
+				return vmr;
+			if (or_next)
+				ret = vmr;
+			node = READ_ONCE(node->rb_left);
+		} else {
+			node = READ_ONCE(node->rb_right);
+		}
+	}
+	return ret;
+}
+
 /* The caller will set the prot, flags, file, and offset.  We find a spot for it
  * in p's address space, set proc, base, and end.  Caller holds p's vmr_lock.
  *
- * TODO: take a look at solari's vmem alloc.  And consider keeping these in a
- * tree of some sort for easier lookups. */
+ * We take the first gap at or after va that is big enough, like a vmem
+ * next-fit.  The gaps are tracked in the tree, so this is O(log n). */
 static bool vmr_insert(struct vm_region *vmr, struct proc *p, uintptr_t va,
                        size_t len)
 {
-	struct vm_region *vm_i, *vm_next;
+	struct vm_region *vm_i, *vm_next, *vm_prev;
 	uintptr_t gap_end;
 	bool ret = false;
 
@@ -286,32 +447,39 @@ static bool vmr_insert(struct vm_region *vmr, struct proc *p, uintptr_t va,
 		TAILQ_INSERT_HEAD(&p->vm_regions, vmr, vm_link);
 		ret = true;
 	} else {
-		TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
+		/* skip til we get past the 'hint' va: the first gap that ends
+		 * after va belongs to the VMR holding va, or to the VMR before
+		 * the first one after va. */
+		vm_i = __find_vmr(p, va, true);
+		if (!vm_i) {
+			vm_i = TAILQ_LAST(&p->vm_regions, vmr_tailq);
+		} else if (vm_i->vm_base > va) {
+			vm_prev = TAILQ_PREV(vm_i, vmr_tailq, vm_link);
+			if (vm_prev)
+				vm_i = vm_prev;
+		}
+		/* Find a gap that is big enough */
+		vm_i = vmr_next_fit(vm_i, len);
+		if (vm_i) {
 			vm_next = TAILQ_NEXT(vm_i, vm_link);
 			gap_end = vm_next ? vm_next->vm_base : UMAPTOP;
-			/* skip til we get past the 'hint' va */
-			if (va >= gap_end)
-				continue;
-			/* Find a gap that is big enough */
-			if (gap_end - vm_i->vm_end >= len) {
-				/* if we can put it at va, let's do that.  o/w,
-				 * put it so it fits */
-				if ((gap_end >= va + len) &&
-				    (va >= vm_i->vm_end))
-					vmr->vm_base = va;
-				else
-					vmr->vm_base = vm_i->vm_end;
-				TAILQ_INSERT_AFTER(&p->vm_regions, vm_i, vmr,
-						   vm_link);
-				ret = true;
-				break;
-			}
+			/* if we can put it at va, let's do that.  o/w, put it
+			 * so it fits */
+			if ((gap_end >= va + len) && (va >= vm_i->vm_end))
+				vmr->vm_base = va;
+			else
+				vmr->vm_base = vm_i->vm_end;
+			TAILQ_INSERT_AFTER(&p->vm_regions, vm_i, vmr, vm_link);
+			ret = true;
 		}
 	}
 	/* Finalize the creation, if we got one */
 	if (ret) {
 		vmr->vm_proc = p;
 		vmr->vm_end = vmr->vm_base + len;
+		__seq_start_write(&p->vmr_seq);
+		vmr_tree_insert(p, vmr);
+		__seq_end_write(&p->vmr_seq);
 	}
 	if (!ret)
 		warn("Not making a VMR, wanted %p, + %p = %p", va, len, va +
@@ -319,10 +487,37 @@ static bool vmr_insert(struct vm_region *vmr, struct proc *p, uintptr_t va,
 	return ret;
 }
 
+/* Helper: if a jumbo page maps va, but doesn't start at va, we split it into
+ * regular pages.  The TLB shootdown goes in tlb. */
+static void split_jumbo_at(struct proc *p, uintptr_t va,
+                           struct tlb_gather *tlb)
+{
+	pte_t pte;
+	bool split = FALSE;
+
+	if (ALIGNED(va, PML2_PTE_REACH))
+		return;
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+	if (pte_walk_okay(pte) && pte_is_jumbo(pte)) {
+		jumbo_page_split(pa2page(pte_get_paddr(pte)));
+		split = pgdir_split_jumbo(p->env_pgdir, (void*)va);
+		assert(split);
+		p->nr_jumbo_pgs--;
+	}
+	spin_unlock(&p->pte_lock);
+	/* Intel wants us to flush when changing page sizes */
+	if (split) {
+		va = ROUNDDOWN(va, PML2_PTE_REACH);
+		tlb_gather_add(tlb, va, va + PML2_PTE_REACH);
+	}
+}
+
 /* Split a VMR at va, returning the new VMR.  It is set up the same way, with
  * file offsets fixed accordingly.  'va' is the beginning of the new one, and
- * must be page aligned. */
-static struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
+ * must be page aligned.  Any TLB shootdown goes in tlb. */
+static struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va,
+                                   struct tlb_gather *tlb)
 {
 	struct vm_region *new_vmr;
 
@@ -331,37 +526,58 @@ static struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
 		return 0;
 	new_vmr = kmem_cache_alloc(vmr_kcache, 0);
 	assert(new_vmr);
-	TAILQ_INSERT_AFTER(&old_vmr->vm_proc->vm_regions, old_vmr, new_vmr,
-	                   vm_link);
 	new_vmr->vm_proc = old_vmr->vm_proc;
 	new_vmr->vm_base = va;
 	new_vmr->vm_end = old_vmr->vm_end;
-	old_vmr->vm_end = va;
 	new_vmr->vm_prot = old_vmr->vm_prot;
 	new_vmr->vm_flags = old_vmr->vm_flags;
+	new_vmr->vm_ready = old_vmr->vm_ready;
+	new_vmr->vm_shootdown_needed = false;
+	new_vmr->vm_dying = false;
 	if (vmr_has_file(old_vmr)) {
 		foc_incref(old_vmr->__vm_foc);
 		new_vmr->__vm_foc = old_vmr->__vm_foc;
-		new_vmr->vm_foff = old_vmr->vm_foff +
-		                      old_vmr->vm_end - old_vmr->vm_base;
-		pm_add_vmr(vmr_to_pm(old_vmr), new_vmr);
+		new_vmr->vm_foff = old_vmr->vm_foff + va - old_vmr->vm_base;
 	} else {
 		new_vmr->__vm_foc = NULL;
 		new_vmr->vm_foff = 0;
 	}
+	/* Lockless lookups must see both halves, or neither */
+	__seq_start_write(&old_vmr->vm_proc->vmr_seq);
+	TAILQ_INSERT_AFTER(&old_vmr->vm_proc->vm_regions, old_vmr, new_vmr,
+	                   vm_link);
+	old_vmr->vm_end = va;
+	vmr_tree_insert(old_vmr->vm_proc, new_vmr);
+	__seq_end_write(&old_vmr->vm_proc->vmr_seq);
+	if (vmr_has_file(new_vmr))
+		pm_add_vmr(vmr_to_pm(new_vmr), new_vmr);
+	/* Jumbo pages can't straddle VMRs.  We split after changing the VMRs:
+	 * from here on, lockless faults won't map a jumbo across va. */
+	split_jumbo_at(old_vmr->vm_proc, va, tlb);
 	return new_vmr;
 }
 
-/* Called by the unmapper, just cleans up.  Whoever calls this will need to sort
- * out the page table entries. */
-static void destroy_vmr(struct vm_region *vmr)
+/* Helper: releases a VMR that is no longer in its proc's tree. */
+static void __destroy_vmr(struct vm_region *vmr)
 {
+	vmr->vm_dying = true;
 	if (vmr_has_file(vmr)) {
 		pm_remove_vmr(vmr_to_pm(vmr), vmr);
 		foc_decref(vmr->__vm_foc);
 	}
-	TAILQ_REMOVE(&vmr->vm_proc->vm_regions, vmr, vm_link);
-	vmr_free(vmr);
+	vmr_free_rcu(vmr);
+}
+
+/* Called by the unmapper, just cleans up.  Whoever calls this will need to sort
+ * out the page table entries. */
+static void destroy_vmr(struct vm_region *vmr)
+{
+	struct proc *p = vmr->vm_proc;
+
+	__seq_start_write(&p->vmr_seq);
+	vmr_unlink(p, vmr);
+	__seq_end_write(&p->vmr_seq);
+	__destroy_vmr(vmr);
 }
 
 /* Merges two vm regions.  For now, it will check to make sure they are the
@@ -377,8 +593,13 @@ static int merge_vmr(struct vm_region *first, struct vm_region *second)
 	if (vmr_has_file(first) && (second->vm_foff != first->vm_foff +
 	                            first->vm_end - first->vm_base))
 		return -1;
+	/* Lockless lookups must always find one of them */
+	__seq_start_write(&first->vm_proc->vmr_seq);
+	vmr_unlink(first->vm_proc, second);
 	first->vm_end = second->vm_end;
-	destroy_vmr(second);
+	vmr_update_gaps(first);
+	__seq_end_write(&first->vm_proc->vmr_seq);
+	__destroy_vmr(second);
 	return 0;
 }
 
@@ -411,7 +632,10 @@ static int grow_vmr(struct vm_region *vmr, uintptr_t va)
 		return -1;
 	if (va <= vmr->vm_end)
 		return -1;
+	__seq_start_write(&vmr->vm_proc->vmr_seq);
 	vmr->vm_end = va;
+	vmr_update_gaps(vmr);
+	__seq_end_write(&vmr->vm_proc->vmr_seq);
 	return 0;
 }
 
@@ -422,50 +646,67 @@ static int shrink_vmr(struct vm_region *vmr, uintptr_t va)
 	assert(!PGOFF(va));
 	if ((va < vmr->vm_base) || (va > vmr->vm_end))
 		return -1;
+	__seq_start_write(&vmr->vm_proc->vmr_seq);
 	vmr->vm_end = va;
+	vmr_update_gaps(vmr);
+	__seq_end_write(&vmr->vm_proc->vmr_seq);
 	return 0;
 }
 
 /* Given a va and a proc (later an mm, possibly), returns the owning vmr, or 0
- * if there is none. */
+ * if there is none.  Caller holds the vmr_lock. */
 static struct vm_region *find_vmr(struct proc *p, uintptr_t va)
 {
-	struct vm_region *vmr;
-
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
-			return vmr;
-	}
-	return 0;
+	return __find_vmr(p, va, false);
 }
 
 /* Finds the first vmr after va (including the one holding va), or 0 if there is
- * none. */
+ * none.  Caller holds the vmr_lock. */
 static struct vm_region *find_first_vmr(struct proc *p, uintptr_t va)
+{
+	return __find_vmr(p, va, true);
+}
+
+/* Lockless version of find_vmr(), used by the page fault handler.  Caller must
+ * be in an RCU read-side section, which keeps the VMR from being freed.  The
+ * VMR can still change or be destroyed at any point, so anything learned from
+ * it needs to be rechecked under the pte_lock (see vmr_still_maps()). */
+static struct vm_region *find_vmr_rcu(struct proc *p, uintptr_t va)
 {
 	struct vm_region *vmr;
+	seq_ctr_t seq;
 
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
-			return vmr;
-		if (vmr->vm_base > va)
-			return vmr;
-	}
-	return 0;
+	do {
+		seq = ACCESS_ONCE(p->vmr_seq);
+		rmb();
+		vmr = __find_vmr(p, va, false);
+	} while (seqctr_retry(seq, ACCESS_ONCE(p->vmr_seq)));
+	return vmr;
+}
+
+/* Checks that a VMR found with find_vmr_rcu() still maps va with vm_prot.  Call
+ * this with the pte_lock held.  munmap marks VMRs as dying under the pte_lock
+ * before it clears their PTEs, and mprotect changes vm_prot before it walks
+ * the PTEs, so if this passes, they will clean up whatever PTE we write. */
+static bool vmr_still_maps(struct vm_region *vmr, uintptr_t va, int vm_prot)
+{
+	return !ACCESS_ONCE(vmr->vm_dying) &&
+	       (ACCESS_ONCE(vmr->vm_prot) == vm_prot) &&
+	       (ACCESS_ONCE(vmr->vm_base) <= va) &&
+	       (va < ACCESS_ONCE(vmr->vm_end));
 }
 
 /* Makes sure that no VMRs cross either the start or end of the given region
- * [va, va + len), splitting any VMRs that are on the endpoints. */
-static void isolate_vmrs(struct proc *p, uintptr_t va, size_t len)
+ * [va, va + len), splitting any VMRs that are on the endpoints.  The caller
+ * needs to flush tlb. */
+static void isolate_vmrs(struct proc *p, uintptr_t va, size_t len,
+                         struct tlb_gather *tlb)
 {
 	struct vm_region *vmr;
 	if ((vmr = find_vmr(p, va)))
-		split_vmr(vmr, va);
-	/* TODO: don't want to do another find (linear search) */
+		split_vmr(vmr, va, tlb);
 	if ((vmr = find_vmr(p, va + len)))
-		split_vmr(vmr, va + len);
+		split_vmr(vmr, va + len, tlb);
 }
 
 void unmap_and_destroy_vmrs(struct proc *p)
@@ -478,6 +719,7 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	p->vmr_history++;
 	spin_lock(&p->pte_lock);
 	TAILQ_FOREACH(vmr_i, &p->vm_regions, vm_link) {
+		vmr_i->vm_dying = true;
 		/* note this CB sets the PTE = 0, regardless of if it was P or
 		 * not */
 		env_user_mem_walk(p, (void*)vmr_i->vm_base,
@@ -492,9 +734,25 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	spin_unlock(&p->vmr_lock);
 }
 
-/* Helper: copies the contents of pages from p to new p.  For pages that aren't
- * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+/* Helper: drops the PTE's reference on its page.  Jumbo PTEs point to the first
+ * struct page of their jumbo page. */
+static void __put_pte_page(pte_t pte)
+{
+	struct page *page = pa2page(pte_get_paddr(pte));
+
+	if (pte_is_jumbo(pte))
+		jumbo_page_decref(page);
+	else
+		page_decref(page);
+}
+
+/* Helper: shares the pages from p with new_p, copy-on-write.  Both PTEs become
+ * read-only and marked CoW, and the page gets an extra ref.  Whoever writes
+ * first gets a private copy of the page in __hpf_break_cow().  Pages that zswap
+ * paged out get copied.  0 on success, -ERROR on failure.
+ *
+ * The caller needs to flush p's TLB, since p's PTEs lost their write
+ * permission. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
                       uintptr_t va_end)
 {
@@ -513,6 +771,8 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 	int copy_page(struct proc *p, pte_t pte, void *va, void *arg) {
 		struct proc *new_p = (struct proc*)arg;
 		struct page *pp;
+		pte_t new_pte;
+		int settings;
 
 		if (pte_is_unmapped(pte))
 			return 0;
@@ -520,20 +780,45 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		 * VMRs undergoing page removal, which isn't the caller of
 		 * copy_pages. */
 		if (pte_is_mapped(pte)) {
-			/* TODO: check for jumbos */
-			if (upage_alloc(new_p, &pp, 0))
-				return -ENOMEM;
-			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
-			if (page_insert(new_p->env_pgdir, pp, va,
-					pte_get_settings(pte))) {
-				page_decref(pp);
-				return -ENOMEM;
+			pp = pa2page(pte_get_paddr(pte));
+			/* Private file VMRs should only map private copies of
+			 * the PM's pages.  Just in case, the child gets its own
+			 * copy, since we can't take a ref on a PM page. */
+			if (page_is_pagemap(pp)) {
+				if (upage_alloc(new_p, &pp, 0))
+					return -ENOMEM;
+				memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)),
+				       PGSIZE);
+				if (page_insert(new_p->env_pgdir, pp, va,
+						pte_get_settings(pte))) {
+					page_decref(pp);
+					return -ENOMEM;
+				}
+				return 0;
 			}
+			if (pte_is_jumbo(pte))
+				new_pte = pgdir_walk_jumbo(new_p->env_pgdir,
+							   va, 1);
+			else
+				new_pte = pgdir_walk(new_p->env_pgdir, va, 1);
+			if (!pte_walk_okay(new_pte))
+				return -ENOMEM;
+			if (pte_is_jumbo(pte))
+				new_p->nr_jumbo_pgs++;
+			/* Both PTEs are read-only and CoW, regardless of the
+			 * VMR's prots.  Read-only pages need to be CoW too, in
+			 * case someone mprotects them to writable. */
+			settings = pte_get_settings(pte) | PTE_COW;
+			if (pte_has_perm_urw(pte))
+				settings = (settings & ~PTE_PERM) | PTE_USER_RO;
+			pte_write(pte, pte_get_paddr(pte), settings);
+			page_incref(pp);
+			pte_write(new_pte, pte_get_paddr(pte), settings);
 		} else if (pte_is_paged_out(pte)) {
-			/* TODO: (SWAP) will need to either make a copy or
-			 * CoW/refcnt the backend store.  For now, this PTE will
-			 * be the same as the original PTE */
-			panic("Swapping not supported!");
+			new_pte = pgdir_walk(new_p->env_pgdir, va, 1);
+			if (!pte_walk_okay(new_pte))
+				return -ENOMEM;
+			return zswap_dup_pte(new_p, pte, new_pte);
 		} else {
 			panic("Weird PTE %p in %s!", pte_print(pte),
 			      __FUNCTION__);
@@ -586,10 +871,10 @@ static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
 }
 
 /* This will make new_p have the same VMRs as p, and it will make sure all
- * physical pages are copied over, with the exception of MAP_SHARED files.
- * MAP_SHARED files that are also MAP_LOCKED will be attached to the process -
- * presumably they are in the page cache since the parent locked them.  This is
- * all pretty nasty.
+ * physical pages are shared copy-on-write, with the exception of MAP_SHARED
+ * files.  MAP_SHARED files that are also MAP_LOCKED will be attached to the
+ * process - presumably they are in the page cache since the parent locked
+ * them.  This is all pretty nasty.
  *
  * This is used by fork().
  *
@@ -602,8 +887,10 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 
 	TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
 		vmr = kmem_cache_alloc(vmr_kcache, 0);
-		if (!vmr)
-			return -ENOMEM;
+		if (!vmr) {
+			ret = -ENOMEM;
+			break;
+		}
 		vmr->vm_proc = new_p;
 		vmr->vm_base = vm_i->vm_base;
 		vmr->vm_end = vm_i->vm_end;
@@ -611,6 +898,9 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 		vmr->vm_flags = vm_i->vm_flags;
 		vmr->__vm_foc = vm_i->__vm_foc;
 		vmr->vm_foff = vm_i->vm_foff;
+		vmr->vm_ready = vm_i->vm_ready;
+		vmr->vm_shootdown_needed = false;
+		vmr->vm_dying = false;
 		if (vmr_has_file(vm_i)) {
 			foc_incref(vm_i->__vm_foc);
 			pm_add_vmr(vmr_to_pm(vm_i), vmr);
@@ -622,11 +912,17 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 				foc_decref(vm_i->__vm_foc);
 			}
 			vmr_free(vmr);
-			return ret;
+			break;
 		}
+		__seq_start_write(&new_p->vmr_seq);
 		TAILQ_INSERT_TAIL(&new_p->vm_regions, vmr, vm_link);
+		vmr_tree_insert(new_p, vmr);
+		__seq_end_write(&new_p->vmr_seq);
 	}
-	return 0;
+	/* p's writable PTEs are now read-only CoW PTEs, even if we failed
+	 * partway through. */
+	proc_tlbshootdown(p, 0, UMAPTOP);
+	return ret;
 }
 
 void print_vmrs(struct proc *p)
@@ -660,6 +956,46 @@ void enumerate_vmrs(struct proc *p, void (*func)(struct vm_region *vmr,
 	spin_unlock(&p->vmr_lock);
 }
 
+/* Walks the PTEs of p's anonymous memory in [start, end), like
+ * env_user_mem_walk(), skipping MAP_LOCKED VMRs.  The callback runs with the
+ * vmr_lock and pte_lock held, so it can't block, but we drop the locks every
+ * jumbo page's worth of VAs, so that we don't hold off faults for too long.
+ * Returns 0, or whatever nonzero value the callback returned to stop the
+ * walk. */
+int anon_mem_walk(struct proc *p, uintptr_t start, uintptr_t end,
+                  int (*cb)(struct proc *p, pte_t pte, void *va, void *arg),
+                  void *arg)
+{
+	struct vm_region *vmr;
+	uintptr_t va = start, chunk_end;
+	int ret = 0;
+
+	while (va < end) {
+		spin_lock(&p->vmr_lock);
+		vmr = find_first_vmr(p, va);
+		if (!vmr || vmr->vm_base >= end) {
+			spin_unlock(&p->vmr_lock);
+			break;
+		}
+		va = MAX(va, vmr->vm_base);
+		if (vmr_has_file(vmr) || (vmr->vm_flags & MAP_LOCKED)) {
+			va = vmr->vm_end;
+			spin_unlock(&p->vmr_lock);
+			continue;
+		}
+		chunk_end = MIN(ROUNDUP(va + 1, PML2_PTE_REACH), vmr->vm_end);
+		chunk_end = MIN(chunk_end, end);
+		spin_lock(&p->pte_lock);
+		ret = env_user_mem_walk(p, (void*)va, chunk_end - va, cb, arg);
+		spin_unlock(&p->pte_lock);
+		spin_unlock(&p->vmr_lock);
+		if (ret)
+			break;
+		va = chunk_end;
+	}
+	return ret;
+}
+
 static bool mmap_flags_priv_ok(int flags)
 {
 	return (flags & (MAP_PRIVATE | MAP_SHARED)) == MAP_PRIVATE ||
@@ -758,13 +1094,23 @@ out_ref:
  *
  * It's possible that a page has already been mapped here, in which case we'll
  * treat as success.  So when we return 0, *a* page is mapped here, but not
- * necessarily the one you passed in. */
+ * necessarily the one you passed in.
+ *
+ * Callers that do not hold the vmr_lock pass in the VMR they looked up and the
+ * vm_prot they saw.  If the VMR changed, we'll return -ESTALE. */
 static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
-                            int pte_prot)
+                            int pte_prot, struct vm_region *vmr, int vm_prot)
 {
 	pte_t pte;
+	int ret;
 
 	spin_lock(&p->pte_lock);	/* walking and changing PTEs */
+	if (vmr && !vmr_still_maps(vmr, addr, vm_prot)) {
+		spin_unlock(&p->pte_lock);
+		if (!page_is_pagemap(page))
+			page_decref(page);
+		return -ESTALE;
+	}
 	/* find offending PTE (prob don't read this in).  This might alloc an
 	 * intermediate page table page. */
 	pte = pgdir_walk(p->env_pgdir, (void*)addr, TRUE);
@@ -783,6 +1129,14 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 			page_decref(page);
 		return 0;
 	}
+	/* zswap has the page.  The one the caller has is just a blank page. */
+	if (pte_is_paged_out(pte)) {
+		ret = zswap_fault_in_pte(p, pte);
+		spin_unlock(&p->pte_lock);
+		if (!page_is_pagemap(page))
+			page_decref(page);
+		return ret;
+	}
 	/* I used to allow clobbering an old entry (contrary to the
 	 * documentation), but it's probably a sign of another bug. */
 	assert(!pte_is_mapped(pte));
@@ -795,6 +1149,77 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 	return 0;
 }
 
+/* Helper: tries to map a new, zeroed jumbo page at addr, which must be jumbo
+ * aligned and entirely within the VMR.  Returns -ENOENT if the caller should
+ * fall back to regular pages: either we are out of jumbo pages, or some of the
+ * jumbo's region already has a page table (i.e. regular pages).
+ *
+ * Like map_page_at_addr(), callers that do not hold the vmr_lock pass in the
+ * VMR and vm_prot they saw, and we'll return -ESTALE if the VMR changed. */
+static int map_jumbo_at_addr(struct proc *p, uintptr_t addr, int pte_prot,
+                             struct vm_region *vmr, int vm_prot)
+{
+	pte_t pte;
+	void *kva;
+
+	/* Don't bother zeroing a jumbo if we know it can't fit */
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)addr, FALSE);
+	if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
+		spin_unlock(&p->pte_lock);
+		if (pte_is_jumbo(pte))
+			return 0;
+		goto fallback;
+	}
+	spin_unlock(&p->pte_lock);
+	kva = jumbo_page_alloc(1, MEM_ATOMIC);
+	if (!kva)
+		goto fallback;
+	memset(kva, 0, PML2_PTE_REACH);
+	spin_lock(&p->pte_lock);
+	if (vmr && (!vmr_still_maps(vmr, addr, vm_prot) ||
+		    (addr + PML2_PTE_REACH > ACCESS_ONCE(vmr->vm_end)))) {
+		spin_unlock(&p->pte_lock);
+		jumbo_page_free(kva, 1);
+		return -ESTALE;
+	}
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)addr, TRUE);
+	if (!pte_walk_okay(pte)) {
+		spin_unlock(&p->pte_lock);
+		jumbo_page_free(kva, 1);
+		return -ENOMEM;
+	}
+	/* Someone else mapped something while we were zeroing.  If it was a
+	 * jumbo, we're done. */
+	if (pte_is_mapped(pte)) {
+		spin_unlock(&p->pte_lock);
+		jumbo_page_free(kva, 1);
+		if (pte_is_jumbo(pte))
+			return 0;
+		goto fallback;
+	}
+	pte_write(pte, PADDR(kva), pte_prot | PTE_PS);
+	p->nr_jumbo_pgs++;
+	spin_unlock(&p->pte_lock);
+	return 0;
+fallback:
+	/* racy, but just a stat */
+	p->nr_jumbo_fallbacks++;
+	return -ENOENT;
+}
+
+/* Helper: returns TRUE if the fault at va in an anonymous VMR should try to use
+ * a jumbo page, which needs to fit entirely in the VMR.  vmr could be changing
+ * under us; map_jumbo_at_addr() will recheck. */
+static bool vmr_wants_jumbo(struct vm_region *vmr, uintptr_t va)
+{
+	uintptr_t jva = ROUNDDOWN(va, PML2_PTE_REACH);
+
+	return (vmr->vm_flags & MAP_JUMBO) &&
+	       (ACCESS_ONCE(vmr->vm_base) <= jva) &&
+	       (jva + PML2_PTE_REACH <= ACCESS_ONCE(vmr->vm_end));
+}
+
 /* Helper: copies *pp's contents to a new page, replacing your page pointer.  If
  * this succeeds, you'll have a non-PM page, which matters for how you put it.*/
 static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
@@ -810,18 +1235,32 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 }
 
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
- * mappable, which isn't true if there are concurrent changes to the VMRs. */
+ * mappable, which isn't true if there are concurrent changes to the VMRs.  With
+ * jumbo, we'll try to use jumbo pages for the jumbo-aligned parts of the
+ * range. */
 static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
-                            int pte_prot)
+                            int pte_prot, bool jumbo)
 {
 	struct page *page;
 	int ret;
 
 	for (long i = 0; i < nr_pgs; i++) {
+		if (jumbo && ALIGNED(va + i * PGSIZE, PML2_PTE_REACH) &&
+		    (nr_pgs - i >= NR_PGS_PER_JUMBO)) {
+			ret = map_jumbo_at_addr(p, va + i * PGSIZE, pte_prot,
+						NULL, 0);
+			if (!ret) {
+				i += NR_PGS_PER_JUMBO - 1;
+				continue;
+			}
+			if (ret != -ENOENT)
+				return ret;
+		}
 		if (upage_alloc(p, &page, TRUE))
 			return -ENOMEM;
 		/* could imagine doing a memwalk instead of a for loop */
-		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot);
+		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot,
+				       NULL, 0);
 		if (ret)
 			return ret;
 	}
@@ -837,6 +1276,8 @@ static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
 	unsigned long pm_idx0 = offset >> PGSHIFT;
 	int vmr_history = ACCESS_ONCE(p->vmr_history);
 	struct page *page;
+	/* We load the range sequentially, so we can read ahead of ourselves */
+	struct file_ra_state ra = {0};
 
 	/* This is a racy check - see the comments in fs_file.c.  Also, we're
 	 * not even attempting to populate the va, though we could do a partial
@@ -846,13 +1287,13 @@ static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
 	/* locking rules: start the loop holding the vmr lock, enter and exit
 	 * the entire func holding the lock. */
 	for (long i = 0; i < nr_pgs; i++) {
-		ret = pm_load_page_nowait(pm, pm_idx0 + i, &page);
+		ret = pm_load_page_nowait_ra(pm, pm_idx0 + i, &page, &ra);
 		if (ret) {
 			if (ret != -EAGAIN)
 				break;
 			spin_unlock(&p->vmr_lock);
 			/* might block here, can't hold the spinlock */
-			ret = pm_load_page(pm, pm_idx0 + i, &page);
+			ret = pm_load_page_ra(pm, pm_idx0 + i, &page, &ra);
 			spin_lock(&p->vmr_lock);
 			if (ret)
 				break;
@@ -879,7 +1320,8 @@ static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
 			icache_flush_page(0, page2kva(page));
 		/* The page could be either in the PM, or a private, now-anon
 		 * page. */
-		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot);
+		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot,
+				       NULL, 0);
 		if (page_is_pagemap(page))
 			pm_put_page(page);
 		if (ret)
@@ -914,6 +1356,11 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 
 	if (file && (atomic_read(&vcpd->flags) & VC_SCP_NOVCCTX))
 		flags |= MAP_POPULATE | MAP_LOCKED;
+	/* Jumbo pages are only for anonymous memory */
+	if (file)
+		flags &= ~MAP_JUMBO;
+	else if (p->jumbo_anon)
+		flags |= MAP_JUMBO;
 	vmr->vm_prot = prot;
 	vmr->vm_foff = offset;
 	vmr->vm_flags = flags & MAP_PERSIST_FLAGS;
@@ -978,7 +1425,8 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 		unsigned long nr_pgs = len >> PGSHIFT;
 		int ret = 0;
 		if (!file) {
-			ret = populate_anon_va(p, addr, nr_pgs, pte_prot);
+			ret = populate_anon_va(p, addr, nr_pgs, pte_prot,
+					       flags & MAP_JUMBO);
 		} else {
 			/* Note: this will unlock if it blocks.  our refcnt on
 			 * the file keeps the pm alive when we unlock */
@@ -1037,16 +1485,17 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 {
 	struct vm_region *vmr, *next_vmr;
 	pte_t pte;
-	bool shootdown_needed = FALSE;
+	struct tlb_gather tlb;
 	bool file_access_failure = FALSE;
 	int pte_prot = (prot & PROT_WRITE) ? PTE_USER_RW :
 	               (prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : PTE_NONE;
 
 	assert(prot_is_valid(prot));
+	tlb_gather_init(&tlb, p);
 	/* TODO: this is aggressively splitting, when we might not need to if
 	 * the prots are the same as the previous.  Plus, there are three
-	 * excessive scans. */
-	isolate_vmrs(p, addr, len);
+	 * excessive lookups. */
+	isolate_vmrs(p, addr, len, &tlb);
 	vmr = find_first_vmr(p, addr);
 	while (vmr && vmr->vm_base < addr + len) {
 		if (vmr->vm_prot == prot)
@@ -1068,8 +1517,16 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 		     va += PGSIZE) {
 			pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
 			if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
-				pte_replace_perm(pte, pte_prot);
-				shootdown_needed = TRUE;
+				/* CoW PTEs stay read-only until a write fault
+				 * breaks the sharing. */
+				if (pte_is_cow(pte) && (pte_prot == PTE_USER_RW))
+					pte_replace_perm(pte, PTE_USER_RO);
+				else
+					pte_replace_perm(pte, pte_prot);
+				tlb_gather_add(&tlb, va, va + PGSIZE);
+			} else if (pte_walk_okay(pte) &&
+				   pte_is_paged_out(pte)) {
+				zswap_set_perm_pte(pte, pte_prot);
 			}
 		}
 		spin_unlock(&p->pte_lock);
@@ -1083,8 +1540,7 @@ next_vmr:
 		next_vmr = TAILQ_NEXT(vmr, vm_link);
 		vmr = next_vmr;
 	}
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_gather_flush(&tlb);
 	if (file_access_failure) {
 		set_errno(EACCES);
 		return -1;
@@ -1118,7 +1574,7 @@ int munmap(struct proc *p, uintptr_t addr, size_t len)
 
 static int __munmap_pte(struct proc *p, pte_t pte, void *va, void *arg)
 {
-	bool *shootdown_needed = (bool*)arg;
+	struct tlb_gather *tlb = arg;
 	struct page *page;
 
 	/* could put in some checks here for !P and also !0 */
@@ -1126,10 +1582,13 @@ static int __munmap_pte(struct proc *p, pte_t pte, void *va, void *arg)
 		return 0;
 	if (pte_is_dirty(pte)) {
 		page = pa2page(pte_get_paddr(pte));
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		if (page_is_pagemap(page))
+			pm_page_set_dirty(page->pg_mapping, page);
+		else
+			atomic_or(&page->pg_flags, PG_DIRTY);
 	}
 	pte_clear_present(pte);
-	*shootdown_needed = TRUE;
+	tlb_gather_add(tlb, (uintptr_t)va, (uintptr_t)va + PGSIZE);
 	return 0;
 }
 
@@ -1151,39 +1610,47 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 	struct page *page;
 	if (pte_is_unmapped(pte))
 		return 0;
+	if (pte_is_paged_out(pte)) {
+		zswap_free_pte(pte);
+		pte_clear(pte);
+		return 0;
+	}
 	page = pa2page(pte_get_paddr(pte));
-	pte_clear(pte);
+	if (pte_is_jumbo(pte))
+		p->nr_jumbo_pgs--;
 	if (!page_is_pagemap(page))
-		page_decref(page);
+		__put_pte_page(pte);
+	pte_clear(pte);
 	return 0;
 }
 
 int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 {
 	struct vm_region *vmr, *next_vmr, *first_vmr;
-	bool shootdown_needed = FALSE;
+	struct tlb_gather tlb;
 
-	/* TODO: this will be a bit slow, since we end up doing three linear
-	 * searches (two in isolate, one in find_first). */
-	isolate_vmrs(p, addr, len);
+	tlb_gather_init(&tlb, p);
+	isolate_vmrs(p, addr, len, &tlb);
 	first_vmr = find_first_vmr(p, addr);
 	vmr = first_vmr;
 	spin_lock(&p->pte_lock);	/* changing PTEs */
 	while (vmr && vmr->vm_base < addr + len) {
+		/* Lockless faults check this under the pte_lock.  Once it is
+		 * set, they will not add PTEs for this VMR. */
+		vmr->vm_dying = true;
 		/* It's important that we call __munmap_pte and sync the
 		 * PG_DIRTY bit before we unhook the VMR from the PM (in
 		 * destroy_vmr). */
 		env_user_mem_walk(p, (void*)vmr->vm_base,
 				  vmr->vm_end - vmr->vm_base, __munmap_pte,
-				  &shootdown_needed);
+				  &tlb);
 		vmr = TAILQ_NEXT(vmr, vm_link);
 	}
 	spin_unlock(&p->pte_lock);
 	/* we haven't freed the pages yet; still using the PTEs to store the
 	 * them.  There should be no races with inserts/faults, since we still
 	 * hold the mm lock since the previous CB. */
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_gather_flush(&tlb);
 	vmr = first_vmr;
 	while (vmr && vmr->vm_base < addr + len) {
 		/* there is rarely more than one VMR in this loop.  o/w, we'll
@@ -1264,6 +1731,173 @@ static int __hpf_load_page(struct proc *p, struct page_map *pm,
 	return 0;
 }
 
+/* Helper: handles a write fault on a CoW PTE by giving p its own copy of the
+ * page (or jumbo page).  If no one else shares the page anymore, we can just
+ * make it writable.  Returns -ENOENT if va is not a CoW PTE, in which case the
+ * caller handles the fault normally, or -ESTALE if the VMR changed.
+ *
+ * We copy while holding the pte_lock.  Once we unlock, another thread could
+ * munmap va and free the old page. */
+static int __hpf_break_cow(struct proc *p, uintptr_t va, struct vm_region *vmr,
+                           int vm_prot)
+{
+	struct page *old_page, *new_page;
+	pte_t pte;
+	void *new_kva;
+	size_t pgsize;
+	int settings;
+
+	spin_lock(&p->pte_lock);
+	if (!vmr_still_maps(vmr, va, vm_prot)) {
+		spin_unlock(&p->pte_lock);
+		return -ESTALE;
+	}
+	pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+	if (!pte_walk_okay(pte) || !pte_is_present(pte) || !pte_is_cow(pte)) {
+		spin_unlock(&p->pte_lock);
+		return -ENOENT;
+	}
+	settings = (pte_get_settings(pte) & ~(PTE_PERM | PTE_COW)) |
+		   PTE_USER_RW;
+	old_page = pa2page(pte_get_paddr(pte));
+	if (!page_is_shared(old_page)) {
+		/* Upgrading permissions doesn't need a shootdown.  Other cores
+		 * with the old PTE cached will take a spurious fault. */
+		pte_write(pte, page2pa(old_page), settings);
+		spin_unlock(&p->pte_lock);
+		return 0;
+	}
+	if (pte_is_jumbo(pte)) {
+		pgsize = PML2_PTE_REACH;
+		new_kva = jumbo_page_alloc(1, MEM_ATOMIC);
+	} else {
+		pgsize = PGSIZE;
+		new_kva = upage_alloc(p, &new_page, FALSE) ? NULL
+							   : page2kva(new_page);
+	}
+	if (!new_kva) {
+		spin_unlock(&p->pte_lock);
+		return -ENOMEM;
+	}
+	memcpy(new_kva, page2kva(old_page), pgsize);
+	__put_pte_page(pte);
+	pte_write(pte, PADDR(new_kva), settings);
+	spin_unlock(&p->pte_lock);
+	/* Other cores could still be reading the old page */
+	va = ROUNDDOWN(va, pgsize);
+	proc_tlbshootdown(p, va, va + pgsize);
+	return 0;
+}
+
+/* Helper: brings back an anonymous page that zswap paged out.  Returns 0 on
+ * success, -ENOENT if the page wasn't paged out, or some other -error.
+ *
+ * Like __hpf_break_cow(), we do the work while holding the pte_lock. */
+static int __hpf_swap_in(struct proc *p, uintptr_t va, struct vm_region *vmr,
+                         int vm_prot)
+{
+	pte_t pte;
+	int ret;
+
+	spin_lock(&p->pte_lock);
+	if (!vmr_still_maps(vmr, va, vm_prot)) {
+		spin_unlock(&p->pte_lock);
+		return -ESTALE;
+	}
+	pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+	if (!pte_walk_okay(pte) || !pte_is_paged_out(pte)) {
+		spin_unlock(&p->pte_lock);
+		return -ENOENT;
+	}
+	ret = zswap_fault_in_pte(p, pte);
+	spin_unlock(&p->pte_lock);
+	return ret;
+}
+
+/* Fault-around: when we fault on a file page, we also map up to
+ * fault_around_pgs of its neighbors, if they are already in the page cache.
+ * The window is aligned, like a tiny jumbo page, and it never leaves the VMR or
+ * goes past the end of the file.  Anything that isn't cached is left for a
+ * later fault; we never wait on I/O for a neighbor.
+ *
+ * Private mappings get their own copies of the pages, just like in __hpf().
+ * Tune with #mem/fault_around.  0 or 1 turns it off. */
+unsigned int fault_around_pgs = 16;
+
+static struct fault_around_stats {
+	atomic_t			nr_faults;
+	atomic_t			nr_mapped;
+	atomic_t			nr_uncached;
+} fa_stats;
+
+void fault_around_fetch_stats(struct sized_alloc *sza)
+{
+	sza_printf(sza, "Pages        : %u\n", fault_around_pgs);
+	sza_printf(sza, "File faults  : %lu\n",
+	           atomic_read(&fa_stats.nr_faults));
+	sza_printf(sza, "Mapped around: %lu\n",
+	           atomic_read(&fa_stats.nr_mapped));
+	sza_printf(sza, "Not cached   : %lu\n",
+	           atomic_read(&fa_stats.nr_uncached));
+}
+
+/* Helper: maps the cached neighbors of va, which we just mapped for a file
+ * fault.  Caller is in an RCU read-side section, like __hpf(), so we can't
+ * block.  All of the work happens under the pte_lock, which keeps the VMR from
+ * changing and lets us check the PTEs once. */
+static void __hpf_fault_around(struct proc *p, struct vm_region *vmr,
+                               int vm_prot, uintptr_t va, int pte_prot)
+{
+	struct file_or_chan *file = vmr->__vm_foc;
+	struct page_map *pm = foc_to_pm(file);
+	unsigned long nr_file_pgs = nr_pages(foc_get_len(file));
+	unsigned long nr, f_idx;
+	uintptr_t start, end;
+	struct page *page;
+	pte_t pte;
+
+	nr = MIN(READ_ONCE(fault_around_pgs), FAULT_AROUND_MAX_PGS);
+	if (nr <= 1)
+		return;
+	atomic_inc(&fa_stats.nr_faults);
+	start = ROUNDDOWN(va, nr * PGSIZE);
+	end = start + nr * PGSIZE;
+	spin_lock(&p->pte_lock);
+	if (!vmr_still_maps(vmr, va, vm_prot))
+		goto out;
+	start = MAX(start, vmr->vm_base);
+	end = MIN(end, vmr->vm_end);
+	for (uintptr_t va_i = start; va_i < end; va_i += PGSIZE) {
+		if (va_i == va)
+			continue;
+		f_idx = (va_i - vmr->vm_base + vmr->vm_foff) >> PGSHIFT;
+		if (f_idx >= nr_file_pgs)
+			break;
+		pte = pgdir_walk(p->env_pgdir, (void*)va_i, FALSE);
+		if (!pte_walk_okay(pte) || !pte_is_unmapped(pte))
+			continue;
+		if (pm_load_page_nowait(pm, f_idx, &page)) {
+			atomic_inc(&fa_stats.nr_uncached);
+			continue;
+		}
+		if (vmr->vm_flags & MAP_PRIVATE) {
+			if (__copy_and_swap_pmpg(p, &page)) {
+				pm_put_page(page);
+				break;
+			}
+		}
+		if (vm_prot & PROT_EXEC)
+			icache_flush_page((void*)va_i, page2kva(page));
+		/* Same deal with PM refs as in __hpf() */
+		pte_write(pte, page2pa(page), pte_prot);
+		if (page_is_pagemap(page))
+			pm_put_page(page);
+		atomic_inc(&fa_stats.nr_mapped);
+	}
+out:
+	spin_unlock(&p->pte_lock);
+}
+
 /* Returns 0 on success, or an appropriate -error code.
  *
  * Notes: if your TLB caches negative results, you'll need to flush the
@@ -1278,26 +1912,51 @@ static int __hpf(struct proc *p, uintptr_t va, int prot, bool file_ok)
 	struct file_or_chan *file;
 	struct page *a_page;
 	unsigned int f_idx;	/* index of the missing page in the file */
+	int vm_prot;
 	int ret = 0;
 	bool first = TRUE;
 	va = ROUNDDOWN(va,PGSIZE);
 
 refault:
-	/* read access to the VMRs TODO: RCU */
-	spin_lock(&p->vmr_lock);
+	/* Lockless read access to the VMRs.  We can't block until we unlock,
+	 * and the VMR could change under us.  map_page_at_addr() will recheck
+	 * the VMR under the pte_lock. */
+	rcu_read_lock();
 	/* Check the vmr's protection */
-	vmr = find_vmr(p, va);
+	vmr = find_vmr_rcu(p, va);
 	if (!vmr) {			/* not mapped at all */
 		printd("fault: %p not mapped\n", va);
 		ret = -EFAULT;
 		goto out;
 	}
-	if (!(vmr->vm_prot & prot)) {	/* wrong prots for this vmr */
+	vm_prot = ACCESS_ONCE(vmr->vm_prot);
+	if (!(vm_prot & prot)) {	/* wrong prots for this vmr */
 		ret = -EPERM;
 		goto out;
 	}
+	/* Writes to pages we share with a parent or child (from fork()) */
+	if (prot & PROT_WRITE) {
+		ret = __hpf_break_cow(p, va, vmr, vm_prot);
+		if (ret != -ENOENT)
+			goto out;
+		ret = 0;
+	}
 	if (!vmr_has_file(vmr)) {
 		/* No file - just want anonymous memory */
+		ret = __hpf_swap_in(p, va, vmr, vm_prot);
+		if (ret != -ENOENT)
+			goto out;
+		ret = 0;
+		if (vmr_wants_jumbo(vmr, va)) {
+			int pte_prot = (vm_prot & PROT_WRITE) ? PTE_USER_RW :
+			                                        PTE_USER_RO;
+
+			ret = map_jumbo_at_addr(p, ROUNDDOWN(va, PML2_PTE_REACH),
+						pte_prot, vmr, vm_prot);
+			if (ret != -ENOENT)
+				goto out;
+			ret = 0;
+		}
 		if (upage_alloc(p, &a_page, TRUE)) {
 			ret = -ENOMEM;
 			goto out;
@@ -1315,10 +1974,8 @@ refault:
 			printk("[kernel] "
 			       "possible issue with VMR prots on file %s!\n",
 			       foc_to_name(file));
-		/* Load the file's page in the page cache.
-		 * TODO: (BLK) Note, we are holding the mem lock!  We need to
-		 * rewrite this stuff so we aren't hold the lock as excessively
-		 * as we are, and such that we can block and resume later. */
+		/* Load the file's page in the page cache.  If we need to block,
+		 * we'll drop out of RCU and refault. */
 		assert(!PGOFF(va - vmr->vm_base + vmr->vm_foff));
 		f_idx = (va - vmr->vm_base + vmr->vm_foff) >> PGSHIFT;
 		/* This is a racy check - see the comments in fs_file.c */
@@ -1330,9 +1987,13 @@ refault:
 		if (ret) {
 			if (ret != -EAGAIN)
 				goto out;
-			/* keep the file alive after we unlock */
-			foc_incref(file);
-			spin_unlock(&p->vmr_lock);
+			/* keep the file alive after we unlock.  The VMR might
+			 * have been destroyed and dropped its ref already. */
+			if (!kref_get_not_zero(&file->kref, 1)) {
+				rcu_read_unlock();
+				goto refault;
+			}
+			rcu_read_unlock();
 			ret = __hpf_load_page(p, foc_to_pm(file), f_idx,
 					      &a_page, first);
 			first = FALSE;
@@ -1353,14 +2014,16 @@ refault:
 		}
 		/* if this is an executable page, we might have to flush the
 		 * instruction cache if our HW requires it. */
-		if (vmr->vm_prot & PROT_EXEC)
+		if (vm_prot & PROT_EXEC)
 			icache_flush_page((void*)va, page2kva(a_page));
 	}
 	/* update the page table TODO: careful with MAP_PRIVATE etc.  might do
 	 * this separately (file, no file) */
-	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
-	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
-	ret = map_page_at_addr(p, a_page, va, pte_prot);
+	int pte_prot = (vm_prot & PROT_WRITE) ? PTE_USER_RW :
+	               (vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
+	ret = map_page_at_addr(p, a_page, va, pte_prot, vmr, vm_prot);
+	if (!ret && vmr_has_file(vmr))
+		__hpf_fault_around(p, vmr, vm_prot, va, pte_prot);
 	/* fall through, even for errors */
 out_put_pg:
 	/* the VMR's existence in the PM (via the mmap) allows us to have PTE
@@ -1370,7 +2033,10 @@ out_put_pg:
 	if (page_is_pagemap(a_page))
 		pm_put_page(a_page);
 out:
-	spin_unlock(&p->vmr_lock);
+	rcu_read_unlock();
+	/* The VMR changed while we were working on it. */
+	if (ret == -ESTALE)
+		goto refault;
 	return ret;
 }
 
@@ -1411,7 +2077,8 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 			                                          : 0;
 		nr_pgs_this_vmr = MIN(nr_pgs, (vmr->vm_end - va) >> PGSHIFT);
 		if (!vmr_has_file(vmr)) {
-			if (populate_anon_va(p, va, nr_pgs_this_vmr, pte_prot))
+			if (populate_anon_va(p, va, nr_pgs_this_vmr, pte_prot,
+					     vmr->vm_flags & MAP_JUMBO))
 			{
 				/* on any error, we can just bail.  we might be
 				 * underestimating nr_filled. */
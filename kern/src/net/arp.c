@@ -37,14 +37,34 @@
 #include <pmap.h>
 #include <smp.h>
 #include <net/ip.h>
+#include <rculist.h>
+#include <hash_helper.h>
+#include <percpu_counter.h>
 
 /*
  *  address resolution tables
+ *
+ * Entries live in a hash table keyed on the IP address.  Senders look up
+ * resolved entries without locking: they walk the bucket under RCU and copy the
+ * MAC under the entry's seq counter.  Everything else (misses, resolution,
+ * retransmits, timeouts, and the arp file) happens under arp->qlock.  Entries
+ * are never reused in place; they get freed with kfree_rcu.
+ *
+ * The table grows with the number of entries, up to arp->limit entries.  At the
+ * limit, we evict with CLOCK: senders mark entries referenced, and the sweep
+ * gives referenced entries a second chance.
+ *
+ * Every unresolved entry is on the rxmt chain, in order of rtime, which is when
+ * rxmitproc will retransmit its request.  After MAX_MULTICAST_SOLICIT
+ * retransmits with no answer, rxmitproc gives up: it drops the packets waiting
+ * on the entry and frees it.  The next packet for that address starts over.
  */
 
 enum {
-	NHASH = (1 << 6),
-	NCACHE = 256,
+	ARP_INIT_BITS = 6,
+	ARP_DEF_LIMIT = 16384,
+	ARP_MAX_HOLD = 8,		/* packets waiting on one entry */
+	ARP_MAX_AGE = 15 * 60 * 1000,	/* msec a resolution is good for */
 
 	AOK = 1,
 	AWAIT = 2,
@@ -56,169 +76,295 @@ char *arpstate[] = {
 	"WAIT",
 };
 
+struct arp_table {
+	struct rcu_head rcu;
+	unsigned int nr_bits;
+	struct hlist_head buckets[];
+};
+
 /*
  *  one per Fs
  */
 struct arp {
 	qlock_t qlock;
 	struct Fs *f;
-	struct arpent *hash[NHASH];
-	struct arpent cache[NCACHE];
-	struct arpent *rxmt;
+	struct arp_table *tbl;
+	seq_ctr_t tbl_seq;		/* odd while we're resizing tbl */
+	struct siphash_key key;
+	struct list_head lru;		/* every entry, in CLOCK order */
+	unsigned int nr_entries;
+	unsigned int limit;
+	struct list_head rxmt;
 	struct proc *rxmitp;		/* neib sol re-transmit proc */
 	struct rendez rxmtq;
 	struct block *dropf, *dropl;
+	struct Ipifc *dropifc;		/* for icmp unreachables for drops */
+
+	/* hits are counted locklessly, by every sender.  The rest are under
+	 * the qlock. */
+	struct percpu_counter hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long failures;		/* gave up resolving */
+	unsigned long hold_drops;	/* too many packets waiting */
+	unsigned long resizes;
 };
 
-#define haship(s) ((s)[IPaddrlen-1]%NHASH)
-
 int ReTransTimer = RETRANS_TIMER;
 static void rxmitproc(void *v);
 
+static struct arp_table *arp_alloc_table(unsigned int nr_bits)
+{
+	struct arp_table *tbl;
+
+	tbl = kzmalloc(sizeof(struct arp_table) +
+		       (sizeof(struct hlist_head) << nr_bits), MEM_WAIT);
+	tbl->nr_bits = nr_bits;
+	return tbl;
+}
+
 void arpinit(struct Fs *f)
 {
 	f->arp = kzmalloc(sizeof(struct arp), MEM_WAIT);
 	qlock_init(&f->arp->qlock);
 	rendez_init(&f->arp->rxmtq);
 	f->arp->f = f;
-	f->arp->rxmt = NULL;
+	f->arp->tbl = arp_alloc_table(ARP_INIT_BITS);
+	urandom_read(&f->arp->key, sizeof(f->arp->key));
+	INIT_LIST_HEAD(&f->arp->lru);
+	f->arp->limit = ARP_DEF_LIMIT;
+	INIT_LIST_HEAD(&f->arp->rxmt);
 	f->arp->dropf = f->arp->dropl = NULL;
+	percpu_counter_init(&f->arp->hits, 0, MEM_WAIT);
 	ktask("rxmitproc", rxmitproc, f->arp);
 }
 
-/*
- *  create a new arp entry for an ip address.
- */
-static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
-                              int addrxt)
+static struct hlist_head *arpbucket(struct arp *arp, struct arp_table *tbl,
+				    uint8_t *ip)
 {
-	unsigned int t;
-	struct block *next, *xp;
-	struct arpent *a, *e, *f, **l;
-	struct medium *m = ifc->m;
-	int empty;
-
-	/* find oldest entry */
-	e = &arp->cache[NCACHE];
-	a = arp->cache;
-	t = a->utime;
-	for (f = a; f < e; f++) {
-		if (f->utime < t) {
-			t = f->utime;
-			a = f;
-		}
+	uint32_t hv = siphash(ip, IPaddrlen, &arp->key);
+
+	return &tbl->buckets[hv & ((1U << tbl->nr_bits) - 1)];
+}
+
+/* Finds ip's entry for medium type.  Call with the qlock, or from a lockless
+ * reader under rcu_read_lock and the tbl_seq. */
+static struct arpent *arplookup(struct arp *arp, uint8_t *ip,
+				struct medium *type)
+{
+	struct arpent *a;
+
+	hlist_for_each_entry_rcu(a, arpbucket(arp, rcu_dereference(arp->tbl),
+					      ip), hash) {
+		if (a->type == type && ipcmp(ip, a->ip) == 0)
+			return a;
 	}
+	return NULL;
+}
+
+/* Lockless lookup for the common case: ip is resolved.  Copies out the MAC and
+ * returns TRUE if so.  Anything else is a job for arpget's slow path. */
+static bool arp_fastget(struct arp *arp, uint8_t *ip, struct medium *type,
+			uint8_t *mac)
+{
+	struct arpent *a;
+	seq_ctr_t seq;
+	bool ok = FALSE;
+
+	rcu_read_lock();
+	do {
+		seq = ACCESS_ONCE(arp->tbl_seq);
+		rmb();
+		a = arplookup(arp, ip, type);
+	} while (seqctr_retry(seq, ACCESS_ONCE(arp->tbl_seq)));
+	if (a) {
+		do {
+			seq = ACCESS_ONCE(a->seq);
+			rmb();
+			ok = (a->state == AOK) && (NOW - a->ctime <= ARP_MAX_AGE);
+			if (ok)
+				memmove(mac, a->mac, type->maclen);
+		} while (seqctr_retry(seq, ACCESS_ONCE(a->seq)));
+		/* Only write if we need to, so senders don't bounce the line */
+		if (ok && !ACCESS_ONCE(a->referenced))
+			a->referenced = TRUE;
+	}
+	rcu_read_unlock();
+	if (ok)
+		percpu_counter_inc(&arp->hits);
+	return ok;
+}
+
+/* Doubles the table.  Moving an entry changes its hash link, which would send
+ * lockless readers into the wrong bucket, so they spin on tbl_seq until we're
+ * done.  called with arp qlocked */
+static void arp_grow(struct arp *arp)
+{
+	struct arp_table *old = arp->tbl;
+	struct arp_table *new = arp_alloc_table(old->nr_bits + 1);
+	struct arpent *a;
+	struct hlist_node *temp;
+
+	__seq_start_write(&arp->tbl_seq);
+	for (int i = 0; i < (1U << old->nr_bits); i++) {
+		hlist_for_each_entry_safe(a, temp, &old->buckets[i], hash)
+			hlist_add_head(&a->hash, arpbucket(arp, new, a->ip));
+	}
+	rcu_assign_pointer(arp->tbl, new);
+	__seq_end_write(&arp->tbl_seq);
+	arp->resizes++;
+	kfree_rcu(old, rcu);
+}
+
+/* take out of re-transmit chain.  a's link is empty if it isn't on it. */
+static void rxmtunchain(struct arp *arp, struct arpent *a)
+{
+	list_del_init(&a->rxmt_link);
+}
+
+/* put to the end of re-transmit chain */
+static void rxmtchain(struct arp *arp, struct arpent *a)
+{
+	bool empty;
+
+	rxmtunchain(arp, a);
+	empty = list_empty(&arp->rxmt);
+	list_add_tail(&a->rxmt_link, &arp->rxmt);
+	if (empty)
+		rendez_wakeup(&arp->rxmtq);
+}
+
+/* Gets rid of a's waiting packets.  v4 packets just get freed.  v6 packets go
+ * on the drop list, and rxmitproc sends host unreachables for them later, w/o
+ * the arp qlock.  called with arp qlocked */
+static void arpdrophold(struct arp *arp, struct arpent *a)
+{
+	struct block *next, *xp;
 
-	/* dump waiting packets */
 	xp = a->hold;
 	a->hold = NULL;
-
+	a->last = NULL;
+	a->nr_hold = 0;
+	if (!xp)
+		return;
 	if (isv4(a->ip)) {
-		while (xp) {
+		for (; xp; xp = next) {
 			next = xp->list;
 			freeblist(xp);
-			xp = next;
-		}
-	} else {
-		/* queue icmp unreachable for rxmitproc later, w/o arp lock */
-		if (xp) {
-			if (arp->dropl == NULL)
-				arp->dropf = xp;
-			else
-				arp->dropl->list = xp;
-
-			for (next = xp->list; next; next = next->list)
-				xp = next;
-			arp->dropl = xp;
-			rendez_wakeup(&arp->rxmtq);
 		}
+		return;
 	}
+	if (arp->dropl == NULL)
+		arp->dropf = xp;
+	else
+		arp->dropl->list = xp;
+	for (next = xp->list; next; next = next->list)
+		xp = next;
+	arp->dropl = xp;
+	arp->dropifc = a->ifc;
+	rendez_wakeup(&arp->rxmtq);
+}
 
-	/* take out of current chain */
-	l = &arp->hash[haship(a->ip)];
-	for (f = *l; f; f = f->hash) {
-		if (f == a) {
-			*l = a->hash;
-			break;
+/* Unhashes a and frees it, once lockless readers are done with it.
+ *
+ * called with arp qlocked */
+void cleanarpent(struct arp *arp, struct arpent *a)
+{
+	arpdrophold(arp, a);
+	rxmtunchain(arp, a);
+	hlist_del_rcu(&a->hash);
+	list_del(&a->lru);
+	arp->nr_entries--;
+	kfree_rcu(a, rcu);
+}
+
+/* Evicts one entry, CLOCK style.  Every entry we skip loses its referenced bit,
+ * so we find a victim within two trips around.  called with arp qlocked */
+static void arpevict(struct arp *arp)
+{
+	struct arpent *a;
+
+	while (!list_empty(&arp->lru)) {
+		a = list_first_entry(&arp->lru, struct arpent, lru);
+		if (ACCESS_ONCE(a->referenced)) {
+			a->referenced = FALSE;
+			list_move_tail(&a->lru, &arp->lru);
+			continue;
 		}
-		l = &f->hash;
+		cleanarpent(arp, a);
+		arp->evictions++;
+		return;
 	}
+}
 
-	/* insert into new chain */
-	l = &arp->hash[haship(ip)];
-	a->hash = *l;
-	*l = a;
+/*
+ *  create a new arp entry for an ip address.  AWAIT entries wait for a
+ *  resolution (and go on the re-transmit chain).  AOK entries come with their
+ *  mac.
+ *
+ *  called with arp qlocked
+ */
+static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
+			      int state, uint8_t *mac)
+{
+	struct arpent *a;
+	struct medium *m = ifc->m;
+
+	if (arp->nr_entries >= arp->limit)
+		arpevict(arp);
 
+	a = kzmalloc(sizeof(struct arpent), MEM_WAIT);
 	memmove(a->ip, ip, sizeof(a->ip));
-	a->utime = NOW;
-	a->ctime = 0;	/* somewhat of a "last sent time".  0, to trigger a send. */
 	a->type = m;
+	a->state = state;
+	if (state == AOK) {
+		memmove(a->mac, mac, m->maclen);
+		a->ctime = NOW;
+	} else {
+		/* somewhat of a "last sent time".  0, to trigger a send. */
+		a->ctime = 0;
+	}
+	/* New entries get one trip around the clock */
+	a->referenced = TRUE;
 
 	a->rtime = NOW + ReTransTimer;
 	a->rxtsrem = MAX_MULTICAST_SOLICIT;
 	a->ifc = ifc;
 	a->ifcid = ifc->ifcid;
 
-	/* put to the end of re-transmit chain; addrxt is 0 when isv4(a->ip) */
-	if (!ipismulticast(a->ip) && addrxt) {
-		l = &arp->rxmt;
-		empty = (*l == NULL);
-
-		for (f = *l; f; f = f->nextrxt) {
-			if (f == a) {
-				*l = a->nextrxt;
-				break;
-			}
-			l = &f->nextrxt;
-		}
-		for (f = *l; f; f = f->nextrxt) {
-			l = &f->nextrxt;
-		}
-		*l = a;
-		if (empty)
-			rendez_wakeup(&arp->rxmtq);
-	}
-
-	a->nextrxt = NULL;
+	INIT_LIST_HEAD(&a->rxmt_link);
+	if (state == AWAIT && !ipismulticast(a->ip))
+		rxmtchain(arp, a);
 
+	/* The add's wmb publishes the fields we set above */
+	hlist_add_head_rcu(&a->hash, arpbucket(arp, arp->tbl, ip));
+	list_add_tail(&a->lru, &arp->lru);
+	arp->nr_entries++;
+	if (arp->nr_entries > HASH_MAX_LOAD_FACTOR(1U << arp->tbl->nr_bits))
+		arp_grow(arp);
 	return a;
 }
 
-/* called with arp qlocked */
-
-void cleanarpent(struct arp *arp, struct arpent *a)
+/* Puts bp on a's list of packets waiting for the resolution.  If there are too
+ * many already, we drop the oldest.  called with arp qlocked */
+static void arphold(struct arp *arp, struct arpent *a, struct block *bp)
 {
-	struct arpent *f, **l;
-
-	a->utime = 0;
-	a->ctime = 0;
-	a->type = 0;
-	a->state = 0;
-
-	/* take out of current chain */
-	l = &arp->hash[haship(a->ip)];
-	for (f = *l; f; f = f->hash) {
-		if (f == a) {
-			*l = a->hash;
-			break;
-		}
-		l = &f->hash;
-	}
-
-	/* take out of re-transmit chain */
-	l = &arp->rxmt;
-	for (f = *l; f; f = f->nextrxt) {
-		if (f == a) {
-			*l = a->nextrxt;
-			break;
-		}
-		l = &f->nextrxt;
+	struct block *xp;
+
+	if (a->nr_hold >= ARP_MAX_HOLD) {
+		xp = a->hold;
+		a->hold = xp->list;
+		freeblist(xp);
+		a->nr_hold--;
+		arp->hold_drops++;
 	}
-	a->nextrxt = NULL;
-	a->hash = NULL;
-	a->hold = NULL;
-	a->last = NULL;
-	a->ifc = NULL;
+	if (a->hold)
+		a->last->list = bp;
+	else
+		a->hold = bp;
+	a->last = bp;
+	bp->list = NULL;
+	a->nr_hold++;
 }
 
 /*
@@ -230,52 +376,34 @@ void cleanarpent(struct arp *arp, struct arpent *a)
 struct arpent *arpget(struct arp *arp, struct block *bp, int version,
                       struct Ipifc *ifc, uint8_t *ip, uint8_t *mac)
 {
-	int hash, len;
 	struct arpent *a;
 	struct medium *type = ifc->m;
 	uint8_t v6ip[IPaddrlen];
-	uint16_t *s, *d;
 
 	if (version == V4) {
 		v4tov6(v6ip, ip);
 		ip = v6ip;
 	}
 
-	qlock(&arp->qlock);
-	hash = haship(ip);
-	for (a = arp->hash[hash]; a; a = a->hash) {
-		if (ipcmp(ip, a->ip) == 0)
-			if (type == a->type)
-				break;
-	}
+	if (arp_fastget(arp, ip, type, mac))
+		return NULL;
 
-	if (a == NULL) {
-		a = newarp6(arp, ip, ifc, (version != V4));
-		a->state = AWAIT;
-	}
-	a->utime = NOW;
+	qlock(&arp->qlock);
+	arp->misses++;
+	a = arplookup(arp, ip, type);
+	if (a == NULL)
+		a = newarp6(arp, ip, ifc, AWAIT, NULL);
 	if (a->state == AWAIT) {
-		if (bp != NULL) {
-			if (a->hold)
-				a->last->list = bp;
-			else
-				a->hold = bp;
-			a->last = bp;
-			bp->list = NULL;
-		}
+		if (bp != NULL)
+			arphold(arp, a, bp);
 		return a;	/* return with arp qlocked */
 	}
 
-	s = (uint16_t *)a->mac;
-	d = (uint16_t *)mac;
-	len = a->type->maclen / 2;
-	while (len) {
-		*d++ = *s++;
-		len--;
-	}
+	memmove(mac, a->mac, type->maclen);
+	a->referenced = TRUE;
 
 	/* remove old entries */
-	if (NOW - a->ctime > 15 * 60 * 1000)
+	if (NOW - a->ctime > ARP_MAX_AGE)
 		cleanarpent(arp, a);
 
 	qunlock(&arp->qlock);
@@ -300,25 +428,19 @@ struct block *arpresolve(struct arp *arp, struct arpent *a, struct medium *type,
                          uint8_t *mac)
 {
 	struct block *bp;
-	struct arpent *f, **l;
 
-	if (!isv4(a->ip)) {
-		l = &arp->rxmt;
-		for (f = *l; f; f = f->nextrxt) {
-			if (f == a) {
-				*l = a->nextrxt;
-				break;
-			}
-			l = &f->nextrxt;
-		}
-	}
+	rxmtunchain(arp, a);
 
+	__seq_start_write(&a->seq);
 	memmove(a->mac, mac, type->maclen);
 	a->type = type;
 	a->state = AOK;
-	a->utime = NOW;
+	a->ctime = NOW;
+	__seq_end_write(&a->seq);
 	bp = a->hold;
 	a->hold = NULL;
+	a->last = NULL;
+	a->nr_hold = 0;
 	/* brho: it looks like we return the entire hold list, though it might
 	 * be purged by now via some other crazy arp list management.  our
 	 * callers can't handle the arp's b->list stuff. */
@@ -334,7 +456,7 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 	ERRSTACK(1);
 	struct arp *arp;
 	struct route *r;
-	struct arpent *a, *f, **l;
+	struct arpent *a;
 	struct Ipifc *ifc;
 	struct medium *type;
 	struct block *bp, *next;
@@ -368,66 +490,48 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 	type = ifc->m;
 
 	qlock(&arp->qlock);
-	for (a = arp->hash[haship(ip)]; a; a = a->hash) {
-		if (a->type != type || (a->state != AWAIT && a->state != AOK))
-			continue;
-
-		if (ipcmp(a->ip, ip) == 0) {
-			a->state = AOK;
-			memmove(a->mac, mac, type->maclen);
-
-			if (version == V6) {
-				/* take out of re-transmit chain */
-				l = &arp->rxmt;
-				for (f = *l; f; f = f->nextrxt) {
-					if (f == a) {
-						*l = a->nextrxt;
-						break;
-					}
-					l = &f->nextrxt;
-				}
-			}
+	a = arplookup(arp, ip, type);
+	if (a) {
+		__seq_start_write(&a->seq);
+		a->state = AOK;
+		memmove(a->mac, mac, type->maclen);
+		a->ctime = NOW;
+		__seq_end_write(&a->seq);
+
+		rxmtunchain(arp, a);
+		a->ifc = ifc;
+		a->ifcid = ifc->ifcid;
+		bp = a->hold;
+		a->hold = NULL;
+		a->last = NULL;
+		a->nr_hold = 0;
+		if (version == V4)
+			ip += IPv4off;
+		qunlock(&arp->qlock);
 
-			a->ifc = ifc;
-			a->ifcid = ifc->ifcid;
-			bp = a->hold;
-			a->hold = NULL;
-			if (version == V4)
-				ip += IPv4off;
-			a->utime = NOW;
-			a->ctime = a->utime;
-			qunlock(&arp->qlock);
-
-			while (bp) {
-				next = bp->list;
-				if (ifc != NULL) {
-					rlock(&ifc->rwlock);
-					if (waserror()) {
-						runlock(&ifc->rwlock);
-						nexterror();
-					}
-					if (ifc->m != NULL)
-						ifc->m->bwrite(ifc, bp, version,
-							       ip);
-					else
-						freeb(bp);
+		while (bp) {
+			next = bp->list;
+			if (ifc != NULL) {
+				rlock(&ifc->rwlock);
+				if (waserror()) {
 					runlock(&ifc->rwlock);
-					poperror();
-				} else
+					nexterror();
+				}
+				if (ifc->m != NULL)
+					ifc->m->bwrite(ifc, bp, version, ip);
+				else
 					freeb(bp);
-				bp = next;
-			}
-			return;
+				runlock(&ifc->rwlock);
+				poperror();
+			} else
+				freeb(bp);
+			bp = next;
 		}
+		return;
 	}
 
-	if (refresh == 0) {
-		a = newarp6(arp, ip, ifc, 0);
-		a->state = AOK;
-		a->type = type;
-		a->ctime = NOW;
-		memmove(a->mac, mac, type->maclen);
-	}
+	if (refresh == 0)
+		newarp6(arp, ip, ifc, AOK, mac);
 
 	qunlock(&arp->qlock);
 }
@@ -435,10 +539,10 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 int arpwrite(struct Fs *fs, char *s, long len)
 {
 	int n;
+	unsigned long limit;
 	struct route *r;
 	struct arp *arp;
-	struct block *bp;
-	struct arpent *a, *fl, **l;
+	struct arpent *a, *temp;
 	struct medium *m;
 	char *f[4], buf[256];
 	uint8_t ip[IPaddrlen], mac[MAClen];
@@ -456,23 +560,8 @@ int arpwrite(struct Fs *fs, char *s, long len)
 	n = getfields(buf, f, 4, 1, " ");
 	if (strcmp(f[0], "flush") == 0) {
 		qlock(&arp->qlock);
-		for (a = arp->cache; a < &arp->cache[NCACHE]; a++) {
-			memset(a->ip, 0, sizeof(a->ip));
-			memset(a->mac, 0, sizeof(a->mac));
-			a->hash = NULL;
-			a->state = 0;
-			a->utime = 0;
-			while (a->hold != NULL) {
-				bp = a->hold->list;
-				freeblist(a->hold);
-				a->hold = bp;
-			}
-		}
-		memset(arp->hash, 0, sizeof(arp->hash));
-		/* clear all pkts on these lists (rxmt, dropf/l) */
-		arp->rxmt = NULL;
-		arp->dropf = NULL;
-		arp->dropl = NULL;
+		list_for_each_entry_safe(a, temp, &arp->lru, lru)
+			cleanarpent(arp, a);
 		qunlock(&arp->qlock);
 	} else if (strcmp(f[0], "add") == 0) {
 		switch (n) {
@@ -509,35 +598,23 @@ int arpwrite(struct Fs *fs, char *s, long len)
 
 		parseip(ip, f[1]);
 		qlock(&arp->qlock);
-
-		l = &arp->hash[haship(ip)];
-		for (a = *l; a; a = a->hash) {
-			if (memcmp(ip, a->ip, sizeof(a->ip)) == 0) {
-				*l = a->hash;
+		hlist_for_each_entry(a, arpbucket(arp, arp->tbl, ip), hash) {
+			if (ipcmp(ip, a->ip) == 0)
 				break;
-			}
-			l = &a->hash;
-		}
-
-		if (a) {
-			/* take out of re-transmit chain */
-			l = &arp->rxmt;
-			for (fl = *l; fl; fl = fl->nextrxt) {
-				if (fl == a) {
-					*l = a->nextrxt;
-					break;
-				}
-				l = &fl->nextrxt;
-			}
-
-			a->nextrxt = NULL;
-			a->hash = NULL;
-			a->hold = NULL;
-			a->last = NULL;
-			a->ifc = NULL;
-			memset(a->ip, 0, sizeof(a->ip));
-			memset(a->mac, 0, sizeof(a->mac));
 		}
+		if (a)
+			cleanarpent(arp, a);
+		qunlock(&arp->qlock);
+	} else if (strcmp(f[0], "limit") == 0) {
+		if (n != 2)
+			error(EINVAL, "usage: limit NR_ENTRIES");
+		limit = strtoul(f[1], 0, 0);
+		if (!limit || limit > UINT32_MAX)
+			error(EINVAL, "bad arp limit %s", f[1]);
+		qlock(&arp->qlock);
+		arp->limit = limit;
+		while (arp->nr_entries > arp->limit)
+			arpevict(arp);
 		qunlock(&arp->qlock);
 	} else
 		error(EINVAL, ERROR_FIXME);
@@ -547,132 +624,110 @@ int arpwrite(struct Fs *fs, char *s, long len)
 
 enum {
 	Alinelen = 90,
+	Astatlen = 256,
 };
 
 static char *aformat = "%-6.6s %-8.8s %-40.40I %E\n";
 
-int arpread(struct arp *arp, char *p, uint32_t offset, int len)
+/* Snapshots the table and the stats for a reader of the arp file, which reads
+ * the snapshot with readmem.  Free it with kfree. */
+struct sized_alloc *arpopen(struct arp *arp)
 {
+	struct sized_alloc *sza;
 	struct arpent *a;
-	int n;
-	int left = len;
-	int amt;
 
-	if (offset % Alinelen)
-		return 0;
-
-	offset = offset / Alinelen;
-	len = len / Alinelen;
-
-	n = 0;
-	for (a = arp->cache; len > 0 && a < &arp->cache[NCACHE]; a++) {
-		if (a->state == 0)
-			continue;
-		if (offset > 0) {
-			offset--;
-			continue;
-		}
-		len--;
-		left--;
-		qlock(&arp->qlock);
-		amt = snprintf(p + n, left, aformat, a->type->name,
-			       arpstate[a->state],
-		               a->ip, a->mac);
-		n += amt;
-		left -= amt;
-		qunlock(&arp->qlock);
-	}
-
-	return n;
+	qlock(&arp->qlock);
+	sza = sized_kzmalloc(arp->nr_entries * Alinelen + Astatlen, MEM_WAIT);
+	list_for_each_entry(a, &arp->lru, lru)
+		sza_printf(sza, aformat, a->type->name, arpstate[a->state],
+			   a->ip, a->mac);
+	sza_printf(sza, "Entries: %u\n", arp->nr_entries);
+	sza_printf(sza, "Limit: %u\n", arp->limit);
+	sza_printf(sza, "Buckets: %u\n", 1U << arp->tbl->nr_bits);
+	sza_printf(sza, "Resizes: %lu\n", arp->resizes);
+	sza_printf(sza, "Hits: %lld\n", percpu_counter_sum(&arp->hits));
+	sza_printf(sza, "Misses: %lu\n", arp->misses);
+	sza_printf(sza, "Evictions: %lu\n", arp->evictions);
+	sza_printf(sza, "Failures: %lu\n", arp->failures);
+	sza_printf(sza, "HoldDrops: %lu\n", arp->hold_drops);
+	qunlock(&arp->qlock);
+	return sza;
 }
 
+/* Retransmits the request for the first entry on the rxmt chain, if it's time.
+ * Entries that are out of retransmits, or whose interface went away, fail.
+ * Returns how many msec until the next retransmit, or 0 if there's nothing on
+ * the chain. */
 static uint64_t rxmitsols(struct arp *arp)
 {
 	unsigned int sflag;
 	struct block *next, *xp;
-	struct arpent *a, *b, **l;
+	struct arpent *a;
 	struct Fs *f;
-	uint8_t ipsrc[IPaddrlen];
-	struct Ipifc *ifc = NULL;
-	uint64_t nrxt;
+	uint8_t ip[IPaddrlen], ipsrc[IPaddrlen];
+	struct Ipifc *ifc = NULL, *dropifc;
+	int64_t nrxt = 0;
+	bool send = FALSE;
 
 	qlock(&arp->qlock);
 	f = arp->f;
 
-	a = arp->rxmt;
-	if (a == NULL) {
-		nrxt = 0;
-		goto dodrops;	/* return nrxt; */
-	}
-	nrxt = a->rtime - NOW;
-	if (nrxt > 3 * ReTransTimer / 4)
-		goto dodrops;	/* return nrxt; */
-
-	for (; a; a = a->nextrxt) {
+	while ((a = list_first_entry_or_null(&arp->rxmt, struct arpent,
+					     rxmt_link))) {
+		nrxt = a->rtime - NOW;
+		if (nrxt > 3 * ReTransTimer / 4)
+			break;
 		ifc = a->ifc;
-		assert(ifc != NULL);
-		if ((a->rxtsrem <= 0) || !(canrlock(&ifc->rwlock))
-			|| (a->ifcid != ifc->ifcid)) {
-			xp = a->hold;
-			a->hold = NULL;
-
-			if (xp) {
-				if (arp->dropl == NULL)
-					arp->dropf = xp;
-				else
-					arp->dropl->list = xp;
+		if (a->rxtsrem > 0 && canrlock(&ifc->rwlock)) {
+			if (a->ifcid == ifc->ifcid) {
+				send = TRUE;
+				break;
 			}
-
-			cleanarpent(arp, a);
-		} else
-			break;
-	}
-	if (a == NULL)
-		goto dodrops;
-
-	qunlock(&arp->qlock);	/* for icmpns */
-	if ((sflag = ipv6anylocal(ifc, ipsrc)) != SRC_UNSPEC)
-		icmpns(f, ipsrc, sflag, a->ip, TARG_MULTI, ifc->mac);
-
-	runlock(&ifc->rwlock);
-	qlock(&arp->qlock);
-
-	/* put to the end of re-transmit chain */
-	l = &arp->rxmt;
-	for (b = *l; b; b = b->nextrxt) {
-		if (b == a) {
-			*l = a->nextrxt;
-			break;
+			runlock(&ifc->rwlock);
 		}
-		l = &b->nextrxt;
+		arp->failures++;
+		cleanarpent(arp, a);
 	}
-	for (b = *l; b; b = b->nextrxt) {
-		l = &b->nextrxt;
+	if (send) {
+		/* a can go away once we unlock, so do the bookkeeping now */
+		memmove(ip, a->ip, sizeof(ip));
+		a->rxtsrem--;
+		a->rtime = NOW + ReTransTimer;
+		rxmtchain(arp, a);
+		nrxt = list_first_entry(&arp->rxmt, struct arpent,
+					rxmt_link)->rtime - NOW;
 	}
-	*l = a;
-	a->rxtsrem--;
-	a->nextrxt = NULL;
-	a->rtime = NOW + ReTransTimer;
-
-	a = arp->rxmt;
-	if (a == NULL)
+	if (list_empty(&arp->rxmt))
 		nrxt = 0;
 	else
-		nrxt = a->rtime - NOW;
+		nrxt = MAX(nrxt, 1);
 
-dodrops:
 	xp = arp->dropf;
+	dropifc = arp->dropifc;
 	arp->dropf = NULL;
 	arp->dropl = NULL;
+	arp->dropifc = NULL;
 	qunlock(&arp->qlock);
 
+	if (send) {
+		if (isv4(ip)) {
+			if (ifc->m->areq)
+				ifc->m->areq(ifc, ip);
+		} else if ((sflag = ipv6anylocal(ifc, ipsrc)) != SRC_UNSPEC) {
+			icmpns(f, ipsrc, sflag, ip, TARG_MULTI, ifc->mac);
+		}
+		runlock(&ifc->rwlock);
+	}
+
 	for (; xp; xp = next) {
 		next = xp->list;
-		icmphostunr(f, ifc, xp, icmp6_adr_unreach, 1);
+		if (dropifc)
+			icmphostunr(f, dropifc, xp, icmp6_adr_unreach, 1);
+		else
+			freeblist(xp);
 	}
 
 	return nrxt;
-
 }
 
 static int rxready(void *v)
@@ -680,7 +735,7 @@ static int rxready(void *v)
 	struct arp *arp = (struct arp *)v;
 	int x;
 
-	x = ((arp->rxmt != NULL) || (arp->dropf != NULL));
+	x = (!list_empty(&arp->rxmt) || (arp->dropf != NULL));
 
 	return x;
 }
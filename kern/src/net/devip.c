@@ -73,7 +73,7 @@ enum {
 
 	Logtype = 5,
 	Masktype = (1 << Logtype) - 1,
-	Logconv = 12,
+	Logconv = 19,
 	Maskconv = (1 << Logconv) - 1,
 	Shiftconv = Logtype,
 	Logproto = 8,
@@ -81,6 +81,7 @@ enum {
 	Shiftproto = Logtype + Logconv,
 
 	Nfs = 32,
+	Nfreeconvtries = 8,
 	BYPASS_QMAX = 64 * MiB,
 	IPROUTE_LEN = 2 * PGSIZE,
 };
@@ -366,6 +367,7 @@ static struct Fs *ipgetfs(int dev)
 		qlock_init(&f->iprouter.qlock);
 		ip_init(f);
 		arpinit(f);
+		routeinit(f);
 		netloginit(f);
 		for (i = 0; ipprotoinit[i]; i++)
 			ipprotoinit[i] (f);
@@ -471,6 +473,10 @@ static struct chan *ipopen(struct chan *c, int omode)
 		c->synth_buf = kpages_zalloc(IPROUTE_LEN, MEM_WAIT);
 		routeread(f, c->synth_buf, 0, IPROUTE_LEN);
 		break;
+	case Qarp:
+		if (omode & O_READ)
+			c->synth_buf = arpopen(f->arp);
+		break;
 	case Qtopdir:
 	case Qprotodir:
 	case Qconvdir:
@@ -713,6 +719,34 @@ static char *ipchaninfo(struct chan *ch, char *ret, size_t ret_l)
 	return ret;
 }
 
+/*
+ *  closed convs wait on p->free_convs, oldest first, until Fsprotoclone
+ *  reuses them.
+ */
+static void putfreeconv(struct conv *c)
+{
+	struct Proto *p = c->p;
+
+	spin_lock(&p->free_lock);
+	if (!c->on_free_list) {
+		TAILQ_INSERT_TAIL(&p->free_convs, c, free_link);
+		c->on_free_list = TRUE;
+	}
+	spin_unlock(&p->free_lock);
+}
+
+static void unlistfreeconv(struct conv *c)
+{
+	struct Proto *p = c->p;
+
+	spin_lock(&p->free_lock);
+	if (c->on_free_list) {
+		TAILQ_REMOVE(&p->free_convs, c, free_link);
+		c->on_free_list = FALSE;
+	}
+	spin_unlock(&p->free_lock);
+}
+
 static void closeconv(struct conv *cv)
 {
 	ERRSTACK(1);
@@ -748,6 +782,7 @@ static void closeconv(struct conv *cv)
 		undo_proto_qio_bypass(cv);
 	cv->p->close(cv);
 	cv->state = Idle;
+	putfreeconv(cv);
 	qunlock(&cv->qlock);
 	poperror();
 }
@@ -785,6 +820,12 @@ static void ipclose(struct chan *c)
 			c->synth_buf = NULL;
 		}
 		break;
+	case Qarp:
+		if (c->flag & COPEN) {
+			kfree(c->synth_buf);
+			c->synth_buf = NULL;
+		}
+		break;
 	}
 	kfree(((struct IPaux *)c->aux)->owner);
 	kfree(c->aux);
@@ -801,6 +842,7 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 	char *buf, *p;
 	long rv;
 	struct Fs *f;
+	struct sized_alloc *sza;
 	uint32_t offset = off;
 
 	f = ipfs[ch->dev];
@@ -814,7 +856,8 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 	case Qconvdir:
 		return devdirread(ch, a, n, 0, 0, ipgen);
 	case Qarp:
-		return arpread(f->arp, a, offset, n);
+		sza = ch->synth_buf;
+		return readmem(offset, a, n, sza->buf, sza->sofar);
 	case Qndb:
 		return readstr(offset, a, n, f->ndb);
 	case Qiproute:
@@ -917,6 +960,42 @@ static void setladdr(struct conv *c)
 	findlocalip(c->p->f, c->laddr, c->raddr);
 }
 
+/*
+ *  set c's local port, keeping count of the convs holding each port.  a conv
+ *  holds its port until it gets another one, even after the protocol zeroes
+ *  lport on close.  called with the protocol locked.
+ */
+static void holdlport(struct conv *c, uint16_t lport)
+{
+	struct Proto *p = c->p;
+
+	if (p->lport_refs) {
+		if (c->held_lport)
+			p->lport_refs[c->held_lport]--;
+		if (lport)
+			p->lport_refs[lport]++;
+		c->held_lport = lport;
+	}
+	c->lport = lport;
+}
+
+/*
+ *  whether a conv other than c holds lport.  called with the protocol locked.
+ */
+static bool lportheld(struct conv *c, uint16_t lport)
+{
+	struct Proto *p = c->p;
+	int x;
+
+	if (p->lport_refs)
+		return p->lport_refs[lport] > (c->held_lport == lport ? 1 : 0);
+	for (x = 0; x < p->ac; x++) {
+		if (p->conv[x] != c && p->conv[x]->lport == lport)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 /*
  *  set a local port making sure the quad of raddr,rport,laddr,lport is unique
  */
@@ -924,15 +1003,15 @@ static void setluniqueport(struct conv *c, int lport)
 {
 	struct Proto *p;
 	struct conv *xp;
-	int x;
+	int x, n;
 
 	p = c->p;
 
 	qlock(&p->qlock);
-	for (x = 0; x < p->nc; x++) {
+	/* only look for the quad if someone else might be using the port */
+	n = !lport || lportheld(c, lport) ? p->ac : 0;
+	for (x = 0; x < n; x++) {
 		xp = p->conv[x];
-		if (xp == NULL)
-			break;
 		if (xp == c)
 			continue;
 		if ((xp->state == Connected || xp->state == Announced
@@ -945,54 +1024,50 @@ static void setluniqueport(struct conv *c, int lport)
 			error(EFAIL, "address in use");
 		}
 	}
-	c->lport = lport;
+	holdlport(c, lport);
 	qunlock(&p->qlock);
 }
 
 /*
- *  pick a local port and set it
+ *  pick a local port and set it.
+ *  restricted ports must lie between 600 and 1024, and we hand them out in
+ *  order.  other ports are between 5000 and 65535.  we start looking at a
+ *  random one each time, so they are hard to guess.
  */
 static void setlport(struct conv *c)
 {
 	struct Proto *p;
-	uint16_t *pp;
-	int x, found;
+	uint16_t lport;
+	int x;
 
 	p = c->p;
-	if (c->restricted)
-		pp = &p->nextrport;
-	else
-		pp = &p->nextport;
 	qlock(&p->qlock);
-	for (;; (*pp)++) {
-		/*
-		 * Fsproto initialises p->nextport to 0 and the restricted
-		 * ports (p->nextrport) to 600.
-		 * Restricted ports must lie between 600 and 1024.  For the
-		 * initial condition or if the unrestricted port number has
-		 * wrapped round, select a random port between 5000 and 1<<15 to
-		 * start at.
-		 */
-		if (c->restricted) {
-			if (*pp >= 1024)
-				*pp = 600;
-		} else
-			while (*pp < 5000)
-				urandom_read(pp, sizeof(*pp));
-
-		found = 0;
-		for (x = 0; x < p->nc; x++) {
-			if (p->conv[x] == NULL)
+	if (c->restricted) {
+		for (x = 600; x < 1024; x++) {
+			if (p->nextrport < 600 || p->nextrport >= 1024)
+				p->nextrport = 600;
+			lport = p->nextrport++;
+			if (!lportheld(c, lport))
 				break;
-			if (p->conv[x]->lport == *pp) {
-				found = 1;
+		}
+		if (x == 1024) {
+			qunlock(&p->qlock);
+			error(EADDRINUSE, "no free restricted ports");
+		}
+	} else {
+		urandom_read(&lport, sizeof(lport));
+		lport = 5000 + lport % (65536 - 5000);
+		for (x = 5000; x < 65536; x++) {
+			if (!lportheld(c, lport))
 				break;
-			}
+			lport = lport == 65535 ? 5000 : lport + 1;
+		}
+		if (x == 65536) {
+			qunlock(&p->qlock);
+			error(EADDRINUSE, "no free ports");
 		}
-		if (!found)
-			break;
 	}
-	c->lport = (*pp)++;
+	holdlport(c, lport);
 	qunlock(&p->qlock);
 }
 
@@ -1706,14 +1781,21 @@ int Fsproto(struct Fs *f, struct Proto *p)
 		f->t2p[p->ipproto] = p;
 	}
 
+	static_assert(Maxconv <= Maskconv + 1);
+	p->nc = MIN(p->nc, Maxconv);
+	p->maxnc = MIN(MAX(p->maxnc, p->nc), Maxconv);
 	p->qid.type = QTDIR;
 	p->qid.path = QID(f->np, 0, Qprotodir);
 	p->conv = kzmalloc(sizeof(struct conv *) * (p->nc + 1), 0);
 	if (p->conv == NULL)
 		panic("Fsproto");
+	spinlock_init(&p->free_lock);
+	TAILQ_INIT(&p->free_convs);
+	if (p->connect != NULL)
+		p->lport_refs = kzmalloc(sizeof(uint32_t) * (1 << 16),
+					 MEM_WAIT);
 
 	p->x = f->np;
-	p->nextport = 0;
 	p->nextrport = 600;
 	f->p[f->np++] = p;
 
@@ -1729,6 +1811,118 @@ int Fsbuiltinproto(struct Fs *f, uint8_t proto)
 	return f->t2p[proto] != NULL;
 }
 
+/*
+ *  make sure both processes and protocol are done with this conv.  called
+ *  with c qlocked.
+ */
+static bool convidle(struct conv *c)
+{
+	struct Proto *p = c->p;
+
+	return c->inuse == 0 && (p->inuse == NULL || (*p->inuse)(c) == 0);
+}
+
+/*
+ *  try a few convs from the front of the free list.  ones the protocol
+ *  still has (e.g. in TIME_WAIT) go to the back.  ones that were opened
+ *  again come back when they are closed.  returns a qlocked conv.
+ */
+static struct conv *getfreeconv(struct Proto *p)
+{
+	struct conv *c;
+	int i;
+
+	for (i = 0; i < Nfreeconvtries; i++) {
+		spin_lock(&p->free_lock);
+		c = TAILQ_FIRST(&p->free_convs);
+		if (c != NULL) {
+			TAILQ_REMOVE(&p->free_convs, c, free_link);
+			c->on_free_list = FALSE;
+		}
+		spin_unlock(&p->free_lock);
+		if (c == NULL)
+			return NULL;
+		if (canqlock(&c->qlock)) {
+			if (convidle(c))
+				return c;
+			if (c->inuse) {
+				qunlock(&c->qlock);
+				continue;
+			}
+			qunlock(&c->qlock);
+		}
+		putfreeconv(c);
+	}
+	return NULL;
+}
+
+/*
+ *  double the conv array, up to p->maxnc.  lockless readers index the array
+ *  below p->ac, or walk it to its NULL, and some of them block while they
+ *  do.  so we never free the old arrays.  like the convs themselves, they
+ *  are a high water mark: since the array doubles, the old ones add up to
+ *  less than the current one.  called with protocol locked.
+ */
+static bool growconvs(struct Proto *p)
+{
+	struct conv **conv;
+	int nc;
+
+	nc = MIN(p->nc * 2, p->maxnc);
+	if (nc <= p->nc)
+		return FALSE;
+	conv = kzmalloc(sizeof(struct conv *) * (nc + 1), 0);
+	if (conv == NULL)
+		return FALSE;
+	memmove(conv, p->conv, sizeof(struct conv *) * p->nc);
+	wmb();	/* publish the contents before the array */
+	p->conv = conv;
+	p->nc = nc;
+	return TRUE;
+}
+
+/*
+ *  allocate the next conv.  returns it qlocked.  called with protocol
+ *  locked, and there must be room in p->conv.
+ */
+static struct conv *newconv(struct Proto *p)
+{
+	struct conv *c;
+
+	c = kzmalloc(sizeof(struct conv), 0);
+	if (c == NULL)
+		error(ENOMEM, "conv kzmalloc(%d, 0) failed in Fsprotoclone",
+		      sizeof(struct conv));
+	qlock_init(&c->qlock);
+	qlock_init(&c->listenq);
+	rendez_init(&c->cr);
+	rendez_init(&c->listenr);
+	/* already = 0; set to be futureproof */
+	SLIST_INIT(&c->data_taps);
+	SLIST_INIT(&c->listen_taps);
+	spinlock_init(&c->tap_lock);
+	qlock(&c->qlock);
+	c->p = p;
+	c->x = p->ac;
+	if (p->ptclsize != 0) {
+		c->ptcl = kzmalloc(p->ptclsize, 0);
+		if (c->ptcl == NULL) {
+			kfree(c);
+			error(ENOMEM,
+			      "ptcl kzmalloc(%d, 0) failed in Fsprotoclone",
+			      p->ptclsize);
+		}
+	}
+	c->eq = qopen(1024, Qmsg, 0, 0);
+	(*p->create) (c);
+	assert(c->rq && c->wq);
+	/* readers check x < ac before looking in the array */
+	p->conv[c->x] = c;
+	wmb();
+	p->ac++;
+	return c;
+}
+
 /*
  *  called with protocol locked
  */
@@ -1737,59 +1931,26 @@ struct conv *Fsprotoclone(struct Proto *p, char *user)
 	struct conv *c, **pp, **ep;
 
 retry:
-	c = NULL;
-	ep = &p->conv[p->nc];
-	for (pp = p->conv; pp < ep; pp++) {
-		c = *pp;
-		if (c == NULL) {
-			c = kzmalloc(sizeof(struct conv), 0);
-			if (c == NULL)
-				error(ENOMEM,
-				      "conv kzmalloc(%d, 0) failed in Fsprotoclone",
-				      sizeof(struct conv));
-			qlock_init(&c->qlock);
-			qlock_init(&c->listenq);
-			rendez_init(&c->cr);
-			rendez_init(&c->listenr);
-			/* already = 0; set to be futureproof */
-			SLIST_INIT(&c->data_taps);
-			SLIST_INIT(&c->listen_taps);
-			spinlock_init(&c->tap_lock);
-			qlock(&c->qlock);
-			c->p = p;
-			c->x = pp - p->conv;
-			if (p->ptclsize != 0) {
-				c->ptcl = kzmalloc(p->ptclsize, 0);
-				if (c->ptcl == NULL) {
-					kfree(c);
-					error(ENOMEM,
-					      "ptcl kzmalloc(%d, 0) failed in Fsprotoclone",
-					      p->ptclsize);
-				}
+	c = getfreeconv(p);
+	if (c == NULL && (p->ac < p->nc || growconvs(p)))
+		c = newconv(p);
+	if (c == NULL) {
+		/* convs the free list missed, or that we put back */
+		ep = &p->conv[p->ac];
+		for (pp = p->conv; pp < ep; pp++) {
+			c = *pp;
+			if (canqlock(&c->qlock)) {
+				if (convidle(c))
+					break;
+				qunlock(&c->qlock);
 			}
-			*pp = c;
-			p->ac++;
-			c->eq = qopen(1024, Qmsg, 0, 0);
-			(*p->create) (c);
-			assert(c->rq && c->wq);
-			break;
 		}
-		if (canqlock(&c->qlock)) {
-			/*
-			 *  make sure both processes and protocol
-			 *  are done with this Conv
-			 */
-			if (c->inuse == 0 && (p->inuse == NULL ||
-					      (*p->inuse)(c) == 0))
-				break;
-
-			qunlock(&c->qlock);
+		if (pp >= ep) {
+			if (p->gc != NULL && (*p->gc) (p))
+				goto retry;
+			return NULL;
 		}
-	}
-	if (pp >= ep) {
-		if (p->gc != NULL && (*p->gc) (p))
-			goto retry;
-		return NULL;
+		unlistfreeconv(c);
 	}
 
 	c->inuse = 1;
@@ -1800,7 +1961,7 @@ retry:
 	ipmove(c->raddr, IPnoaddr);
 	c->r = NULL;
 	c->rgen = 0;
-	c->lport = 0;
+	holdlport(c, 0);
 	c->rport = 0;
 	c->restricted = 0;
 	c->ttl = MAXTTL;
@@ -1886,7 +2047,7 @@ struct conv *Fsnewcall(struct conv *c, uint8_t *raddr, uint16_t rport,
 	ipmove(nc->raddr, raddr);
 	nc->rport = rport;
 	ipmove(nc->laddr, laddr);
-	nc->lport = lport;
+	holdlport(nc, lport);
 	nc->next = NULL;
 	*l = nc;
 	nc->state = Connected;
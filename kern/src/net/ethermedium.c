@@ -36,6 +36,8 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <hash.h>
+#include <corerequest.h>
 #include <net/ip.h>
 
 typedef struct Etherhdr Etherhdr;
@@ -55,9 +57,11 @@ static uint8_t ipbroadcast[IPaddrlen] = {
 static uint8_t etherbroadcast[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
 static void etherread4(void *a);
+static void ether_rxq_worker(void *a);
 static void etherread6(void *a);
 static void etherbind(struct Ipifc *ifc, int argc, char **argv);
 static void etherunbind(struct Ipifc *ifc);
+static void etherctl(struct Ipifc *ifc, char **argv, int argc);
 static void etherbwrite(struct Ipifc *ifc, struct block *bp, int version,
 			uint8_t *ip);
 static void etheraddmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * ia);
@@ -65,6 +69,7 @@ static void etherremmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * ia);
 static struct block *multicastarp(struct Fs *f, struct arpent *a,
 				  struct medium *m, uint8_t *mac);
 static void sendarp(struct Ipifc *ifc, struct arpent *a);
+static void etherarpreq(struct Ipifc *ifc, uint8_t *ip);
 static void sendgarp(struct Ipifc *ifc, uint8_t * unused_uint8_p_t);
 static int multicastea(uint8_t * ea, uint8_t * ip);
 static void recvarpproc(void *);
@@ -79,11 +84,13 @@ struct medium ethermedium = {
 	.maclen = 6,
 	.bind = etherbind,
 	.unbind = etherunbind,
+	.ctl = etherctl,
 	.bwrite = etherbwrite,
 	.addmulti = etheraddmulti,
 	.remmulti = etherremmulti,
 	.ares = arpenter,
 	.areg = sendgarp,
+	.areq = etherarpreq,
 	.pref2addr = etherpref2addr,
 };
 
@@ -95,14 +102,63 @@ struct medium trexmedium = {
 	.maclen = 6,
 	.bind = etherbind,
 	.unbind = etherunbind,
+	.ctl = etherctl,
 	.bwrite = etherbwrite,
 	.addmulti = etheraddmulti,
 	.remmulti = etherremmulti,
 	.ares = arpenter,
 	.areg = sendgarp,
+	.areq = etherarpreq,
 	.pref2addr = etherpref2addr,
 };
 
+/* Receive steering.  etherread4 pulls every IPv4 packet off the device, but the
+ * expensive part is the rest of the receive path: ipiput4, checksums, TCP
+ * input, etc.  That can run on any core.  We hash each packet's flow and pass
+ * the packet to one of the rx workers, each of which is a ktask pinned to its
+ * own core.  A flow always hashes to the same worker, so its packets stay in
+ * order.
+ *
+ * If the NIC does RSS, we use its hash (Brxhash).  Otherwise we hash the
+ * 4-tuple ourselves.  Only the first IP fragment has the ports, so fragments
+ * get hashed on the addresses and protocol alone.  That keeps a datagram's
+ * fragments together, though maybe not with the rest of its flow.
+ *
+ * The ipifc ctl message "rxqueues N" sets how many workers we steer to.  0
+ * means etherread4 does all of the processing itself, like it used to.
+ * Changing it while packets are in flight can reorder a few of them.
+ * "rxqueues default" goes back to the default.
+ *
+ * Either way, packets go through GRO.  A worker's batch is whatever is in its
+ * queue.  When etherread4 does the processing, its batch is whatever is in the
+ * device's read queue: while GRO holds packets, it reads without blocking, and
+ * flushes once the device runs dry.
+ *
+ * Workers go on the LL cores (other than core 0, where etherread4 runs) first,
+ * then on CG cores.  By default, we only steer to the workers on LL cores.  The
+ * CG cores get handed out to MCPs, and a worker there would preempt the MCP's
+ * vcore for every batch of packets, so spreading onto them is opt-in: it
+ * trades MCP latency for receive throughput.  Today core 0 is the only LL core
+ * (see is_ll_core()), so the default is 0, inline processing, which still does
+ * GRO. */
+enum {
+	ETHER_MAX_RXQS = 16,
+	ETHER_DEF_RXQS = 4,
+	ETHER_RXQ_LIMIT = 256 * 1024,	/* bytes per worker before we drop */
+
+	ETHER_IP4_MINHDR = 20,
+	ETHER_IP_FRAG = 0x3fff,		/* MF and the fragment offset */
+	ETHER_IP_TCP = 6,
+	ETHER_IP_UDP = 17,
+};
+
+struct ether_rxq {
+	int coreid;
+	struct Ipifc *ifc;
+	struct queue *q;
+	struct ipgro gro;
+};
+
 typedef struct Etherrock Etherrock;
 struct Etherrock {
 	struct Fs *f;			/* file system we belong to */
@@ -114,6 +170,11 @@ struct Etherrock {
 	struct chan *cchan4;		/* Control channel for v4 */
 	struct chan *mchan6;		/* Data channel for v6 */
 	struct chan *cchan6;		/* Control channel for v6 */
+	struct ether_rxq rxqs[ETHER_MAX_RXQS];
+	struct ipgro gro;		/* for etherread4, when inline */
+	unsigned int nr_rxq_workers;	/* workers we started */
+	unsigned int nr_ll_rxqs;	/* workers on LL cores, at the front */
+	unsigned int nr_rxqs;		/* workers we steer to */
 };
 
 /*
@@ -165,6 +226,8 @@ static unsigned int parsefeat(char *ptr)
 		feat |= NETF_LRO;
 	if (strstr(ptr, "rxcsum"))
 		feat |= NETF_RXCSUM;
+	if (strstr(ptr, "rxhash"))
+		feat |= NETF_RXHASH;
 	return feat;
 }
 
@@ -180,6 +243,7 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	int fd, cfd, n;
 	char *ptr;
 	Etherrock *er;
+	struct ether_rxq *rxq;
 
 	if (argc < 2)
 		error(EINVAL, ERROR_FIXME);
@@ -291,6 +355,24 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	er->mchan6 = mchan6;
 	er->cchan6 = cchan6;
 	er->f = ifc->conv->p->f;
+	for (int ll = 1; ll >= 0; ll--) {
+		for (int i = 1; i < num_cores; i++) {
+			if (is_ll_core(i) != ll ||
+			    er->nr_rxq_workers == ETHER_MAX_RXQS)
+				continue;
+			er->rxqs[er->nr_rxq_workers++].coreid = i;
+			if (ll)
+				er->nr_ll_rxqs++;
+		}
+	}
+	er->nr_rxqs = MIN(er->nr_ll_rxqs, ETHER_DEF_RXQS);
+	for (int i = 0; i < er->nr_rxq_workers; i++) {
+		rxq = &er->rxqs[i];
+		rxq->ifc = ifc;
+		rxq->q = qopen(ETHER_RXQ_LIMIT, Qmsg, 0, 0);
+		ipgro_init(&rxq->gro, er->f, ifc);
+	}
+	ipgro_init(&er->gro, er->f, ifc);
 	ifc->arg = er;
 
 	kfree(buf);
@@ -298,6 +380,11 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	kfree(dir);
 	poperror();
 
+	/* Idle workers just sleep, so it's fine to start them on CG cores, so
+	 * long as we don't steer to them. */
+	for (int i = 0; i < er->nr_rxq_workers; i++)
+		ktask_on_core("ether_rxq", ether_rxq_worker, &er->rxqs[i],
+			      er->rxqs[i].coreid);
 	ktask("etherread4", etherread4, ifc);
 	ktask("recvarpproc", recvarpproc, ifc);
 	ktask("etherread6", etherread6, ifc);
@@ -340,6 +427,30 @@ static void etherunbind(struct Ipifc *ifc)
 	kfree(er);
 }
 
+/*
+ *  medium-specific ctl messages, called with c locked
+ */
+static void etherctl(struct Ipifc *ifc, char **argv, int argc)
+{
+	Etherrock *er = ifc->arg;
+	unsigned long nr;
+
+	if (strcmp(argv[0], "rxqueues") == 0) {
+		if (argc < 2)
+			error(EINVAL, "usage: rxqueues N|default");
+		if (strcmp(argv[1], "default") == 0)
+			nr = MIN(er->nr_ll_rxqs, ETHER_DEF_RXQS);
+		else
+			nr = strtoul(argv[1], 0, 0);
+		if (nr > er->nr_rxq_workers)
+			error(EINVAL, "rxqueues %lu: only have %u rx workers",
+			      nr, er->nr_rxq_workers);
+		WRITE_ONCE(er->nr_rxqs, nr);
+		return;
+	}
+	error(EINVAL, "unknown command to %s", __func__);
+}
+
 /*
  * copy ethernet address
  */
@@ -419,15 +530,132 @@ static void etherbwrite(struct Ipifc *ifc, struct block *bp, int version,
 	ifc->out++;
 }
 
+/* Hashes bp's flow, for picking an rx worker.  bp->rp is at the IP header. */
+static uint32_t ether_flow_hash(struct block *bp)
+{
+	uint8_t *h = bp->rp;
+	uint32_t hash;
+	int hl;
+
+	if (bp->flag & Brxhash)
+		return bp->rx_hash;
+	if (BHLEN(bp) < ETHER_IP4_MINHDR)
+		return 0;
+	hash = nhgetl(h + 12) * 31 + nhgetl(h + 16);
+	hash = hash * 31 + h[9];
+	hl = (h[0] & 0x0f) << 2;
+	if ((h[9] == ETHER_IP_TCP || h[9] == ETHER_IP_UDP) &&
+	    !(nhgets(h + 6) & ETHER_IP_FRAG) && BHLEN(bp) >= hl + 4)
+		hash = hash * 31 + nhgetl(h + hl);
+	return hash_32(hash, 32);
+}
+
+/* Runs the IPv4 receive path on bp, whose rp is at the IP header, through gro
+ * if we have one.  Might throw. */
+static void ether_iput4(struct Ipifc *ifc, struct block *bp, struct ipgro *gro)
+{
+	ERRSTACK(1);
+	Etherrock *er = ifc->arg;
+
+	if (!canrlock(&ifc->rwlock)) {
+		freeb(bp);
+		return;
+	}
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		nexterror();
+	}
+	if (ifc->lifc == NULL) {
+		freeb(bp);
+	} else {
+		ipifc_trace_block(ifc, bp);
+		if (gro && READ_ONCE(ifc->gro))
+			ipgro_input(gro, bp);
+		else
+			ipiput4(er->f, ifc, bp);
+	}
+	runlock(&ifc->rwlock);
+	poperror();
+}
+
+/* Sends everything gro is holding up the stack.  Might throw. */
+static void ether_gro_flush(struct Ipifc *ifc, struct ipgro *gro)
+{
+	ERRSTACK(1);
+
+	if (!gro->nr_held)
+		return;
+	rlock(&ifc->rwlock);
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		nexterror();
+	}
+	ipgro_flush(gro);
+	runlock(&ifc->rwlock);
+	poperror();
+}
+
+/*
+ *  per-core worker, processes the packets etherread4 steered to it
+ */
+static void ether_rxq_worker(void *a)
+{
+	ERRSTACK(1);
+	struct ether_rxq *rxq = a;
+
+	if (waserror()) {
+		warn("ether_rxq_worker returns, probably unexpectedly\n");
+		poperror();
+		return;
+	}
+	for (;;) {
+		ether_iput4(rxq->ifc, qbread(rxq->q, 128 * 1024), &rxq->gro);
+		/* End of the batch, we're about to block */
+		if (!qlen(rxq->q))
+			ether_gro_flush(rxq->ifc, &rxq->gro);
+	}
+	poperror();
+}
+
+/* Reads the next packet from the device.  If gro is holding packets, we only
+ * take what the device already has.  Once it runs dry, that's the end of the
+ * batch: we flush gro, then block.  Might throw. */
+static struct block *ether_bread4(struct Ipifc *ifc, struct ipgro *gro)
+{
+	ERRSTACK(1);
+	Etherrock *er = ifc->arg;
+	struct chan *c = er->mchan4;
+	struct block *bp;
+
+	if (gro->nr_held) {
+		/* etherread4 is the only reader of mchan4 */
+		c->flag |= O_NONBLOCK;
+		if (!waserror()) {
+			bp = devtab[c->type].bread(c, 128 * 1024, 0);
+			poperror();
+			c->flag &= ~O_NONBLOCK;
+			return bp;
+		}
+		poperror();
+		c->flag &= ~O_NONBLOCK;
+		if (get_errno() != EAGAIN)
+			nexterror();
+		ether_gro_flush(ifc, gro);
+	}
+	return devtab[c->type].bread(c, 128 * 1024, 0);
+}
+
 /*
  *  process to read from the ethernet
  */
 static void etherread4(void *a)
 {
-	ERRSTACK(2);
+	ERRSTACK(1);
 	struct Ipifc *ifc;
 	struct block *bp;
 	Etherrock *er;
+	unsigned int nr_rxqs;
+	struct ether_rxq *rxq;
 
 	ifc = a;
 	er = ifc->arg;
@@ -439,25 +667,19 @@ static void etherread4(void *a)
 		return;
 	}
 	for (;;) {
-		bp = devtab[er->mchan4->type].bread(er->mchan4, 128 * 1024, 0);
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
+		bp = ether_bread4(ifc, &er->gro);
 		ifc->in++;
 		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(er->f, ifc, bp);
+		nr_rxqs = READ_ONCE(er->nr_rxqs);
+		if (!nr_rxqs) {
+			ether_iput4(ifc, bp, &er->gro);
+			continue;
 		}
-		runlock(&ifc->rwlock);
-		poperror();
+		/* Don't let packets we held pass the ones we steer */
+		ether_gro_flush(ifc, &er->gro);
+		rxq = &er->rxqs[ether_flow_hash(bp) % nr_rxqs];
+		if (qpass(rxq->q, bp) < 0)
+			ifc->inerr++;
 	}
 	poperror();
 }
@@ -551,44 +773,44 @@ static void etherremmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * unused)
  *  send an ethernet arp
  *  (only v4, v6 uses the neighbor discovery, rfc1970)
  *
- * May drop packets on stale arps. */
+ * Only the first packet for an entry sends the request.  The arp's rxmitproc
+ * retransmits it after that, and meanwhile arpget holds on to a few packets. */
 static void sendarp(struct Ipifc *ifc, struct arpent *a)
 {
-	int n;
-	struct block *bp;
-	Etherarp *e;
 	Etherrock *er = ifc->arg;
+	uint8_t ip[IPaddrlen];
 
-	/* don't do anything if it's been less than a second since the last.
-	 * ctime is set to 0 for the first time through.  we hold the f->arp
+	/* ctime is set to 0 for the first time through.  we hold the f->arp
 	 * qlock, so there shouldn't be a problem with another arp request for
-	 * this same arpent coming down til we update ctime again. */
-	if (NOW - a->ctime < 1000) {
+	 * this same arpent coming down til we update ctime. */
+	if (a->ctime) {
 		arprelease(er->f->arp, a);
 		return;
 	}
 
-	/* remove all but the last message.  brho: this might be unnecessary.
-	 * we'll eventually send them.  but they should be quite stale at this
-	 * point. */
-	while ((bp = a->hold) != NULL) {
-		if (bp == a->last)
-			break;
-		a->hold = bp->list;
-		freeblist(bp);
-	}
-
-	/* update last sent time */
+	/* update last sent time.  a can be freed once we release it. */
 	a->ctime = NOW;
+	memmove(ip, a->ip, sizeof(ip));
 	arprelease(er->f->arp, a);
 
+	etherarpreq(ifc, ip);
+}
+
+/* Broadcasts an arp request for ip */
+static void etherarpreq(struct Ipifc *ifc, uint8_t *ip)
+{
+	int n;
+	struct block *bp;
+	Etherarp *e;
+	Etherrock *er = ifc->arg;
+
 	n = sizeof(Etherarp);
-	if (n < a->type->mintu)
-		n = a->type->mintu;
+	if (n < ifc->m->mintu)
+		n = ifc->m->mintu;
 	bp = block_alloc(n, MEM_WAIT);
 	memset(bp->rp, 0, n);
 	e = (Etherarp *) bp->rp;
-	memmove(e->tpa, a->ip + IPv4off, sizeof(e->tpa));
+	memmove(e->tpa, ip + IPv4off, sizeof(e->tpa));
 	ipv4local(ifc, e->spa);
 	memmove(e->sha, ifc->mac, sizeof(e->sha));
 	memset(e->d, 0xff, sizeof(e->d));	/* ethernet broadcast */
@@ -610,24 +832,16 @@ static void sendarp(struct Ipifc *ifc, struct arpent *a)
 static void resolveaddr6(struct Ipifc *ifc, struct arpent *a)
 {
 	int sflag;
-	struct block *bp;
 	Etherrock *er = ifc->arg;
-	uint8_t ipsrc[IPaddrlen];
+	uint8_t ip[IPaddrlen], ipsrc[IPaddrlen];
 
-	/* don't do anything if it's been less than a second since the last */
+	/* don't do anything if it's been less than a second since the last.
+	 * arpget limits how many packets wait on a. */
 	if (NOW - a->ctime < ReTransTimer) {
 		arprelease(er->f->arp, a);
 		return;
 	}
 
-	/* remove all but the last message */
-	while ((bp = a->hold) != NULL) {
-		if (bp == a->last)
-			break;
-		a->hold = bp->list;
-		freeblist(bp);
-	}
-
 	/* try to keep it around for a second more */
 	a->ctime = NOW;
 	a->rtime = NOW + ReTransTimer;
@@ -637,10 +851,12 @@ static void resolveaddr6(struct Ipifc *ifc, struct arpent *a)
 	}
 
 	a->rxtsrem--;
+	/* a can be freed once we release it */
+	memmove(ip, a->ip, sizeof(ip));
 	arprelease(er->f->arp, a);
 
 	if ((sflag = ipv6anylocal(ifc, ipsrc)))
-		icmpns(er->f, ipsrc, sflag, a->ip, TARG_MULTI, ifc->mac);
+		icmpns(er->f, ipsrc, sflag, ip, TARG_MULTI, ifc->mac);
 }
 
 /*
@@ -77,6 +77,8 @@ enum {
 	FragOKs,
 	FragFails,
 	FragCreates,
+	GroMerged,
+	GroFlushed,
 
 	Nstats,
 };
@@ -141,6 +143,8 @@ static char *statnames[] = {
 	[FragOKs] "FragOKs",
 	[FragFails] "FragFails",
 	[FragCreates] "FragCreates",
+	[GroMerged] "GroMerged",
+	[GroFlushed] "GroFlushed",
 };
 
 #define BLKIP(xp)	((struct Ip4hdr*)((xp)->rp))
@@ -548,6 +552,294 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	freeblist(bp);
 }
 
+/* Software GRO (generic receive offload).
+ *
+ * A medium's receive loop can pass its IPv4 packets to ipgro_input() instead of
+ * ipiput4().  We hold on to TCP segments for a little while, and merge later,
+ * in-order segments of the same flow into the first one: their payloads go on
+ * the end of the first block's extra_data, and the IP length grows.  The stack
+ * then makes one trip through ipiput4 and tcpiput, with one conv lookup and
+ * maybe one ACK, instead of one per segment.
+ *
+ * We only merge segments with just ACK (and maybe PSH) set, with no IP options
+ * or fragmentation, and with the same ACK, window and TCP options as the first
+ * segment.  The merged packet's checksums are bogus, so we check every segment's
+ * checksums as we go, and mark the result Bipck | Btcpck.
+ *
+ * A flow goes up the stack (a flush) when it gets a PSH, a short segment or
+ * something we can't merge, or when it gets too big or too old.  The receive
+ * loop also calls ipgro_flush() at the end of every batch, i.e. before it
+ * blocks, so nothing waits around for packets that aren't coming.
+ *
+ * We don't merge if we're routing, since the merged packet would be too big to
+ * forward.  The caller holds the ifc's rlock for all of these. */
+enum {
+	IPGRO_TCP = 6,
+	IPGRO_TCP_HDR = 20,
+	IPGRO_TCP_ACK = 0x10,
+	IPGRO_TCP_PSH = 0x08,
+	IPGRO_MAX_LEN = IP_MAX - 1,
+	IPGRO_MAX_USEC = 100,
+};
+
+void ipgro_init(struct ipgro *g, struct Fs *f, struct Ipifc *ifc)
+{
+	memset(g, 0, sizeof(struct ipgro));
+	g->f = f;
+	g->ifc = ifc;
+}
+
+static uint8_t *ipgro_tcphdr(struct block *bp)
+{
+	return bp->rp + IP4HDR;
+}
+
+static int ipgro_tcphlen(struct block *bp)
+{
+	return (ipgro_tcphdr(bp)[12] >> 4) << 2;
+}
+
+/* Checks bp's IP and TCP checksums, if the NIC didn't already. */
+static bool ipgro_csum_ok(struct block *bp)
+{
+	struct Ip4hdr *h = (struct Ip4hdr *)bp->rp;
+	uint8_t *th = ipgro_tcphdr(bp);
+	int length = nhgets(h->length);
+	uint8_t ttl, cksum[2];
+	bool ok;
+
+	if (!(bp->flag & Bipck) && ipcsum(&h->vihl))
+		return FALSE;
+	if (!(bp->flag & Btcpck) && (th[16] || th[17])) {
+		/* Same pseudo-header trick as tcpiput() */
+		ttl = h->ttl;
+		memcpy(cksum, h->cksum, sizeof(cksum));
+		h->ttl = 0;
+		hnputs(h->cksum, length - IP4HDR);
+		ok = !ptclcsum(bp, 8, length - 8);
+		h->ttl = ttl;
+		memcpy(h->cksum, cksum, sizeof(cksum));
+		if (!ok)
+			return FALSE;
+	}
+	bp->flag |= Bipck | Btcpck;
+	return TRUE;
+}
+
+/* Returns bp's TCP payload length if it's a segment we could merge, o/w 0. */
+static int ipgro_seg_len(struct IP *ip, struct block *bp)
+{
+	struct Ip4hdr *h = (struct Ip4hdr *)bp->rp;
+	uint8_t *th = ipgro_tcphdr(bp);
+	int length, thl;
+
+	if (ip->iprouting || bp->next || bp->free)
+		return 0;
+	if (BHLEN(bp) < IP4HDR + IPGRO_TCP_HDR)
+		return 0;
+	if (h->vihl != (IP_VER4 | IP_HLEN4) || h->proto != IPGRO_TCP)
+		return 0;
+	if (nhgets(h->frag) & ~IP_DF)
+		return 0;
+	if ((th[13] & ~IPGRO_TCP_PSH) != IPGRO_TCP_ACK)
+		return 0;
+	length = nhgets(h->length);
+	thl = ipgro_tcphlen(bp);
+	/* Ether pads tiny frames, so length can be less than BLEN */
+	if (length != BLEN(bp) || thl < IPGRO_TCP_HDR ||
+	    BHLEN(bp) < IP4HDR + thl || length <= IP4HDR + thl)
+		return 0;
+	if (!ipgro_csum_ok(bp))
+		return 0;
+	return length - IP4HDR - thl;
+}
+
+/* Returns the held flow bp belongs to, if any.  bp might not be TCP. */
+static struct ipgro_flow *ipgro_find(struct ipgro *g, struct block *bp)
+{
+	struct Ip4hdr *h = (struct Ip4hdr *)bp->rp;
+	struct ipgro_flow *fl;
+
+	if (!g->nr_held || BHLEN(bp) < IP4HDR + 4)
+		return NULL;
+	if (h->vihl != (IP_VER4 | IP_HLEN4) || h->proto != IPGRO_TCP)
+		return NULL;
+	for (int i = 0; i < IPGRO_MAX_FLOWS; i++) {
+		fl = &g->flows[i];
+		if (!fl->head)
+			continue;
+		/* src and dst, then the ports */
+		if (!memcmp(fl->head->rp + 12, bp->rp + 12, 8) &&
+		    !memcmp(ipgro_tcphdr(fl->head), ipgro_tcphdr(bp), 4))
+			return fl;
+	}
+	return NULL;
+}
+
+/* Can bp, a mergeable segment from fl's flow, go on the end of fl? */
+static bool ipgro_can_merge(struct ipgro_flow *fl, struct block *bp, int plen)
+{
+	struct Ip4hdr *hh = (struct Ip4hdr *)fl->head->rp;
+	struct Ip4hdr *h = (struct Ip4hdr *)bp->rp;
+	uint8_t *hth = ipgro_tcphdr(fl->head);
+	uint8_t *th = ipgro_tcphdr(bp);
+
+	if (fl->nr_segs >= IPGRO_MAX_SEGS)
+		return FALSE;
+	if (nhgets(hh->length) + plen > IPGRO_MAX_LEN)
+		return FALSE;
+	if (nhgetl(th + 4) != fl->next_seq)
+		return FALSE;
+	if (hh->tos != h->tos || hh->ttl != h->ttl)
+		return FALSE;
+	/* Header length, ACK, window, and all of the options */
+	if (hth[12] != th[12] || memcmp(hth + 8, th + 8, 4) ||
+	    memcmp(hth + 14, th + 14, 2))
+		return FALSE;
+	return !memcmp(hth + IPGRO_TCP_HDR, th + IPGRO_TCP_HDR,
+		       ipgro_tcphlen(bp) - IPGRO_TCP_HDR);
+}
+
+/* Puts bp's data, starting off bytes in, on the end of head's extra_data, then
+ * frees bp.  Returns -1 and leaves both alone if we can't grow head. */
+static int ipgro_append(struct block *head, struct block *bp, int off)
+{
+	struct extra_bdata *ebd;
+
+	if (block_add_extd(head, head->nr_extra_bufs + 1 + bp->nr_extra_bufs,
+			   MEM_ATOMIC))
+		return -1;
+	/* Like qio's point_to_body(), we point into bp and keep a ref on it */
+	if (BHLEN(bp) > off) {
+		kmalloc_incref(bp);
+		block_append_extra(head, (uintptr_t)bp,
+				   bp->rp + off - (uint8_t*)bp, BHLEN(bp) - off,
+				   MEM_ATOMIC);
+	}
+	for (int i = 0; i < bp->nr_extra_bufs; i++) {
+		ebd = &bp->extra_data[i];
+		if (!ebd->base || !ebd->len)
+			continue;
+		kmalloc_incref((void*)ebd->base);
+		block_append_extra(head, ebd->base, ebd->off, ebd->len,
+				   MEM_ATOMIC);
+	}
+	freeb(bp);
+	return 0;
+}
+
+static void ipgro_flush_flow(struct ipgro *g, struct ipgro_flow *fl)
+{
+	struct block *bp = fl->head;
+
+	fl->head = NULL;
+	g->nr_held--;
+	if (fl->nr_segs > 1)
+		g->f->ip->stats[GroFlushed]++;
+	if (g->ifc->lifc == NULL) {
+		freeb(bp);
+		return;
+	}
+	ipiput4(g->f, g->ifc, bp);
+}
+
+void ipgro_flush(struct ipgro *g)
+{
+	for (int i = 0; i < IPGRO_MAX_FLOWS && g->nr_held; i++) {
+		if (g->flows[i].head)
+			ipgro_flush_flow(g, &g->flows[i]);
+	}
+}
+
+/* Flushes flows we've held too long, so a busy receive loop, which rarely gets
+ * to the end of a batch, doesn't sit on segments. */
+static void ipgro_flush_old(struct ipgro *g)
+{
+	uint64_t now;
+	struct ipgro_flow *fl;
+
+	if (!g->nr_held)
+		return;
+	now = read_tsc();
+	for (int i = 0; i < IPGRO_MAX_FLOWS; i++) {
+		fl = &g->flows[i];
+		if (fl->head && tsc2usec(now - fl->start) > IPGRO_MAX_USEC)
+			ipgro_flush_flow(g, fl);
+	}
+}
+
+/* Returns an unused flow, flushing the oldest one if we have to. */
+static struct ipgro_flow *ipgro_get_flow(struct ipgro *g)
+{
+	struct ipgro_flow *fl, *oldest = NULL;
+
+	for (int i = 0; i < IPGRO_MAX_FLOWS; i++) {
+		fl = &g->flows[i];
+		if (!fl->head)
+			return fl;
+		if (!oldest || fl->start < oldest->start)
+			oldest = fl;
+	}
+	ipgro_flush_flow(g, oldest);
+	return oldest;
+}
+
+/* Takes bp, an IPv4 packet, and either holds it or passes it (and maybe some
+ * held packets) to ipiput4. */
+void ipgro_input(struct ipgro *g, struct block *bp)
+{
+	struct IP *ip = g->f->ip;
+	struct ipgro_flow *fl;
+	struct Ip4hdr *hh;
+	uint8_t *th;
+	int plen;
+	uint32_t seq;
+	bool psh;
+
+	plen = ipgro_seg_len(ip, bp);
+	fl = ipgro_find(g, bp);
+	if (!plen) {
+		/* Keep the flow in order */
+		if (fl)
+			ipgro_flush_flow(g, fl);
+		ipiput4(g->f, g->ifc, bp);
+		goto out;
+	}
+	th = ipgro_tcphdr(bp);
+	seq = nhgetl(th + 4);
+	psh = th[13] & IPGRO_TCP_PSH;
+	if (fl) {
+		if (ipgro_can_merge(fl, bp, plen) &&
+		    !ipgro_append(fl->head, bp, IP4HDR + ipgro_tcphlen(bp))) {
+			ip->stats[GroMerged]++;
+			hh = (struct Ip4hdr *)fl->head->rp;
+			hnputs(hh->length, nhgets(hh->length) + plen);
+			fl->next_seq += plen;
+			fl->nr_segs++;
+			if (psh)
+				ipgro_tcphdr(fl->head)[13] |= IPGRO_TCP_PSH;
+			/* A short segment is the end of a burst */
+			if (psh || plen < fl->seg_len)
+				ipgro_flush_flow(g, fl);
+			goto out;
+		}
+		ipgro_flush_flow(g, fl);
+	}
+	if (psh) {
+		ipiput4(g->f, g->ifc, bp);
+		goto out;
+	}
+	fl = ipgro_get_flow(g);
+	fl->head = bp;
+	fl->next_seq = seq + plen;
+	fl->seg_len = plen;
+	fl->nr_segs = 1;
+	fl->start = read_tsc();
+	g->nr_held++;
+out:
+	ipgro_flush_old(g);
+}
+
 int ipstats(struct Fs *f, char *buf, int len)
 {
 	struct IP *ip;
@@ -38,6 +38,8 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <endian.h>
+#include <rculist.h>
+#include <hash_helper.h>
 
 /*
  *  well known IP addresses
@@ -594,63 +596,205 @@ int parsemac(uint8_t * to, char *from, int len)
 
 /*
  *  hashing tcp, udp, ... connections
- *  gcc weirdness: it gave a bogus result until ron split the %= out.
  */
-uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
+
+/* The tuple we hash, in the order we hash it.  Packed, so there are no holes
+ * for stack garbage to get into the hash. */
+struct ipht_tuple {
+	uint8_t raddr[IPaddrlen];
+	uint8_t laddr[IPaddrlen];
+	uint16_t rport;
+	uint16_t lport;
+} __attribute__((packed));
+
+static uint32_t iphash(struct Ipht *ht, uint8_t *sa, uint16_t sp, uint8_t *da,
+		       uint16_t dp)
 {
-	uint32_t ret;
+	struct ipht_tuple t;
 
-	ret = (sa[IPaddrlen - 1] << 24) ^ (sp << 16) ^ (da[IPaddrlen - 1] << 8)
-		^ dp;
-	ret %= Nhash;
-	return ret;
+	ipmove(t.raddr, sa);
+	ipmove(t.laddr, da);
+	t.rport = sp;
+	t.lport = dp;
+	return siphash(&t, sizeof(t), &ht->key);
 }
 
-void iphtadd(struct Ipht *ht, struct conv *c)
+/* The stripe only depends on the hash, not on the table size, so an entry
+ * stays in the same stripe across resizes. */
+static struct ipht_stripe *ipht_stripe(struct Ipht *ht, uint32_t hv)
 {
-	uint32_t hv;
-	struct Iphash *h;
+	return &ht->stripes[hv % NIPHT_STRIPES];
+}
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	h = kzmalloc(sizeof(*h), 0);
-	if (ipcmp(c->raddr, IPnoaddr) != 0)
-		h->match = IPmatchexact;
-	else {
-		if (ipcmp(c->laddr, IPnoaddr) != 0) {
-			if (c->lport == 0)
-				h->match = IPmatchaddr;
-			else
-				h->match = IPmatchpa;
-		} else {
-			if (c->lport == 0)
-				h->match = IPmatchany;
-			else
-				h->match = IPmatchport;
-		}
+static struct hlist_head *ipht_bucket(struct ipht_table *tbl, uint32_t hv)
+{
+	return &tbl->buckets[hv & ((1U << tbl->nr_bits) - 1)];
+}
+
+static struct ipht_table *ipht_alloc_table(unsigned int nr_bits, int flags)
+{
+	struct ipht_table *tbl;
+
+	tbl = kzmalloc(sizeof(struct ipht_table) +
+		       (sizeof(struct hlist_head) << nr_bits), flags);
+	if (tbl)
+		tbl->nr_bits = nr_bits;
+	return tbl;
+}
+
+void iphtinit(struct Ipht *ht)
+{
+	ht->tbl = ipht_alloc_table(IPHT_INIT_BITS, MEM_WAIT);
+	urandom_read(&ht->key, sizeof(ht->key));
+	atomic_init(&ht->nr_items, 0);
+	qlock_init(&ht->resize_qlock);
+	ht->nr_resizes = 0;
+	for (int i = 0; i < NIPHT_STRIPES; i++) {
+		spinlock_init(&ht->stripes[i].lock);
+		ht->stripes[i].seq = SEQCTR_INITIALIZER;
 	}
-	h->c = c;
+}
+
+/* Doubles the table.  Every entry moves, and lookups can't walk a bucket while
+ * its entries are being moved, so we lock every stripe and hold all of their
+ * seqs odd until the new table is in place.  Lookups spin until then.  This is
+ * rare: the table only grows, and only when it is over its load factor.
+ *
+ * We're called after an add, which might be from the receive path, so we don't
+ * wait: only one caller grows the table, and if we can't get memory, a later
+ * add will try again. */
+static void ipht_grow(struct Ipht *ht)
+{
+	struct ipht_table *old, *new;
+	struct Iphash *h;
+	struct hlist_node *temp;
+
+	if (!canqlock(&ht->resize_qlock))
+		return;
+	/* Only resizers change ht->tbl, and we're the only one. */
+	old = ht->tbl;
+	if (atomic_read(&ht->nr_items) <= HASH_MAX_LOAD_FACTOR(1U << old->nr_bits))
+		goto out;
+	new = ipht_alloc_table(old->nr_bits + 1, MEM_ATOMIC);
+	if (!new)
+		goto out;
+	for (int i = 0; i < NIPHT_STRIPES; i++) {
+		spin_lock(&ht->stripes[i].lock);
+		__seq_start_write(&ht->stripes[i].seq);
+	}
+	for (int i = 0; i < (1U << old->nr_bits); i++) {
+		hlist_for_each_entry_safe(h, temp, &old->buckets[i], link)
+			hlist_add_head(&h->link, ipht_bucket(new, h->hv));
+	}
+	rcu_assign_pointer(ht->tbl, new);
+	ht->nr_resizes++;
+	for (int i = 0; i < NIPHT_STRIPES; i++) {
+		__seq_end_write(&ht->stripes[i].seq);
+		spin_unlock(&ht->stripes[i].lock);
+	}
+	/* Lookups that started before we swapped might still be looking at the
+	 * old table's buckets.  They'll retry, but they need the memory. */
+	kfree_rcu(old, rcu);
+out:
+	qunlock(&ht->resize_qlock);
+}
+
+static int ipht_match_type(uint8_t *raddr, uint8_t *laddr, uint16_t lport)
+{
+	if (ipcmp(raddr, IPnoaddr) != 0)
+		return IPmatchexact;
+	if (ipcmp(laddr, IPnoaddr) != 0)
+		return lport == 0 ? IPmatchaddr : IPmatchpa;
+	return lport == 0 ? IPmatchany : IPmatchport;
+}
 
-	spin_lock(&ht->lock);
-	h->next = ht->tab[hv];
-	ht->tab[hv] = h;
-	spin_unlock(&ht->lock);
+/* Adds h, keyed on the tuple.  If h was already in the table (e.g. a UDP conv
+ * that was bound and then connected), it moves.  Callers serialize adds and
+ * removes of a given entry, usually with the conv's qlock. */
+void __iphtadd(struct Ipht *ht, struct Iphash *h, uint8_t *raddr,
+	       uint16_t rport, uint8_t *laddr, uint16_t lport)
+{
+	struct ipht_stripe *s;
+	struct ipht_table *tbl;
+
+	__iphtrem(ht, h);
+	/* h is unhashed, so no lookup can see these changes until the add, which
+	 * has a wmb. */
+	ipmove(h->raddr, raddr);
+	ipmove(h->laddr, laddr);
+	h->rport = rport;
+	h->lport = lport;
+	h->match = ipht_match_type(raddr, laddr, lport);
+	h->hv = iphash(ht, raddr, rport, laddr, lport);
+
+	s = ipht_stripe(ht, h->hv);
+	spin_lock(&s->lock);
+	/* Adding at the head doesn't disturb lookups, so no seq change */
+	tbl = ht->tbl;
+	hlist_add_head_rcu(&h->link, ipht_bucket(tbl, h->hv));
+	spin_unlock(&s->lock);
+	if (atomic_fetch_and_add(&ht->nr_items, 1) + 1 >
+	    HASH_MAX_LOAD_FACTOR(1U << tbl->nr_bits))
+		ipht_grow(ht);
+}
+
+/* Removes h, if it was in the table.  A lookup could be sitting on h right now,
+ * and if h gets added again, h's next pointer will point into some other
+ * bucket.  The seq change tells that lookup to start over. */
+void __iphtrem(struct Ipht *ht, struct Iphash *h)
+{
+	struct ipht_stripe *s;
+
+	if (hlist_unhashed(&h->link))
+		return;
+	s = ipht_stripe(ht, h->hv);
+	spin_lock(&s->lock);
+	__seq_start_write(&s->seq);
+	hlist_del_init_rcu(&h->link);
+	__seq_end_write(&s->seq);
+	spin_unlock(&s->lock);
+	atomic_dec(&ht->nr_items);
+}
+
+void iphtadd(struct Ipht *ht, struct conv *c)
+{
+	__iphtadd(ht, &c->ipht, c->raddr, c->rport, c->laddr, c->lport);
 }
 
 void iphtrem(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
-	struct Iphash **l, *h;
-
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	spin_lock(&ht->lock);
-	for (l = &ht->tab[hv]; (*l) != NULL; l = &(*l)->next)
-		if ((*l)->c == c) {
-			h = *l;
-			(*l) = h->next;
-			kfree(h);
-			break;
+	__iphtrem(ht, &c->ipht);
+}
+
+/* Finds the entry of type match for exactly this tuple.  Wildcard entries were
+ * added with IPnoaddr and 0 in their wildcard fields, and the caller passes the
+ * same, so one comparison works for all types.  Call with rcu_read_lock. */
+static struct Iphash *ipht_find(struct Ipht *ht, int match, uint8_t *sa,
+				uint16_t sp, uint8_t *da, uint16_t dp)
+{
+	uint32_t hv = iphash(ht, sa, sp, da, dp);
+	struct ipht_stripe *s = ipht_stripe(ht, hv);
+	struct ipht_table *tbl;
+	struct Iphash *h, *ret;
+	seq_ctr_t seq;
+
+	do {
+		seq = ACCESS_ONCE(s->seq);
+		rmb();
+		ret = NULL;
+		tbl = rcu_dereference(ht->tbl);
+		hlist_for_each_entry_rcu(h, ipht_bucket(tbl, hv), link) {
+			if (h->hv != hv || h->match != match)
+				continue;
+			if (sp == h->rport && dp == h->lport &&
+			    ipcmp(sa, h->raddr) == 0 &&
+			    ipcmp(da, h->laddr) == 0) {
+				ret = h;
+				break;
+			}
 		}
-	spin_unlock(&ht->lock);
+	} while (seqctr_retry(seq, ACCESS_ONCE(s->seq)));
+	return ret;
 }
 
 /* look for a matching conversation with the following precedence
@@ -659,90 +803,54 @@ void iphtrem(struct Ipht *ht, struct conv *c)
  *	announced && *,lport
  *	announced && laddr,*
  *	announced && *,*
- */
-struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
-					  uint16_t dp)
+ *
+ * No locks: the entry we return could be removed as soon as we return it, same
+ * as it could be right after a locked lookup.  Convs are never freed, so
+ * callers can still look at it. */
+struct Iphash *__iphtlook(struct Ipht *ht, uint8_t *sa, uint16_t sp,
+			  uint8_t *da, uint16_t dp)
 {
-	uint32_t hv;
 	struct Iphash *h;
-	struct conv *c;
 
-	/* exact 4 pair match (connection) */
-	hv = iphash(sa, sp, da, dp);
-	spin_lock(&ht->lock);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchexact)
-			continue;
-		c = h->c;
-		if (sp == c->rport && dp == c->lport
-		    && ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
-
-	/* match local address and port */
-	hv = iphash(IPnoaddr, 0, da, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchpa)
-			continue;
-		c = h->c;
-		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
-
-	/* match just port */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchport)
-			continue;
-		c = h->c;
-		if (dp == c->lport) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+	rcu_read_lock();
+	h = ipht_find(ht, IPmatchexact, sa, sp, da, dp);
+	if (!h)
+		h = ipht_find(ht, IPmatchpa, IPnoaddr, 0, da, dp);
+	if (!h)
+		h = ipht_find(ht, IPmatchport, IPnoaddr, 0, IPnoaddr, dp);
+	if (!h)
+		h = ipht_find(ht, IPmatchaddr, IPnoaddr, 0, da, 0);
+	if (!h)
+		h = ipht_find(ht, IPmatchany, IPnoaddr, 0, IPnoaddr, 0);
+	rcu_read_unlock();
+	return h;
+}
 
-	/* match local address */
-	hv = iphash(IPnoaddr, 0, da, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchaddr)
-			continue;
-		c = h->c;
-		if (ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
+					  uint16_t dp)
+{
+	struct Iphash *h = __iphtlook(ht, sa, sp, da, dp);
 
-	/* look for something that matches anything */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchany)
-			continue;
-		c = h->c;
-		spin_unlock(&ht->lock);
-		return c;
-	}
-	spin_unlock(&ht->lock);
-	return NULL;
+	return h ? container_of(h, struct conv, ipht) : NULL;
 }
 
 void dump_ipht(struct Ipht *ht)
 {
+	struct ipht_table *tbl;
 	struct Iphash *h;
 	struct conv *c;
 
-	spin_lock(&ht->lock);
-	for (int i = 0; i < Nipht; i++) {
-		for (h = ht->tab[i]; h != NULL; h = h->next) {
-			c = h->c;
+	rcu_read_lock();
+	tbl = rcu_dereference(ht->tbl);
+	printk("%ld convs, %u buckets, %lu resizes\n",
+	       atomic_read(&ht->nr_items), 1U << tbl->nr_bits, ht->nr_resizes);
+	for (int i = 0; i < (1U << tbl->nr_bits); i++) {
+		hlist_for_each_entry_rcu(h, &tbl->buckets[i], link) {
+			c = container_of(h, struct conv, ipht);
 			printk("Conv proto %s, idx %d: local %I:%d, remote %I:%d\n",
 			       c->p->name, c->x, c->laddr, c->lport, c->raddr,
 			       c->rport);
 		}
 	}
-	spin_unlock(&ht->lock);
+	rcu_read_unlock();
 }
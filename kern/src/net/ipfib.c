@@ -0,0 +1,246 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Forwarding information base: a multibit trie for longest-prefix-match route
+ * lookups.
+ *
+ * The route trees in iproute.c are still the authority on which routes exist.
+ * The FIB is built from them and only answers "which route covers this
+ * address", which is all v4lookup() and v6lookup() need.
+ *
+ * The trie is DIR-16-8-8 style: the root node is indexed by the first 16 bits
+ * of the address, and every level below it by the next 8 bits.  Prefixes are
+ * expanded to their level's stride (a /20 fills 16 slots of a level-1 node) and
+ * leaf-pushed: every slot holds the longest prefix that covers it, including
+ * the slots of child nodes.  A lookup is one array index per level, with no
+ * backtracking and no comparisons.  IPv4 lookups touch at most three nodes.
+ *
+ * A slot is either a struct route pointer (maybe NULL), or a pointer to a child
+ * node tagged with FIB_CHILD.  Each node also has a plen[] array, parallel to
+ * the slots, with the prefix length of each slot's route, plus one so that 0
+ * means "no route".  Only writers look at plen[]: a new prefix takes over the
+ * slots with shorter prefixes and leaves the longer ones alone.
+ *
+ * Lookups are lockless: callers hold rcu_read_lock().  Writers are serialized
+ * by the caller (the routelock).  They fill in new nodes before publishing
+ * them, and free nodes with RCU once they no longer hold any prefixes of their
+ * own.  Routes are type-stable (see freeroute()), so a lookup racing with a
+ * removal gets a stale route, never freed memory.  Writers also bump the FIB's
+ * seq counter, and the rt.gen of every route that loses slots, so that callers
+ * that cache lookups can tell when their route went stale. */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <rcu.h>
+#include <net/ip.h>
+
+#define FIB_CHILD		1UL
+#define FIB_ROOT_BITS		16
+#define FIB_LEVEL_BITS		8
+#define FIB_ROOT_SLOTS		(1 << FIB_ROOT_BITS)
+#define FIB_LEVEL_SLOTS		(1 << FIB_LEVEL_BITS)
+/* The root covers two bytes of the key, then one level per byte. */
+#define FIB_MAX_DEPTH		(IPaddrlen - 2)
+
+struct fib_node {
+	struct rcu_head			rcu;
+	/* Non-child slots with prefixes that end in this node's stride */
+	unsigned int			nr_own;
+	unsigned int			nr_children;
+	uint8_t				*plen;
+	uintptr_t			slots[];
+};
+
+static size_t fib_node_size(unsigned int nr_slots)
+{
+	return sizeof(struct fib_node) +
+	       nr_slots * (sizeof(uintptr_t) + sizeof(uint8_t));
+}
+
+/* Bits [fib_start_bit(d), fib_end_bit(d)) of the key index nodes at depth d. */
+static int fib_start_bit(int depth)
+{
+	return depth ? FIB_ROOT_BITS + (depth - 1) * FIB_LEVEL_BITS : 0;
+}
+
+static int fib_end_bit(int depth)
+{
+	return FIB_ROOT_BITS + depth * FIB_LEVEL_BITS;
+}
+
+static unsigned int fib_index(const uint8_t *key, int depth)
+{
+	return depth ? key[depth + 1] : (key[0] << 8) | key[1];
+}
+
+/* Whether a slot with stored plen sp holds a prefix that ends in the stride of
+ * a node at depth, as opposed to one inherited from above. */
+static bool fib_own(uint8_t sp, int depth)
+{
+	return sp > fib_start_bit(depth) + 1;
+}
+
+static struct fib_node *fib_node_alloc(struct fib *fib, unsigned int nr_slots,
+				       uintptr_t e, uint8_t sp)
+{
+	struct fib_node *n = kzmalloc(fib_node_size(nr_slots), MEM_WAIT);
+
+	n->plen = (uint8_t*)&n->slots[nr_slots];
+	for (int i = 0; i < nr_slots; i++) {
+		n->slots[i] = e;
+		n->plen[i] = sp;
+	}
+	fib->nr_nodes++;
+	return n;
+}
+
+static struct fib_node *fib_child(uintptr_t e)
+{
+	return (struct fib_node*)(e & ~FIB_CHILD);
+}
+
+void fib_init(struct fib *fib)
+{
+	fib->root = fib_node_alloc(fib, FIB_ROOT_SLOTS, 0, 0);
+}
+
+static void __fib_destroy(struct fib_node *n, unsigned int nr_slots)
+{
+	for (int i = 0; i < nr_slots; i++) {
+		if (n->slots[i] & FIB_CHILD)
+			__fib_destroy(fib_child(n->slots[i]), FIB_LEVEL_SLOTS);
+	}
+	kfree(n);
+}
+
+/* Frees the whole trie.  The caller makes sure there are no readers. */
+void fib_destroy(struct fib *fib)
+{
+	__fib_destroy(fib->root, FIB_ROOT_SLOTS);
+	fib->root = NULL;
+	fib->nr_nodes = 0;
+	fib->nr_prefixes = 0;
+}
+
+size_t fib_memory(struct fib *fib)
+{
+	return fib_node_size(FIB_ROOT_SLOTS) +
+	       (fib->nr_nodes - 1) * fib_node_size(FIB_LEVEL_SLOTS);
+}
+
+/* Returns the route for the longest prefix matching key, which is an address
+ * in network order.  Caller holds rcu_read_lock. */
+struct route *fib_lookup(struct fib *fib, const uint8_t *key)
+{
+	struct fib_node *n = rcu_dereference(fib->root);
+	uintptr_t e = ACCESS_ONCE(n->slots[(key[0] << 8) | key[1]]);
+
+	for (int i = 2; e & FIB_CHILD; i++)
+		e = ACCESS_ONCE(fib_child(e)->slots[key[i]]);
+	return (struct route*)e;
+}
+
+/* Points slot i of n, and every slot below it that doesn't have a longer
+ * prefix than plen, at r.  sp is r's stored plen. */
+static void fib_push_slot(struct fib_node *n, int depth, unsigned int i,
+			  int plen, struct route *r, uint8_t sp)
+{
+	uintptr_t e = n->slots[i];
+	struct route *old;
+
+	if (e & FIB_CHILD) {
+		for (int j = 0; j < FIB_LEVEL_SLOTS; j++)
+			fib_push_slot(fib_child(e), depth + 1, j, plen, r, sp);
+		return;
+	}
+	if (n->plen[i] > plen + 1)
+		return;
+	old = (struct route*)e;
+	if (old && old != r)
+		old->rt.gen++;
+	n->nr_own -= fib_own(n->plen[i], depth);
+	n->nr_own += fib_own(sp, depth);
+	n->plen[i] = sp;
+	WRITE_ONCE(n->slots[i], (uintptr_t)r);
+}
+
+/* Sets the slots for the prefix key/plen, and the slots below them, to r,
+ * unless they have longer prefixes.  Inserting sets them to the prefix's own
+ * route.  Removing sets them to the next longest prefix that covers key/plen,
+ * and then frees any nodes that were only there for the removed prefix. */
+static void fib_set(struct fib *fib, const uint8_t *key, int plen,
+		    struct route *r, int r_plen, bool insert)
+{
+	struct fib_node *path[FIB_MAX_DEPTH];
+	unsigned int path_idx[FIB_MAX_DEPTH];
+	struct fib_node *n = fib->root, *child;
+	unsigned int i, nr_slots;
+	int depth = 0;
+	uintptr_t e;
+
+	while (plen > fib_end_bit(depth)) {
+		i = fib_index(key, depth);
+		e = n->slots[i];
+		if (!(e & FIB_CHILD)) {
+			/* Nothing this long was ever inserted here */
+			if (!insert)
+				return;
+			child = fib_node_alloc(fib, FIB_LEVEL_SLOTS, e,
+					       n->plen[i]);
+			n->nr_own -= fib_own(n->plen[i], depth);
+			n->nr_children++;
+			e = (uintptr_t)child | FIB_CHILD;
+			/* Readers can see child as soon as we write the slot */
+			wmb();
+			WRITE_ONCE(n->slots[i], e);
+		}
+		path[depth] = n;
+		path_idx[depth] = i;
+		depth++;
+		n = fib_child(e);
+	}
+	nr_slots = 1 << (fib_end_bit(depth) - plen);
+	i = fib_index(key, depth) & ~(nr_slots - 1);
+	for (int j = 0; j < nr_slots; j++)
+		fib_push_slot(n, depth, i + j, plen, r, r_plen + 1);
+
+	/* Every slot of a node with no own prefixes and no children holds the
+	 * same inherited route, so its parent's slot can hold it instead. */
+	while (depth && !n->nr_own && !n->nr_children) {
+		depth--;
+		child = n;
+		n = path[depth];
+		i = path_idx[depth];
+		n->plen[i] = child->plen[0];
+		n->nr_own += fib_own(n->plen[i], depth);
+		n->nr_children--;
+		WRITE_ONCE(n->slots[i], child->slots[0]);
+		fib->nr_nodes--;
+		kfree_rcu(child, rcu);
+	}
+}
+
+/* Adds the prefix key/plen, with route r.  Key is in network order, and plen
+ * must be new: the caller merges duplicate routes. */
+void fib_insert(struct fib *fib, const uint8_t *key, int plen,
+		struct route *r)
+{
+	__seq_start_write(&fib->seq);
+	fib_set(fib, key, plen, r, plen, TRUE);
+	__seq_end_write(&fib->seq);
+	fib->nr_prefixes++;
+}
+
+/* Removes the prefix key/plen.  cover is the route for the next longest prefix
+ * covering key/plen, of length cover_plen, or NULL and -1 for none. */
+void fib_remove(struct fib *fib, const uint8_t *key, int plen,
+		struct route *cover, int cover_plen)
+{
+	__seq_start_write(&fib->seq);
+	fib_set(fib, key, plen, cover, cover_plen, FALSE);
+	__seq_end_write(&fib->seq);
+	fib->nr_prefixes--;
+}
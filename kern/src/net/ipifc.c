@@ -169,6 +169,7 @@ static void ipifcbind(struct conv *c, char **argv, int argc)
 	ifc->m = m;
 	ifc->mintu = ifc->m->mintu;
 	ifc->maxtu = ifc->m->maxtu;
+	ifc->gro = 1;
 	if (ifc->m->unbindonclose == 0)
 		ifc->conv->inuse++;
 	ifc->rp.mflag = 0;	// default not managed
@@ -219,6 +220,7 @@ static void ipifcunbind(struct Ipifc *ifc)
 	memset(ifc->dev, 0, sizeof(ifc->dev));
 	ifc->arg = NULL;
 	ifc->reassemble = 0;
+	ifc->gro = 0;
 
 	/* close queues to stop queuing of packets */
 	qclose(ifc->conv->rq);
@@ -342,6 +344,7 @@ static void ipifccreate(struct conv *c)
 	ifc->unbinding = 0;
 	ifc->m = NULL;
 	ifc->reassemble = 0;
+	ifc->gro = 0;
 	rwinit(&ifc->rwlock);
 	/* These are never used, but we might need them if we ever do "unbind on
 	 * the fly" (see ip.h).  Not sure where the code went that used these
@@ -383,6 +386,18 @@ static void ipifcsetmtu(struct Ipifc *ifc, char **argv, int argc)
 	ifc->maxtu = mtu;
 }
 
+static void ipifcsetgro(struct Ipifc *ifc, char **argv, int argc)
+{
+	if (argc < 2)
+		error(EINVAL, "usage: gro on|off");
+	if (strcmp(argv[1], "on") == 0)
+		WRITE_ONCE(ifc->gro, 1);
+	else if (strcmp(argv[1], "off") == 0)
+		WRITE_ONCE(ifc->gro, 0);
+	else
+		error(EINVAL, "usage: gro on|off");
+}
+
 /*
  *  add an address to an interface.
  */
@@ -829,6 +844,8 @@ static void ipifcctl(struct conv *c, char **argv, int argc)
 		ipifcsetmtu(ifc, argv, argc);
 	else if (strcmp(argv[0], "reassemble") == 0)
 		ifc->reassemble = 1;
+	else if (strcmp(argv[0], "gro") == 0)
+		ipifcsetgro(ifc, argv, argc);
 	else if (strcmp(argv[0], "iprouting") == 0)
 		ipifc_iprouting(c->p->f, argv, argc);
 	else if (strcmp(argv[0], "addpref6") == 0)
@@ -839,6 +856,8 @@ static void ipifcctl(struct conv *c, char **argv, int argc)
 		ipifcsendra6(ifc, argv, argc);
 	else if (strcmp(argv[0], "recvra6") == 0)
 		ipifcrecvra6(ifc, argv, argc);
+	else if (ifc->m != NULL && ifc->m->ctl != NULL)
+		ifc->m->ctl(ifc, argv, argc);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -36,17 +36,18 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <rcu.h>
 #include <net/ip.h>
 
 static void walkadd(struct Fs *, struct route **, struct route *);
 static void addnode(struct Fs *, struct route **, struct route *);
 static void calcd(struct route *);
+struct route **looknode(struct route **, struct route *);
 
 /* these are used for all instances of IP */
 struct route *v4freelist;
 struct route *v6freelist;
 rwlock_t routelock;
-uint32_t v4routegeneration, v6routegeneration;
 
 /*
  * TODO: Change this to a proper release.
@@ -67,6 +68,8 @@ static void freeroute(struct route *r)
 
 	r->rt.left = NULL;
 	r->rt.right = NULL;
+	/* The FIB no longer points at r, but convs may have it cached. */
+	r->rt.gen++;
 	if (r->rt.type & Rv4)
 		l = &v4freelist;
 	else
@@ -80,6 +83,7 @@ static struct route *allocroute(int type)
 	struct route *r;
 	int n;
 	struct route **l;
+	uint32_t gen;
 
 	if (type & Rv4) {
 		n = sizeof(struct RouteTree) + sizeof(struct V4route);
@@ -97,7 +101,11 @@ static struct route *allocroute(int type)
 		if (r == NULL)
 			panic("out of routing nodes");
 	}
+	/* Routes are type-stable, and lockless lookups may still be looking at
+	 * r or have it cached.  Keep its gen moving forward. */
+	gen = r->rt.gen;
 	memset(r, 0, n);
+	r->rt.gen = gen;
 	r->rt.type = type;
 	r->rt.ifc = NULL;
 	kref_init(&r->rt.kref, route_release, 1);
@@ -322,11 +330,193 @@ static void addnode(struct Fs *f, struct route **cur, struct route *new)
 }
 
 #define	V4H(a)	((a&0x07ffffff)>>(32-Lroot-5))
+#define	V6H(a)	(((a)[IPllen-1] & 0x07ffffff)>>(32-Lroot-5))
+#define ISDFLT(a, mask, tag) ((ipcmp((a),v6Unspecified)==0) && (ipcmp((mask),v6Unspecified)==0) && (strcmp((tag), "ra")!=0))
+
+void routeinit(struct Fs *f)
+{
+	fib_init(&f->v4fib);
+	fib_init(&f->v6fib);
+}
+
+/*
+ *  prefix length of a range: the leading bits its ends have in common.  the
+ *  FIB treats a route with a non-contiguous mask as that prefix.
+ */
+static int v4plen(struct route *r)
+{
+	uint32_t x = r->v4.address ^ r->v4.endaddress;
+
+	return x ? __builtin_clz(x) : 32;
+}
+
+static int v6plen(struct route *r)
+{
+	uint32_t x;
+	int h;
+
+	for (h = 0; h < IPllen; h++) {
+		x = r->v6.address[h] ^ r->v6.endaddress[h];
+		if (x)
+			return h * 32 + __builtin_clz(x);
+	}
+	return IPllen * 32;
+}
+
+/*
+ *  a route that spans several trees has a copy in each.  the FIB points at
+ *  the copy in the tree of the route's first address.
+ */
+static struct route *v4canonical(struct Fs *f, struct route *r)
+{
+	struct route **p;
+
+	p = looknode(&f->v4root[V4H(r->v4.address)], r);
+	return p ? *p : NULL;
+}
+
+static struct route *v6canonical(struct Fs *f, struct route *r)
+{
+	struct route **p;
+
+	p = looknode(&f->v6root[V6H(r->v6.address)], r);
+	return p ? *p : NULL;
+}
+
+/*
+ *  find the smallest range in the tree containing la, not looking
+ *  inside stop
+ */
+static struct route *v4treelookup(struct route *p, uint32_t la,
+				  struct route *stop)
+{
+	struct route *q;
+
+	q = NULL;
+	while (p && p != stop)
+		if (la >= p->v4.address) {
+			if (la <= p->v4.endaddress) {
+				q = p;
+				p = p->rt.mid;
+			} else
+				p = p->rt.right;
+		} else
+			p = p->rt.left;
+	return q;
+}
+
+static struct route *v6treelookup(struct route *p, uint32_t *la,
+				  struct route *stop)
+{
+	struct route *q;
+	uint32_t x, y;
+	int h;
+
+	q = NULL;
+	while (p && p != stop) {
+		for (h = 0; h < IPllen; h++) {
+			x = la[h];
+			y = p->v6.address[h];
+			if (x == y)
+				continue;
+			if (x < y) {
+				p = p->rt.left;
+				goto next;
+			}
+			break;
+		}
+		for (h = 0; h < IPllen; h++) {
+			x = la[h];
+			y = p->v6.endaddress[h];
+			if (x == y)
+				continue;
+			if (x > y) {
+				p = p->rt.right;
+				goto next;
+			}
+			break;
+		}
+		q = p;
+		p = p->rt.mid;
+next:	;
+	}
+	return q;
+}
+
+/*
+ *  called with routelock held, after adding r to the trees.  if r was
+ *  merged into an existing route, that route is already in the FIB, but it
+ *  may have changed.
+ */
+static void v4fibadd(struct Fs *f, struct route *r, struct route *added)
+{
+	uint8_t key[IPv4addrlen];
+	struct route *p;
+
+	p = v4canonical(f, r);
+	if (p == NULL)
+		return;
+	if (p != added) {
+		p->rt.gen++;
+		return;
+	}
+	hnputl(key, p->v4.address);
+	fib_insert(&f->v4fib, key, v4plen(p), p);
+}
+
+static void v6fibadd(struct Fs *f, struct route *r, struct route *added)
+{
+	uint8_t key[IPaddrlen];
+	struct route *p;
+	int h;
+
+	p = v6canonical(f, r);
+	if (p == NULL)
+		return;
+	if (p != added) {
+		p->rt.gen++;
+		return;
+	}
+	for (h = 0; h < IPllen; h++)
+		hnputl(key + 4 * h, p->v6.address[h]);
+	fib_insert(&f->v6fib, key, v6plen(p), p);
+}
+
+/*
+ *  called with routelock held, before removing p from tree h, where p is the
+ *  canonical copy.  its FIB slots go to the next smallest range around it.
+ */
+static void v4fibdel(struct Fs *f, int h, struct route *p)
+{
+	uint8_t key[IPv4addrlen];
+	struct route *q;
+
+	q = v4treelookup(f->v4root[h], p->v4.address, p);
+	if (q)
+		q = v4canonical(f, q);
+	hnputl(key, p->v4.address);
+	fib_remove(&f->v4fib, key, v4plen(p), q, q ? v4plen(q) : -1);
+}
+
+static void v6fibdel(struct Fs *f, int h, struct route *p)
+{
+	uint8_t key[IPaddrlen];
+	struct route *q;
+	int i;
+
+	q = v6treelookup(f->v6root[h], p->v6.address, p);
+	if (q)
+		q = v6canonical(f, q);
+	for (i = 0; i < IPllen; i++)
+		hnputl(key + 4 * i, p->v6.address[i]);
+	fib_remove(&f->v6fib, key, v6plen(p), q, q ? v6plen(q) : -1);
+}
 
 void v4addroute(struct Fs *f, char *tag, uint8_t *a, uint8_t *mask,
 		uint8_t *gate, int type)
 {
-	struct route *p;
+	struct route *p, *added;
+	struct route rt;
 	uint32_t sa;
 	uint32_t m;
 	uint32_t ea;
@@ -335,7 +525,12 @@ void v4addroute(struct Fs *f, char *tag, uint8_t *a, uint8_t *mask,
 	m = nhgetl(mask);
 	sa = nhgetl(a) & m;
 	ea = sa | ~m;
+	rt.v4.address = sa;
+	rt.v4.endaddress = ea;
+	rt.rt.type = Rv4;
 
+	added = NULL;
+	wlock(&routelock);
 	eh = V4H(ea);
 	for (h = V4H(sa); h <= eh; h++) {
 		p = allocroute(Rv4 | type);
@@ -343,28 +538,27 @@ void v4addroute(struct Fs *f, char *tag, uint8_t *a, uint8_t *mask,
 		p->v4.endaddress = ea;
 		memmove(p->v4.gate, gate, sizeof(p->v4.gate));
 		memmove(p->rt.tag, tag, sizeof(p->rt.tag));
+		if (h == V4H(sa))
+			added = p;
 
-		wlock(&routelock);
 		addnode(f, &f->v4root[h], p);
 		while ((p = f->queue)) {
 			f->queue = p->rt.mid;
 			walkadd(f, &f->v4root[h], p->rt.left);
 			freeroute(p);
 		}
-		wunlock(&routelock);
 	}
-	v4routegeneration++;
+	v4fibadd(f, &rt, added);
+	wunlock(&routelock);
 
 	ipifcaddroute(f, Rv4, a, mask, gate, type);
 }
 
-#define	V6H(a)	(((a)[IPllen-1] & 0x07ffffff)>>(32-Lroot-5))
-#define ISDFLT(a, mask, tag) ((ipcmp((a),v6Unspecified)==0) && (ipcmp((mask),v6Unspecified)==0) && (strcmp((tag), "ra")!=0))
-
 void v6addroute(struct Fs *f, char *tag, uint8_t *a, uint8_t *mask,
 		uint8_t *gate, int type)
 {
-	struct route *p;
+	struct route *p, *added;
+	struct route rt;
 	uint32_t sa[IPllen], ea[IPllen];
 	uint32_t x, y;
 	int h, eh;
@@ -380,7 +574,12 @@ void v6addroute(struct Fs *f, char *tag, uint8_t *a, uint8_t *mask,
 		sa[h] = x & y;
 		ea[h] = x | ~y;
 	}
+	memmove(rt.v6.address, sa, IPaddrlen);
+	memmove(rt.v6.endaddress, ea, IPaddrlen);
+	rt.rt.type = 0;
 
+	added = NULL;
+	wlock(&routelock);
 	eh = V6H(ea);
 	for (h = V6H(sa); h <= eh; h++) {
 		p = allocroute(type);
@@ -388,17 +587,18 @@ void v6addroute(struct Fs *f, char *tag, uint8_t *a, uint8_t *mask,
 		memmove(p->v6.endaddress, ea, IPaddrlen);
 		memmove(p->v6.gate, gate, IPaddrlen);
 		memmove(p->rt.tag, tag, sizeof(p->rt.tag));
+		if (h == V6H(sa))
+			added = p;
 
-		wlock(&routelock);
 		addnode(f, &f->v6root[h], p);
 		while ((p = f->queue)) {
 			f->queue = p->rt.mid;
 			walkadd(f, &f->v6root[h], p->rt.left);
 			freeroute(p);
 		}
-		wunlock(&routelock);
 	}
-	v6routegeneration++;
+	v6fibadd(f, &rt, added);
+	wunlock(&routelock);
 
 	ipifcaddroute(f, 0, a, mask, gate, type);
 }
@@ -442,10 +642,10 @@ void v4delroute(struct Fs *f, uint8_t *a, uint8_t *mask, int dolock)
 	rt.v4.endaddress = rt.v4.address | ~m;
 	rt.rt.type = Rv4;
 
+	if (dolock)
+		wlock(&routelock);
 	eh = V4H(rt.v4.endaddress);
 	for (h = V4H(rt.v4.address); h <= eh; h++) {
-		if (dolock)
-			wlock(&routelock);
 		r = looknode(&f->v4root[h], &rt);
 		if (r) {
 			p = *r;
@@ -454,6 +654,8 @@ void v4delroute(struct Fs *f, uint8_t *a, uint8_t *mask, int dolock)
 			 * code is when we want to release.  btw, use better
 			 * code reuse btw v4 and v6... */
 			if (kref_put(&p->rt.kref)) {
+				if (h == V4H(rt.v4.address))
+					v4fibdel(f, h, p);
 				*r = 0;
 				addqueue(&f->queue, p->rt.left);
 				addqueue(&f->queue, p->rt.mid);
@@ -466,10 +668,9 @@ void v4delroute(struct Fs *f, uint8_t *a, uint8_t *mask, int dolock)
 				}
 			}
 		}
-		if (dolock)
-			wunlock(&routelock);
 	}
-	v4routegeneration++;
+	if (dolock)
+		wunlock(&routelock);
 
 	ipifcremroute(f, Rv4, a, mask);
 }
@@ -489,10 +690,10 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 	}
 	rt.rt.type = 0;
 
+	if (dolock)
+		wlock(&routelock);
 	eh = V6H(rt.v6.endaddress);
 	for (h = V6H(rt.v6.address); h <= eh; h++) {
-		if (dolock)
-			wlock(&routelock);
 		r = looknode(&f->v6root[h], &rt);
 		if (r) {
 			p = *r;
@@ -501,6 +702,8 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 			 * code is when we want to release.  btw, use better
 			 * code reuse btw v4 and v6... */
 			if (kref_put(&p->rt.kref)) {
+				if (h == V6H(rt.v6.address))
+					v6fibdel(f, h, p);
 				*r = 0;
 				addqueue(&f->queue, p->rt.left);
 				addqueue(&f->queue, p->rt.mid);
@@ -513,38 +716,66 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 				}
 			}
 		}
-		if (dolock)
-			wunlock(&routelock);
 	}
-	v6routegeneration++;
+	if (dolock)
+		wunlock(&routelock);
 
 	ipifcremroute(f, 0, a, mask);
 }
 
+/*
+ *  a conv's cached route is good until the route changes, which bumps its
+ *  gen.  adding or removing other routes only invalidates the convs whose
+ *  routes they override.
+ */
+static bool routecached(struct conv *c)
+{
+	struct route *r;
+
+	if (c == NULL || (r = c->r) == NULL)
+		return FALSE;
+	if (r->rt.ifc == NULL || r->rt.ifcid != r->rt.ifc->ifcid)
+		return FALSE;
+	return c->rgen == ACCESS_ONCE(r->rt.gen);
+}
+
+/*
+ *  remember q for c, unless the FIB changed since seq: q may already be
+ *  stale, and its gen bumped before we read it.
+ */
+static void cacheroute(struct conv *c, struct fib *fib, seq_ctr_t seq,
+		       struct route *q, uint32_t gen)
+{
+	if (seqctr_retry(seq, ACCESS_ONCE(fib->seq)))
+		q = NULL;
+	c->r = q;
+	c->rgen = gen;
+}
+
 struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
-	struct route *p, *q;
-	uint32_t la;
+	struct route *q;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
+	seq_ctr_t seq;
+	uint32_t gen;
 
-	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v4routegeneration)
+	if (routecached(c))
 		return c->r;
 
-	la = nhgetl(a);
-	q = NULL;
-	for (p = f->v4root[V4H(la)]; p;)
-		if (la >= p->v4.address) {
-			if (la <= p->v4.endaddress) {
-				q = p;
-				p = p->rt.mid;
-			} else
-				p = p->rt.right;
-		} else
-			p = p->rt.left;
+	seq = ACCESS_ONCE(f->v4fib.seq);
+	rmb();
+	rcu_read_lock();
+	q = fib_lookup(&f->v4fib, a);
+	rcu_read_unlock();
+	if (q == NULL) {
+		if (c != NULL)
+			c->r = NULL;
+		return NULL;
+	}
+	gen = ACCESS_ONCE(q->rt.gen);
 
-	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
+	if (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid) {
 		if (q->rt.type & Rifc) {
 			hnputl(gate + IPv4off, q->v4.address);
 			memmove(gate, v4prefix, IPv4off);
@@ -557,22 +788,20 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 		q->rt.ifcid = ifc->ifcid;
 	}
 
-	if (c != NULL) {
-		c->r = q;
-		c->rgen = v4routegeneration;
-	}
+	if (c != NULL)
+		cacheroute(c, &f->v4fib, seq, q, gen);
 
 	return q;
 }
 
 struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
-	struct route *p, *q;
-	uint32_t la[IPllen];
+	struct route *q;
 	int h;
-	uint32_t x, y;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
+	seq_ctr_t seq;
+	uint32_t gen;
 
 	if (memcmp(a, v4prefix, IPv4off) == 0) {
 		q = v4lookup(f, a + IPv4off, c);
@@ -580,43 +809,22 @@ struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 			return q;
 	}
 
-	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v6routegeneration)
+	if (routecached(c))
 		return c->r;
 
-	for (h = 0; h < IPllen; h++)
-		la[h] = nhgetl(a + 4 * h);
-
-	q = 0;
-	for (p = f->v6root[V6H(la)]; p;) {
-		for (h = 0; h < IPllen; h++) {
-			x = la[h];
-			y = p->v6.address[h];
-			if (x == y)
-				continue;
-			if (x < y) {
-				p = p->rt.left;
-				goto next;
-			}
-			break;
-		}
-		for (h = 0; h < IPllen; h++) {
-			x = la[h];
-			y = p->v6.endaddress[h];
-			if (x == y)
-				continue;
-			if (x > y) {
-				p = p->rt.right;
-				goto next;
-			}
-			break;
-		}
-		q = p;
-		p = p->rt.mid;
-next:	;
+	seq = ACCESS_ONCE(f->v6fib.seq);
+	rmb();
+	rcu_read_lock();
+	q = fib_lookup(&f->v6fib, a);
+	rcu_read_unlock();
+	if (q == NULL) {
+		if (c != NULL)
+			c->r = NULL;
+		return NULL;
 	}
+	gen = ACCESS_ONCE(q->rt.gen);
 
-	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
+	if (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid) {
 		if (q->rt.type & Rifc) {
 			for (h = 0; h < IPllen; h++)
 				hnputl(gate + 4 * h, q->v6.address[h]);
@@ -628,10 +836,8 @@ next:	;
 		q->rt.ifc = ifc;
 		q->rt.ifcid = ifc->ifcid;
 	}
-	if (c != NULL) {
-		c->r = q;
-		c->rgen = v6routegeneration;
-	}
+	if (c != NULL)
+		cacheroute(c, &f->v6fib, seq, q, gen);
 
 	return q;
 }
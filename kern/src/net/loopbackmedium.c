@@ -47,6 +47,7 @@ struct LB {
 	struct proc *readp;
 	struct queue *q;
 	struct Fs *f;
+	struct ipgro gro;
 };
 
 static void loopbackread(void *a);
@@ -60,6 +61,7 @@ static void loopbackbind(struct Ipifc *ifc, int unused_int,
 	lb->f = ifc->conv->p->f;
 	/* TO DO: make queue size a function of kernel memory */
 	lb->q = qopen(128 * 1024, Qmsg, NULL, NULL);
+	ipgro_init(&lb->gro, lb->f, ifc);
 	ifc->arg = lb;
 
 	ktask("loopbackread", loopbackread, ifc);
@@ -130,8 +132,14 @@ static void loopbackread(void *a)
 			freeb(bp);
 		} else {
 			ipifc_trace_block(ifc, bp);
-			ipiput4(lb->f, ifc, bp);
+			if (READ_ONCE(ifc->gro))
+				ipgro_input(&lb->gro, bp);
+			else
+				ipiput4(lb->f, ifc, bp);
 		}
+		/* End of the batch, we're about to block */
+		if (!qlen(lb->q))
+			ipgro_flush(&lb->gro);
 		runlock(&ifc->rwlock);
 		poperror();
 	}
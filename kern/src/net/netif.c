@@ -279,6 +279,8 @@ static int feature_appender(int features, char *p, int sofar)
 		sofar += snprintf(p + sofar, READSTR - sofar, "lro ");
 	if (features & NETF_RXCSUM)
 		sofar += snprintf(p + sofar, READSTR - sofar, "rxcsum ");
+	if (features & NETF_RXHASH)
+		sofar += snprintf(p + sofar, READSTR - sofar, "rxhash ");
 	return sofar;
 }
 
@@ -295,6 +297,8 @@ long netifread(struct ether *nif, struct chan *c, void *a, long n,
 	switch (NETTYPE(c->qid.path)) {
 	case Ndataqid:
 		f = nif->f[NETID(c->qid.path)];
+		if (c->flag & O_NONBLOCK)
+			return qread_nonblock(f->in, a, n);
 		return qread(f->in, a, n);
 	case Nctlqid:
 		return readnum(offset, a, n, NETID(c->qid.path), NUMSIZE);
@@ -365,6 +369,8 @@ struct block *netifbread(struct ether *nif, struct chan *c, long n,
 	if ((c->qid.type & QTDIR) || NETTYPE(c->qid.path) != Ndataqid)
 		return devbread(c, n, offset);
 
+	if (c->flag & O_NONBLOCK)
+		return qbread_nonblock(nif->f[NETID(c->qid.path)]->in, n);
 	return qbread(nif->f[NETID(c->qid.path)]->in, n);
 }
 
@@ -66,6 +66,14 @@ static char *statnames[] = {
 	[HlenErrs] "HlenErrs",
 	[LenErrs] "LenErrs",
 	[OutOfOrder] "OutOfOrder",
+	[LimboOverflows] "LimboOverflows",
+	[SynCookiesSent] "SynCookiesSent",
+	[SynCookiesAccepted] "SynCookiesAccepted",
+	[SynCookiesFailed] "SynCookiesFailed",
+	[TimerTicks] "TimerTicks",
+	[TimersExpired] "TimersExpired",
+	[TimersCascaded] "TimersCascaded",
+	[TimerTickUs] "TimerTickUs",
 };
 
 /*
@@ -98,11 +106,12 @@ static void tcprxmit(struct conv *);
 static void tcpsettimer(Tcpctl *);
 static void tcpsynackrtt(struct conv *);
 static void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
-static void tcp_loss_event(struct conv *s, Tcpctl *tcb);
+static void tcp_loss_event(struct conv *s, Tcpctl *tcb, bool rto);
 static uint16_t derive_payload_mss(Tcpctl *tcb);
 static void set_in_flight(Tcpctl *tcb);
 
-static void limborexmit(struct Proto *);
+static void limbotimer(void *);
+static uint64_t tcptimer_count(struct tcppriv *priv, Tcptimer *t);
 static void limbo(struct conv *, uint8_t *unused_uint8_p_t, uint8_t *, Tcp *,
 		  int);
 
@@ -161,14 +170,16 @@ static int tcpstate(struct conv *c, char *state, int n)
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-			"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+			"%s qin %d qout %d srtt %d mdev %d cc %s cwin %u ssthresh %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %llu katimer.count %llu\n",
 			tcpstates[s->state],
 			c->rq ? qlen(c->rq) : 0,
 			c->wq ? qlen(c->wq) : 0,
-			s->srtt, s->mdev,
-			s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-			s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-			s->katimer.start, s->katimer.count);
+			s->srtt, s->mdev, s->cc ? s->cc->name : "none",
+			s->cwind, s->ssthresh, s->snd.wnd, s->rcv.scale,
+			s->rcv.wnd, s->snd.scale, s->timer.start,
+			tcptimer_count(c->p->priv, &s->timer), s->rerecv,
+			s->katimer.start,
+			tcptimer_count(c->p->priv, &s->katimer));
 }
 
 static int tcpinuse(struct conv *c)
@@ -223,6 +234,8 @@ static void tcpclose(struct conv *c)
 
 	tcb = (Tcpctl *) c->ptcl;
 
+	/* The next user of the conv gets the default */
+	tcb->cc_chosen = NULL;
 	qhangup(c->rq, NULL);
 	qhangup(c->wq, NULL);
 	qhangup(c->eq, NULL);
@@ -348,44 +361,109 @@ static void tcpcreate(struct conv *c)
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
 }
 
-static void timerstate(struct tcppriv *priv, Tcptimer *t, int newstate)
+/* TCP timers live on a hierarchical timing wheel (Varghese and Lauck), one per
+ * TCP instance, protected by priv->tl.  Level 0 has a slot per tick, and each
+ * level up has slots that are TW_SIZE times as wide as the level below.  A
+ * timer goes in the lowest level whose range covers its expiry, so arming and
+ * halting are O(1).
+ *
+ * Each tick runs one slot of level 0.  Whenever a level's index wraps to 0, we
+ * cascade the next slot of the level above, re-adding its timers, which will
+ * land in lower levels.  An idle timer, like a keepalive, is touched about once
+ * per level, instead of once per tick. */
+static void tw_add(struct tcp_timer_wheel *tw, Tcptimer *t)
+{
+	uint64_t delta = t->expires - tw->now;
+	uint64_t when = t->expires;
+	int lvl;
+
+	for (lvl = 0; lvl < TW_LEVELS - 1; lvl++) {
+		if (delta < 1ULL << (TW_BITS * (lvl + 1)))
+			break;
+	}
+	/* Past the end of the wheel: park it in the farthest slot.  It'll get
+	 * re-added when that slot cascades. */
+	if (delta >= 1ULL << (TW_BITS * TW_LEVELS))
+		when = tw->now + (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+	list_add_tail(&t->link,
+	              &tw->slots[lvl][(when >> (TW_BITS * lvl)) & TW_MASK]);
+}
+
+/* Re-adds the timers in slot idx of lvl, returning idx. */
+static int tw_cascade(struct tcppriv *priv, int lvl, int idx)
 {
-	if (newstate != TcptimerON) {
-		if (t->state == TcptimerON) {
-			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
-				if (t->prev != NULL)
-					panic("timerstate1");
-			}
-			if (t->next)
-				t->next->prev = t->prev;
-			if (t->prev)
-				t->prev->next = t->next;
-			t->next = t->prev = NULL;
-		}
-	} else {
-		if (t->state != TcptimerON) {
-			// chain
-			if (t->prev != NULL || t->next != NULL)
-				panic("timerstate2");
-			t->prev = NULL;
-			t->next = priv->timers;
-			if (t->next)
-				t->next->prev = t;
-			priv->timers = t;
+	struct tcp_timer_wheel *tw = &priv->wheel;
+	struct list_head tmp = LIST_HEAD_INIT(tmp);
+	Tcptimer *t, *tp;
+
+	list_splice_init(&tw->slots[lvl][idx], &tmp);
+	list_for_each_entry_safe(t, tp, &tmp, link) {
+		tw_add(tw, t);
+		priv->stats[TimersCascaded]++;
+	}
+	return idx;
+}
+
+/* Runs one tick of the wheel.  Returns the timers that fired, chained by
+ * readynext, all TcptimerDONE. */
+static Tcptimer *tw_tick(struct tcppriv *priv)
+{
+	struct tcp_timer_wheel *tw = &priv->wheel;
+	int idx = tw->now & TW_MASK;
+	Tcptimer *t, *tp, *timeo = NULL;
+
+	if (!idx) {
+		for (int lvl = 1; lvl < TW_LEVELS; lvl++) {
+			if (tw_cascade(priv, lvl,
+			               (tw->now >> (TW_BITS * lvl)) & TW_MASK))
+				break;
 		}
 	}
+	tw->now++;
+	list_for_each_entry_safe(t, tp, &tw->slots[0][idx], link) {
+		list_del(&t->link);
+		t->state = TcptimerDONE;
+		t->count = 0;
+		t->readynext = timeo;
+		timeo = t;
+		priv->stats[TimersExpired]++;
+	}
+	return timeo;
+}
+
+/* Ticks left until t fires, like the old count-down timers had. */
+static uint64_t tcptimer_count(struct tcppriv *priv, Tcptimer *t)
+{
+	if (t->state == TcptimerON)
+		return t->expires - READ_ONCE(priv->wheel.now) + 1;
+	return t->count;
+}
+
+static void timerstate(struct tcppriv *priv, Tcptimer *t, int newstate)
+{
+	struct tcp_timer_wheel *tw = &priv->wheel;
+
+	if (t->state == TcptimerON) {
+		list_del(&t->link);
+		/* Halting: save what's left, e.g. for RTT measurements */
+		if (newstate != TcptimerON)
+			t->count = t->expires - tw->now + 1;
+	}
+	if (newstate == TcptimerON) {
+		/* tcpgo() set count.  We fire on the count'th tick from now. */
+		t->expires = tw->now + t->count - 1;
+		tw_add(tw, t);
+	}
 	t->state = newstate;
 }
 
 static void tcpackproc(void *a)
 {
 	ERRSTACK(1);
-	Tcptimer *t, *tp, *timeo;
+	Tcptimer *t, *timeo;
 	struct Proto *tcp;
 	struct tcppriv *priv;
-	int loop;
+	uint64_t tsc;
 
 	tcp = a;
 	priv = tcp->priv;
@@ -394,27 +472,14 @@ static void tcpackproc(void *a)
 		kthread_usleep(MSPTICK * 1000);
 
 		qlock(&priv->tl);
-		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
-			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
-					timerstate(priv, t, TcptimerDONE);
-					t->readynext = timeo;
-					timeo = t;
-				}
-			}
-		}
+		tsc = read_tsc();
+		timeo = tw_tick(priv);
+		priv->tick_nsec += tsc2nsec(read_tsc() - tsc);
+		priv->stats[TimerTicks]++;
+		priv->stats[TimerTickUs] = priv->tick_nsec / 1000;
 		qunlock(&priv->tl);
 
-		loop = 0;
 		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
 			if (t->state == TcptimerDONE && t->func != NULL) {
 				/* discard error style */
 				if (!waserror())
@@ -422,8 +487,6 @@ static void tcpackproc(void *a)
 				poperror();
 			}
 		}
-
-		limborexmit(tcp);
 	}
 }
 
@@ -532,13 +595,18 @@ static void inittcpctl(struct conv *s, int mode)
 	Tcpctl *tcb;
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
+	struct tcp_cc_ops *cc;
 	int mss;
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	cc = tcb->cc_chosen;
 	memset(tcb, 0, sizeof(Tcpctl));
 
 	tcb->ssthresh = UINT32_MAX;
+	tcb->cc_chosen = cc;
+	tcb->cc = cc ?: ((struct tcppriv *)s->p->priv)->cc_default;
+	tcb->cc->init(tcb);
 	tcb->srtt = tcp_irtt;
 	tcb->mdev = 0;
 
@@ -733,8 +801,9 @@ static void write_opts(Tcp *tcph, uint8_t *opt, uint16_t optpad, Tcpctl *tcb)
 		}
 		*opt++ = TS_OPT;
 		*opt++ = TS_LENGTH;
-		/* Setting TSval, our time */
-		hnputl(opt, milliseconds());
+		/* Setting TSval, our time, unless we're sending something
+		 * else in it */
+		hnputl(opt, tcph->ts_ours ? tcph->ts_ours : milliseconds());
 		opt += 4;
 		/* Setting TSecr, the time we last saw from them, stored in
 		 * ts_val */
@@ -947,6 +1016,7 @@ static void clear_tcph_opts(Tcp *tcph)
 	tcph->nr_sacks = 0;
 	tcph->ts_val = 0;
 	tcph->ts_ecr = 0;
+	tcph->ts_ours = 0;
 }
 
 static int ntohtcp6(Tcp *tcph, struct block **bpp)
@@ -1148,6 +1218,7 @@ static void tcphangup(struct conv *s)
 			seg.sack_ok = FALSE;
 			seg.nr_sacks = 0;
 			seg.ts_val = tcb->ts_recent;
+			seg.ts_ours = 0;
 			switch (s->ipversion) {
 			case V4:
 				tcb->protohdr.tcp4hdr.vihl = IP_VER4;
@@ -1173,7 +1244,7 @@ static void tcphangup(struct conv *s)
 /*
  *  (re)send a SYN ACK
  */
-static int sndsynack(struct Proto *tcp, Limbo *lp)
+static int sndsynack(struct Proto *tcp, Limbo *lp, uint32_t ts_ours)
 {
 	struct block *hbp;
 	Tcp4hdr ph4;
@@ -1216,6 +1287,7 @@ static int sndsynack(struct Proto *tcp, Limbo *lp)
 	seg.mss = tcpmtu(lp->ifc, lp->version, &scale);
 	seg.wnd = QMAX;
 	seg.ts_val = lp->ts_val;
+	seg.ts_ours = ts_ours;
 	seg.nr_sacks = 0;
 
 	/* if the other side set scale, we should too */
@@ -1251,118 +1323,333 @@ static int sndsynack(struct Proto *tcp, Limbo *lp)
 	return 0;
 }
 
-#define hashipa(a, p) ( ( (a)[IPaddrlen-2] + (a)[IPaddrlen-1] + p )&LHTMASK )
+/* The tuple we hash for limbo buckets and SYN cookies, in the order we hash
+ * it.  Packed, so there are no holes for stack garbage to get into the hash. */
+struct syn_tuple {
+	uint8_t raddr[IPaddrlen];
+	uint8_t laddr[IPaddrlen];
+	uint16_t rport;
+	uint16_t lport;
+	uint32_t irs;
+	uint32_t extra;
+} __attribute__((packed));
+
+static uint32_t syn_hash(struct siphash_key *key, uint8_t *raddr,
+			 uint16_t rport, uint8_t *laddr, uint16_t lport,
+			 uint32_t irs, uint32_t extra)
+{
+	struct syn_tuple t;
+
+	ipmove(t.raddr, raddr);
+	ipmove(t.laddr, laddr);
+	t.rport = rport;
+	t.lport = lport;
+	t.irs = irs;
+	t.extra = extra;
+	return siphash(&t, sizeof(t), key);
+}
+
+static struct hlist_head *limbo_bucket(struct tcppriv *tpriv, uint8_t *raddr,
+				       uint16_t rport, uint8_t *laddr,
+				       uint16_t lport)
+{
+	return &tpriv->lht[syn_hash(&tpriv->limbo_key, raddr, rport, laddr,
+				    lport, 0, 0) & LHTMASK];
+}
 
 /*
- *  put a call into limbo and respond with a SYN ACK
+ *  find the call in limbo from raddr!rport to laddr!lport
  *
  *  called with proto locked
  */
-static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
-                  int version)
+static Limbo *limbo_lookup(struct tcppriv *tpriv, uint8_t *raddr,
+			   uint16_t rport, uint8_t *laddr, uint16_t lport,
+			   uint8_t version)
 {
-	Limbo *lp, **l;
-	struct tcppriv *tpriv;
-	int h;
+	Limbo *lp;
 
-	tpriv = s->p->priv;
-	h = hashipa(source, seg->source);
-
-	for (l = &tpriv->lht[h]; *l != NULL; l = &lp->next) {
-		lp = *l;
-		if (lp->lport != seg->dest || lp->rport != seg->source
+	hlist_for_each_entry(lp, limbo_bucket(tpriv, raddr, rport, laddr,
+					      lport), hlink) {
+		if (lp->lport != lport || lp->rport != rport
 			|| lp->version != version)
 			continue;
-		if (ipcmp(lp->raddr, source) != 0)
+		if (ipcmp(lp->raddr, raddr) != 0)
 			continue;
-		if (ipcmp(lp->laddr, dest) != 0)
+		if (ipcmp(lp->laddr, laddr) != 0)
 			continue;
+		return lp;
+	}
+	return NULL;
+}
+
+/* Takes lp out of limbo, without freeing it. */
+static void limbo_unlink(struct tcppriv *tpriv, Limbo *lp)
+{
+	hlist_del(&lp->hlink);
+	list_del(&lp->rxlink);
+	tpriv->nlimbo--;
+}
+
+static void limbo_free(struct tcppriv *tpriv, Limbo *lp)
+{
+	limbo_unlink(tpriv, lp);
+	kfree(lp);
+}
+
+/* Makes sure the limbo timer goes off by deadline, in NOW ms.  The timer only
+ * needs to go off for the earliest call in limbo. */
+static void limbo_arm(struct tcppriv *tpriv, uint64_t deadline)
+{
+	Tcptimer *t = &tpriv->limbo_timer;
+	uint64_t now = NOW;
+
+	/* We read the state without tl.  If the timer just went off, that's
+	 * fine: limbotimer() rearms it for whatever is still in limbo. */
+	if (t->state == TcptimerON && tpriv->limbo_deadline <= deadline)
+		return;
+	tpriv->limbo_deadline = deadline;
+	t->start = deadline > now ? DIV_ROUND_UP(deadline - now, MSPTICK) : 1;
+	tcpgo(tpriv, t);
+}
+
+/* Puts lp at the back of the line to rexmit, which is the order of rxstart
+ * within each limbo_rx list, since they all wait the same amount. */
+static void limbo_wait(struct tcppriv *tpriv, Limbo *lp)
+{
+	lp->rxstart = NOW;
+	list_move_tail(&lp->rxlink, &tpriv->limbo_rx[lp->rexmits]);
+	limbo_arm(tpriv, lp->rxstart + (lp->rexmits + 1) * SYNACK_RXTIMER);
+}
+
+static void limbo_init(Limbo *lp, uint8_t *source, uint8_t *dest, Tcp *seg,
+		       int version)
+{
+	lp->version = version;
+	ipmove(lp->laddr, dest);
+	ipmove(lp->raddr, source);
+	lp->lport = seg->dest;
+	lp->rport = seg->source;
+	lp->mss = seg->mss;
+	lp->rcvscale = seg->ws;
+	lp->sack_ok = seg->sack_ok;
+	lp->irs = seg->seq;
+	lp->ts_val = seg->ts_val;
+}
+
+/* The MSSs a cookie can encode.  We pick the biggest that isn't bigger than
+ * what the other side asked for. */
+static const uint16_t syncookie_mss[] = {
+	536, 1200, 1300, 1400, 1440, 1460, 4312, 8960,
+};
+
+static uint32_t syncookie_make(struct tcppriv *tpriv, uint8_t *raddr,
+			       uint16_t rport, uint8_t *laddr, uint16_t lport,
+			       uint32_t irs, uint32_t count,
+			       unsigned int mssidx)
+{
+	uint32_t hash;
+
+	/* The MSS index is in the hash too, so it can't be changed */
+	hash = syn_hash(&tpriv->cookie_key, raddr, rport, laddr, lport, irs,
+			count << 3 | mssidx);
+	return (count << SYNCOOKIE_COUNT_SHIFT) |
+	       (mssidx << SYNCOOKIE_MSS_SHIFT) | (hash & SYNCOOKIE_HASH_MASK);
+}
+
+/* Our TS val for a cookie SYN ACK: our clock, with the options the cookie
+ * doesn't have room for in the low bits.  The other side echoes it back.
+ *
+ * The options can put it up to SYNCOOKIE_TS_MASK ahead of our clock.  The
+ * other side keeps it as TS.Recent, and if our next segments had smaller TS
+ * vals, PAWS would drop them.  So we back it off to be in the past. */
+static uint32_t syncookie_ts(Limbo *lp)
+{
+	uint32_t now = milliseconds();
+	uint32_t opts, ts;
+
+	opts = lp->rcvscale ? lp->rcvscale & 0xff : SYNCOOKIE_TS_NOWS;
+	if (lp->sack_ok)
+		opts |= SYNCOOKIE_TS_SACK;
+	ts = (now & ~SYNCOOKIE_TS_MASK) | opts;
+	if ((int32_t)(ts - now) > 0)
+		ts -= SYNCOOKIE_TS_MASK + 1;
+	return ts;
+}
+
+/*
+ *  respond to a SYN with a SYN ACK, without putting the call in limbo.  the
+ *  call's state is in the ISS and our TS val.
+ *
+ *  called with proto locked
+ */
+static void syncookie_send(struct Proto *tcp, uint8_t *source, uint8_t *dest,
+			   Tcp *seg, int version)
+{
+	struct tcppriv *tpriv = tcp->priv;
+	Limbo c = {0};
+	unsigned int mssidx = 0;
+
+	limbo_init(&c, source, dest, seg, version);
+	while (mssidx + 1 < ARRAY_SIZE(syncookie_mss) &&
+	       syncookie_mss[mssidx + 1] <= c.mss)
+		mssidx++;
+	c.iss = syncookie_make(tpriv, source, seg->source, dest, seg->dest,
+			       seg->seq, (NOW / SYNCOOKIE_PERIOD), mssidx);
+	/* Without timestamps, we'd have nowhere to keep these */
+	if (!c.ts_val) {
+		c.rcvscale = 0;
+		c.sack_ok = FALSE;
+	}
+	if (sndsynack(tcp, &c, c.ts_val ? syncookie_ts(&c) : 0) < 0)
+		return;
+	tpriv->stats[SynCookiesSent]++;
+	tpriv->last_cookie = NOW;
+}
 
+/*
+ *  check whether an ACK is for a cookie SYN ACK we sent.  if so, fill in lp as
+ *  if the call had been in limbo.
+ *
+ *  called with proto locked
+ */
+static bool syncookie_check(struct Proto *tcp, Tcp *segp, uint8_t *src,
+			    uint8_t *dst, uint8_t version, Limbo *lp)
+{
+	struct tcppriv *tpriv = tcp->priv;
+	uint32_t cookie = segp->ack - 1;
+	uint32_t count = NOW / SYNCOOKIE_PERIOD;
+	unsigned int mssidx;
+	uint32_t opts, sent;
+	int scale;
+
+	/* Don't give anyone a shot at guessing a cookie unless we sent some */
+	if (!tpriv->last_cookie || NOW - tpriv->last_cookie > SYNCOOKIE_PERIOD)
+		return FALSE;
+	mssidx = (cookie >> SYNCOOKIE_MSS_SHIFT) & 7;
+	/* Good for this period and the one before */
+	if ((cookie >> SYNCOOKIE_COUNT_SHIFT) != (count & 0x1f))
+		count--;
+	if (cookie != syncookie_make(tpriv, src, segp->source, dst, segp->dest,
+				     segp->seq - 1, count, mssidx)) {
+		tpriv->stats[SynCookiesFailed]++;
+		return FALSE;
+	}
+
+	memset(lp, 0, sizeof(*lp));
+	lp->version = version;
+	ipmove(lp->laddr, dst);
+	ipmove(lp->raddr, src);
+	lp->lport = segp->dest;
+	lp->rport = segp->source;
+	lp->irs = segp->seq - 1;
+	lp->iss = cookie;
+	lp->mss = syncookie_mss[mssidx];
+	lp->ifc = findipifc(tcp->f, dst, 0);
+	if (segp->ts_val) {
+		opts = segp->ts_ecr & SYNCOOKIE_TS_MASK;
+		if ((opts & SYNCOOKIE_TS_NOWS) != SYNCOOKIE_TS_NOWS) {
+			lp->rcvscale = HaveWS | (opts & SYNCOOKIE_TS_NOWS);
+			tcpmtu(lp->ifc, version, &scale);
+			lp->sndscale = scale;
+		}
+		lp->sack_ok = SACK_SUPPORTED && (opts & SYNCOOKIE_TS_SACK);
+		/* Our TS val says when we sent the SYN ACK */
+		sent = (uint32_t)milliseconds() -
+		       (segp->ts_ecr & ~SYNCOOKIE_TS_MASK);
+		if (sent < SYNCOOKIE_PERIOD)
+			lp->lastsend = NOW - sent;
+	}
+	tpriv->stats[SynCookiesAccepted]++;
+	return TRUE;
+}
+
+/*
+ *  put a call into limbo and respond with a SYN ACK
+ *
+ *  called with proto locked
+ */
+static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
+                  int version)
+{
+	Limbo *lp;
+	struct tcppriv *tpriv;
+
+	tpriv = s->p->priv;
+	lp = limbo_lookup(tpriv, source, seg->source, dest, seg->dest, version);
+	if (lp != NULL) {
 		/* each new SYN restarts the retransmits */
 		lp->irs = seg->seq;
-		break;
-	}
-	lp = *l;
-	if (lp == NULL) {
-		if (tpriv->nlimbo >= Maxlimbo && tpriv->lht[h]) {
-			lp = tpriv->lht[h];
-			tpriv->lht[h] = lp->next;
-			lp->next = NULL;
-		} else {
+	} else {
+		if (tpriv->nlimbo >= Maxlimbo)
+			lp = NULL;
+		else
 			lp = kzmalloc(sizeof(*lp), 0);
-			if (lp == NULL)
-				return;
-			tpriv->nlimbo++;
-		}
-		*l = lp;
-		lp->version = version;
-		ipmove(lp->laddr, dest);
-		ipmove(lp->raddr, source);
-		lp->lport = seg->dest;
-		lp->rport = seg->source;
-		lp->mss = seg->mss;
-		lp->rcvscale = seg->ws;
-		lp->sack_ok = seg->sack_ok;
-		lp->irs = seg->seq;
-		lp->ts_val = seg->ts_val;
+		if (lp == NULL) {
+			tpriv->stats[LimboOverflows]++;
+			syncookie_send(s->p, source, dest, seg, version);
+			return;
+		}
+		limbo_init(lp, source, dest, seg, version);
 		urandom_read(&lp->iss, sizeof(lp->iss));
+		hlist_add_head(&lp->hlink, limbo_bucket(tpriv, source,
+							seg->source, dest,
+							seg->dest));
+		INIT_LIST_HEAD(&lp->rxlink);
+		tpriv->nlimbo++;
 	}
 
-	if (sndsynack(s->p, lp) < 0) {
-		*l = lp->next;
-		tpriv->nlimbo--;
-		kfree(lp);
+	if (sndsynack(s->p, lp, 0) < 0) {
+		limbo_free(tpriv, lp);
+		return;
 	}
+	limbo_wait(tpriv, lp);
 }
 
 /*
- *  resend SYN ACK's once every SYNACK_RXTIMER ms.
+ *  resend SYN ACK's that are due, and give up on calls that are out of
+ *  retransmits.  only looks at the front of each limbo_rx list.
  */
-static void limborexmit(struct Proto *tcp)
+static void limbotimer(void *v)
 {
-	struct tcppriv *tpriv;
-	Limbo **l, *lp;
-	int h;
-	int seen;
+	struct Proto *tcp = v;
+	struct tcppriv *tpriv = tcp->priv;
+	Limbo *lp, *tmp;
 	uint64_t now;
 
-	tpriv = tcp->priv;
-
-	if (!canqlock(&tcp->qlock))
+	/* Don't hold up the other timers behind a SYN flood */
+	if (!canqlock(&tcp->qlock)) {
+		tpriv->limbo_timer.start = 1;
+		tcpgo(tpriv, &tpriv->limbo_timer);
 		return;
-	seen = 0;
+	}
 	now = NOW;
-	for (h = 0; h < NLHT && seen < tpriv->nlimbo; h++) {
-		for (l = &tpriv->lht[h]; *l != NULL && seen < tpriv->nlimbo;) {
-			lp = *l;
-			seen++;
-			if (now - lp->lastsend <
-			    (lp->rexmits + 1) * SYNACK_RXTIMER)
-				continue;
-
-			/* time it out after 1 second */
-			if (++(lp->rexmits) > 5) {
-				tpriv->nlimbo--;
-				*l = lp->next;
-				kfree(lp);
+	/* From the back, so we don't look at a call again after it moves */
+	for (int i = SYNACK_RXMITS; i >= 0; i--) {
+		list_for_each_entry_safe(lp, tmp, &tpriv->limbo_rx[i], rxlink) {
+			if (now - lp->rxstart < (i + 1) * SYNACK_RXTIMER)
+				break;
+			if (i == SYNACK_RXMITS) {
+				limbo_free(tpriv, lp);
 				continue;
 			}
-
+			lp->rexmits++;
 			/* if we're being attacked, don't bother resending SYN
 			 * ACK's */
-			if (tpriv->nlimbo > 100)
-				continue;
-
-			if (sndsynack(tcp, lp) < 0) {
-				tpriv->nlimbo--;
-				*l = lp->next;
-				kfree(lp);
+			if (tpriv->nlimbo <= 100 && sndsynack(tcp, lp, 0) < 0) {
+				limbo_free(tpriv, lp);
 				continue;
 			}
-
-			l = &lp->next;
+			lp->rxstart = now;
+			list_move_tail(&lp->rxlink,
+				       &tpriv->limbo_rx[lp->rexmits]);
 		}
 	}
+	for (int i = 0; i <= SYNACK_RXMITS; i++) {
+		if (list_empty(&tpriv->limbo_rx[i]))
+			continue;
+		lp = list_first_entry(&tpriv->limbo_rx[i], Limbo, rxlink);
+		limbo_arm(tpriv, lp->rxstart + (i + 1) * SYNACK_RXTIMER);
+	}
 	qunlock(&tcp->qlock);
 }
 
@@ -1374,32 +1661,17 @@ static void limborexmit(struct Proto *tcp)
 static void limborst(struct conv *s, Tcp *segp, uint8_t *src, uint8_t *dst,
                      uint8_t version)
 {
-	Limbo *lp, **l;
-	int h;
+	Limbo *lp;
 	struct tcppriv *tpriv;
 
 	tpriv = s->p->priv;
 
 	/* find a call in limbo */
-	h = hashipa(src, segp->source);
-	for (l = &tpriv->lht[h]; *l != NULL; l = &lp->next) {
-		lp = *l;
-		if (lp->lport != segp->dest || lp->rport != segp->source
-			|| lp->version != version)
-			continue;
-		if (ipcmp(lp->laddr, dst) != 0)
-			continue;
-		if (ipcmp(lp->raddr, src) != 0)
-			continue;
+	lp = limbo_lookup(tpriv, src, segp->source, dst, segp->dest, version);
 
-		/* RST can only follow the SYN */
-		if (segp->seq == lp->irs + 1) {
-			tpriv->nlimbo--;
-			*l = lp->next;
-			kfree(lp);
-		}
-		break;
-	}
+	/* RST can only follow the SYN */
+	if (lp != NULL && segp->seq == lp->irs + 1)
+		limbo_free(tpriv, lp);
 }
 
 /* The advertised MSS (e.g. 1460) includes any per-packet TCP options, such as
@@ -1430,8 +1702,7 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	struct tcppriv *tpriv;
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
-	Limbo *lp, **l;
-	int h;
+	Limbo *lp, cookie;
 
 	/* unless it's just an ack, it can't be someone coming out of limbo */
 	if ((segp->flags & SYN) || (segp->flags & ACK) == 0)
@@ -1439,41 +1710,29 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 
 	tpriv = s->p->priv;
 
-	/* find a call in limbo */
-	h = hashipa(src, segp->source);
-	for (l = &tpriv->lht[h]; (lp = *l) != NULL; l = &lp->next) {
-		netlog(s->p->f, Logtcp,
-			   "tcpincoming s %I!%d/%I!%d d %I!%d/%I!%d v %d/%d\n",
-			   src, segp->source, lp->raddr, lp->rport, dst,
-			   segp->dest, lp->laddr, lp->lport, version,
-			   lp->version);
-
-		if (lp->lport != segp->dest || lp->rport != segp->source
-			|| lp->version != version)
-			continue;
-		if (ipcmp(lp->laddr, dst) != 0)
-			continue;
-		if (ipcmp(lp->raddr, src) != 0)
-			continue;
-
+	/* find a call in limbo, or else one we sent a cookie to */
+	lp = limbo_lookup(tpriv, src, segp->source, dst, segp->dest, version);
+	if (lp != NULL) {
 		/* we're assuming no data with the initial SYN */
 		if (segp->seq != lp->irs + 1 || segp->ack != lp->iss + 1) {
 			netlog(s->p->f, Logtcp,
 			       "tcpincoming s 0x%lx/0x%lx a 0x%lx 0x%lx\n",
 			       segp->seq, lp->irs + 1, segp->ack, lp->iss + 1);
-			lp = NULL;
-		} else {
-			tpriv->nlimbo--;
-			*l = lp->next;
+			return NULL;
 		}
-		break;
+		limbo_unlink(tpriv, lp);
+	} else {
+		if (!syncookie_check(s->p, segp, src, dst, version, &cookie))
+			return NULL;
+		lp = &cookie;
 	}
-	if (lp == NULL)
-		return NULL;
 
 	new = Fsnewcall(s, src, segp->source, dst, segp->dest, version);
-	if (new == NULL)
+	if (new == NULL) {
+		if (lp != &cookie)
+			kfree(lp);
 		return NULL;
+	}
 
 	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb = (Tcpctl *) new->ptcl;
@@ -1520,12 +1779,17 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
+	tcb->cc->init(tcb);
 
-	/* set initial round trip time */
-	tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
-	tcpsynackrtt(new);
+	/* set initial round trip time, from the SYN ACK they're ACKing.  we
+	 * don't know when we sent a cookie without timestamps. */
+	if (lp->lastsend) {
+		tcb->sndsyntime = lp->lastsend;
+		tcpsynackrtt(new);
+	}
 
-	kfree(lp);
+	if (lp != &cookie)
+		kfree(lp);
 
 	/* set up proto header */
 	switch (version) {
@@ -1705,7 +1969,7 @@ static void sack_has_changed(struct conv *s, Tcpctl *tcb,
 			       tcb->snd.rtx, tcb_sack->left, tcb_sack->right,
 			       tcb->snd.una, tcb->snd.recovery_pt);
 			/* Redo retrans, but keep the sacks and recovery point*/
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, FALSE);
 			tcb->snd.rtx = tcb->snd.una;
 			tcb->snd.sack_loss_hint = 0;
 			/* Act like an RTO.  We just detected it earlier.  This
@@ -2004,7 +2268,7 @@ static void update(struct conv *s, Tcp *seg)
 			       s->laddr, s->lport, s->raddr, s->rport,
 			       tcb->snd.nr_sacks, tcb->snd.nxt, tcb->snd.una,
 			       tcb->cwind);
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, FALSE);
 			tcb->snd.recovery_pt = tcb->snd.nxt;
 			if (tcb->snd.nr_sacks) {
 				tcb->snd.recovery = SACK_RETRANS_RECOVERY;
@@ -2053,28 +2317,9 @@ static void update(struct conv *s, Tcp *seg)
 		goto done;
 	}
 
-	/* slow start as long as we're not recovering from lost packets */
+	/* grow the window unless we're recovering from lost packets */
 	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
-		if (tcb->cwind < tcb->ssthresh) {
-			/* We increase the cwind by every byte we receive.  We
-			 * want to increase the cwind by one MSS for every MSS
-			 * that gets ACKed.  Note that multiple MSSs can be
-			 * ACKed in a single ACK.  If we had a remainder of
-			 * acked / MSS, we'd add just that remainder - not 0 or
-			 * 1 MSS. */
-			expand = acked;
-		} else {
-			/* Every RTT, which consists of CWND bytes, we're
-			 * supposed to expand by MSS bytes.  The classic
-			 * algorithm was
-			 * 	expand = (tcb->mss * tcb->mss) / tcb->cwind;
-			 * which assumes the ACK was for MSS bytes.  Instead,
-			 * for every 'acked' bytes, we increase the window by
-			 * acked / CWND (in units of MSS). */
-			expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss
-			         / tcb->cwind;
-		}
-
+		expand = tcb->cc->on_ack(tcb, acked);
 		if (tcb->cwind + expand < tcb->cwind)
 			expand = tcb->snd.wnd - tcb->cwind;
 		if (tcb->cwind + expand > tcb->snd.wnd)
@@ -3047,6 +3292,7 @@ static void tcpoutput(struct conv *s)
 		tcb->last_ack_sent = seg.ack;
 		seg.wnd = tcb->rcv.wnd;
 		seg.ts_val = tcb->ts_recent;
+		seg.ts_ours = 0;
 
 		/* Pull out data to send */
 		bp = NULL;
@@ -3166,6 +3412,7 @@ static void tcpsendka(struct conv *s)
 	seg.ws = 0;
 	seg.sack_ok = FALSE;
 	seg.nr_sacks = 0;
+	seg.ts_ours = 0;
 	if (tcpporthogdefense)
 		urandom_read(&seg.seq, sizeof(seg.seq));
 	else
@@ -3273,16 +3520,17 @@ static void tcpsetchecksum(struct conv *s, char **f, int unused)
 	tcb->nochecksum = !atoi(f[1]);
 }
 
-static void tcp_loss_event(struct conv *s, Tcpctl *tcb)
+static void tcp_loss_event(struct conv *s, Tcpctl *tcb, bool rto)
 {
 	uint32_t old_cwnd = tcb->cwind;
 
-	/* Reno */
-	tcb->ssthresh = tcb->cwind / 2;
-	tcb->cwind = tcb->ssthresh;
+	if (rto)
+		tcb->cc->on_rto(tcb);
+	else
+		tcb->cc->on_loss(tcb);
 	netlog(s->p->f, Logtcprxmt,
-	       "%I.%d -> %I.%d: loss event, cwnd was %d, now %d\n",
-	       s->laddr, s->lport, s->raddr, s->rport,
+	       "%I.%d -> %I.%d: %s loss event, cwnd was %d, now %d\n",
+	       s->laddr, s->lport, s->raddr, s->rport, tcb->cc->name,
 	       old_cwnd, tcb->cwind);
 }
 
@@ -3369,7 +3617,7 @@ static void tcptimeout(void *arg)
 		       tcb->snd.una, tcb->snd.rtx, tcb->snd.nxt,
 		       tcb->snd.in_flight, tcb->timer.start);
 		tcpsettimer(tcb);
-		tcp_loss_event(s, tcb);
+		tcp_loss_event(s, tcb, TRUE);
 		/* Advance the recovery point.  Any dupacks/sacks below this
 		 * won't trigger a new loss, since we won't reset_recovery()
 		 * until we ack past recovery_pt. */
@@ -3630,6 +3878,40 @@ static void tcpporthogdefensectl(char *val)
 		error(EINVAL, "unknown value for tcpporthogdefense");
 }
 
+static struct tcp_cc_ops *tcpfindcc(char **f, int n)
+{
+	struct tcp_cc_ops *cc;
+
+	if (n != 2)
+		error(EINVAL, "usage: %s reno|cubic", f[0]);
+	cc = tcp_cc_lookup(f[1]);
+	if (cc == NULL)
+		error(EINVAL, "unknown congestion control %s", f[1]);
+	return cc;
+}
+
+/* Sets the conv's congestion control.  Before a connect or announce, this
+ * picks the algorithm the connection starts with.  On an open conv, the new
+ * algorithm starts from the current cwind and ssthresh.  Passive opens get
+ * their listener's.  The choice lasts until the conv is closed. */
+static void tcpsetcc(struct conv *s, char **f, int n)
+{
+	Tcpctl *tcb;
+
+	tcb = (Tcpctl *) s->ptcl;
+	tcb->cc_chosen = tcpfindcc(f, n);
+	tcb->cc = tcb->cc_chosen;
+	tcb->cc->init(tcb);
+}
+
+/* Sets the congestion control for convs made from now on */
+static void tcpsetccdefault(struct conv *s, char **f, int n)
+{
+	struct tcppriv *tpriv = s->p->priv;
+
+	tpriv->cc_default = tcpfindcc(f, n);
+}
+
 /* called with c qlocked */
 static void tcpctl(struct conv *c, char **f, int n)
 {
@@ -3641,6 +3923,10 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpsetchecksum(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
+	else if (n >= 1 && strcmp(f[0], "cc") == 0)
+		tcpsetcc(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "ccdefault") == 0)
+		tcpsetccdefault(c, f, n);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -3731,7 +4017,18 @@ void tcpinit(struct Fs *fs)
 	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), 0);
 	debug_priv = tpriv;
 	qlock_init(&tpriv->tl);
+	for (int i = 0; i < TW_LEVELS; i++)
+		for (int j = 0; j < TW_SIZE; j++)
+			INIT_LIST_HEAD(&tpriv->wheel.slots[i][j]);
 	qlock_init(&tpriv->apl);
+	iphtinit(&tpriv->ht);
+	urandom_read(&tpriv->limbo_key, sizeof(tpriv->limbo_key));
+	urandom_read(&tpriv->cookie_key, sizeof(tpriv->cookie_key));
+	for (int i = 0; i <= SYNACK_RXMITS; i++)
+		INIT_LIST_HEAD(&tpriv->limbo_rx[i]);
+	tpriv->limbo_timer.func = limbotimer;
+	tpriv->limbo_timer.arg = tcp;
+	tpriv->cc_default = &tcp_cc_reno;
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
 	tcp->announce = tcpannounce;
@@ -3748,8 +4045,9 @@ void tcpinit(struct Fs *fs)
 	tcp->gc = tcpgc;
 	tcp->ipproto = IP_TCPPROTO;
 	tcp->nc = 4096;
+	tcp->maxnc = Maxconv;
 	tcp->ptclsize = sizeof(Tcpctl);
-	tpriv->stats[MaxConn] = tcp->nc;
+	tpriv->stats[MaxConn] = tcp->maxnc;
 
 	Fsproto(fs, tcp);
 }
@@ -0,0 +1,202 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * TCP congestion control algorithms.
+ *
+ * update() in tcp.c does the bookkeeping common to all algorithms: it only
+ * asks the algorithm how much to grow cwind when there is room to grow, and
+ * clamps the result to the send window.  Losses found by dupacks or SACKs and
+ * retransmit timeouts each get their own op, so an algorithm can back off
+ * differently for them.
+ *
+ * Reno is what TCP always did here: slow start, then one MSS per RTT, and
+ * halve on a loss.
+ *
+ * CUBIC (RFC 9438) grows the window as a cubic function of the time since the
+ * last loss, centered on the window at which the loss happened.  It gets back
+ * to that window quickly, stays there for a while, then probes for more.
+ * Growth depends on time rather than on ACKs, so it fills long fat pipes much
+ * sooner than Reno, and it is never slower than Reno would be.  We do the math
+ * in bytes and ms, with integers. */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+static void reno_init(Tcpctl *tcb)
+{
+}
+
+static uint32_t reno_on_ack(Tcpctl *tcb, uint32_t acked)
+{
+	if (tcb->cwind < tcb->ssthresh) {
+		/* We increase the cwind by every byte we receive.  We want to
+		 * increase the cwind by one MSS for every MSS that gets ACKed.
+		 * Note that multiple MSSs can be ACKed in a single ACK.  If we
+		 * had a remainder of acked / MSS, we'd add just that remainder
+		 * - not 0 or 1 MSS. */
+		return acked;
+	}
+	/* Every RTT, which consists of CWND bytes, we're supposed to expand by
+	 * MSS bytes.  The classic algorithm was
+	 * 	expand = (tcb->mss * tcb->mss) / tcb->cwind;
+	 * which assumes the ACK was for MSS bytes.  Instead, for every 'acked'
+	 * bytes, we increase the window by acked / CWND (in units of MSS). */
+	return MAX(acked, tcb->typical_mss) * tcb->typical_mss / tcb->cwind;
+}
+
+static void reno_on_loss(Tcpctl *tcb)
+{
+	tcb->ssthresh = tcb->cwind / 2;
+	tcb->cwind = tcb->ssthresh;
+}
+
+struct tcp_cc_ops tcp_cc_reno = {
+	.name = "reno",
+	.init = reno_init,
+	.on_ack = reno_on_ack,
+	.on_loss = reno_on_loss,
+	.on_rto = reno_on_loss,
+};
+
+/* In tenths: cwind shrinks to 0.7 of itself on a loss, and the cubic grows by
+ * 0.4 MSS per s^3.  dt is capped, in ms, so that dt^3 doesn't overflow.
+ * CUBIC_CBRT_MAX is the cube root of 2^64, rounded up. */
+#define CUBIC_BETA		7
+#define CUBIC_C			4
+#define CUBIC_MAX_DT		100000
+#define CUBIC_CBRT_MAX		2642246
+
+static void cubic_init(Tcpctl *tcb)
+{
+	memset(&tcb->cc_state.cubic, 0, sizeof(struct cubic_state));
+}
+
+/* Returns the integer cube root of x, rounded down */
+uint32_t tcp_cubic_cbrt(uint64_t x)
+{
+	uint64_t lo = 0, hi = CUBIC_CBRT_MAX, mid;
+
+	while (lo + 1 < hi) {
+		mid = (lo + hi) / 2;
+		if (mid * mid * mid <= x)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* C * dt^3, in bytes, for dt in ms */
+static uint64_t cubic_growth(Tcpctl *tcb, uint64_t dt)
+{
+	dt = MIN(dt, CUBIC_MAX_DT);
+	return dt * dt * dt / 1000 * CUBIC_C * tcb->typical_mss / 10000000;
+}
+
+/* Starts growing from the current cwind.  K is when the cubic gets back to
+ * w_max: C * K^3 = w_max - cwind. */
+static void cubic_start_epoch(Tcpctl *tcb, uint64_t now)
+{
+	struct cubic_state *cs = &tcb->cc_state.cubic;
+	uint32_t cwnd = tcb->cwind;
+
+	cs->epoch_start = now;
+	cs->w_est_start = cwnd;
+	if (cwnd < cs->w_max) {
+		cs->origin = cs->w_max;
+		cs->k = tcp_cubic_cbrt((uint64_t)(cs->w_max - cwnd) *
+				   (10000000 / CUBIC_C) / tcb->typical_mss *
+				   1000);
+	} else {
+		cs->origin = cwnd;
+		cs->k = 0;
+	}
+}
+
+static uint32_t cubic_on_ack(Tcpctl *tcb, uint32_t acked)
+{
+	struct cubic_state *cs = &tcb->cc_state.cubic;
+	uint64_t now = milliseconds();
+	uint32_t cwnd = tcb->cwind;
+	uint32_t srtt = MAX(tcb->srtt, 1);
+	uint64_t t, target, w_est;
+
+	if (cwnd < tcb->ssthresh)
+		return acked;
+	if (!cs->epoch_start)
+		cubic_start_epoch(tcb, now);
+
+	/* Aim for where the cubic will be an RTT from now */
+	t = now - cs->epoch_start + srtt;
+	if (t < cs->k)
+		target = cs->origin - MIN(cubic_growth(tcb, cs->k - t),
+					  cs->origin);
+	else
+		target = cs->origin + cubic_growth(tcb, t - cs->k);
+
+	/* Reno, backing off by CUBIC_BETA, would have grown by
+	 * 3 * (1 - beta) / (1 + beta) MSS per RTT.  Don't be slower. */
+	w_est = cs->w_est_start + t * 3 * (10 - CUBIC_BETA) *
+		tcb->typical_mss / ((10 + CUBIC_BETA) * srtt);
+	target = MAX(target, w_est);
+
+	/* Grow by at most half a window per RTT */
+	target = MIN(target, (uint64_t)cwnd + cwnd / 2);
+	if (target <= cwnd)
+		return 0;
+	/* Get to target over the next cwind bytes of ACKs */
+	return (target - cwnd) * acked / cwnd;
+}
+
+static void cubic_on_loss(Tcpctl *tcb)
+{
+	struct cubic_state *cs = &tcb->cc_state.cubic;
+	uint32_t cwnd = tcb->cwind;
+
+	cs->epoch_start = 0;
+	/* Fast convergence: if we didn't get back to the last w_max, another
+	 * flow is probably taking more of the link.  Give it some room. */
+	if (cwnd < cs->w_max)
+		cs->w_max = (uint64_t)cwnd * (10 + CUBIC_BETA) / 20;
+	else
+		cs->w_max = cwnd;
+	tcb->ssthresh = MAX((uint64_t)cwnd * CUBIC_BETA / 10,
+			    2 * tcb->typical_mss);
+	tcb->cwind = tcb->ssthresh;
+}
+
+/* A timeout means we don't know much about the link anymore, so we start over
+ * from the reduced window, instead of heading back to the old w_max. */
+static void cubic_on_rto(Tcpctl *tcb)
+{
+	cubic_on_loss(tcb);
+	cubic_init(tcb);
+}
+
+struct tcp_cc_ops tcp_cc_cubic = {
+	.name = "cubic",
+	.init = cubic_init,
+	.on_ack = cubic_on_ack,
+	.on_loss = cubic_on_loss,
+	.on_rto = cubic_on_rto,
+};
+
+static struct tcp_cc_ops *tcp_ccs[] = {
+	&tcp_cc_reno,
+	&tcp_cc_cubic,
+};
+
+/* Returns the algorithm called name, or NULL. */
+struct tcp_cc_ops *tcp_cc_lookup(char *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(tcp_ccs); i++) {
+		if (!strcmp(tcp_ccs[i]->name, name))
+			return tcp_ccs[i];
+	}
+	return NULL;
+}
@@ -673,9 +673,11 @@ int udpstats(struct Proto *udp, char *buf, int len)
 void udpinit(struct Fs *fs)
 {
 	struct Proto *udp;
+	Udppriv *upriv;
 
 	udp = kzmalloc(sizeof(struct Proto), 0);
-	udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	upriv = udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	iphtinit(&upriv->ht);
 	udp->name = "udp";
 	udp->connect = udpconnect;
 	udp->bind = udpbind;
@@ -690,6 +692,7 @@ void udpinit(struct Fs *fs)
 	udp->stats = udpstats;
 	udp->ipproto = IP_UDPPROTO;
 	udp->nc = 4096;
+	udp->maxnc = Maxconv;
 	udp->ptclsize = sizeof(Udpcb);
 
 	Fsproto(fs, udp);
@@ -60,8 +60,9 @@ struct block *block_alloc(size_t size, int mem_flags)
 	/* If Hdrspc is not block aligned it will cause issues. */
 	static_assert(Hdrspc % BLOCKALIGN == 0);
 
-	b = kmalloc(sizeof(struct block) + size + Hdrspc + (BLOCKALIGN - 1),
-				mem_flags);
+	/* Blocks get kmalloc_incref()d when other blocks point into them. */
+	b = kmalloc_refd(sizeof(struct block) + size + Hdrspc +
+	                 (BLOCKALIGN - 1), mem_flags);
 	if (b == NULL)
 		return NULL;
 
@@ -183,6 +184,7 @@ void block_copy_metadata(struct block *new_b, struct block *old_b)
 	new_b->flag |= (old_b->flag & BLOCK_META_FLAGS);
 	new_b->tx_csum_offset = old_b->tx_csum_offset;
 	new_b->mss = old_b->mss;
+	new_b->rx_hash = old_b->rx_hash;
 	new_b->network_offset = old_b->network_offset;
 	new_b->transport_offset = old_b->transport_offset;
 	new_b->free = old_b->free;
@@ -199,6 +201,7 @@ void block_reset_metadata(struct block *b)
 	b->flag &= ~BLOCK_META_FLAGS;
 	b->tx_csum_offset = 0;
 	b->mss = 0;
+	b->rx_hash = 0;
 	b->network_offset = 0;
 	b->transport_offset = 0;
 	b->free = NULL;
@@ -191,6 +191,7 @@ struct chan *newchan(void)
 	c->name = 0;
 	c->buf = NULL;
 	c->mountpoint = NULL;
+	memset(&c->ra, 0, sizeof(c->ra));
 	return c;
 }
 
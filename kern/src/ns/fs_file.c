@@ -302,7 +302,7 @@ static void fs_file_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 			error(-error, "punch_hole pm_load_page failed");
 		zero_amt = MIN(PGSIZE - PGOFF(begin), end - begin);
 		memset(page2kva(page) + PGOFF(begin), 0, zero_amt);
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_page_set_dirty(f->pm, page);
 		pm_put_page(page);
 		first_pg_idx++;
 		nr_pages--;
@@ -316,7 +316,7 @@ static void fs_file_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 		if (error)
 			error(-error, "punch_hole pm_load_page failed");
 		memset(page2kva(page), 0, PGOFF(end));
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_page_set_dirty(f->pm, page);
 		pm_put_page(page);
 		last_pg_idx--;
 		nr_pages--;
@@ -349,9 +349,10 @@ void fs_file_truncate(struct fs_file *f, off64_t to)
 }
 
 /* Standard read.  We sync with write, in that once the length is set, we'll
- * attempt to read those bytes. */
+ * attempt to read those bytes.  ra is the reader's readahead state (e.g. the
+ * chan's), or NULL for no readahead. */
 size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
-                    off64_t offset)
+                    off64_t offset, struct file_ra_state *ra)
 {
 	ERRSTACK(1);
 	struct page *page;
@@ -379,7 +380,7 @@ size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
 			break;
 		pg_off = PGOFF(offset + so_far);
 		pg_idx = LA2PPN(offset + so_far);
-		error = pm_load_page(f->pm, pg_idx, &page);
+		error = pm_load_page_ra(f->pm, pg_idx, &page, ra);
 		if (error)
 			error(-error, "read pm_load_page failed");
 		copy_amt = MIN(PGSIZE - pg_off, buf_end - buf);
@@ -431,6 +432,7 @@ size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
 			      count);
 	}
 	while (buf < buf_end) {
+		pm_throttle_dirty(f->pm);
 		pg_off = PGOFF(offset + so_far);
 		pg_idx = LA2PPN(offset + so_far);
 		error = pm_load_page(f->pm, pg_idx, &page);
@@ -453,7 +455,7 @@ size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
 			memset(page2kva(page) + pg_off, 0, copy_amt);
 		buf += copy_amt;
 		so_far += copy_amt;
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_page_set_dirty(f->pm, page);
 		pm_put_page(page);
 	}
 	assert(buf == buf_end);
@@ -558,7 +558,7 @@ struct block *adjustblock(struct block *bp, int len)
 			return bp;
 		}
 		/* Grow with extra data buffers. */
-		buf = kzmalloc(len - BLEN(bp), MEM_WAIT);
+		buf = kzmalloc_refd(len - BLEN(bp), MEM_WAIT);
 		block_append_extra(bp, (uintptr_t)buf, 0, len - BLEN(bp),
 				   MEM_WAIT);
 		QDEBUG checkb(bp, "adjustblock 3");
@@ -1573,7 +1573,7 @@ static struct block *build_block(void *from, size_t len, int mem_flags)
 	b = block_alloc(64, mem_flags);
 	if (!b)
 		return 0;
-	ext_buf = kmalloc(len, mem_flags);
+	ext_buf = kmalloc_refd(len, mem_flags);
 	if (!ext_buf) {
 		kfree(b);
 		return 0;
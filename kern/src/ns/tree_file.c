@@ -86,6 +86,8 @@ static void __tf_free(struct tree_file *tf)
 	struct tree_file *parent = tf->parent;
 	struct tree_filesystem *tfs = tf->tfs;
 
+	/* Readahead or writeback might still be using the backend */
+	pm_wait_async(tf->file.pm);
 	tf->tfs->tf_ops.free(tf);
 	if (tf->flags & TF_F_IS_ROOT) {
 		assert(tfs->root == tf);
@@ -1027,7 +1029,7 @@ size_t tree_chan_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 
 	if (tree_file_is_dir(tf))
 		return tree_file_readdir(tf, ubuf, n, offset, &c->dri);
-	return fs_file_read(&tf->file, ubuf, n, offset);
+	return fs_file_read(&tf->file, ubuf, n, offset, &c->ra);
 }
 
 size_t tree_chan_write(struct chan *c, void *ubuf, size_t n, off64_t offset)
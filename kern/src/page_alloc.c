@@ -9,22 +9,383 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <arena.h>
+#include <arch/topology.h>
+#include <reclaim.h>
+
+/* Physical memory is split into one kpages arena per NUMA node, e.g.
+ * kpages_1, which import from the base arena.  Their import functions only
+ * take memory from their node's SRAT ranges.  Allocations prefer the calling
+ * core's node, or a node the caller asks for, and fall back to the global
+ * kpages arena if the node is out of memory.  kpages_arena still backs the
+ * slabs and anything allocated before numa_init().
+ *
+ * The arena import functions only get the source arena, not the importer, so
+ * each node arena's source is the node's 'mem' arena.  The mem arena never has
+ * any segments; it just tells the import functions which node they are
+ * working for.  It also groups the node arena under a per-node name in
+ * kmemstat.
+ *
+ * With only one node, we don't bother with any of this, and node 0 uses
+ * kpages_arena. */
+#define NUMA_MAX_MEM_RANGES		16
+
+/* Pool of pre-zeroed pages, one per NUMA node.  Allocators that want a zeroed
+ * page try their node's pool first, and only memset inline on a miss.  Idle
+ * cores refill their node's pool from smp_idle().
+ *
+ * Watermarks: once a pool drops below ZPOOL_LOW_WATER, idle cores refill it
+ * until it reaches ZPOOL_HIGH_WATER, ZPOOL_BATCH pages at a time.  We won't
+ * refill at all if less than 1/ZPOOL_MIN_FREE_FRAC of memory is free, since
+ * those pages would be better off in the allocator. */
+#define ZPOOL_LOW_WATER			256
+#define ZPOOL_HIGH_WATER		1024
+#define ZPOOL_BATCH			8
+#define ZPOOL_MIN_FREE_FRAC		16
+
+struct zpool {
+	spinlock_t			lock;
+	page_list_t			pages;
+	size_t				nr_pages;
+	bool				refilling;
+	uint64_t			nr_hits;
+	uint64_t			nr_misses;
+	uint64_t			nr_zeroed;
+	uint64_t			nr_reclaimed;
+};
+
+struct numa_node {
+	struct arena			*kpages;
+	struct arena			kpages_arena;
+	struct arena			mem;
+	int				nr_ranges;
+	struct {
+		uintptr_t		start;
+		uintptr_t		end;
+	} ranges[NUMA_MAX_MEM_RANGES];
+	size_t				amt_mem;
+	atomic_t			nr_fallbacks;
+	struct zpool			zpool;
+};
+
+static struct numa_node *numa_nodes;
+static int nr_numa_nodes;
+
+static struct numa_node *numa_node(int node)
+{
+	if (!numa_nodes)
+		return NULL;
+	if (node < 0 || node >= nr_numa_nodes)
+		node = core_numa_id(core_id());
+	return &numa_nodes[node];
+}
+
+static int this_numa_id(void)
+{
+	if (!numa_nodes)
+		return 0;
+	return core_numa_id(core_id());
+}
+
+int numa_nr_nodes(void)
+{
+	return nr_numa_nodes ?: 1;
+}
+
+static void *numa_mem_import(struct arena *mem, size_t size, int flags)
+{
+	struct numa_node *n = container_of(mem, struct numa_node, mem);
+	void *ret;
+
+	/* Base arenas panic on OOM unless MEM_ATOMIC.  The node running out is
+	 * not an OOM; our caller will try elsewhere. */
+	flags = (flags & ~MEM_FLAGS) | MEM_ATOMIC;
+	for (int i = 0; i < n->nr_ranges; i++) {
+		ret = arena_xalloc(base_arena, size, PGSIZE, 0, 0,
+		                   (void*)n->ranges[i].start,
+		                   (void*)n->ranges[i].end, flags);
+		if (ret)
+			return ret;
+	}
+	return NULL;
+}
+
+static void numa_mem_release(struct arena *mem, void *addr, size_t size)
+{
+	arena_xfree(base_arena, addr, size);
+}
+
+static void add_numa_range(int numa_id, physaddr_t start, size_t len,
+                           void *arg)
+{
+	struct numa_node *n = arg;
+	physaddr_t end = start + len;
+
+	if (numa_id >= nr_numa_nodes) {
+		warn("SRAT memory for numa_id %d, but we have %d nodes",
+		     numa_id, nr_numa_nodes);
+		return;
+	}
+	n = &n[numa_id];
+	/* Only the KERNBASE mapping is in the base arena. */
+	if (start >= max_paddr)
+		return;
+	end = MIN(end, max_paddr);
+	if (n->nr_ranges == NUMA_MAX_MEM_RANGES) {
+		warn("Too many SRAT memory ranges for numa_id %d", numa_id);
+		return;
+	}
+	n->ranges[n->nr_ranges].start = (uintptr_t)KADDR(start);
+	n->ranges[n->nr_ranges].end = (uintptr_t)KADDR(end);
+	n->nr_ranges++;
+	n->amt_mem += end - start;
+}
+
+static void zpool_init(struct zpool *zp)
+{
+	spinlock_init_irqsave(&zp->lock);
+	BSD_LIST_INIT(&zp->pages);
+	zp->refilling = TRUE;
+}
+
+/* Reclaim hook: when memory is low, give the pools' pages back.  The pools
+ * won't refill until memory frees up. */
+static void zpool_reclaim(struct reclaimer *r, int level)
+{
+	struct zpool *zp;
+	page_list_t victims;
+	struct page *pg;
+
+	if (level != RECLAIM_LOW_MEM)
+		return;
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		zp = &numa_nodes[i].zpool;
+		BSD_LIST_INIT(&victims);
+		spin_lock_irqsave(&zp->lock);
+		while ((pg = BSD_LIST_FIRST(&zp->pages))) {
+			BSD_LIST_REMOVE(pg, pg_link);
+			BSD_LIST_INSERT_HEAD(&victims, pg, pg_link);
+		}
+		zp->nr_reclaimed += zp->nr_pages;
+		zp->nr_pages = 0;
+		spin_unlock_irqsave(&zp->lock);
+		while ((pg = BSD_LIST_FIRST(&victims))) {
+			BSD_LIST_REMOVE(pg, pg_link);
+			kpages_free(page2kva(pg), PGSIZE);
+		}
+	}
+}
+
+static struct reclaimer zpool_reclaimer = {
+	.name = "zpool",
+	.func = zpool_reclaim,
+};
+
+/* Called after topology_init(), once we know how many nodes there are.  Until
+ * then, all allocations come from kpages_arena, and zeroed allocations memset
+ * inline. */
+void numa_init(void)
+{
+	struct numa_node *nodes, *n;
+	char name[ARENA_NAME_SZ];
+
+	nr_numa_nodes = MAX(cpu_topology_info.num_numa, 1);
+	nodes = kzmalloc(sizeof(struct numa_node) * nr_numa_nodes, MEM_WAIT);
+	numa_foreach_mem_range(add_numa_range, nodes);
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		n = &nodes[i];
+		zpool_init(&n->zpool);
+		if (nr_numa_nodes == 1 || !n->nr_ranges) {
+			n->kpages = kpages_arena;
+			continue;
+		}
+		snprintf(name, sizeof(name), "numa%d_mem", i);
+		__arena_create(&n->mem, name, PGSIZE, NULL, NULL, NULL, 0);
+		snprintf(name, sizeof(name), "kpages_%d", i);
+		__arena_create(&n->kpages_arena, name, PGSIZE, numa_mem_import,
+		               numa_mem_release, &n->mem, 8 * PGSIZE);
+		n->kpages = &n->kpages_arena;
+		printk("NUMA node %d: %lu MB in %d ranges\n", i,
+		       n->amt_mem >> 20, n->nr_ranges);
+	}
+	wmb();	/* init before publishing */
+	numa_nodes = nodes;
+	register_reclaimer(&zpool_reclaimer);
+}
+
+/* Allocates from node n's kpages, without falling back to other nodes.  Tags
+ * the first page so kpages_free() knows which arena to return it to. */
+static void *__node_kpages_alloc(struct numa_node *n, size_t size, int flags)
+{
+	void *ret;
+
+	if (n->kpages == kpages_arena)
+		return arena_alloc(kpages_arena, size, flags);
+	ret = arena_alloc(n->kpages, size, (flags & ~MEM_FLAGS) | MEM_ATOMIC);
+	if (ret)
+		kva2page(ret)->pg_kpages_node = n - numa_nodes + 1;
+	return ret;
+}
+
+/* Allocates from kpages, preferring node's memory.  Drivers can use this to
+ * put buffers near their device, and the ksched near a proc's cores
+ * (core_numa_id()).  Falls back to any node. */
+void *kpages_alloc_node(size_t size, int flags, int node)
+{
+	struct numa_node *n = numa_node(node);
+	void *ret;
+
+	if (!n)
+		return arena_alloc(kpages_arena, size, flags);
+	ret = __node_kpages_alloc(n, size, flags);
+	if (ret)
+		return ret;
+	atomic_inc(&n->nr_fallbacks);
+	return arena_alloc(kpages_arena, size, flags);
+}
 
 /* Helper, allocates a free page. */
-static struct page *get_a_free_page(void)
+static struct page *get_a_free_page(int node)
 {
 	void *addr;
 
-	addr = kpages_alloc(PGSIZE, MEM_ATOMIC);
+	addr = kpages_alloc_node(PGSIZE, MEM_ATOMIC, node);
 	if (!addr)
 		return NULL;
 	return kva2page(addr);
 }
 
+/* Returns a zeroed page from node's zpool, or NULL if it is empty. */
+static struct page *zpool_get(int node)
+{
+	struct numa_node *n = numa_node(node);
+	struct zpool *zp;
+	struct page *pg;
+
+	if (!n)
+		return NULL;
+	zp = &n->zpool;
+	spin_lock_irqsave(&zp->lock);
+	pg = BSD_LIST_FIRST(&zp->pages);
+	if (pg) {
+		BSD_LIST_REMOVE(pg, pg_link);
+		zp->nr_pages--;
+		zp->nr_hits++;
+		if (zp->nr_pages < ZPOOL_LOW_WATER)
+			zp->refilling = TRUE;
+	} else {
+		zp->nr_misses++;
+		zp->refilling = TRUE;
+	}
+	spin_unlock_irqsave(&zp->lock);
+	return pg;
+}
+
+static bool zpool_mem_is_low(void)
+{
+	size_t total = base_arena->amt_total_segs;
+
+	return total - base_arena->amt_alloc_segs < total / ZPOOL_MIN_FREE_FRAC;
+}
+
+/* Zeroes up to ZPOOL_BATCH pages for this core's zpool.  Called by idle cores
+ * with IRQs disabled, so we keep the batches small.  Returns TRUE if the pool
+ * still wants more pages, in which case the caller should check for other work
+ * and call us again. */
+bool zpool_refill_idle(void)
+{
+	struct numa_node *n = numa_node(this_numa_id());
+	struct page *batch[ZPOOL_BATCH];
+	struct zpool *zp;
+	int nr = 0;
+	void *kva;
+
+	if (!n)
+		return FALSE;
+	zp = &n->zpool;
+	if (!READ_ONCE(zp->refilling))
+		return FALSE;
+	if (zpool_mem_is_low())
+		return FALSE;
+	for (; nr < ZPOOL_BATCH; nr++) {
+		/* Only local pages, not the fallback */
+		kva = __node_kpages_alloc(n, PGSIZE, MEM_ATOMIC);
+		if (!kva)
+			break;
+		memset(kva, 0, PGSIZE);
+		batch[nr] = kva2page(kva);
+	}
+	spin_lock_irqsave(&zp->lock);
+	for (int i = 0; i < nr; i++)
+		BSD_LIST_INSERT_HEAD(&zp->pages, batch[i], pg_link);
+	zp->nr_pages += nr;
+	zp->nr_zeroed += nr;
+	if (nr < ZPOOL_BATCH || zp->nr_pages >= ZPOOL_HIGH_WATER)
+		zp->refilling = FALSE;
+	spin_unlock_irqsave(&zp->lock);
+	return READ_ONCE(zp->refilling);
+}
+
+void zpool_fetch_stats(struct sized_alloc *sza)
+{
+	struct zpool *zp;
+
+	sza_printf(sza, "Zero page pools: low %d, high %d, batch %d\n",
+	           ZPOOL_LOW_WATER, ZPOOL_HIGH_WATER, ZPOOL_BATCH);
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		zp = &numa_nodes[i].zpool;
+		spin_lock_irqsave(&zp->lock);
+		sza_printf(sza, "Node %d: pages %lu, %s\n", i, zp->nr_pages,
+		           zp->refilling ? "refilling" : "full");
+		sza_printf(sza, "\thits %llu, misses %llu, zeroed %llu\n",
+		           zp->nr_hits, zp->nr_misses, zp->nr_zeroed);
+		sza_printf(sza, "\treclaimed %llu\n", zp->nr_reclaimed);
+		spin_unlock_irqsave(&zp->lock);
+	}
+}
+
+void numa_fetch_stats(struct sized_alloc *sza)
+{
+	struct numa_node *n;
+	int nr_cores;
+
+	sza_printf(sza, "NUMA nodes: %d\n", numa_nr_nodes());
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		n = &numa_nodes[i];
+		nr_cores = 0;
+		for (int j = 0; j < num_cores; j++)
+			nr_cores += core_numa_id(j) == i;
+		sza_printf(sza, "Node %d: cores %d, arena %s\n", i, nr_cores,
+		           n->kpages->name);
+		sza_printf(sza, "\tMemory (SRAT): %15llu\n", n->amt_mem);
+		sza_printf(sza, "\tImported     : %15llu\n",
+		           n->kpages->amt_total_segs);
+		sza_printf(sza, "\tAllocated    : %15llu\n",
+		           n->kpages->amt_alloc_segs);
+		sza_printf(sza, "\tAllocs ever  : %15llu\n",
+		           n->kpages->nr_allocs_ever);
+		sza_printf(sza, "\tFallbacks    : %15llu\n",
+		           atomic_read(&n->nr_fallbacks));
+	}
+}
+
+/* Helper, returns a zeroed page, preferably one from the zpool. */
+static struct page *get_a_zeroed_page(int node)
+{
+	struct page *pg = zpool_get(node);
+
+	if (pg)
+		return pg;
+	pg = get_a_free_page(node);
+	if (pg)
+		memset(page2kva(pg), 0, PGSIZE);
+	return pg;
+}
+
 /**
- * @brief Allocates a physical page from a pool of unused physical memory.
+ * @brief Allocates a physical page from a pool of unused physical memory,
+ * preferably from NUMA node.
  *
- * Zeroes the page.
+ * Zeroes the page, if asked.  Zeroed pages come from the zpool if possible.
  *
  * @param[out] page  set to point to the Page struct
  *                   of the newly allocated page
@@ -32,21 +393,26 @@ static struct page *get_a_free_page(void)
  * @return ESUCCESS on success
  * @return -ENOMEM  otherwise
  */
-error_t upage_alloc(struct proc *p, page_t **page, bool zero)
+error_t upage_alloc_node(struct proc *p, page_t **page, bool zero, int node)
 {
-	struct page *pg = get_a_free_page();
+	struct page *pg = zero ? get_a_zeroed_page(node)
+	                       : get_a_free_page(node);
 
 	if (!pg)
 		return -ENOMEM;
 	*page = pg;
-	if (zero)
-		memset(page2kva(*page), 0, PGSIZE);
 	return 0;
 }
 
+/* Same, but from the calling core's node */
+error_t upage_alloc(struct proc *p, page_t **page, bool zero)
+{
+	return upage_alloc_node(p, page, zero, this_numa_id());
+}
+
 error_t kpage_alloc(page_t **page)
 {
-	struct page *pg = get_a_free_page();
+	struct page *pg = get_a_free_page(this_numa_id());
 
 	if (!pg)
 		return -ENOMEM;
@@ -58,7 +424,7 @@ error_t kpage_alloc(page_t **page)
  * returns the kernel address (kernbase), or 0 on error. */
 void *kpage_alloc_addr(void)
 {
-	struct page *pg = get_a_free_page();
+	struct page *pg = get_a_free_page(this_numa_id());
 
 	if (!pg)
 		return 0;
@@ -67,23 +433,31 @@ void *kpage_alloc_addr(void)
 
 void *kpage_zalloc_addr(void)
 {
-	void *retval = kpage_alloc_addr();
-	if (retval)
-		memset(retval, 0, PGSIZE);
-	return retval;
+	struct page *pg = get_a_zeroed_page(this_numa_id());
+
+	if (!pg)
+		return 0;
+	return page2kva(pg);
 }
 
-/* Helper function for allocating from the kpages_arena.  This may be useful
- * later since we might send the caller to a different NUMA domain. */
+/* Helper function for allocating from the kpages arenas.  Prefers the calling
+ * core's NUMA node. */
 void *kpages_alloc(size_t size, int flags)
 {
-	return arena_alloc(kpages_arena, size, flags);
+	return kpages_alloc_node(size, flags, this_numa_id());
 }
 
 void *kpages_zalloc(size_t size, int flags)
 {
-	void *ret = arena_alloc(kpages_arena, size, flags);
+	struct page *pg;
+	void *ret;
 
+	if (size == PGSIZE) {
+		pg = zpool_get(this_numa_id());
+		if (pg)
+			return page2kva(pg);
+	}
+	ret = kpages_alloc(size, flags);
 	if (!ret)
 		return NULL;
 	memset(ret, 0, size);
@@ -92,7 +466,15 @@ void *kpages_zalloc(size_t size, int flags)
 
 void kpages_free(void *addr, size_t size)
 {
-	arena_free(kpages_arena, addr, size);
+	struct page *pg = kva2page(addr);
+	int node = pg->pg_kpages_node;
+
+	if (!node) {
+		arena_free(kpages_arena, addr, size);
+		return;
+	}
+	pg->pg_kpages_node = 0;
+	arena_free(numa_nodes[node - 1].kpages, addr, size);
 }
 
 /* Returns naturally aligned, contiguous pages of amount PGSIZE << order.  Linux
@@ -109,13 +491,52 @@ void free_cont_pages(void *buf, size_t order)
 	arena_xfree(kpages_arena, buf, PGSIZE << order);
 }
 
-/* Frees the page */
+/* Pages from a split jumbo page share the jumbo's refcnt, which is in the
+ * jumbo's first page.  Jumbos are naturally aligned. */
+static page_t *jumbo_head(page_t *page)
+{
+	return pa2page(ROUNDDOWN(page2pa(page), PML2_PTE_REACH));
+}
+
+static bool page_is_jumbo_split(page_t *page)
+{
+	return atomic_read(&page->pg_flags) & PG_JUMBO_SPLIT ? true : false;
+}
+
+/* Pages start out with one implicit ref, held by whoever allocated them.  Extra
+ * refs come from sharing, e.g. fork() mapping the same page CoW into the parent
+ * and the child.  Whoever drops the last ref frees the page. */
+void page_incref(page_t *page)
+{
+	if (page_is_jumbo_split(page))
+		page = jumbo_head(page);
+	atomic_inc(&page->pg_extra_refs);
+}
+
+/* Frees the page, if no one else has a ref */
 void page_decref(page_t *page)
 {
 	assert(!page_is_pagemap(page));
+	if (page_is_jumbo_split(page))
+		return jumbo_page_decref(jumbo_head(page));
+	if (atomic_add_not_zero(&page->pg_extra_refs, -1))
+		return;
 	kpages_free(page2kva(page), PGSIZE);
 }
 
+/* Returns TRUE if someone other than the caller also has a ref on page.  If
+ * this returns FALSE, the caller has the only ref, and no one else can get one
+ * unless the caller shares it.
+ *
+ * We don't track refs on the individual pages of a split jumbo, so those are
+ * always considered shared. */
+bool page_is_shared(page_t *page)
+{
+	if (page_is_jumbo_split(page))
+		return TRUE;
+	return atomic_read(&page->pg_extra_refs) != 0;
+}
+
 /* Attempts to get a lock on the page for IO operations.  If it is already
  * locked, it will block the kthread until it is unlocked.  Note that this is
  * really a "sleep on some event", not necessarily the IO, but it is "the page
@@ -142,7 +563,8 @@ static void *__jumbo_pml2_alloc(struct arena *a, size_t size, int flags)
 
 static struct arena *jumbo_pml2_arena;
 
-/* Just for example; we could add qcaches too.  Do this after kmalloc_init(). */
+/* Jumbo pages for user memory; we could add qcaches too.  Do this after
+ * kmalloc_init(). */
 void jumbo_arena_init(void)
 {
 	jumbo_pml2_arena = arena_create("jumbo_pml2", NULL, 0, PML2_PTE_REACH,
@@ -160,3 +582,25 @@ void jumbo_page_free(void *buf, size_t nr)
 {
 	arena_free(jumbo_pml2_arena, buf, nr * PML2_PTE_REACH);
 }
+
+/* Same as page_decref(), but for a PML2 jumbo page.  The refs are tracked in
+ * the struct page of the first page of the jumbo. */
+void jumbo_page_decref(page_t *page)
+{
+	if (atomic_add_not_zero(&page->pg_extra_refs, -1))
+		return;
+	for (int i = 0; i < NR_PGS_PER_JUMBO; i++)
+		atomic_and(&page[i].pg_flags, ~PG_JUMBO_SPLIT);
+	jumbo_page_free(page2kva(page), 1);
+}
+
+/* The jumbo page starting at page was mapped by a single PTE, which is now
+ * split into NR_PGS_PER_JUMBO PTEs.  Each of those holds a ref on the jumbo,
+ * and page_decref() on any of them drops a ref on the whole jumbo.  The jumbo
+ * is freed once all of its pages are unmapped. */
+void jumbo_page_split(page_t *page)
+{
+	for (int i = 0; i < NR_PGS_PER_JUMBO; i++)
+		atomic_or(&page[i].pg_flags, PG_JUMBO_SPLIT);
+	atomic_add(&page->pg_extra_refs, NR_PGS_PER_JUMBO - 1);
+}
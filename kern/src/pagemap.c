@@ -13,6 +13,45 @@
 #include <stdio.h>
 #include <pagemap.h>
 #include <rcu.h>
+#include <fs_file.h>
+#include <kthread.h>
+#include <trap.h>
+#include <smp.h>
+#include <kmalloc.h>
+#include <arena.h>
+#include <rendez.h>
+
+/* Readahead.  Readers pass a file_ra_state to pm_load_page_ra(), and we watch
+ * for sequential access.  Once a reader is sequential, we issue a window of
+ * pages after the one it is loading, asynchronously: a routine kmsg inserts
+ * them, locked and not UPTODATE, then reads them in.  A reader that gets to one
+ * of those pages early just waits on the page lock, like for any other load.
+ *
+ * When the reader enters the newest window, we issue the next one, so the
+ * reader stays about a window behind the IO.  At that point, the reader is done
+ * with the older window, and we know how many of its pages it used (hits).  If
+ * it used most of them, we double the window size; if it used less than half,
+ * we halve it.  Pages that were already in the page cache don't count as hits,
+ * so a cached file shrinks to PM_RA_MIN_PGS.  Non-sequential access stops
+ * readahead until the reader is sequential again.
+ *
+ * Pages we read ahead have PG_READAHEAD until someone loads them.  If we free a
+ * page that still has it, the readahead was wasted. */
+#define PM_RA_MIN_PGS			4
+#define PM_RA_MAX_PGS			64
+
+static struct pm_ra_stats {
+	atomic_t			nr_windows;
+	atomic_t			nr_issued;
+	atomic_t			nr_cached;
+	atomic_t			nr_hits;
+	atomic_t			nr_wasted;
+	atomic_t			nr_failed;
+	atomic_t			nr_grows;
+	atomic_t			nr_shrinks;
+} pm_ra_stats;
+
+static void pm_wb_set_mapped(struct page_map *pm, bool mapped);
 
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
@@ -22,6 +61,8 @@ void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 	 * keeps the VMR connected. */
 	spin_lock(&pm->pm_lock);
 	TAILQ_INSERT_TAIL(&pm->pm_vmrs, vmr, vm_pm_link);
+	if ((vmr->vm_flags & MAP_SHARED) && !pm->pm_nr_shared_vmrs++)
+		pm_wb_set_mapped(pm, true);
 	spin_unlock(&pm->pm_lock);
 }
 
@@ -29,6 +70,8 @@ void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr)
 {
 	spin_lock(&pm->pm_lock);
 	TAILQ_REMOVE(&pm->pm_vmrs, vmr, vm_pm_link);
+	if ((vmr->vm_flags & MAP_SHARED) && !--pm->pm_nr_shared_vmrs)
+		pm_wb_set_mapped(pm, false);
 	spin_unlock(&pm->pm_lock);
 }
 
@@ -96,6 +139,16 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 	qlock_init(&pm->pm_qlock);
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
+	atomic_init(&pm->pm_async_users, 0);
+	atomic_init(&pm->pm_nr_dirty, 0);
+	atomic_init(&pm->pm_nr_writeback, 0);
+	pm->pm_nr_shared_vmrs = 0;
+	pm->pm_on_dirty_list = false;
+	pm->pm_dirtied_at = 0;
+	pm->pm_on_mapped_list = false;
+	pm->pm_nr_written = 0;
+	pm->pm_nr_wb_errors = 0;
+	pm->pm_nr_throttled = 0;
 }
 
 /* Looks up the index'th page in the page map, returning a refcnt'd reference
@@ -150,7 +203,7 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	void **tree_slot;
 	void *slot_val = 0;
 
-	page->pg_mapping = pm;	/* debugging */
+	page->pg_mapping = pm;
 	page->pg_index = index;
 	/* no one should be looking at the tree slot til we stop write locking.
 	 * the only other one who looks is removal, who requires a PM write
@@ -183,15 +236,31 @@ void pm_put_page(struct page *page)
 	atomic_add((atomic_t*)tree_slot, -(1UL << PM_REFCNT_SHIFT));
 }
 
-/* Makes sure the index'th page of the mapped object is loaded in the page cache
- * and returns its location via **pp.
- *
- * You'll get a pm-slot refcnt back, which you need to put when you're done. */
-int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
+/* Clears PG_READAHEAD, returning TRUE if we were the first to use the page
+ * since it was read ahead. */
+static bool pm_page_ra_hit(struct page *page)
+{
+	if (!(atomic_read(&page->pg_flags) & PG_READAHEAD))
+		return FALSE;
+	atomic_and(&page->pg_flags, ~PG_READAHEAD);
+	atomic_inc(&pm_ra_stats.nr_hits);
+	return TRUE;
+}
+
+/* For pages we're about to free */
+static void pm_page_ra_check_waste(struct page *page)
+{
+	if (atomic_read(&page->pg_flags) & PG_READAHEAD)
+		atomic_inc(&pm_ra_stats.nr_wasted);
+}
+
+static int __pm_load_page(struct page_map *pm, unsigned long index,
+                          struct page **pp, bool *ra_hit)
 {
 	struct page *page;
 	int error;
 
+	*ra_hit = FALSE;
 	page = pm_find_page(pm, index);
 	while (!page) {
 		if (kpage_alloc(&page))
@@ -225,6 +294,7 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	assert(page);
 	assert(pm_slot_check_refcnt(*page->pg_tree_slot));
 	assert(pm_slot_get_page(*page->pg_tree_slot) == page);
+	*ra_hit = pm_page_ra_hit(page);
 	if (atomic_read(&page->pg_flags) & PG_UPTODATE) {
 		*pp = page;
 		printd("pm %p FOUND page %p, addr %p, idx %d\n", pm, page,
@@ -252,11 +322,23 @@ load_locked_page:
 	return 0;
 }
 
-int pm_load_page_nowait(struct page_map *pm, unsigned long index,
-                        struct page **pp)
+/* Makes sure the index'th page of the mapped object is loaded in the page cache
+ * and returns its location via **pp.
+ *
+ * You'll get a pm-slot refcnt back, which you need to put when you're done. */
+int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
+{
+	bool ra_hit;
+
+	return __pm_load_page(pm, index, pp, &ra_hit);
+}
+
+static int __pm_load_page_nowait(struct page_map *pm, unsigned long index,
+                                 struct page **pp, bool *ra_hit)
 {
 	struct page *page = pm_find_page(pm, index);
 
+	*ra_hit = FALSE;
 	if (!page)
 		return -EAGAIN;
 	if (!(atomic_read(&page->pg_flags) & PG_UPTODATE)) {
@@ -264,10 +346,351 @@ int pm_load_page_nowait(struct page_map *pm, unsigned long index,
 		pm_put_page(page);
 		return -EAGAIN;
 	}
+	*ra_hit = pm_page_ra_hit(page);
 	*pp = page;
 	return 0;
 }
 
+int pm_load_page_nowait(struct page_map *pm, unsigned long index,
+                        struct page **pp)
+{
+	bool ra_hit;
+
+	return __pm_load_page_nowait(pm, index, pp, &ra_hit);
+}
+
+/* Reads in the pages in [start, start + nr) that aren't in the PM yet.  Runs as
+ * a routine kmsg, so we can block.  We insert all of the pages before reading
+ * any, so that readers wait on them instead of loading them on their own. */
+static void __pm_ra_kmsg(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct page_map *pm = (struct page_map*)a0;
+	unsigned long start = a1;
+	unsigned long nr = a2;
+	struct page *pages[PM_RA_MAX_PGS];
+	unsigned long nr_file_pgs;
+	int nr_loads = 0;
+	struct page *page;
+
+	nr_file_pgs = nr_pages(fs_file_get_length(pm->pm_file));
+	nr = MIN(nr, nr_file_pgs > start ? nr_file_pgs - start : 0);
+	for (unsigned long i = start; i < start + nr; i++) {
+		page = pm_find_page(pm, i);
+		if (page) {
+			pm_put_page(page);
+			atomic_inc(&pm_ra_stats.nr_cached);
+			continue;
+		}
+		if (kpage_alloc(&page))
+			break;
+		atomic_set(&page->pg_flags, PG_LOCKED | PG_PAGEMAP |
+		           PG_READAHEAD);
+		sem_init(&page->pg_sem, 0);
+		if (pm_insert_page(pm, i, page)) {
+			/* Someone beat us to it, or we're out of memory */
+			atomic_set(&page->pg_flags, 0);
+			page_decref(page);
+			continue;
+		}
+		pages[nr_loads++] = page;
+	}
+	for (int i = 0; i < nr_loads; i++) {
+		page = pages[i];
+		/* On failure, the page stays !UPTODATE, and whoever loads it
+		 * will try again and deal with the error. */
+		if (pm->pm_op->readpage(pm, page)) {
+			atomic_and(&page->pg_flags, ~PG_READAHEAD);
+			atomic_inc(&pm_ra_stats.nr_failed);
+		} else {
+			atomic_inc(&pm_ra_stats.nr_issued);
+		}
+		unlock_page(page);
+		pm_put_page(page);
+	}
+	atomic_dec(&pm->pm_async_users);
+}
+
+/* Sets up ra's newest window at start, and sends a kmsg to read it in. */
+static void pm_ra_issue(struct page_map *pm, struct file_ra_state *ra,
+                        unsigned long start)
+{
+	unsigned long nr_file_pgs = nr_pages(fs_file_get_length(pm->pm_file));
+
+	ra->win[1].start = start;
+	ra->win[1].nr = start < nr_file_pgs ? MIN(ra->size, nr_file_pgs - start)
+	                                    : 0;
+	ra->win[1].nr_hits = 0;
+	if (!ra->win[1].nr)
+		return;
+	atomic_inc(&pm_ra_stats.nr_windows);
+	atomic_inc(&pm->pm_async_users);
+	send_kernel_message(core_id(), __pm_ra_kmsg, (long)pm, start,
+	                    ra->win[1].nr, KMSG_ROUTINE);
+}
+
+/* Called before a reader loads page idx.  Doesn't block. */
+static void pm_readahead(struct page_map *pm, struct file_ra_state *ra,
+                         unsigned long idx)
+{
+	unsigned long nr, hits;
+
+	if (idx == ra->prev_idx && (idx || ra->size))
+		return;
+	/* Reading from the start of the file counts as sequential */
+	if (idx != ra->prev_idx + 1 && (idx || ra->size)) {
+		memset(ra, 0, sizeof(struct file_ra_state));
+		ra->prev_idx = idx;
+		return;
+	}
+	ra->prev_idx = idx;
+	if (!ra->size) {
+		ra->size = PM_RA_MIN_PGS;
+		pm_ra_issue(pm, ra, idx + 1);
+		return;
+	}
+	if (idx < ra->win[1].start)
+		return;
+	nr = ra->win[0].nr;
+	hits = ra->win[0].nr_hits;
+	if (nr && hits * 4 >= nr * 3 && ra->size < PM_RA_MAX_PGS) {
+		ra->size = MIN(ra->size * 2, PM_RA_MAX_PGS);
+		atomic_inc(&pm_ra_stats.nr_grows);
+	} else if (nr && hits * 2 < nr && ra->size > PM_RA_MIN_PGS) {
+		ra->size = MAX(ra->size / 2, PM_RA_MIN_PGS);
+		atomic_inc(&pm_ra_stats.nr_shrinks);
+	}
+	ra->win[0] = ra->win[1];
+	pm_ra_issue(pm, ra, ra->win[1].start + ra->win[1].nr);
+}
+
+static void pm_ra_count_hit(struct file_ra_state *ra, unsigned long idx)
+{
+	for (int i = 0; i < 2; i++) {
+		if (ra->win[i].start <= idx &&
+		    idx < ra->win[i].start + ra->win[i].nr)
+			ra->win[i].nr_hits++;
+	}
+}
+
+/* pm_load_page(), with readahead for a reader whose state is ra.  ra can be
+ * NULL.  The caller needs to serialize users of ra; racing just results in bad
+ * guesses. */
+int pm_load_page_ra(struct page_map *pm, unsigned long index,
+                    struct page **pp, struct file_ra_state *ra)
+{
+	bool ra_hit;
+	int ret;
+
+	if (ra)
+		pm_readahead(pm, ra, index);
+	ret = __pm_load_page(pm, index, pp, &ra_hit);
+	if (!ret && ra_hit && ra)
+		pm_ra_count_hit(ra, index);
+	return ret;
+}
+
+/* pm_load_page_nowait(), with readahead.  Safe to call while holding a
+ * spinlock.  If this returns -EAGAIN, follow up with pm_load_page_ra(). */
+int pm_load_page_nowait_ra(struct page_map *pm, unsigned long index,
+                           struct page **pp, struct file_ra_state *ra)
+{
+	bool ra_hit;
+	int ret;
+
+	if (ra)
+		pm_readahead(pm, ra, index);
+	ret = __pm_load_page_nowait(pm, index, pp, &ra_hit);
+	if (!ret && ra_hit && ra)
+		pm_ra_count_hit(ra, index);
+	return ret;
+}
+
+void pm_fetch_ra_stats(struct sized_alloc *sza)
+{
+	struct pm_ra_stats *st = &pm_ra_stats;
+
+	sza_printf(sza, "Readahead windows: %lu (min %d, max %d pages)\n",
+	           atomic_read(&st->nr_windows), PM_RA_MIN_PGS, PM_RA_MAX_PGS);
+	sza_printf(sza, "Pages read ahead : %lu\n", atomic_read(&st->nr_issued));
+	sza_printf(sza, "Already cached   : %lu\n", atomic_read(&st->nr_cached));
+	sza_printf(sza, "Hits             : %lu\n", atomic_read(&st->nr_hits));
+	sza_printf(sza, "Wasted (freed)   : %lu\n", atomic_read(&st->nr_wasted));
+	sza_printf(sza, "Failed reads     : %lu\n", atomic_read(&st->nr_failed));
+	sza_printf(sza, "Window grows     : %lu\n", atomic_read(&st->nr_grows));
+	sza_printf(sza, "Window shrinks   : %lu\n", atomic_read(&st->nr_shrinks));
+}
+
+/* Writeback.  PMs with a backing store (a writepage op) count their dirty
+ * pages, and a PM with any dirty pages sits on wb_dirty_pms, oldest first.  The
+ * writeback ktask wakes up every PM_WB_POLL_MS and writes back any PM that has
+ * been dirty for more than pm_dirty_expire_ms.  If more than
+ * pm_dirty_bg_ratio percent of memory is dirty, it writes back PMs, oldest
+ * first, until we're under the ratio again.  Either way, the pages get written
+ * in batches of consecutive pages (see queue_writeback()), so a PM op like
+ * writepages can send them to the backend as one big write.
+ *
+ * Writers that dirty pages faster than the backend can take them (more than
+ * pm_dirty_throttle_ratio percent of memory is dirty) wait in
+ * pm_throttle_dirty() for the ktask to catch up, for up to
+ * PM_WB_THROTTLE_MAX_MS per call, so a dead backend doesn't hang writers
+ * forever.
+ *
+ * A PM is on the list if and only if it has dirty pages, give or take a race
+ * with writeback: the ktask takes the PM off the list once it is clean, and
+ * pm_page_set_dirty() puts it back.  The ktask holds a pm_async_users ref while
+ * it works on a PM, and pm_wait_async() takes the PM off the list for good
+ * before waiting on those refs.
+ *
+ * Pages written through a shared mmap don't go through pm_page_set_dirty();
+ * the MMU just sets the dirty bit in the PTE.  So PMs with shared VMRs also sit
+ * on wb_mapped_pms, and every PM_WB_HARVEST_MS, the ktask moves their PTE dirty
+ * bits to the pages (mark_and_clear_dirty_ptes()), which puts the PMs on the
+ * dirty list.  Until then, those pages don't count as dirty, so a process
+ * dirtying a big mapping can get up to PM_WB_HARVEST_MS ahead of the ratios.
+ * No one throttles page faults, only write(). */
+#define PM_WB_POLL_MS			250
+#define PM_WB_HARVEST_MS		1000
+#define PM_WB_THROTTLE_MAX_MS		1000
+#define PM_WB_BATCH_PGS			32
+
+unsigned int pm_dirty_expire_ms = 30000;
+unsigned int pm_dirty_bg_ratio = 10;
+unsigned int pm_dirty_throttle_ratio = 20;
+
+static spinlock_t wb_lock = SPINLOCK_INITIALIZER;
+static struct page_map_tailq wb_dirty_pms =
+	TAILQ_HEAD_INITIALIZER(wb_dirty_pms);
+static unsigned long wb_nr_dirty_pms;
+static struct page_map_tailq wb_mapped_pms =
+	TAILQ_HEAD_INITIALIZER(wb_mapped_pms);
+static unsigned long wb_nr_mapped_pms;
+static uint64_t wb_harvested_at;
+static atomic_t wb_nr_dirty;
+static atomic_t wb_nr_writeback;
+static struct rendez wb_rv;
+static struct rendez wb_throttle_rv;
+static bool wb_kicked;
+static bool wb_running;
+
+static struct pm_wb_stats {
+	atomic_t			nr_passes;
+	atomic_t			nr_harvests;
+	atomic_t			nr_expired;
+	atomic_t			nr_over_ratio;
+	atomic_t			nr_batches;
+	atomic_t			nr_written;
+	atomic_t			nr_errors;
+	atomic_t			nr_throttled;
+	atomic_t			throttle_msec;
+} pm_wb_stats;
+
+static bool pm_has_backing_store(struct page_map *pm)
+{
+	return pm->pm_op->writepage != NULL;
+}
+
+/* Whether more than pct percent of memory is dirty */
+static bool wb_dirty_over(unsigned int pct)
+{
+	size_t total_pgs = arena_amt_total(base_arena) >> PGSHIFT;
+
+	return atomic_read(&wb_nr_dirty) * 100 > total_pgs * pct;
+}
+
+/* Marks page, which is in pm, dirty.  Safe to call while holding spinlocks. */
+void pm_page_set_dirty(struct page_map *pm, struct page *page)
+{
+	long old_flags;
+
+	do {
+		old_flags = atomic_read(&page->pg_flags);
+		if (old_flags & PG_DIRTY)
+			return;
+	} while (!atomic_cas(&page->pg_flags, old_flags,
+	                     old_flags | PG_DIRTY));
+	if (!pm_has_backing_store(pm))
+		return;
+	atomic_inc(&pm->pm_nr_dirty);
+	atomic_inc(&wb_nr_dirty);
+	/* Pairs with the mb() in pm_wb_put_back(): either we see the PM is off
+	 * the list, or the ktask sees our dirty page and keeps it on. */
+	mb();
+	if (READ_ONCE(pm->pm_on_dirty_list))
+		return;
+	spin_lock(&wb_lock);
+	if (!pm->pm_on_dirty_list) {
+		pm->pm_on_dirty_list = true;
+		pm->pm_dirtied_at = nsec();
+		TAILQ_INSERT_TAIL(&wb_dirty_pms, pm, pm_dirty_link);
+		wb_nr_dirty_pms++;
+	}
+	spin_unlock(&wb_lock);
+}
+
+/* Clears page's dirty bit.  Returns true if it was dirty. */
+static bool pm_page_clear_dirty(struct page_map *pm, struct page *page)
+{
+	long old_flags;
+
+	do {
+		old_flags = atomic_read(&page->pg_flags);
+		if (!(old_flags & PG_DIRTY))
+			return false;
+	} while (!atomic_cas(&page->pg_flags, old_flags,
+	                     old_flags & ~PG_DIRTY));
+	if (pm_has_backing_store(pm)) {
+		atomic_dec(&pm->pm_nr_dirty);
+		atomic_dec(&wb_nr_dirty);
+	}
+	return true;
+}
+
+/* Puts pm on or takes it off the list of PMs with shared VMRs.  Caller holds
+ * pm_lock. */
+static void pm_wb_set_mapped(struct page_map *pm, bool mapped)
+{
+	if (!pm_has_backing_store(pm))
+		return;
+	spin_lock(&wb_lock);
+	if (mapped && !pm->pm_on_mapped_list) {
+		TAILQ_INSERT_TAIL(&wb_mapped_pms, pm, pm_mapped_link);
+		wb_nr_mapped_pms++;
+	} else if (!mapped && pm->pm_on_mapped_list) {
+		TAILQ_REMOVE(&wb_mapped_pms, pm, pm_mapped_link);
+		wb_nr_mapped_pms--;
+	}
+	pm->pm_on_mapped_list = mapped;
+	spin_unlock(&wb_lock);
+}
+
+/* Takes pm off the dirty and mapped lists, for good. */
+static void pm_wb_forget(struct page_map *pm)
+{
+	spin_lock(&wb_lock);
+	if (pm->pm_on_dirty_list) {
+		pm->pm_on_dirty_list = false;
+		TAILQ_REMOVE(&wb_dirty_pms, pm, pm_dirty_link);
+		wb_nr_dirty_pms--;
+	}
+	if (pm->pm_on_mapped_list) {
+		pm->pm_on_mapped_list = false;
+		TAILQ_REMOVE(&wb_mapped_pms, pm, pm_mapped_link);
+		wb_nr_mapped_pms--;
+	}
+	spin_unlock(&wb_lock);
+}
+
+/* Waits for any readahead and writeback on pm to finish, and keeps the
+ * writeback ktask away from it.  Call this before tearing down whatever the
+ * PM's ops need (e.g. backend chans).  No one should dirty pm's pages after
+ * this. */
+void pm_wait_async(struct page_map *pm)
+{
+	pm_wb_forget(pm);
+	while (atomic_read(&pm->pm_async_users))
+		kthread_usleep(1000);
+}
+
 static bool vmr_has_page_idx(struct vm_region *vmr, unsigned long pg_idx)
 {
 	unsigned long nr_pgs = (vmr->vm_end - vmr->vm_base) >> PGSHIFT;
@@ -351,6 +774,8 @@ static bool __remove_or_zero_cb(void **slot, unsigned long tree_idx, void *arg)
 	 * return true, but this is fine.  Future lock-free lookups will now
 	 * fail (since the page is 0), and insertions will block on the write
 	 * lock. */
+	pm_page_ra_check_waste(page);
+	pm_page_clear_dirty(pm, page);
 	atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
 	page_decref(page);
 	return true;
@@ -376,8 +801,7 @@ static int __pm_mark_and_clear_dirty(struct proc *p, pte_t pte, void *va,
 
 	if (!pte_is_present(pte) || !pte_is_dirty(pte))
 		return 0;
-	if (!(atomic_read(&page->pg_flags) & PG_DIRTY))
-		atomic_or(&page->pg_flags, PG_DIRTY);
+	pm_page_set_dirty(page->pg_mapping, page);
 	pte_clear_dirty(pte);
 	vmr->vm_shootdown_needed = true;
 	return 0;
@@ -411,49 +835,91 @@ static void mark_and_clear_dirty_ptes(struct page_map *pm)
 
 static void shootdown_vmrs(struct page_map *pm)
 {
-	struct vm_region *vmr_i;
+	struct vm_region *vmr_i, *vmr_j;
+	struct tlb_gather tlb;
 
 	/* The VMR flag shootdown_needed is owned by the PM.  Each VMR is hooked
-	 * to at most one file, so there's no issue there.  We might have a proc
-	 * that has multiple non-private VMRs in the same file, but it shouldn't
-	 * be a big enough issue to worry about. */
+	 * to at most one file, so there's no issue there.  A proc might have
+	 * multiple non-private VMRs in the same file; we gather those up, so
+	 * each proc gets one shootdown. */
 	spin_lock(&pm->pm_lock);
 	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
-		if (vmr_i->vm_shootdown_needed) {
-			vmr_i->vm_shootdown_needed = false;
-			proc_tlbshootdown(vmr_i->vm_proc, 0, 0);
+		if (!vmr_i->vm_shootdown_needed)
+			continue;
+		tlb_gather_init(&tlb, vmr_i->vm_proc);
+		for (vmr_j = vmr_i; vmr_j;
+		     vmr_j = TAILQ_NEXT(vmr_j, vm_pm_link)) {
+			if (vmr_j->vm_proc != vmr_i->vm_proc ||
+			    !vmr_j->vm_shootdown_needed)
+				continue;
+			vmr_j->vm_shootdown_needed = false;
+			tlb_gather_add(&tlb, vmr_j->vm_base, vmr_j->vm_end);
 		}
+		tlb_gather_flush(&tlb);
 	}
 	spin_unlock(&pm->pm_lock);
 }
 
+/* Consecutive dirty pages, waiting to be written back */
+struct pm_wb_batch {
+	struct page_map			*pm;
+	int				nr;
+	struct page			*pages[PM_WB_BATCH_PGS];
+};
+
 /* Send any queued WBs that haven't been sent yet. */
-static void flush_queued_writebacks(struct page_map *pm)
+static void flush_queued_writebacks(struct pm_wb_batch *wb)
 {
-	/* TODO (WB) */
+	struct page_map *pm = wb->pm;
+	int nr_errors = 0;
+
+	if (!wb->nr)
+		return;
+	if (pm->pm_op->writepages) {
+		if (pm->pm_op->writepages(pm, wb->pages, wb->nr))
+			nr_errors = wb->nr;
+	} else {
+		for (int i = 0; i < wb->nr; i++) {
+			if (pm->pm_op->writepage(pm, wb->pages[i]))
+				nr_errors++;
+		}
+	}
+	/* The pages are clean now, even if the write failed.  We have no way to
+	 * tell the writer, and retrying a broken backend forever would pin the
+	 * dirty pages (and throttle everyone). */
+	pm->pm_nr_written += wb->nr;
+	pm->pm_nr_wb_errors += nr_errors;
+	atomic_add(&pm_wb_stats.nr_written, wb->nr);
+	atomic_add(&pm_wb_stats.nr_errors, nr_errors);
+	atomic_inc(&pm_wb_stats.nr_batches);
+	atomic_add(&pm->pm_nr_writeback, -wb->nr);
+	atomic_add(&wb_nr_writeback, -wb->nr);
+	wb->nr = 0;
 }
 
-/* Batches up pages to be written back, preferably as one big op.  If we have a
- * bunch outstanding, we'll send them. */
-static void queue_writeback(struct page_map *pm, struct page *page)
+/* Batches up pages to be written back, preferably as one big op.  A batch is
+ * a run of consecutive pages; we send it when the run breaks or the batch is
+ * full.  The caller holds the PM qlock, so the pages stay in the PM until we
+ * flush. */
+static void queue_writeback(struct pm_wb_batch *wb, struct page *page)
 {
-	/* TODO (WB): add a bulk op (instead of only writepage()), collect
-	 * extents, and send them to the device.  Probably do something similar
-	 * for reads. */
-	pm->pm_op->writepage(pm, page);
+	if (wb->nr && (wb->nr == PM_WB_BATCH_PGS ||
+	               page->pg_index != wb->pages[wb->nr - 1]->pg_index + 1))
+		flush_queued_writebacks(wb);
+	wb->pages[wb->nr++] = page;
+	atomic_inc(&wb->pm->pm_nr_writeback);
+	atomic_inc(&wb_nr_writeback);
 }
 
 static bool __writeback_cb(void **slot, unsigned long tree_idx, void *arg)
 {
-	struct page_map *pm = arg;
+	struct pm_wb_batch *wb = arg;
 	struct page *page = pm_slot_get_page(*slot);
 
 	/* We're qlocked, so all items should have pages. */
 	assert(page);
-	if (atomic_read(&page->pg_flags) & PG_DIRTY) {
-		atomic_and(&page->pg_flags, ~PG_DIRTY);
-		queue_writeback(pm, page);
-	}
+	if (pm_page_clear_dirty(wb->pm, page))
+		queue_writeback(wb, page);
 	return false;
 }
 
@@ -461,14 +927,213 @@ static bool __writeback_cb(void **slot, unsigned long tree_idx, void *arg)
  * not.  All the dirty bits get cleared too, before writing back. */
 void pm_writeback_pages(struct page_map *pm)
 {
+	struct pm_wb_batch wb = {.pm = pm};
+
+	/* Nothing to write back to */
+	if (!pm_has_backing_store(pm))
+		return;
 	qlock(&pm->pm_qlock);
 	mark_and_clear_dirty_ptes(pm);
 	shootdown_vmrs(pm);
-	radix_for_each_slot(&pm->pm_tree, __writeback_cb, pm);
-	flush_queued_writebacks(pm);
+	radix_for_each_slot(&pm->pm_tree, __writeback_cb, &wb);
+	flush_queued_writebacks(&wb);
 	qunlock(&pm->pm_qlock);
 }
 
+static int wb_kicked_cond(void *arg)
+{
+	return READ_ONCE(wb_kicked);
+}
+
+static int wb_under_throttle_cond(void *arg)
+{
+	return !wb_dirty_over(pm_dirty_throttle_ratio);
+}
+
+/* Called by the ktask, holding wb_lock, after writing back pm.  Keeps pm on
+ * the list if it still (or already again) has dirty pages. */
+static void pm_wb_put_back(struct page_map *pm)
+{
+	if (!pm->pm_on_dirty_list)
+		return;
+	if (atomic_read(&pm->pm_nr_dirty)) {
+		/* Pages dirtied during the writeback start a new age. */
+		pm->pm_dirtied_at = nsec();
+		return;
+	}
+	pm->pm_on_dirty_list = false;
+	TAILQ_REMOVE(&wb_dirty_pms, pm, pm_dirty_link);
+	wb_nr_dirty_pms--;
+	mb();
+	if (atomic_read(&pm->pm_nr_dirty)) {
+		pm->pm_on_dirty_list = true;
+		pm->pm_dirtied_at = nsec();
+		TAILQ_INSERT_TAIL(&wb_dirty_pms, pm, pm_dirty_link);
+		wb_nr_dirty_pms++;
+	}
+}
+
+/* Moves the PTE dirty bits of every PM with shared VMRs to their pages, which
+ * puts the PMs on the dirty list. */
+static void pm_wb_harvest(void)
+{
+	struct page_map *pm;
+	unsigned long nr_pms;
+
+	if (nsec() - wb_harvested_at < PM_WB_HARVEST_MS * 1000000ULL)
+		return;
+	wb_harvested_at = nsec();
+	atomic_inc(&pm_wb_stats.nr_harvests);
+	spin_lock(&wb_lock);
+	nr_pms = wb_nr_mapped_pms;
+	spin_unlock(&wb_lock);
+	for (unsigned long i = 0; i < nr_pms; i++) {
+		spin_lock(&wb_lock);
+		pm = TAILQ_FIRST(&wb_mapped_pms);
+		if (!pm) {
+			spin_unlock(&wb_lock);
+			break;
+		}
+		TAILQ_REMOVE(&wb_mapped_pms, pm, pm_mapped_link);
+		TAILQ_INSERT_TAIL(&wb_mapped_pms, pm, pm_mapped_link);
+		atomic_inc(&pm->pm_async_users);
+		spin_unlock(&wb_lock);
+
+		qlock(&pm->pm_qlock);
+		mark_and_clear_dirty_ptes(pm);
+		shootdown_vmrs(pm);
+		qunlock(&pm->pm_qlock);
+		atomic_dec(&pm->pm_async_users);
+	}
+}
+
+/* Looks at each PM that was on the list when we started, oldest first, and
+ * writes back the ones that are too old, or all of them until we're under the
+ * background ratio. */
+static void pm_wb_pass(void)
+{
+	struct page_map *pm;
+	unsigned long nr_pms;
+	bool expired, over;
+
+	atomic_inc(&pm_wb_stats.nr_passes);
+	pm_wb_harvest();
+	spin_lock(&wb_lock);
+	nr_pms = wb_nr_dirty_pms;
+	spin_unlock(&wb_lock);
+	for (unsigned long i = 0; i < nr_pms; i++) {
+		spin_lock(&wb_lock);
+		pm = TAILQ_FIRST(&wb_dirty_pms);
+		if (!pm) {
+			spin_unlock(&wb_lock);
+			break;
+		}
+		/* Rotate, so we get to the others next */
+		TAILQ_REMOVE(&wb_dirty_pms, pm, pm_dirty_link);
+		TAILQ_INSERT_TAIL(&wb_dirty_pms, pm, pm_dirty_link);
+		expired = nsec() - pm->pm_dirtied_at >
+		          pm_dirty_expire_ms * 1000000ULL;
+		over = wb_dirty_over(pm_dirty_bg_ratio);
+		if (!expired && !over) {
+			spin_unlock(&wb_lock);
+			continue;
+		}
+		atomic_inc(&pm->pm_async_users);
+		spin_unlock(&wb_lock);
+
+		atomic_inc(expired ? &pm_wb_stats.nr_expired
+		                   : &pm_wb_stats.nr_over_ratio);
+		pm_writeback_pages(pm);
+
+		spin_lock(&wb_lock);
+		pm_wb_put_back(pm);
+		spin_unlock(&wb_lock);
+		atomic_dec(&pm->pm_async_users);
+		rendez_wakeup(&wb_throttle_rv);
+	}
+}
+
+static void pm_wb_ktask(void *arg)
+{
+	while (1) {
+		rendez_sleep_timeout(&wb_rv, wb_kicked_cond, NULL,
+		                     PM_WB_POLL_MS * 1000);
+		WRITE_ONCE(wb_kicked, false);
+		pm_wb_pass();
+		rendez_wakeup(&wb_throttle_rv);
+	}
+}
+
+/* Called by writers before they dirty more of pm's pages.  If too much memory
+ * is dirty, we kick the writeback ktask and wait for it to catch up.  The
+ * caller can block, and can't hold pm's qlock or its file's qlock. */
+void pm_throttle_dirty(struct page_map *pm)
+{
+	uint64_t start;
+
+	if (!pm_has_backing_store(pm) || !READ_ONCE(wb_running))
+		return;
+	if (!wb_dirty_over(pm_dirty_throttle_ratio))
+		return;
+	pm->pm_nr_throttled++;
+	atomic_inc(&pm_wb_stats.nr_throttled);
+	start = nsec();
+	while (wb_dirty_over(pm_dirty_throttle_ratio) &&
+	       nsec() - start < PM_WB_THROTTLE_MAX_MS * 1000000ULL) {
+		WRITE_ONCE(wb_kicked, true);
+		rendez_wakeup(&wb_rv);
+		rendez_sleep_timeout(&wb_throttle_rv, wb_under_throttle_cond,
+		                     NULL, PM_WB_POLL_MS * 1000);
+	}
+	atomic_add(&pm_wb_stats.throttle_msec, (nsec() - start) / 1000000);
+}
+
+void pm_writeback_init(void)
+{
+	rendez_init(&wb_rv);
+	rendez_init(&wb_throttle_rv);
+	WRITE_ONCE(wb_running, true);
+	ktask("writeback", pm_wb_ktask, NULL);
+}
+
+void pm_fetch_wb_stats(struct sized_alloc *sza)
+{
+	struct pm_wb_stats *st = &pm_wb_stats;
+	struct page_map *pm;
+
+	sza_printf(sza, "Total pages      : %lu\n",
+	           arena_amt_total(base_arena) >> PGSHIFT);
+	sza_printf(sza, "Dirty pages      : %lu (bg %u%%, throttle %u%%)\n",
+	           atomic_read(&wb_nr_dirty), pm_dirty_bg_ratio,
+	           pm_dirty_throttle_ratio);
+	sza_printf(sza, "Writeback pages  : %lu\n",
+	           atomic_read(&wb_nr_writeback));
+	sza_printf(sza, "Dirty expire     : %u ms\n", pm_dirty_expire_ms);
+	sza_printf(sza, "Passes           : %lu\n", atomic_read(&st->nr_passes));
+	sza_printf(sza, "PTE harvests     : %lu (%lu mapped PMs)\n",
+	           atomic_read(&st->nr_harvests), wb_nr_mapped_pms);
+	sza_printf(sza, "PMs expired      : %lu\n", atomic_read(&st->nr_expired));
+	sza_printf(sza, "PMs over ratio   : %lu\n",
+	           atomic_read(&st->nr_over_ratio));
+	sza_printf(sza, "Batches          : %lu\n", atomic_read(&st->nr_batches));
+	sza_printf(sza, "Pages written    : %lu\n", atomic_read(&st->nr_written));
+	sza_printf(sza, "Write errors     : %lu\n", atomic_read(&st->nr_errors));
+	sza_printf(sza, "Throttled writes : %lu (%lu ms)\n",
+	           atomic_read(&st->nr_throttled),
+	           atomic_read(&st->throttle_msec));
+	sza_printf(sza, "\nDirty page maps: %lu\n", wb_nr_dirty_pms);
+	spin_lock(&wb_lock);
+	TAILQ_FOREACH(pm, &wb_dirty_pms, pm_dirty_link) {
+		sza_printf(sza, "\t%p: qid %p, pages %lu, dirty %lu, ",
+		           pm, pm->pm_file->dir.qid.path, pm->pm_num_pages,
+		           atomic_read(&pm->pm_nr_dirty));
+		sza_printf(sza, "writeback %lu, age %llu ms\n",
+		           atomic_read(&pm->pm_nr_writeback),
+		           (nsec() - pm->pm_dirtied_at) / 1000000);
+	}
+	spin_unlock(&wb_lock);
+}
+
 static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
 {
 	struct page_map *pm = arg;
@@ -507,14 +1172,17 @@ static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
 	/* Need to check PG_DIRTY *after* checking VMRs.  o/w we could check,
 	 * PAUSE, see no VMRs.  But in the meantime, we had a VMR that munmapped
 	 * and wrote-back the dirty flag. */
-	if (atomic_read(&page->pg_flags) & PG_DIRTY) {
+	if (pm_page_clear_dirty(pm, page) && pm_has_backing_store(pm)) {
 		/* If we want to batch these, we'll also have to batch the
 		 * freeing, which isn't a big deal.  Just do it before freeing
 		 * and before unlocking the PM; we don't want someone to load
 		 * the page from the backing store and get an old value. */
-		pm->pm_op->writepage(pm, page);
+		if (pm->pm_op->writepage(pm, page))
+			pm->pm_nr_wb_errors++;
+		pm->pm_nr_written++;
 	}
 	/* All clear - the page is unused and (now) clean. */
+	pm_page_ra_check_waste(page);
 	atomic_set(&page->pg_flags, 0);	/* catch bugs */
 	page_decref(page);
 	return true;
@@ -534,10 +1202,13 @@ void pm_free_unused_pages(struct page_map *pm)
 
 static bool __destroy_cb(void **slot, unsigned long tree_idx, void *arg)
 {
+	struct page_map *pm = arg;
 	struct page *page = pm_slot_get_page(*slot);
 
 	/* Should be no users or need to sync */
 	assert(pm_slot_check_refcnt(*slot) == 0);
+	pm_page_ra_check_waste(page);
+	pm_page_clear_dirty(pm, page);
 	atomic_set(&page->pg_flags, 0);	/* catch bugs */
 	page_decref(page);
 	return true;
@@ -545,6 +1216,8 @@ static bool __destroy_cb(void **slot, unsigned long tree_idx, void *arg)
 
 void pm_destroy(struct page_map *pm)
 {
+	assert(!atomic_read(&pm->pm_async_users));
+	pm_wb_forget(pm);
 	radix_for_each_slot(&pm->pm_tree, __destroy_cb, pm);
 	radix_tree_destroy(&pm->pm_tree);
 }
@@ -554,6 +1227,10 @@ void print_page_map_info(struct page_map *pm)
 	struct vm_region *vmr_i;
 	printk("Page Map %p\n", pm);
 	printk("\tNum pages: %lu\n", pm->pm_num_pages);
+	printk("\tDirty: %lu, writeback: %lu\n", atomic_read(&pm->pm_nr_dirty),
+	       atomic_read(&pm->pm_nr_writeback));
+	printk("\tWritten: %lu, errors: %lu, throttled: %lu\n",
+	       pm->pm_nr_written, pm->pm_nr_wb_errors, pm->pm_nr_throttled);
 	spin_lock(&pm->pm_lock);
 	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
 		printk("\tVMR proc %d: (%p - %p): 0x%08x, 0x%08x, %p, %p\n",
@@ -22,6 +22,7 @@
 #include <multiboot.h>
 #include <arena.h>
 #include <init.h>
+#include <zswap.h>
 
 physaddr_t max_pmem = 0;  /* Total amount of physical memory (bytes) */
 physaddr_t max_paddr = 0; /* Maximum addressable physical address */
@@ -249,7 +250,7 @@ int page_insert(pgdir_t pgdir, struct page *page, void *va, int perm)
  * of the pte for this page.  This is used by page_remove
  * but should not be used by other callers.
  *
- * For jumbos, right now this returns the first Page* in the 4MB range
+ * For (PML2) jumbos, this returns the Page* for va within the jumbo page.
  *
  * @param[in]  pgdir     the page directory from which we should do the lookup
  * @param[in]  va        the virtual address of the page we are looking up
@@ -267,6 +268,10 @@ page_t *page_lookup(pgdir_t pgdir, void *va, pte_t *pte_store)
 		return 0;
 	if (pte_store)
 		*pte_store = pte;
+	if (pte_is_jumbo(pte))
+		return pa2page(pte_get_paddr(pte) +
+			       ROUNDDOWN((uintptr_t)va & (PML2_PTE_REACH - 1),
+					 PGSIZE));
 	return pa2page(pte_get_paddr(pte));
 }
 
@@ -310,8 +315,7 @@ void page_remove(pgdir_t pgdir, void *va)
 		tlb_invalidate(pgdir, va);
 		page_decref(page);
 	} else if (pte_is_paged_out(pte)) {
-		/* TODO: (SWAP) need to free this from the swap */
-		panic("Swapping not supported!");
+		zswap_free_pte(pte);
 		pte_clear(pte);
 	}
 }
@@ -47,6 +47,9 @@ spinlock_t pid_bmask_lock = SPINLOCK_INITIALIZER;
 struct hashtable *pid_hash;
 spinlock_t pid_hash_lock; // initialized in proc_init
 
+/* Address space IDs, for tagged TLBs.  0 is never handed out. */
+static atomic_t next_as_id = 0;
+
 /* Finds the next free entry (zero) entry in the pid_bitmask.  Set means busy.
  * PID 0 is reserved (in proc_init).  A return value of 0 is a failure (and
  * you'll also see a warning, for now).  Consider doing this with atomics. */
@@ -415,8 +418,12 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	p->env_flags = 0;
 	spinlock_init(&p->vmr_lock);
 	spinlock_init(&p->pte_lock);
+	p->as_id = atomic_fetch_and_add(&next_as_id, 1) + 1;
 	TAILQ_INIT(&p->vm_regions); /* could init this in the slab */
+	p->vm_tree = RB_ROOT;
+	p->vmr_seq = SEQCTR_INITIALIZER;
 	p->vmr_history = 0;
+	p->jumbo_anon = parent ? parent->jumbo_anon : FALSE;
 	/* Initialize the vcore lists, we'll build the inactive list so that it
 	 * includes all vcores when we initialize procinfo.  Do this before
 	 * initing procinfo. */
@@ -604,12 +611,12 @@ static void __set_proc_current(struct proc *p)
 	/* If the process wasn't here, then we need to load its address space */
 	if (p != pcpui->cur_proc) {
 		proc_incref(p, 1);
-		lcr3(p->env_cr3);
 		/* This is "leaving the process context" of the previous proc.
-		 * The previous lcr3 unloaded the previous proc's context.  This
-		 * should rarely happen, since we usually proactively leave
-		 * process context, but this is the fallback. */
+		 * The lcr3 unloads the previous proc's context.  This should
+		 * rarely happen, since we usually proactively leave process
+		 * context, but this is the fallback. */
 		old_proc = pcpui->cur_proc;
+		switch_addr_space(old_proc, p);
 		pcpui->cur_proc = p;
 		if (old_proc)
 			proc_decref(old_proc);
@@ -1934,7 +1941,7 @@ uintptr_t switch_to(struct proc *new_p)
 	/* If we aren't the proc already, then switch to it */
 	if (old_proc != new_p) {
 		pcpui->cur_proc = new_p;	/* uncounted ref */
-		lcr3(new_p->env_cr3);
+		switch_addr_space(old_proc, new_p);
 	}
 	ret = (uintptr_t)old_proc;
 	if (is_ktask(kth)) {
@@ -1967,61 +1974,137 @@ void switch_back(struct proc *new_p, uintptr_t old_ret)
 	old_proc = (struct proc*)old_ret;
 	if (old_proc != new_p) {
 		pcpui->cur_proc = old_proc;
-		if (old_proc)
-			lcr3(old_proc->env_cr3);
-		else
-			lcr3(boot_cr3);
+		switch_addr_space(new_p, old_proc);
+	}
+}
+
+/* Loads new's address space on this core, replacing old's.  Either can be 0,
+ * meaning the kernel's boot_cr3.  Callers should pass in whatever was loaded,
+ * usually cur_proc, and hold references on both.
+ *
+ * p->tlb_cores tracks the cores that have p's address space loaded, which are
+ * the only cores that can have TLB entries for it: loading a cr3 flushes the
+ * old one's entries.  We set our bit before loading the cr3; that pairs with
+ * the mb() in proc_tlbshootdown().  Either the shooter sees our bit, or we see
+ * its PTE changes.
+ *
+ * With tagged TLBs (e.g. x86 PCIDs), the arch may keep an address space's TLB
+ * entries after we switch away from it.  Those cores won't get shootdowns, so
+ * the arch uses p->tlb_gen to tell if it needs to flush on the next load. */
+void switch_addr_space(struct proc *old, struct proc *new)
+{
+	int coreid = core_id();
+
+	if (new) {
+		set_bit(coreid, new->tlb_cores.cpus);
+		arch_load_addr_space(new);
+	} else {
+		lcr3(boot_cr3);
 	}
+	if (old && old != new)
+		clear_bit(coreid, old->tlb_cores.cpus);
 }
 
-/* Will send a TLB shootdown message to every vcore in the main address space
- * (aka, all vcores for now).  The message will take the start and end virtual
- * addresses as well, in case we want to be more clever about how much we
- * shootdown and batching our messages.  Should do the sanity about rounding up
- * and down in this function too.
+/* Invalidates [start, end) of p's address space in the TLB of every core that
+ * has it loaded (p->tlb_cores), including kthreads that borrowed it for a
+ * syscall, not just the online vcores.  Callers change the PTEs first.
+ *
+ * Small ranges get INVLPGs; anything over TLB_SHOOTDOWN_MAX_PGS is a full
+ * flush.  To shoot down several ranges, gather them up in a tlb_gather, so we
+ * send one message per core.
  *
- * Would be nice to have a broadcast kmsg at this point.  Note this may send a
- * message to the calling core (interrupting it, possibly while holding the
- * proc_lock).  We don't need to process routine messages since it's an
- * immediate message. */
+ * Note this may send a message to the calling core (interrupting it, possibly
+ * while holding the proc_lock).  We don't need to process routine messages
+ * since it's an immediate message. */
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
 {
-	/* TODO: need a better way to find cores running our address space.  we
-	 * can have kthreads running syscalls, async calls, processes being
-	 * created. */
-	struct vcore *vc_i;
+	int coreid = core_id();
 
-	/* TODO: we might be able to avoid locking here in the future (we must
-	 * hit all online, and we can check __mapped).  it'll be complicated. */
-	spin_lock(&p->proc_lock);
-	switch (p->state) {
-	case (PROC_RUNNING_S):
-		tlbflush();
-		break;
-	case (PROC_RUNNING_M):
-		/* TODO: (TLB) sanity checks and rounding on the ranges.
-		 *
-		 * We need to make sure that once a core that was online has
-		 * been removed from the online list, then it must receive a TLB
-		 * flush (abandon_core()) before running the process again.
-		 * Either that, or make other decisions about who to
-		 * TLB-shootdown. */
-		TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-			send_kernel_message(vc_i->pcoreid, __tlbshootdown,
-					    start, end, 0, KMSG_IMMEDIATE);
+	start = ROUNDDOWN(start, PGSIZE);
+	end = ROUNDUP(end, PGSIZE);
+	if (end <= start)
+		return;
+	/* Cores that switched away from p may still have tagged TLB entries
+	 * for it.  This tells them to flush when they load p again. */
+	atomic_inc(&p->tlb_gen);
+	/* Order our PTE writes before checking who might have cached them */
+	mb();
+	for (int i = 0; i < num_cores; i++) {
+		if (!core_set_getcpu(&p->tlb_cores, i))
+			continue;
+		if (i == coreid)
+			__tlbshootdown(coreid, start, end, p->env_cr3);
+		else
+			send_kernel_message(i, __tlbshootdown, start, end,
+			                    p->env_cr3, KMSG_IMMEDIATE);
+	}
+	proc_iotlb_flush(p);
+}
+
+void tlb_gather_flush(struct tlb_gather *tlb)
+{
+	if (tlb->end > tlb->start)
+		proc_tlbshootdown(tlb->p, tlb->start, tlb->end);
+	tlb_gather_init(tlb, tlb->p);
+}
+
+struct tlb_sync {
+	uintptr_t			cr3;
+	atomic_t			nr_left;
+};
+
+static void __tlbshootdown_sync(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct tlb_sync *ts = (struct tlb_sync*)a2;
+
+	__tlbshootdown(srcid, a0, a1, ts->cr3);
+	atomic_dec(&ts->nr_left);
+}
+
+/* Like proc_tlbshootdown(), but doesn't return until every core has flushed.
+ * proc_tlbshootdown() is fine when p gave up the memory (e.g. munmap), since a
+ * write through a stale TLB entry is the process's own problem.  Use this when
+ * we take memory away behind p's back and then read or free it.
+ *
+ * We wait for the other cores with IRQs on, so two cores shooting each other
+ * down don't deadlock.  Don't hold any locks a message handler might need. */
+void proc_tlbshootdown_sync(struct proc *p, uintptr_t start, uintptr_t end)
+{
+	int coreid = core_id();
+	struct tlb_sync ts[1];
+
+	assert(irq_is_enabled());
+	start = ROUNDDOWN(start, PGSIZE);
+	end = ROUNDUP(end, PGSIZE);
+	if (end <= start)
+		return;
+	ts->cr3 = p->env_cr3;
+	atomic_init(&ts->nr_left, 0);
+	atomic_inc(&p->tlb_gen);
+	mb();
+	for (int i = 0; i < num_cores; i++) {
+		if (!core_set_getcpu(&p->tlb_cores, i))
+			continue;
+		if (i == coreid) {
+			__tlbshootdown(coreid, start, end, p->env_cr3);
+			continue;
 		}
-		break;
-	default:
-		/* TODO: til we fix shootdowns, there are some odd cases where
-		 * we have the address space loaded, but the state is in
-		 * transition. */
-		if (p == current)
-			tlbflush();
+		atomic_inc(&ts->nr_left);
+		send_kernel_message(i, __tlbshootdown_sync, start, end,
+		                    (long)ts, KMSG_IMMEDIATE);
 	}
-	spin_unlock(&p->proc_lock);
+	while (atomic_read(&ts->nr_left))
+		cpu_relax();
 	proc_iotlb_flush(p);
 }
 
+void tlb_gather_flush_sync(struct tlb_gather *tlb)
+{
+	if (tlb->end > tlb->start)
+		proc_tlbshootdown_sync(tlb->p, tlb->start, tlb->end);
+	tlb_gather_init(tlb, tlb->p);
+}
+
 /* Helper, used by __startcore and __set_curctx, which sets up cur_ctx to run a
  * given process's vcore.  Caller needs to set up things like owning_proc and
  * whatnot.  Note that we might not have p loaded as current. */
@@ -2260,7 +2343,7 @@ void __startcore(uint32_t srcid, long a0, long a1, long a2)
 	 * Keep in sync with __proc_give_cores() and __proc_run_m(). */
 	if (!pcpui->cur_proc) {
 		pcpui->cur_proc = p_to_run; /* install the ref to cur_proc */
-		lcr3(p_to_run->env_cr3);
+		switch_addr_space(NULL, p_to_run);
 	} else {
 		proc_decref(p_to_run);
 	}
@@ -2404,11 +2487,19 @@ void __death(uint32_t srcid, long a0, long a1, long a2)
 }
 
 /* Kernel message handler, usually sent IMMEDIATE, to shoot down virtual
- * addresses from a0 to a1. */
+ * addresses from a0 to a1 (page aligned) in the address space whose cr3 is a2.
+ * If that isn't loaded anymore, we flushed it when we switched away. */
 void __tlbshootdown(uint32_t srcid, long a0, long a1, long a2)
 {
-	/* TODO: (TLB) something more intelligent with the range */
-	tlbflush();
+	/* cr3 may have other bits, e.g. the PCID */
+	if (ROUNDDOWN(rcr3(), PGSIZE) != a2)
+		return;
+	if ((a1 - a0) >> PGSHIFT > TLB_SHOOTDOWN_MAX_PGS) {
+		tlbflush();
+		return;
+	}
+	for (uintptr_t va = a0; va < a1; va += PGSIZE)
+		invlpg((void*)va);
 }
 
 void print_allpids(void)
@@ -0,0 +1,124 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Memory reclaim.  See reclaim.h.
+ *
+ * The reclaim ktask wakes up every RECLAIM_POLL_MS.  It runs a RECLAIM_LOW_MEM
+ * pass if someone poked it or if less than 1/RECLAIM_LOW_FRAC of the base
+ * arena is free.  It stops that pass early once 1/RECLAIM_OK_FRAC is free, so
+ * we don't run the expensive reclaimers if the cheap ones were enough.  Every
+ * RECLAIM_TRIM_PERIOD_MS, it runs a RECLAIM_TRIM pass.
+ *
+ * Pokes can come from allocation failures, where we might hold any lock, and
+ * where waking the ktask might need memory.  So a poke just sets a flag that
+ * the ktask sees on its next poll. */
+
+#include <reclaim.h>
+#include <arena.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <atomic.h>
+#include <time.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define RECLAIM_POLL_MS			100
+#define RECLAIM_TRIM_PERIOD_MS		15000
+#define RECLAIM_LOW_FRAC		32
+#define RECLAIM_OK_FRAC			16
+
+static struct list_head reclaimers = LIST_HEAD_INIT(reclaimers);
+static qlock_t reclaim_qlock = QLOCK_INITIALIZER(reclaim_qlock);
+static bool reclaim_poked;
+static uint64_t nr_trim_passes;
+static uint64_t nr_low_mem_passes;
+static uint64_t nr_pokes;
+
+void register_reclaimer(struct reclaimer *r)
+{
+	r->nr_trims = 0;
+	r->nr_low_mem = 0;
+	qlock(&reclaim_qlock);
+	list_add_tail(&r->link, &reclaimers);
+	qunlock(&reclaim_qlock);
+}
+
+void unregister_reclaimer(struct reclaimer *r)
+{
+	qlock(&reclaim_qlock);
+	list_del(&r->link);
+	qunlock(&reclaim_qlock);
+}
+
+void reclaim_poke(void)
+{
+	WRITE_ONCE(reclaim_poked, TRUE);
+}
+
+static bool mem_below(size_t frac)
+{
+	size_t total = arena_amt_total(base_arena);
+
+	return arena_amt_free(base_arena) < total / frac;
+}
+
+void reclaim_now(int level)
+{
+	struct reclaimer *r;
+
+	qlock(&reclaim_qlock);
+	if (level == RECLAIM_LOW_MEM)
+		nr_low_mem_passes++;
+	else
+		nr_trim_passes++;
+	list_for_each_entry(r, &reclaimers, link) {
+		if (level == RECLAIM_LOW_MEM) {
+			if (!mem_below(RECLAIM_OK_FRAC))
+				break;
+			r->nr_low_mem++;
+		} else {
+			r->nr_trims++;
+		}
+		r->func(r, level);
+	}
+	qunlock(&reclaim_qlock);
+}
+
+static void reclaim_ktask(void *arg)
+{
+	uint64_t last_trim = nsec();
+
+	while (1) {
+		kthread_usleep(RECLAIM_POLL_MS * 1000);
+		if (READ_ONCE(reclaim_poked) || mem_below(RECLAIM_LOW_FRAC)) {
+			if (READ_ONCE(reclaim_poked))
+				nr_pokes++;
+			WRITE_ONCE(reclaim_poked, FALSE);
+			reclaim_now(RECLAIM_LOW_MEM);
+		}
+		if (nsec() - last_trim > RECLAIM_TRIM_PERIOD_MS * 1000000ULL) {
+			reclaim_now(RECLAIM_TRIM);
+			last_trim = nsec();
+		}
+	}
+}
+
+void reclaim_init(void)
+{
+	ktask("reclaim", reclaim_ktask, NULL);
+}
+
+void reclaim_fetch_stats(struct sized_alloc *sza)
+{
+	struct reclaimer *r;
+
+	qlock(&reclaim_qlock);
+	sza_printf(sza, "Trim passes: %llu, low mem passes: %llu, pokes: %llu\n",
+	           nr_trim_passes, nr_low_mem_passes, nr_pokes);
+	sza_printf(sza, "Free memory: %lu of %lu\n", arena_amt_free(base_arena),
+	           arena_amt_total(base_arena));
+	list_for_each_entry(r, &reclaimers, link)
+		sza_printf(sza, "\t%-20s trims %llu, low mem %llu\n", r->name,
+		           r->nr_trims, r->nr_low_mem);
+	qunlock(&reclaim_qlock);
+}
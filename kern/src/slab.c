@@ -67,15 +67,25 @@
  *   the pcpu state during a magazine resize.  I have two ways to do this: just
  *   racily write and set pcc->magsize, or have the pcc's poll when they check
  *   the depot during free.  Either approach doesn't require someone else to
- *   grab a pcc lock.
+ *   grab a pcc lock.  We do the latter.
+ * - When do magazines resize?  lock_depot() counts contended acquisitions.  A
+ *   burst of them grows the depot's magsize by one, up to KMC_MAG_MAX_SZ.  When
+ *   the periodic trim finds that a depot had no contention since the last
+ *   trim, it gives back half of the growth.  The depot stats (#mem/magazines)
+ *   show the current magsize and the contention counts.
+ *
+ * - How do magazines and slabs get freed?  Each depot tracks its working set:
+ *   the min and max number of magazines on each of its lists since the last
+ *   trim.  The reclaim ktask periodically calls kmem_cache_trim(), which frees
+ *   the 'min' magazines (they sat in the depot the whole interval), followed by
+ *   kmem_cache_reap(), which frees the empty slabs back to the source arena.
+ *   When memory is low, we free all of the depot's magazines.  The pcpu
+ *   caches' magazines are left alone.
  *
  * TODO:
- * - Add reclaim function.
  * - When resizing, do we want to go through the depot and consolidate
  *   magazines?  (probably not a big deal.  maybe we'd deal with it when we
  *   clean up our excess mags.)
- * - Could do some working set tracking.  Like max/min over an interval, with
- *   resetting (in the depot, used for reclaim and maybe aggressive freeing).
  * - Debugging info
  */
 
@@ -87,11 +97,14 @@
 #include <hash.h>
 #include <arena.h>
 #include <hashtable.h>
+#include <reclaim.h>
 
 #define SLAB_POISON ((void*)0xdead1111)
 
 /* Tunables.  I don't know which numbers to pick yet.  Maybe we play with it at
- * runtime.  Though once a mag increases, it'll never decrease. */
+ * runtime.  A depot's magsize grows by one whenever it sees more than
+ * resize_threshold contended acquisitions within resize_timeout_ns.  It shrinks
+ * when a whole trim interval goes by without contention. */
 uint64_t resize_timeout_ns = 1000000000;
 unsigned int resize_threshold = 1;
 
@@ -169,8 +182,10 @@ static void lock_depot(struct kmem_depot *depot)
 {
 	uint64_t time;
 
-	if (spin_trylock_irqsave(&depot->lock))
+	if (spin_trylock_irqsave(&depot->lock)) {
+		depot->nr_acquires++;
 		return;
+	}
 	/* The lock is contended.  When we finally get the lock, we'll up the
 	 * contention count and see if we've had too many contentions over time.
 	 *
@@ -186,6 +201,8 @@ static void lock_depot(struct kmem_depot *depot)
 	 * lock.  We might then think the burst wasn't big enough. */
 	time = nsec();
 	spin_lock_irqsave(&depot->lock);
+	depot->nr_acquires++;
+	depot->nr_contended++;
 	/* If there are no not-empty mags, we're probably fighting for the lock
 	 * not because the magazines aren't big enough, but because there aren't
 	 * enough mags in the system yet. */
@@ -198,12 +215,30 @@ static void lock_depot(struct kmem_depot *depot)
 	depot->busy_count++;
 	if (depot->busy_count > resize_threshold) {
 		depot->busy_count = 0;
-		depot->magsize = MIN(KMC_MAG_MAX_SZ, depot->magsize + 1);
+		if (depot->magsize < KMC_MAG_MAX_SZ) {
+			depot->magsize++;
+			depot->nr_grows++;
+		}
 		/* That's all we do - the pccs will eventually notice and up
 		 * their magazine sizes. */
 	}
 }
 
+/* Shrinks the magsize if the depot was uncontended since the last call.  We
+ * give back half of the growth each time, so a cache that was busy once
+ * doesn't keep its big mags for long.  As with growing, the pccs will notice
+ * during their next free to the depot.  Mags with more rounds than the new
+ * magsize are fine; see the FAQ.  Hold the depot lock. */
+static void __depot_try_shrink(struct kmem_depot *depot)
+{
+	if (depot->nr_contended == depot->nr_contended_last_trim &&
+	    depot->magsize > KMC_MAG_MIN_SZ) {
+		depot->magsize -= (depot->magsize - KMC_MAG_MIN_SZ + 1) / 2;
+		depot->nr_shrinks++;
+	}
+	depot->nr_contended_last_trim = depot->nr_contended;
+}
+
 static void unlock_depot(struct kmem_depot *depot)
 {
 	spin_unlock_irqsave(&depot->lock);
@@ -219,6 +254,16 @@ static void depot_init(struct kmem_depot *depot)
 	depot->nr_empty = 0;
 	depot->busy_count = 0;
 	depot->busy_start = 0;
+	depot->ws_min_not_empty = 0;
+	depot->ws_min_empty = 0;
+	depot->ws_max_not_empty = 0;
+	depot->ws_max_empty = 0;
+	depot->nr_mags_trimmed = 0;
+	depot->nr_acquires = 0;
+	depot->nr_contended = 0;
+	depot->nr_contended_last_trim = 0;
+	depot->nr_grows = 0;
+	depot->nr_shrinks = 0;
 }
 
 static bool mag_is_empty(struct kmem_magazine *mag)
@@ -244,9 +289,13 @@ static void __return_to_depot(struct kmem_cache *kc, struct kmem_magazine *mag)
 	if (mag_is_empty(mag)) {
 		SLIST_INSERT_HEAD(&depot->empty, mag, link);
 		depot->nr_empty++;
+		depot->ws_max_empty = MAX(depot->ws_max_empty,
+					  depot->nr_empty);
 	} else {
 		SLIST_INSERT_HEAD(&depot->not_empty, mag, link);
 		depot->nr_not_empty++;
+		depot->ws_max_not_empty = MAX(depot->ws_max_not_empty,
+					      depot->nr_not_empty);
 	}
 }
 
@@ -341,6 +390,10 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 			kc->flags |= __KMC_USE_BUFCTL;
 		}
 	}
+	/* Page lookups work by tagging the struct page of each slab, which
+	 * only makes sense for single-page slabs of real memory. */
+	if ((kc->flags & KMC_PGLOOKUP) && __use_bufctls(kc))
+		panic("KC %s wants page lookups, but uses bufctls", kc->name);
 	/* Note that import_amt is only used for bufctls.  The alternative puts
 	 * the slab at the end of a PGSIZE chunk, and fills the page with
 	 * objects.  The reliance on PGSIZE is used when finding a slab for a
@@ -364,6 +417,7 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->priv = priv;
 	kc->nr_cur_alloc = 0;
 	kc->nr_direct_allocs_ever = 0;
+	kc->nr_grows = 0;
 	kc->alloc_hash = kc->static_hash;
 	hash_init_hh(&kc->hh);
 	for (int i = 0; i < kc->hh.nr_hash_lists; i++)
@@ -385,6 +439,26 @@ static int __mag_ctor(void *obj, void *priv, int flags)
 	return 0;
 }
 
+/* Reclaim hook for all slabs.  Periodically, we trim the depots to their
+ * working sets.  When memory is low, we trim them completely.  Either way, we
+ * then free the empty slabs. */
+static void kmem_reclaim(struct reclaimer *r, int level)
+{
+	struct kmem_cache *kc_i;
+
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link) {
+		kmem_cache_trim(kc_i, level == RECLAIM_LOW_MEM);
+		kmem_cache_reap(kc_i);
+	}
+	qunlock(&arenas_and_slabs_lock);
+}
+
+static struct reclaimer kmem_reclaimer = {
+	.name = "slabs",
+	.func = kmem_reclaim,
+};
+
 void kmem_cache_init(void)
 {
 	/* magazine must be first - all caches, including mags, will do a slab
@@ -410,6 +484,7 @@ void kmem_cache_init(void)
 	                    sizeof(struct kmem_trace),
 	                    __alignof__(struct kmem_trace), KMC_NOTRACE,
 	                    base_arena, NULL, NULL, NULL);
+	register_reclaimer(&kmem_reclaimer);
 }
 
 /* Cache management */
@@ -469,6 +544,8 @@ static void depot_destroy(struct kmem_cache *kc)
 static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 {
 	if (!__use_bufctls(cp)) {
+		if (cp->flags & KMC_PGLOOKUP)
+			kva2page(a_slab->source_obj)->pg_private = NULL;
 		arena_free(cp->source, a_slab->source_obj, PGSIZE);
 	} else {
 		struct kmem_bufctl *i, *temp;
@@ -685,6 +762,8 @@ try_alloc:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->not_empty, link);
 		depot->nr_not_empty--;
+		depot->ws_min_not_empty = MIN(depot->ws_min_not_empty,
+					      depot->nr_not_empty);
 		__return_to_depot(kc, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
@@ -776,6 +855,8 @@ try_free:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->empty, link);
 		depot->nr_empty--;
+		depot->ws_min_empty = MIN(depot->ws_min_empty,
+					  depot->nr_empty);
 		__return_to_depot(kc, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
@@ -791,8 +872,7 @@ try_free:
 	if (mag) {
 		assert(mag->nr_rounds == 0);
 		lock_depot(depot);
-		SLIST_INSERT_HEAD(&depot->empty, mag, link);
-		depot->nr_empty++;
+		__return_to_depot(kc, mag);
 		unlock_depot(depot);
 		lock_pcu_cache(pcc);
 		goto try_free;
@@ -802,6 +882,14 @@ try_free:
 	__kmem_free_to_slab(kc, buf);
 }
 
+/* Returns the KMC_PGLOOKUP cache that obj came from, or NULL if obj came from
+ * anywhere else.  obj must be a kernel address backed by a struct page, such as
+ * anything from kpages or kmalloc. */
+struct kmem_cache *kmem_obj_cache(void *obj)
+{
+	return kva2page(obj)->pg_private;
+}
+
 /* Back end: internal functions */
 /* When this returns, the cache has at least one slab in the empty list.  If
  * page_alloc fails, there are some serious issues.  This only grows by one slab
@@ -828,6 +916,8 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		a_slab = (struct kmem_slab*)(a_page + PGSIZE
 		                             - sizeof(struct kmem_slab));
 		a_slab->source_obj = a_page;
+		if (cp->flags & KMC_PGLOOKUP)
+			kva2page(a_page)->pg_private = cp;
 		a_slab->num_busy_obj = 0;
 		a_slab->num_total_obj = (PGSIZE - sizeof(struct kmem_slab)) /
 		                        cp->obj_size;
@@ -890,6 +980,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 	}
 	// add a_slab to the empty_list
 	TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+	cp->nr_grows++;
 
 	return TRUE;
 
@@ -915,9 +1006,54 @@ void kmem_cache_reap(struct kmem_cache *cp)
 		kmem_slab_destroy(cp, a_slab);
 		a_slab = next;
 	}
+	/* The list's links were in the slabs we just freed */
+	TAILQ_INIT(&cp->empty_slab_list);
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
+/* Frees the depot's magazines that weren't used since the last trim, or all of
+ * them if @all, and starts a new working set interval.  Their rounds go back
+ * to the slab layer; follow up with kmem_cache_reap() to free the slabs.
+ *
+ * Periodic trims (!all) also shrink the magsize if the depot has been quiet. */
+void kmem_cache_trim(struct kmem_cache *kc, bool all)
+{
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_mag_slist victims = SLIST_HEAD_INITIALIZER(victims);
+	struct kmem_magazine *mag;
+	unsigned int nr_not_empty, nr_empty;
+
+	/* Not lock_depot(): the reaper shouldn't count as contention. */
+	spin_lock_irqsave(&depot->lock);
+	nr_not_empty = all ? depot->nr_not_empty : depot->ws_min_not_empty;
+	nr_empty = all ? depot->nr_empty : depot->ws_min_empty;
+	for (int i = 0; i < nr_not_empty; i++) {
+		mag = SLIST_FIRST(&depot->not_empty);
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		SLIST_INSERT_HEAD(&victims, mag, link);
+	}
+	for (int i = 0; i < nr_empty; i++) {
+		mag = SLIST_FIRST(&depot->empty);
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		SLIST_INSERT_HEAD(&victims, mag, link);
+	}
+	depot->nr_not_empty -= nr_not_empty;
+	depot->nr_empty -= nr_empty;
+	depot->nr_mags_trimmed += nr_not_empty + nr_empty;
+	depot->ws_min_not_empty = depot->ws_max_not_empty = depot->nr_not_empty;
+	depot->ws_min_empty = depot->ws_max_empty = depot->nr_empty;
+	if (!all)
+		__depot_try_shrink(depot);
+	spin_unlock_irqsave(&depot->lock);
+	/* Freeing the mags can land us back in a depot: the magazine cache's,
+	 * which could be this one. */
+	while ((mag = SLIST_FIRST(&victims))) {
+		SLIST_REMOVE_HEAD(&victims, link);
+		drain_mag(kc, mag);
+		kmem_cache_free(kmem_magazine_cache, mag);
+	}
+}
+
 
 /* Tracing */
 
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <assert.h>
 #include <pmap.h>
+#include <page_alloc.h>
 #include <process.h>
 #include <schedule.h>
 #include <trap.h>
@@ -78,6 +79,11 @@ static void __attribute__((noreturn)) __smp_idle(void *arg)
 		process_routine_kmsg();
 		try_run_proc();
 		cpu_bored();		/* call out to the ksched */
+		/* Zero pages for the zpool.  If it wants more, we go around
+		 * again instead of halting, so we check for RKMs in between
+		 * batches. */
+		if (zpool_refill_idle())
+			continue;
 		/* cpu_halt() atomically turns on interrupts and halts the core.
 		 * Important to do this, since we could have a RKM come in via
 		 * an interrupt right while PRKM is returning, and we wouldn't
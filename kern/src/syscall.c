@@ -911,8 +911,8 @@ static ssize_t sys_fork(env_t* e)
 	assert(current == this_pcpui_var(owning_proc));
 	copy_current_ctx_to(&env->scp_ctx);
 
-	/* Make the new process have the same VMRs as the older.  This will copy
-	 * the contents of non MAP_SHARED pages to the new VMRs. */
+	/* Make the new process have the same VMRs as the older.  This will
+	 * share the non MAP_SHARED pages copy-on-write with the new VMRs. */
 	if (duplicate_vmrs(e, env)) {
 		proc_destroy(env);
 		proc_decref(env);
@@ -921,9 +921,9 @@ static ssize_t sys_fork(env_t* e)
 	}
 	/* Switch to the new proc's address space and finish the syscall.  We'll
 	 * never naturally finish this syscall for the new proc, since its
-	 * memory is cloned before we return for the original process.  If we
-	 * ever do CoW for forked memory, this will be the first place that gets
-	 * CoW'd. */
+	 * memory is cloned before we return for the original process.  This is
+	 * usually the first place that gets CoW'd: the kernel write faults on
+	 * the child's copy of the syscall struct. */
 	temp = switch_to(env);
 	finish_sysc(current_kthread->sysc, env, 0);
 	switch_back(env, temp);
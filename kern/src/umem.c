@@ -226,8 +226,7 @@ bool uva_is_kva(struct proc *p, void *uva, void *kva)
 }
 
 /* Given a proc and a user virtual address, gives us the KVA.  Useful for
- * debugging.  Returns 0 if the page is unmapped (page lookup fails).  This
- * doesn't play nice with Jumbo pages. */
+ * debugging.  Returns 0 if the page is unmapped (page lookup fails). */
 uintptr_t uva2kva(struct proc *p, void *uva, size_t len, int prot)
 {
 	struct page *u_page;
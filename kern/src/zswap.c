@@ -0,0 +1,510 @@
+/* Copyright (c) 2026 Google Inc
+ * See LICENSE for details.
+ *
+ * Compressed, in-memory swap for anonymous memory.  See zswap.h.
+ *
+ * We're a reclaimer.  Every RECLAIM_TRIM pass ages the anonymous memory of
+ * every process by clearing the accessed bits in its PTEs, then shooting down
+ * the TLBs, so that the next access sets the bit again.  When memory is low,
+ * RECLAIM_LOW_MEM passes sweep each process's address space like a clock hand
+ * (p->zswap_hand): pages that were accessed get their bit cleared and a second
+ * chance, and pages that weren't get compressed.  That's the classic CLOCK
+ * approximation of LRU.  We skip pages we can't easily take away: CoW or
+ * otherwise shared pages, jumbo pages, MAP_LOCKED VMRs, and VMMs, whose guests
+ * have their own views of memory.
+ *
+ * A paged-out PTE points to a zswap_entry.  Swapping out is three steps:
+ * - Under the pte_lock, the PTE becomes a paged-out PTE pointing to a PENDING
+ *   entry, which holds the page and the PTE's reference on it.
+ * - We shoot down the TLBs, and wait for every core to flush.  After that, no
+ *   one can write the page.  A vcore on another core could write through a
+ *   stale TLB entry until then, which is why an asynchronous shootdown (what
+ *   munmap uses) isn't enough: we'd compress or free the page under it.
+ * - We compress the page, then under the pte_lock, the entry becomes STORED and
+ *   we free the page.  If the page didn't compress well enough, or we're out
+ *   of pool space, we put the page back in the PTE.
+ *
+ * Anyone that finds a PENDING entry (a fault, munmap, fork) can take the page
+ * back from the entry and mark it CANCELLED.  The swapper still owns the entry
+ * and frees it when it sees it was cancelled.  STORED entries are owned by
+ * their PTE.  All of the entry state changes happen under the pte_lock of the
+ * entry's process.
+ *
+ * Decompression happens in the page fault handler with the pte_lock held, so
+ * each core has its own inflate stream.  Only the reclaim ktask compresses, so
+ * there is one deflate stream. */
+
+#include <zswap.h>
+#include <reclaim.h>
+#include <zlib.h>
+#include <pmap.h>
+#include <process.h>
+#include <mm.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <arena.h>
+#include <smp.h>
+#include <time.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* A page is all we compress at a time, so we don't need a bigger window */
+#define ZSWAP_WBITS		12
+#define ZSWAP_MEM_LEVEL		8
+/* Pages that don't compress to this are not worth storing */
+#define ZSWAP_MAX_LEN		(PGSIZE * 3 / 4)
+#define ZSWAP_BATCH_PGS		64
+#define ZSWAP_PGS_PER_PASS	2048
+
+enum {
+	ZSWAP_PENDING,
+	ZSWAP_STORED,
+	ZSWAP_CANCELLED,
+};
+
+struct zswap_entry {
+	struct page			*page;	/* PENDING: PTE's page */
+	void				*data;	/* STORED: compressed page */
+	uintptr_t			va;
+	int				perm;	/* PTE perms for swap in */
+	uint16_t			len;
+	uint8_t				state;
+};
+
+struct zswap_stats {
+	atomic_t			nr_stored;
+	atomic_t			pool_bytes;
+	atomic_t			nr_swapouts;
+	atomic_t			nr_swapins;
+	atomic_t			nr_cancelled;
+	atomic_t			nr_rejected;
+	atomic_t			nr_pool_full;
+	atomic_t			nr_aged;
+	atomic_t			bytes_in;
+	atomic_t			bytes_out;
+	atomic_t			swapin_ticks;
+	atomic_t			swapin_max_ticks;
+};
+
+/* Arguments for a scan of a process's PTEs */
+struct zswap_scan {
+	struct proc			*p;
+	bool				age_only;
+	struct tlb_gather		tlb;
+	struct zswap_entry		*batch[ZSWAP_BATCH_PGS];
+	int				nr;
+	uintptr_t			next_va;
+};
+
+bool zswap_enabled = TRUE;
+unsigned int zswap_max_pool_pct = 20;
+
+static struct zswap_stats zswap_stats;
+static struct kmem_cache *zswap_entry_cache;
+static z_stream zswap_deflate_strm;
+static z_stream *zswap_inflate_strms;	/* one per core */
+static uint8_t *zswap_buf;		/* deflate output */
+static struct reclaimer zswap_reclaimer;
+
+static unsigned long entry2val(struct zswap_entry *e)
+{
+	/* Entries are at least 8 byte aligned */
+	return PADDR(e) >> 3;
+}
+
+static struct zswap_entry *pte2entry(pte_t pte)
+{
+	assert(pte_is_paged_out(pte));
+	return KADDR(pte_get_paged_out(pte) << 3);
+}
+
+static bool zswap_pool_full(size_t len)
+{
+	size_t limit = arena_amt_total(base_arena) / 100 * zswap_max_pool_pct;
+
+	return atomic_read(&zswap_stats.pool_bytes) + len > limit;
+}
+
+/* Compresses the page at kva into zswap_buf.  Returns the length, or 0 if it
+ * didn't compress to ZSWAP_MAX_LEN. */
+static size_t zswap_compress(void *kva)
+{
+	z_stream *strm = &zswap_deflate_strm;
+
+	if (zlib_deflateReset(strm) != Z_OK)
+		return 0;
+	strm->next_in = kva;
+	strm->avail_in = PGSIZE;
+	strm->next_out = zswap_buf;
+	strm->avail_out = ZSWAP_MAX_LEN;
+	if (zlib_deflate(strm, Z_FINISH) != Z_STREAM_END)
+		return 0;
+	return strm->total_out;
+}
+
+static int zswap_decompress(struct zswap_entry *e, void *kva)
+{
+	z_stream *strm = &zswap_inflate_strms[core_id()];
+
+	if (zlib_inflateReset(strm) != Z_OK)
+		return -1;
+	strm->next_in = e->data;
+	strm->avail_in = e->len;
+	strm->next_out = kva;
+	strm->avail_out = PGSIZE;
+	if (zlib_inflate(strm, Z_FINISH) != Z_STREAM_END)
+		return -1;
+	return strm->total_out == PGSIZE ? 0 : -1;
+}
+
+static void zswap_free_entry(struct zswap_entry *e)
+{
+	if (e->state == ZSWAP_STORED) {
+		kfree(e->data);
+		atomic_add(&zswap_stats.pool_bytes, -(long)e->len);
+		atomic_dec(&zswap_stats.nr_stored);
+	}
+	kmem_cache_free(zswap_entry_cache, e);
+}
+
+/* Takes the page back from a PENDING entry and puts it in the PTE. */
+static void zswap_cancel(pte_t pte, struct zswap_entry *e)
+{
+	pte_write(pte, page2pa(e->page), e->perm);
+	e->page = NULL;
+	e->state = ZSWAP_CANCELLED;
+	atomic_inc(&zswap_stats.nr_cancelled);
+}
+
+int zswap_fault_in_pte(struct proc *p, pte_t pte)
+{
+	struct zswap_entry *e = pte2entry(pte);
+	struct page *page;
+	uint64_t ticks = read_tsc();
+
+	if (e->state == ZSWAP_PENDING) {
+		zswap_cancel(pte, e);
+		return 0;
+	}
+	assert(e->state == ZSWAP_STORED);
+	if (upage_alloc(p, &page, FALSE))
+		return -ENOMEM;
+	if (zswap_decompress(e, page2kva(page)))
+		panic("zswap: corrupt page at %p for pid %d", e->va, p->pid);
+	pte_write(pte, page2pa(page), e->perm);
+	zswap_free_entry(e);
+	ticks = read_tsc() - ticks;
+	atomic_inc(&zswap_stats.nr_swapins);
+	atomic_add(&zswap_stats.swapin_ticks, ticks);
+	if (ticks > atomic_read(&zswap_stats.swapin_max_ticks))
+		atomic_set(&zswap_stats.swapin_max_ticks, ticks);
+	return 0;
+}
+
+int zswap_dup_pte(struct proc *new_p, pte_t pte, pte_t new_pte)
+{
+	struct zswap_entry *e = pte2entry(pte);
+	struct zswap_entry *new_e;
+	struct page *page;
+
+	if (e->state == ZSWAP_PENDING) {
+		if (upage_alloc(new_p, &page, FALSE))
+			return -ENOMEM;
+		memcpy(page2kva(page), page2kva(e->page), PGSIZE);
+		pte_write(new_pte, page2pa(page), e->perm);
+		return 0;
+	}
+	new_e = kmem_cache_alloc(zswap_entry_cache, MEM_ATOMIC);
+	if (!new_e)
+		return -ENOMEM;
+	new_e->data = kmalloc(e->len, MEM_ATOMIC);
+	if (!new_e->data) {
+		kmem_cache_free(zswap_entry_cache, new_e);
+		return -ENOMEM;
+	}
+	memcpy(new_e->data, e->data, e->len);
+	new_e->page = NULL;
+	new_e->va = e->va;
+	new_e->perm = e->perm;
+	new_e->len = e->len;
+	new_e->state = ZSWAP_STORED;
+	atomic_add(&zswap_stats.pool_bytes, e->len);
+	atomic_inc(&zswap_stats.nr_stored);
+	pte_write_paged_out(new_pte, entry2val(new_e));
+	return 0;
+}
+
+void zswap_free_pte(pte_t pte)
+{
+	struct zswap_entry *e = pte2entry(pte);
+
+	if (e->state == ZSWAP_PENDING) {
+		page_decref(e->page);
+		e->page = NULL;
+		e->state = ZSWAP_CANCELLED;
+		return;
+	}
+	zswap_free_entry(e);
+}
+
+void zswap_set_perm_pte(pte_t pte, int perm)
+{
+	pte2entry(pte)->perm = perm;
+}
+
+static int zswap_scan_pte(struct proc *p, pte_t pte, void *va, void *arg)
+{
+	struct zswap_scan *zs = arg;
+	struct zswap_entry *e;
+	struct page *page;
+
+	if (!pte_is_present(pte) || pte_is_jumbo(pte) || pte_is_cow(pte))
+		return 0;
+	page = pa2page(pte_get_paddr(pte));
+	if (page_is_pagemap(page) || page_is_shared(page))
+		return 0;
+	if (pte_is_accessed(pte)) {
+		pte_clear_accessed(pte);
+		tlb_gather_add(&zs->tlb, (uintptr_t)va, (uintptr_t)va + PGSIZE);
+		atomic_inc(&zswap_stats.nr_aged);
+		return 0;
+	}
+	if (zs->age_only)
+		return 0;
+	e = kmem_cache_alloc(zswap_entry_cache, MEM_ATOMIC);
+	if (!e)
+		return -ENOMEM;
+	e->page = page;
+	e->data = NULL;
+	e->va = (uintptr_t)va;
+	e->perm = pte_get_settings(pte) & PTE_PERM;
+	e->len = 0;
+	e->state = ZSWAP_PENDING;
+	pte_write_paged_out(pte, entry2val(e));
+	tlb_gather_add(&zs->tlb, (uintptr_t)va, (uintptr_t)va + PGSIZE);
+	zs->batch[zs->nr++] = e;
+	zs->next_va = (uintptr_t)va + PGSIZE;
+	return zs->nr == ZSWAP_BATCH_PGS ? 1 : 0;
+}
+
+/* Finishes swapping out one PENDING entry from a scan.  Caller holds the
+ * pte_lock. */
+static void __zswap_store(struct proc *p, struct zswap_entry *e, void *data,
+                          size_t len)
+{
+	struct page *page = e->page;
+	pte_t pte;
+
+	if (e->state == ZSWAP_CANCELLED) {
+		kfree(data);
+		kmem_cache_free(zswap_entry_cache, e);
+		return;
+	}
+	assert(e->state == ZSWAP_PENDING);
+	if (!data) {
+		pte = pgdir_walk(p->env_pgdir, (void*)e->va, 0);
+		assert(pte_walk_okay(pte) && pte2entry(pte) == e);
+		pte_write(pte, page2pa(page), e->perm);
+		kmem_cache_free(zswap_entry_cache, e);
+		return;
+	}
+	e->data = data;
+	e->len = len;
+	e->page = NULL;
+	e->state = ZSWAP_STORED;
+	atomic_add(&zswap_stats.pool_bytes, len);
+	atomic_inc(&zswap_stats.nr_stored);
+	atomic_inc(&zswap_stats.nr_swapouts);
+	atomic_add(&zswap_stats.bytes_in, PGSIZE);
+	atomic_add(&zswap_stats.bytes_out, len);
+	page_decref(page);
+}
+
+/* Returns a copy of page, compressed, and its length in *len.  Returns NULL if
+ * the page isn't worth storing. */
+static void *zswap_compress_page(struct page *page, size_t *len)
+{
+	void *data;
+
+	*len = zswap_compress(page2kva(page));
+	if (!*len) {
+		atomic_inc(&zswap_stats.nr_rejected);
+		return NULL;
+	}
+	if (zswap_pool_full(*len)) {
+		atomic_inc(&zswap_stats.nr_pool_full);
+		return NULL;
+	}
+	data = kmalloc(*len, MEM_ATOMIC);
+	if (data)
+		memcpy(data, zswap_buf, *len);
+	return data;
+}
+
+/* Compresses the pages of a scan's batch.  Every core has flushed its TLB, so
+ * the pages won't change. */
+static void zswap_store_batch(struct zswap_scan *zs)
+{
+	struct proc *p = zs->p;
+	struct zswap_entry *e;
+	struct page *page;
+	void *data;
+	size_t len = 0;
+
+	for (int i = 0; i < zs->nr; i++) {
+		e = zs->batch[i];
+		/* If a fault took the page back, it could be freed and reused
+		 * while we compress it.  That's OK; we'll see the entry was
+		 * cancelled and throw the data away. */
+		page = ACCESS_ONCE(e->page);
+		data = page ? zswap_compress_page(page, &len) : NULL;
+		spin_lock(&p->pte_lock);
+		__zswap_store(p, e, data, len);
+		spin_unlock(&p->pte_lock);
+	}
+	zs->nr = 0;
+}
+
+static bool zswap_proc_ok(struct proc *p)
+{
+	switch (ACCESS_ONCE(p->state)) {
+	case PROC_CREATED:
+	case PROC_DYING:
+	case PROC_DYING_ABORT:
+		return FALSE;
+	}
+	return !p->vmm.vmmcp;
+}
+
+/* Swaps out up to ZSWAP_BATCH_PGS of p's cold pages.  Returns how many. */
+static int zswap_shrink_proc(struct proc *p)
+{
+	struct zswap_scan zs[1];
+	uintptr_t hand = p->zswap_hand;
+	int ret, nr;
+
+	zs->p = p;
+	zs->age_only = FALSE;
+	zs->nr = 0;
+	tlb_gather_init(&zs->tlb, p);
+	zs->next_va = 0;
+	ret = anon_mem_walk(p, hand, UMAPTOP, zswap_scan_pte, zs);
+	if (!ret) {
+		/* Wrapped around */
+		zs->next_va = 0;
+		ret = anon_mem_walk(p, 0, hand, zswap_scan_pte, zs);
+	}
+	p->zswap_hand = zs->next_va;
+	tlb_gather_flush_sync(&zs->tlb);
+	nr = zs->nr;
+	zswap_store_batch(zs);
+	return nr;
+}
+
+static void zswap_age_proc(struct proc *p)
+{
+	struct zswap_scan zs[1];
+
+	zs->p = p;
+	zs->age_only = TRUE;
+	zs->nr = 0;
+	tlb_gather_init(&zs->tlb, p);
+	anon_mem_walk(p, 0, UMAPTOP, zswap_scan_pte, zs);
+	/* Nothing changes hands, so the flush needn't wait */
+	tlb_gather_flush(&zs->tlb);
+}
+
+static void zswap_reclaim(struct reclaimer *r, int level)
+{
+	struct process_set pset;
+	int nr_done = 0, nr_pass;
+
+	if (!READ_ONCE(zswap_enabled))
+		return;
+	proc_get_set(&pset);
+	if (level == RECLAIM_TRIM) {
+		for (int i = 0; i < pset.num_processes; i++) {
+			if (zswap_proc_ok(pset.procs[i]))
+				zswap_age_proc(pset.procs[i]);
+		}
+		proc_free_set(&pset);
+		return;
+	}
+	/* Round-robin over the processes, a batch at a time */
+	do {
+		nr_pass = 0;
+		for (int i = 0; i < pset.num_processes; i++) {
+			if (zswap_pool_full(0))
+				break;
+			if (zswap_proc_ok(pset.procs[i]))
+				nr_pass += zswap_shrink_proc(pset.procs[i]);
+		}
+		nr_done += nr_pass;
+	} while (nr_pass && nr_done < ZSWAP_PGS_PER_PASS);
+	proc_free_set(&pset);
+}
+
+void zswap_init(void)
+{
+	z_stream *strm;
+
+	zswap_entry_cache = kmem_cache_create("zswap_entry",
+					      sizeof(struct zswap_entry),
+					      __alignof__(struct zswap_entry),
+					      0, NULL, 0, 0, NULL);
+	zswap_buf = kmalloc(PGSIZE, MEM_WAIT);
+	strm = &zswap_deflate_strm;
+	strm->workspace = kmalloc(zlib_deflate_workspacesize(-ZSWAP_WBITS,
+							     ZSWAP_MEM_LEVEL),
+				  MEM_WAIT);
+	if (zlib_deflateInit2(strm, Z_BEST_SPEED, Z_DEFLATED, -ZSWAP_WBITS,
+			      ZSWAP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+		panic("zswap: can't init deflate");
+	zswap_inflate_strms = kzmalloc(sizeof(z_stream) * num_cores, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		strm = &zswap_inflate_strms[i];
+		strm->workspace = kmalloc(zlib_inflate_workspacesize(),
+					  MEM_WAIT);
+		if (zlib_inflateInit2(strm, -ZSWAP_WBITS) != Z_OK)
+			panic("zswap: can't init inflate");
+	}
+	zswap_reclaimer.name = "zswap";
+	zswap_reclaimer.func = zswap_reclaim;
+	register_reclaimer(&zswap_reclaimer);
+}
+
+void zswap_fetch_stats(struct sized_alloc *sza)
+{
+	struct zswap_stats *st = &zswap_stats;
+	unsigned long nr_stored = atomic_read(&st->nr_stored);
+	unsigned long pool_bytes = atomic_read(&st->pool_bytes);
+	unsigned long bytes_out = atomic_read(&st->bytes_out);
+	unsigned long nr_swapins = atomic_read(&st->nr_swapins);
+
+	sza_printf(sza, "Enabled          : %d\n", zswap_enabled);
+	sza_printf(sza, "Pool limit       : %lu bytes (%u%%)\n",
+	           arena_amt_total(base_arena) / 100 * zswap_max_pool_pct,
+	           zswap_max_pool_pct);
+	sza_printf(sza, "Pool             : %lu bytes\n", pool_bytes);
+	sza_printf(sza, "Stored pages     : %lu\n", nr_stored);
+	sza_printf(sza, "Ratio (current)  : %lu%%\n",
+	           pool_bytes ? nr_stored * PGSIZE * 100 / pool_bytes : 0);
+	sza_printf(sza, "Ratio (lifetime) : %lu%%\n",
+	           bytes_out ? atomic_read(&st->bytes_in) * 100 / bytes_out
+	                     : 0);
+	sza_printf(sza, "Swap outs        : %lu\n",
+	           atomic_read(&st->nr_swapouts));
+	sza_printf(sza, "Swap ins         : %lu\n", nr_swapins);
+	sza_printf(sza, "Swap in avg      : %llu ns\n",
+	           nr_swapins ? tsc2nsec(atomic_read(&st->swapin_ticks))
+	                        / nr_swapins : 0);
+	sza_printf(sza, "Swap in max      : %llu ns\n",
+	           tsc2nsec(atomic_read(&st->swapin_max_ticks)));
+	sza_printf(sza, "Cancelled        : %lu\n",
+	           atomic_read(&st->nr_cancelled));
+	sza_printf(sza, "Incompressible   : %lu\n",
+	           atomic_read(&st->nr_rejected));
+	sza_printf(sza, "Pool full        : %lu\n",
+	           atomic_read(&st->nr_pool_full));
+	sza_printf(sza, "Aged PTEs        : %lu\n", atomic_read(&st->nr_aged));
+}
@@ -0,0 +1,99 @@
+/* fork_exec_lat: measures fork() and fork() + exec() latency as the parent's
+ * resident memory grows.
+ *
+ * For each step, the parent touches another chunk of anonymous memory, then
+ * forks NR_LOOPS children that exit right away, and NR_LOOPS children that
+ * exec this binary (which exits right away).  If fork copies the parent's
+ * memory, both latencies grow with the parent's RSS.  With CoW, fork only
+ * copies page tables, and the child's exec throws those away.
+ *
+ * Usage: fork_exec_lat [MAX_RSS_MB] [NR_LOOPS] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+
+#define CHILD_ARG "--exit-now"
+
+static void wait_child(pid_t pid)
+{
+	int status;
+
+	if (pid < 0) {
+		perror("fork");
+		exit(-1);
+	}
+	if (waitpid(pid, &status, 0) != pid) {
+		perror("waitpid");
+		exit(-1);
+	}
+}
+
+/* Returns the average nsec for a fork, and for an exec if argv is set,
+ * including waiting for the child to exit. */
+static uint64_t time_fork(int nr_loops, char **argv)
+{
+	uint64_t start;
+	pid_t pid;
+
+	start = read_tsc();
+	for (int i = 0; i < nr_loops; i++) {
+		pid = fork();
+		if (!pid) {
+			if (argv) {
+				execv(argv[0], argv);
+				perror("execv");
+			}
+			_exit(0);
+		}
+		wait_child(pid);
+	}
+	return tsc2nsec(read_tsc() - start) / nr_loops;
+}
+
+int main(int argc, char **argv)
+{
+	size_t max_rss_mb = 512;
+	size_t rss_mb = 0;
+	int nr_loops = 20;
+	char *child_argv[] = {argv[0], CHILD_ARG, NULL};
+	char *rss;
+
+	if (argc > 1 && !strcmp(argv[1], CHILD_ARG))
+		return 0;
+	if (argc > 1)
+		max_rss_mb = atol(argv[1]);
+	if (argc > 2)
+		nr_loops = atoi(argv[2]);
+	if (!max_rss_mb || nr_loops < 1) {
+		printf("Usage: %s [MAX_RSS_MB] [NR_LOOPS]\n", argv[0]);
+		exit(-1);
+	}
+	rss = mmap(0, max_rss_mb << 20, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rss == MAP_FAILED) {
+		perror("mmap");
+		exit(-1);
+	}
+
+	printf("%10s %14s %14s\n", "RSS (MB)", "fork ns", "fork+exec ns");
+	for (size_t step = 0; ; step = step ? step * 4 : 1) {
+		if (step > max_rss_mb)
+			step = max_rss_mb;
+		/* Touch the next chunk, so it is resident for the children */
+		for (size_t i = rss_mb << 20; i < step << 20; i += PGSIZE)
+			rss[i] = 1;
+		rss_mb = step;
+		printf("%10lu %14lu %14lu\n", rss_mb, time_fork(nr_loops, NULL),
+		       time_fork(nr_loops, child_argv));
+		if (step >= max_rss_mb)
+			break;
+	}
+	return 0;
+}
@@ -0,0 +1,169 @@
+/* mmap_fault_lat: measures page faults on a file mapping with different
+ * fault-around settings.
+ *
+ * We write a FILE_MB file, so its pages are in the page cache.  Then for each
+ * setting of #mem/fault_around, we mmap the file NR_LOOPS times, read a byte
+ * from each page, and munmap it.  We do that from main(), after the 2LS is up:
+ * before that, mmap() populates every file mapping (see VC_SCP_NOVCCTX in
+ * mmap()), so exec and ld.so barely take any file faults.
+ *
+ * Without fault-around, each page we touch is a fault.  With it, each fault
+ * also maps the cached pages around it.  We print the time per page and the
+ * faults per mapping, from #mem/fault_around's counters.
+ *
+ * Usage: mmap_fault_lat [NR_LOOPS] [FILE_MB] [FILE] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+
+#define FA_FILE "#mem/fault_around"
+
+static unsigned int fa_settings[] = {0, 4, 16, 64};
+
+static int set_fault_around(unsigned int nr_pgs)
+{
+	char buf[32];
+	int fd = open(FA_FILE, O_WRONLY);
+	int len, ret;
+
+	if (fd < 0)
+		return -1;
+	len = snprintf(buf, sizeof(buf), "pages %u", nr_pgs);
+	ret = write(fd, buf, len);
+	close(fd);
+	return ret == len ? 0 : -1;
+}
+
+static int read_fault_around(char *buf, size_t sz)
+{
+	int fd = open(FA_FILE, O_RDONLY);
+	ssize_t amt;
+
+	if (fd < 0)
+		return -1;
+	amt = read(fd, buf, sz - 1);
+	close(fd);
+	if (amt <= 0)
+		return -1;
+	buf[amt] = 0;
+	return 0;
+}
+
+/* Returns the value of the "name: val" line in #mem/fault_around, or 0. */
+static unsigned long get_fault_around(char *name)
+{
+	char buf[256];
+	char *p;
+
+	if (read_fault_around(buf, sizeof(buf)))
+		return 0;
+	p = strstr(buf, name);
+	if (p)
+		p = strchr(p, ':');
+	return p ? strtoul(p + 1, 0, 0) : 0;
+}
+
+static int make_file(char *path, size_t len)
+{
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return -1;
+	buf = malloc(PGSIZE);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+	memset(buf, 0xab, PGSIZE);
+	for (size_t off = 0; off < len; off += PGSIZE) {
+		if (write(fd, buf, PGSIZE) != PGSIZE) {
+			free(buf);
+			close(fd);
+			return -1;
+		}
+	}
+	free(buf);
+	return fd;
+}
+
+/* Returns the average nsec per page touched, or 0 if mmap failed. */
+static uint64_t time_faults(int fd, size_t len, int nr_loops)
+{
+	volatile unsigned char *addr;
+	uint64_t start, total = 0;
+	unsigned long sum = 0;
+
+	for (int i = 0; i < nr_loops; i++) {
+		addr = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED)
+			return 0;
+		start = read_tsc();
+		for (size_t off = 0; off < len; off += PGSIZE)
+			sum += addr[off];
+		total += read_tsc() - start;
+		munmap((void*)addr, len);
+	}
+	if (sum != 0xab * (len / PGSIZE) * nr_loops)
+		printf("Bad file contents\n");
+	return tsc2nsec(total) / (len / PGSIZE * nr_loops);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int old_setting = get_fault_around("Pages");
+	char *path = "/tmp/mmap_fault_lat";
+	int nr_loops = 20;
+	size_t file_mb = 64;
+	unsigned long faults;
+	uint64_t nsec;
+	char buf[256];
+	int fd;
+
+	if (argc > 1)
+		nr_loops = atoi(argv[1]);
+	if (argc > 2)
+		file_mb = atoi(argv[2]);
+	if (argc > 3)
+		path = argv[3];
+	if (nr_loops < 1 || !file_mb) {
+		printf("Usage: %s [NR_LOOPS] [FILE_MB] [FILE]\n", argv[0]);
+		exit(-1);
+	}
+	fd = make_file(path, file_mb << 20);
+	if (fd < 0) {
+		perror(path);
+		exit(-1);
+	}
+
+	printf("%10s %15s %15s\n", "fa pages", "ns/page", "faults/mmap");
+	for (int i = 0; i < COUNT_OF(fa_settings); i++) {
+		if (set_fault_around(fa_settings[i])) {
+			printf("Can't set %s, skipping\n", FA_FILE);
+			continue;
+		}
+		faults = get_fault_around("File faults");
+		nsec = time_faults(fd, file_mb << 20, nr_loops);
+		if (!nsec) {
+			perror("mmap");
+			break;
+		}
+		faults = get_fault_around("File faults") - faults;
+		printf("%10u %15lu %15lu\n", fa_settings[i], nsec,
+		       faults / nr_loops);
+	}
+	set_fault_around(old_setting);
+	close(fd);
+	unlink(path);
+	if (!read_fault_around(buf, sizeof(buf)))
+		printf("\n%s", buf);
+	return 0;
+}
@@ -0,0 +1,102 @@
+/* munmap_lat: measures munmap() latency as the number of vcores running in the
+ * address space grows.
+ *
+ * For each step, we get more vcores, each spinning in userspace, so every one
+ * of them has our address space loaded.  Then vcore 0 maps, touches, and unmaps
+ * regions of a few sizes.  Each munmap needs a TLB shootdown on every core that
+ * might have cached the old PTEs.  If the kernel interrupts every vcore with a
+ * full TLB flush, munmap cost grows with the number of vcores, and the spinners
+ * lose their TLBs too.
+ *
+ * Usage: munmap_lat [MAX_VCORES] [NR_LOOPS] */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/timing.h>
+
+static size_t region_pgs[] = {1, 16, 256};
+static volatile bool spinners_done;
+
+static void *spin_thread(void *arg)
+{
+	while (!spinners_done)
+		cpu_relax();
+	return 0;
+}
+
+/* Returns the average nsec for an munmap of nr_pgs touched pages. */
+static uint64_t time_munmap(size_t nr_pgs, int nr_loops)
+{
+	uint64_t ticks = 0, start;
+	char *region;
+
+	for (int i = 0; i < nr_loops; i++) {
+		region = mmap(0, nr_pgs * PGSIZE, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (region == MAP_FAILED) {
+			perror("mmap");
+			exit(-1);
+		}
+		for (size_t j = 0; j < nr_pgs; j++)
+			region[j * PGSIZE] = 1;
+		start = read_tsc();
+		munmap(region, nr_pgs * PGSIZE);
+		ticks += read_tsc() - start;
+	}
+	return tsc2nsec(ticks) / nr_loops;
+}
+
+int main(int argc, char **argv)
+{
+	int max_vcs = max_vcores();
+	int nr_loops = 1000;
+	int nr_vcs = 1;
+	pthread_t *threads;
+
+	if (argc > 1)
+		max_vcs = atoi(argv[1]);
+	if (argc > 2)
+		nr_loops = atoi(argv[2]);
+	if (max_vcs < 1 || max_vcs > max_vcores() || nr_loops < 1) {
+		printf("Usage: %s [MAX_VCORES (up to %d)] [NR_LOOPS]\n",
+		       argv[0], max_vcores());
+		exit(-1);
+	}
+	threads = malloc(sizeof(pthread_t) * max_vcs);
+	assert(threads);
+	parlib_never_yield = TRUE;
+	pthread_need_tls(FALSE);
+	pthread_mcp_init();		/* gives us one vcore */
+
+	printf("%10s", "vcores");
+	for (int i = 0; i < COUNT_OF(region_pgs); i++)
+		printf(" %10lu pg", region_pgs[i]);
+	printf("   (ns/munmap)\n");
+	for (int step = 1; ; step *= 2) {
+		if (step > max_vcs)
+			step = max_vcs;
+		vcore_request_total(step);
+		/* Each spinner holds on to a vcore; we're on the first one */
+		for (; nr_vcs < step; nr_vcs++)
+			pthread_create(&threads[nr_vcs], NULL, spin_thread,
+				       NULL);
+		while (num_vcores() < step)
+			cpu_relax();
+		printf("%10d", num_vcores());
+		for (int i = 0; i < COUNT_OF(region_pgs); i++)
+			printf(" %13lu", time_munmap(region_pgs[i], nr_loops));
+		printf("\n");
+		if (step >= max_vcs)
+			break;
+	}
+	spinners_done = TRUE;
+	for (int i = 1; i < nr_vcs; i++)
+		pthread_join(threads[i], NULL);
+	return 0;
+}
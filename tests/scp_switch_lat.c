@@ -0,0 +1,156 @@
+/* scp_switch_lat: measures the cost of switching between two SCPs on one core,
+ * with and without x86 PCIDs.
+ *
+ * We fork a child and pass a byte back and forth over a pair of pipes.  Each
+ * side blocks in read() until the other writes, so when both SCPs share a core,
+ * every hop is a switch between address spaces.  Without PCIDs, every switch
+ * flushes the TLB, and each side takes TLB misses on its next accesses.  To
+ * make that visible, each side reads NR_TOUCH_PGS pages of its memory per hop.
+ *
+ * PCIDs are toggled with #arch/pcid, whose stats we print after each run.  Run
+ * this with SCPs on a single core, or the numbers include cross-core wakeups.
+ *
+ * Usage: scp_switch_lat [NR_LOOPS] [NR_TOUCH_PGS] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+
+#define PCID_FILE "#arch/pcid"
+
+static char *touch_buf;
+static size_t nr_touch_pgs = 64;
+
+static int set_pcid(int on)
+{
+	int fd = open(PCID_FILE, O_WRONLY);
+	int ret;
+
+	if (fd < 0)
+		return -1;
+	ret = write(fd, on ? "1" : "0", 1);
+	close(fd);
+	return ret == 1 ? 0 : -1;
+}
+
+static void print_pcid_stats(void)
+{
+	char buf[256];
+	int fd = open(PCID_FILE, O_RDONLY);
+	ssize_t amt;
+
+	if (fd < 0)
+		return;
+	amt = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (amt <= 0)
+		return;
+	buf[amt] = 0;
+	printf("%s", buf);
+}
+
+static void touch_pages(void)
+{
+	for (size_t i = 0; i < nr_touch_pgs; i++)
+		(void)*(volatile char*)&touch_buf[i * PGSIZE];
+}
+
+static void hop(int rfd, int wfd)
+{
+	char c = 0;
+
+	if (write(wfd, &c, 1) != 1) {
+		perror("write");
+		exit(-1);
+	}
+	if (read(rfd, &c, 1) != 1) {
+		perror("read");
+		exit(-1);
+	}
+	touch_pages();
+}
+
+/* Returns the average nsec per switch, i.e. half of a round trip. */
+static uint64_t time_pingpong(int nr_loops)
+{
+	int p2c[2], c2p[2];
+	uint64_t start, ticks;
+	pid_t pid;
+	char c;
+
+	if (pipe(p2c) || pipe(c2p)) {
+		perror("pipe");
+		exit(-1);
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(-1);
+	}
+	if (!pid) {
+		close(p2c[1]);
+		close(c2p[0]);
+		while (read(p2c[0], &c, 1) == 1) {
+			touch_pages();
+			if (write(c2p[1], &c, 1) != 1)
+				break;
+		}
+		_exit(0);
+	}
+	close(p2c[0]);
+	close(c2p[1]);
+	/* Warm up, so both sides have faulted in their pages */
+	for (int i = 0; i < 10; i++)
+		hop(c2p[0], p2c[1]);
+	start = read_tsc();
+	for (int i = 0; i < nr_loops; i++)
+		hop(c2p[0], p2c[1]);
+	ticks = read_tsc() - start;
+	close(p2c[1]);
+	close(c2p[0]);
+	waitpid(pid, NULL, 0);
+	return tsc2nsec(ticks) / (nr_loops * 2);
+}
+
+int main(int argc, char **argv)
+{
+	int nr_loops = 100000;
+
+	if (argc > 1)
+		nr_loops = atoi(argv[1]);
+	if (argc > 2)
+		nr_touch_pgs = atol(argv[2]);
+	if (nr_loops < 1) {
+		printf("Usage: %s [NR_LOOPS] [NR_TOUCH_PGS]\n", argv[0]);
+		exit(-1);
+	}
+	touch_buf = mmap(0, (nr_touch_pgs + 1) * PGSIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (touch_buf == MAP_FAILED) {
+		perror("mmap");
+		exit(-1);
+	}
+	memset(touch_buf, 0, (nr_touch_pgs + 1) * PGSIZE);
+
+	for (int on = 1; on >= 0; on--) {
+		if (set_pcid(on)) {
+			printf("Can't turn PCIDs %s, skipping\n",
+			       on ? "on" : "off");
+			continue;
+		}
+		printf("PCIDs %s: %lu ns/switch, touching %lu pgs\n",
+		       on ? "on" : "off", time_pingpong(nr_loops),
+		       nr_touch_pgs);
+		print_pcid_stats();
+	}
+	/* Leave them on, if the CPU has them */
+	set_pcid(1);
+	return 0;
+}
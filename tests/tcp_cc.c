@@ -0,0 +1,270 @@
+/* tcp_cc: sends with each TCP congestion control algorithm, and shows what
+ * the conv's status says about it.
+ *
+ * For each algorithm, we pick it with a new conv's "cc" ctl, connect to DEST,
+ * and send as fast as we can for SECS.  Then we print the throughput and the
+ * cc, cwin, ssthresh and srtt from the conv's status.  We also check that
+ * "ccdefault" picks the algorithm for new convs.  The math itself is checked
+ * by the tcp_cubic ktest.
+ *
+ * Without DEST (or with DEST "loop"), we send to a reader of our own over
+ * loopback, which won't lose anything, so it only shows that the plumbing
+ * works.  To see the algorithms differ, send over a lossy, high-latency link
+ * to a sink, e.g.
+ *
+ * 	iperf -s -p 5001
+ *
+ * and run tcp_cc tcp!SINK_IP!5001.  DEST needs to be tcp!IP!PORT.
+ *
+ * Usage: tcp_cc [DEST] [SECS] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <iplib/iplib.h>
+
+#define IO_SZ (64 * 1024)
+#define LOOP_PORT 5002
+
+static char *algorithms[] = {"reno", "cubic"};
+static char *status_fields[] = {"cc", "cwin", "ssthresh", "srtt"};
+
+static void *reader(void *arg)
+{
+	int fd = (int)(long)arg;
+	char *buf = malloc(IO_SZ);
+
+	if (!buf)
+		return NULL;
+	while (read(fd, buf, IO_SZ) > 0)
+		;
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+/* Accepts connections on adir forever, reading and dropping everything */
+static void *acceptor(void *arg)
+{
+	char *adir = arg;
+	char ldir[40];
+	pthread_t thread;
+	int lcfd, fd;
+
+	for (;;) {
+		lcfd = listen9(adir, ldir, 0);
+		if (lcfd < 0)
+			return NULL;
+		fd = accept9(lcfd, ldir);
+		close(lcfd);
+		if (fd < 0)
+			continue;
+		if (pthread_create(&thread, NULL, reader, (void*)(long)fd)) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+static int setup_loop(char *dest, size_t len)
+{
+	static char adir[40];
+	char addr[64];
+	pthread_t thread;
+
+	snprintf(addr, sizeof(addr), "tcp!*!%d", LOOP_PORT);
+	if (announce9(addr, adir, 0) < 0)
+		return -1;
+	if (pthread_create(&thread, NULL, acceptor, adir))
+		return -1;
+	pthread_detach(thread);
+	snprintf(dest, len, "tcp!127.0.0.1!%d", LOOP_PORT);
+	return 0;
+}
+
+static int ctl(int cfd, char *fmt, char *arg)
+{
+	char buf[64];
+	int len = snprintf(buf, sizeof(buf), fmt, arg);
+
+	return write(cfd, buf, len) == len ? 0 : -1;
+}
+
+/* Prints the value after "field " in the status, or returns -1. */
+static int print_status(char *status, char *field)
+{
+	char key[32];
+	char *p;
+	int len;
+
+	len = snprintf(key, sizeof(key), " %s ", field);
+	p = strstr(status, key);
+	if (!p)
+		return -1;
+	p += len;
+	printf(" %10.*s", (int)strcspn(p, " \n"), p);
+	return 0;
+}
+
+/* Connects to dest, which is tcp!IP!PORT, with algorithm alg (NULL for the
+ * default), which we set before connecting.  Returns the data FD, with the ctl
+ * FD in *cfdp and the conv's directory in dir. */
+static int connect_with_cc(char *dest, char *alg, char *dir, size_t len,
+			   int *cfdp)
+{
+	char buf[32];
+	int cfd, fd;
+	ssize_t amt;
+
+	if (strncmp(dest, "tcp!", 4))
+		return -1;
+	cfd = open("/net/tcp/clone", O_RDWR);
+	if (cfd < 0)
+		return -1;
+	amt = read(cfd, buf, sizeof(buf) - 1);
+	if (amt <= 0)
+		goto err;
+	buf[amt] = 0;
+	snprintf(dir, len, "/net/tcp/%d", atoi(buf));
+	if (alg && ctl(cfd, "cc %s", alg))
+		goto err;
+	if (ctl(cfd, "connect %s", dest + 4))
+		goto err;
+	snprintf(buf, sizeof(buf), "%s/data", dir);
+	fd = open(buf, O_RDWR);
+	if (fd < 0)
+		goto err;
+	*cfdp = cfd;
+	return fd;
+err:
+	close(cfd);
+	return -1;
+}
+
+static int read_status(char *dir, char *buf, size_t len)
+{
+	char path[64];
+	ssize_t amt;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/status", dir);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	amt = read(fd, buf, len - 1);
+	close(fd);
+	if (amt <= 0)
+		return -1;
+	buf[amt] = 0;
+	return 0;
+}
+
+/* Sends for secs with algorithm alg (NULL for the default).  Returns 0 on
+ * success, with the status from the end of the run in status. */
+static int run(char *dest, char *alg, int secs, char *status, size_t len,
+	       unsigned long *bytes, uint64_t *nsec)
+{
+	char dir[40];
+	char *buf;
+	int fd, cfd, ret = -1;
+	uint64_t start, end;
+	ssize_t amt;
+
+	fd = connect_with_cc(dest, alg, dir, sizeof(dir), &cfd);
+	if (fd < 0)
+		return -1;
+	buf = calloc(1, IO_SZ);
+	if (!buf)
+		goto out;
+	*bytes = 0;
+	start = read_tsc();
+	end = start + nsec2tsc(secs * 1000000000ULL);
+	while (read_tsc() < end) {
+		amt = write(fd, buf, IO_SZ);
+		if (amt <= 0)
+			goto out;
+		*bytes += amt;
+	}
+	*nsec = tsc2nsec(read_tsc() - start);
+	ret = read_status(dir, status, len);
+out:
+	free(buf);
+	close(cfd);
+	close(fd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	char dest[128], status[512], key[32];
+	unsigned long bytes;
+	uint64_t nsec;
+	int secs = 5;
+	int cfd, fd;
+
+	if (argc > 1 && strcmp(argv[1], "loop")) {
+		snprintf(dest, sizeof(dest), "%s", argv[1]);
+	} else if (setup_loop(dest, sizeof(dest))) {
+		perror("loopback sink");
+		exit(-1);
+	}
+	if (argc > 2)
+		secs = atoi(argv[2]);
+	if (secs < 1) {
+		printf("Usage: %s [DEST] [SECS]\n", argv[0]);
+		exit(-1);
+	}
+
+	printf("%10s", "MB/s");
+	for (int i = 0; i < COUNT_OF(status_fields); i++)
+		printf(" %10s", status_fields[i]);
+	printf("\n");
+	for (int i = 0; i < COUNT_OF(algorithms); i++) {
+		if (run(dest, algorithms[i], secs, status, sizeof(status),
+			&bytes, &nsec)) {
+			printf("Can't send with %s\n", algorithms[i]);
+			exit(-1);
+		}
+		printf("%10lu", bytes * 1000 / nsec);
+		/* The cc we picked before connecting should have stuck */
+		snprintf(key, sizeof(key), " cc %s ", algorithms[i]);
+		if (!strstr(status, key)) {
+			printf("\ncc %s didn't take: %s", algorithms[i],
+			       status);
+			exit(-1);
+		}
+		for (int j = 0; j < COUNT_OF(status_fields); j++) {
+			if (print_status(status, status_fields[j])) {
+				printf("\nNo %s in status: %s",
+				       status_fields[j], status);
+				exit(-1);
+			}
+		}
+		printf("\n");
+	}
+
+	/* New convs get the default, which any conv's ctl can set */
+	fd = dial9(dest, 0, 0, &cfd, 0);
+	if (fd < 0 || ctl(cfd, "ccdefault %s", "cubic")) {
+		perror("ccdefault");
+		exit(-1);
+	}
+	close(fd);
+	if (run(dest, NULL, 1, status, sizeof(status), &bytes, &nsec) ||
+	    !strstr(status, " cc cubic ")) {
+		printf("ccdefault didn't take: %s", status);
+		ctl(cfd, "ccdefault %s", "reno");
+		exit(-1);
+	}
+	ctl(cfd, "ccdefault %s", "reno");
+	close(cfd);
+	printf("ccdefault works\n");
+	return 0;
+}
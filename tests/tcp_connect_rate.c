@@ -0,0 +1,125 @@
+/* tcp_connect_rate: measures how fast we can set up and tear down TCP
+ * connections while lots of other connections are open.
+ *
+ * Every connection is to ourselves over loopback, so each one is two TCP convs:
+ * the one we dial and the one we accept.  We time NR_CONNECTS rounds of dial,
+ * accept, and close, first with no other connections, then after opening
+ * enough idle connections to reach each step of live convs, up to
+ * NR_LIVE_CONVS.  Finding a conv to clone and picking an ephemeral port used to
+ * scan every conv, so this is where that shows up.
+ *
+ * We stop adding live connections early if we run out of convs (see MaxConn in
+ * /net/tcp/stats) or FDs.
+ *
+ * Usage: tcp_connect_rate [NR_LIVE_CONVS] [NR_CONNECTS] [PORT] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <iplib/iplib.h>
+
+static int live_steps[] = {0, 1000, 10000, 50000};
+
+/* Dials and accepts one connection.  Returns 0 on success, with the FDs in
+ * dfd and afd. */
+static int connect_one(char *adir, char *addr, int *dfd, int *afd)
+{
+	char ldir[40];
+	int lcfd;
+
+	*dfd = dial9(addr, 0, 0, 0, 0);
+	if (*dfd < 0)
+		return -1;
+	lcfd = listen9(adir, ldir, 0);
+	if (lcfd < 0) {
+		close(*dfd);
+		return -1;
+	}
+	*afd = accept9(lcfd, ldir);
+	close(lcfd);
+	if (*afd < 0) {
+		close(*dfd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns the average nsec per connect, or 0 if a connect failed. */
+static uint64_t time_connects(char *adir, char *addr, int nr_connects)
+{
+	uint64_t start;
+	int dfd, afd;
+
+	start = read_tsc();
+	for (int i = 0; i < nr_connects; i++) {
+		if (connect_one(adir, addr, &dfd, &afd)) {
+			perror("connect");
+			return 0;
+		}
+		close(dfd);
+		close(afd);
+	}
+	return tsc2nsec(read_tsc() - start) / nr_connects;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_live_convs = 50000;
+	int nr_connects = 10000;
+	int port = 7778;
+	int live_convs = 0;
+	char adir[40], addr[64];
+	int afd, dfd, target;
+	uint64_t nsec;
+
+	if (argc > 1)
+		nr_live_convs = atoi(argv[1]);
+	if (argc > 2)
+		nr_connects = atoi(argv[2]);
+	if (argc > 3)
+		port = atoi(argv[3]);
+	if (nr_live_convs < 0 || nr_connects < 1) {
+		printf("Usage: %s [NR_LIVE_CONVS] [NR_CONNECTS] [PORT]\n",
+		       argv[0]);
+		exit(-1);
+	}
+
+	snprintf(addr, sizeof(addr), "tcp!*!%d", port);
+	afd = announce9(addr, adir, 0);
+	if (afd < 0) {
+		perror("announce");
+		exit(-1);
+	}
+	snprintf(addr, sizeof(addr), "tcp!127.0.0.1!%d", port);
+
+	printf("%12s %15s %15s\n", "live convs", "ns/connect", "connects/s");
+	for (int i = 0; i < COUNT_OF(live_steps); i++) {
+		target = live_steps[i];
+		if (target > nr_live_convs)
+			target = nr_live_convs;
+		if (i && target <= live_convs)
+			break;
+		while (live_convs < target) {
+			/* Leak dfd and afd, they keep the connection open */
+			if (connect_one(adir, addr, &dfd, &afd)) {
+				printf("Stopped at %d live convs\n",
+				       live_convs);
+				break;
+			}
+			live_convs += 2;
+		}
+		nsec = time_connects(adir, addr, nr_connects);
+		if (!nsec)
+			break;
+		printf("%12d %15lu %15lu\n", live_convs, nsec,
+		       1000000000UL / nsec);
+		if (live_convs < target)
+			break;
+	}
+	return 0;
+}
@@ -0,0 +1,219 @@
+/* tcp_gro: compares TCP receive throughput with and without software GRO.
+ *
+ * For each setting of the interface's "gro" ctl, we measure how fast we can
+ * receive for SECS, and how many segments GRO merged (from /net/ipifc/stats).
+ *
+ * In "loop" mode, we send to ourselves over 127.0.0.1, so IFC should be the
+ * loopback interface.  In "remote" mode, we accept one connection on PORT from
+ * another machine and read from it, so IFC should be e.g. the e1000's
+ * interface.  The sender needs to keep sending for the whole run:
+ *
+ * 	iperf -c AKAROS_IP -p PORT -t 600
+ *
+ * IFC is the interface's directory, e.g. /net/ipifc/0.
+ *
+ * Usage: tcp_gro IFC loop|remote [SECS] [PORT] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <iplib/iplib.h>
+
+#define IO_SZ (64 * 1024)
+#define STATS_FILE "/net/ipifc/stats"
+
+static char *gro_settings[] = {"off", "on"};
+static unsigned long total_bytes;
+
+static void *reader(void *arg)
+{
+	int fd = (int)(long)arg;
+	char *buf = malloc(IO_SZ);
+	ssize_t amt;
+
+	if (!buf)
+		return NULL;
+	while ((amt = read(fd, buf, IO_SZ)) > 0)
+		__sync_fetch_and_add(&total_bytes, amt);
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	int fd = (int)(long)arg;
+	char *buf = calloc(1, IO_SZ);
+
+	if (!buf)
+		return NULL;
+	while (write(fd, buf, IO_SZ) > 0)
+		;
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static int start_thread(void *(*fn)(void *), int fd)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, fn, (void*)(long)fd))
+		return -1;
+	pthread_detach(thread);
+	return 0;
+}
+
+static int set_gro(char *ifc, char *setting)
+{
+	char path[128], buf[32];
+	int fd, len, ret;
+
+	snprintf(path, sizeof(path), "%s/ctl", ifc);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	len = snprintf(buf, sizeof(buf), "gro %s", setting);
+	ret = write(fd, buf, len);
+	close(fd);
+	return ret == len ? 0 : -1;
+}
+
+static unsigned long get_stat(char *buf, const char *name)
+{
+	char *p = strstr(buf, name);
+
+	if (!p)
+		return 0;
+	p = strchr(p, ':');
+	return p ? strtoul(p + 1, 0, 0) : 0;
+}
+
+static void read_gro_stats(unsigned long *merged, unsigned long *flushed)
+{
+	char buf[4096];
+	int fd = open(STATS_FILE, O_RDONLY);
+	ssize_t amt;
+
+	*merged = *flushed = 0;
+	if (fd < 0)
+		return;
+	amt = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (amt <= 0)
+		return;
+	buf[amt] = 0;
+	*merged = get_stat(buf, "GroMerged");
+	*flushed = get_stat(buf, "GroFlushed");
+}
+
+/* Connects to ourselves on port, sending from a writer thread.  Returns the
+ * FD to read from. */
+static int setup_loop(int port)
+{
+	char adir[40], ldir[40], addr[64];
+	int afd, lcfd, dfd, rfd;
+
+	snprintf(addr, sizeof(addr), "tcp!*!%d", port);
+	afd = announce9(addr, adir, 0);
+	if (afd < 0)
+		return -1;
+	snprintf(addr, sizeof(addr), "tcp!127.0.0.1!%d", port);
+	dfd = dial9(addr, 0, 0, 0, 0);
+	if (dfd < 0)
+		return -1;
+	lcfd = listen9(adir, ldir, 0);
+	if (lcfd < 0)
+		return -1;
+	rfd = accept9(lcfd, ldir);
+	close(lcfd);
+	if (rfd < 0 || start_thread(writer, dfd))
+		return -1;
+	return rfd;
+}
+
+/* Waits for a remote sender on port.  Returns the FD to read from. */
+static int setup_remote(int port)
+{
+	char adir[40], ldir[40], addr[64];
+	int afd, lcfd, rfd;
+
+	snprintf(addr, sizeof(addr), "tcp!*!%d", port);
+	afd = announce9(addr, adir, 0);
+	if (afd < 0)
+		return -1;
+	printf("Waiting for a sender on port %d\n", port);
+	lcfd = listen9(adir, ldir, 0);
+	if (lcfd < 0)
+		return -1;
+	rfd = accept9(lcfd, ldir);
+	close(lcfd);
+	return rfd;
+}
+
+static void measure(char *setting, int secs)
+{
+	unsigned long bytes, merged, flushed, merged_0, flushed_0;
+	uint64_t start, nsec;
+
+	read_gro_stats(&merged_0, &flushed_0);
+	bytes = __sync_fetch_and_add(&total_bytes, 0);
+	start = read_tsc();
+	sleep(secs);
+	bytes = __sync_fetch_and_add(&total_bytes, 0) - bytes;
+	nsec = tsc2nsec(read_tsc() - start);
+	read_gro_stats(&merged, &flushed);
+	merged -= merged_0;
+	flushed -= flushed_0;
+	printf("%10s %15lu %15lu %15.2f\n", setting, bytes * 1000 / nsec,
+	       merged, flushed ? 1.0 + (double)merged / flushed : 1.0);
+}
+
+int main(int argc, char **argv)
+{
+	char *ifc;
+	int secs = 5;
+	int port = 5001;
+	int rfd;
+
+	if (argc < 3) {
+		printf("Usage: %s IFC loop|remote [SECS] [PORT]\n", argv[0]);
+		exit(-1);
+	}
+	ifc = argv[1];
+	if (argc > 3)
+		secs = atoi(argv[3]);
+	if (argc > 4)
+		port = atoi(argv[4]);
+	if (!strcmp(argv[2], "loop")) {
+		rfd = setup_loop(port);
+	} else if (!strcmp(argv[2], "remote")) {
+		rfd = setup_remote(port);
+	} else {
+		printf("Usage: %s IFC loop|remote [SECS] [PORT]\n", argv[0]);
+		exit(-1);
+	}
+	if (rfd < 0 || start_thread(reader, rfd)) {
+		perror("setup");
+		exit(-1);
+	}
+
+	printf("%10s %15s %15s %15s\n", "gro", "MB/s", "segs merged",
+	       "segs/pkt");
+	for (int i = 0; i < COUNT_OF(gro_settings); i++) {
+		if (set_gro(ifc, gro_settings[i])) {
+			printf("Can't set gro %s, skipping\n", gro_settings[i]);
+			continue;
+		}
+		sleep(1);
+		measure(gro_settings[i], secs);
+	}
+	set_gro(ifc, "on");
+	return 0;
+}
@@ -0,0 +1,159 @@
+/* tcp_idle_conns: measures the cost of TCP's timer tick with lots of idle
+ * connections.
+ *
+ * We connect NR_CONNS times to ourselves over loopback and turn on keepalives
+ * on both ends of every connection, with a period longer than the run.  Then
+ * nothing happens on those connections; all the kernel does is run its TCP
+ * timer tick every MSPTICK.  We read /net/tcp/stats before and after sleeping
+ * for a while, and report the time spent per tick in the timer wheel, both
+ * with no connections and with all of them.
+ *
+ * Each connection is two TCP convs, and we stop early if we run out of convs
+ * (see MaxConn in /net/tcp/stats) or FDs.
+ *
+ * Usage: tcp_idle_conns [NR_CONNS] [SECS] [PORT] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <parlib/parlib.h>
+#include <iplib/iplib.h>
+
+#define STATS_FILE "/net/tcp/stats"
+#define KA_MSEC 600000
+
+struct timer_stats {
+	unsigned long			ticks;
+	unsigned long			cascaded;
+	unsigned long			tick_us;
+};
+
+static unsigned long get_stat(char *buf, const char *name)
+{
+	char *p = strstr(buf, name);
+
+	if (!p)
+		return 0;
+	p = strchr(p, ':');
+	return p ? strtoul(p + 1, 0, 0) : 0;
+}
+
+static void read_timer_stats(struct timer_stats *ts)
+{
+	char buf[4096];
+	int fd = open(STATS_FILE, O_RDONLY);
+	ssize_t amt;
+
+	memset(ts, 0, sizeof(struct timer_stats));
+	if (fd < 0)
+		return;
+	amt = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (amt <= 0)
+		return;
+	buf[amt] = 0;
+	ts->ticks = get_stat(buf, "TimerTicks");
+	ts->cascaded = get_stat(buf, "TimersCascaded");
+	ts->tick_us = get_stat(buf, "TimerTickUs");
+}
+
+static void measure(const char *what, int secs)
+{
+	struct timer_stats before, after;
+	unsigned long ticks;
+
+	read_timer_stats(&before);
+	sleep(secs);
+	read_timer_stats(&after);
+	ticks = after.ticks - before.ticks;
+	if (!ticks) {
+		printf("%s: no timer ticks, is TCP running?\n", what);
+		return;
+	}
+	printf("%s: %lu ticks, %lu ns/tick, %lu cascades/tick\n", what, ticks,
+	       (after.tick_us - before.tick_us) * 1000 / ticks,
+	       (after.cascaded - before.cascaded) / ticks);
+}
+
+static int set_keepalive(int ctl)
+{
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "keepalive %d", KA_MSEC);
+	return write(ctl, buf, len) == len ? 0 : -1;
+}
+
+/* Returns 0 if we made one more connection. */
+static int connect_one(char *adir, char *addr)
+{
+	char ldir[40];
+	int cfd, dfd, lcfd, adfd;
+
+	dfd = dial9(addr, 0, 0, &cfd, 0);
+	if (dfd < 0)
+		return -1;
+	if (set_keepalive(cfd)) {
+		perror("keepalive");
+		close(cfd);
+		close(dfd);
+		return -1;
+	}
+	close(cfd);
+	lcfd = listen9(adir, ldir, 0);
+	if (lcfd < 0) {
+		close(dfd);
+		return -1;
+	}
+	adfd = accept9(lcfd, ldir);
+	if (adfd < 0) {
+		close(lcfd);
+		close(dfd);
+		return -1;
+	}
+	set_keepalive(lcfd);
+	close(lcfd);
+	/* Leak dfd and adfd, they keep the connection open until we exit. */
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_conns = 100000;
+	int secs = 5;
+	int port = 7777;
+	char adir[40], addr[64], what[64];
+	int afd, i;
+
+	if (argc > 1)
+		nr_conns = atoi(argv[1]);
+	if (argc > 2)
+		secs = atoi(argv[2]);
+	if (argc > 3)
+		port = atoi(argv[3]);
+	if (nr_conns < 1 || secs < 1) {
+		printf("Usage: %s [NR_CONNS] [SECS] [PORT]\n", argv[0]);
+		exit(-1);
+	}
+	measure("0 conns", secs);
+
+	snprintf(addr, sizeof(addr), "tcp!*!%d", port);
+	afd = announce9(addr, adir, 0);
+	if (afd < 0) {
+		perror("announce");
+		exit(-1);
+	}
+	snprintf(addr, sizeof(addr), "tcp!127.0.0.1!%d", port);
+	for (i = 0; i < nr_conns; i++) {
+		if (connect_one(adir, addr)) {
+			printf("Stopped after %d conns\n", i);
+			break;
+		}
+	}
+	snprintf(what, sizeof(what), "%d idle conns", i);
+	measure(what, secs);
+	return 0;
+}
@@ -0,0 +1,157 @@
+/* tcp_rx_scale: measures aggregate TCP receive throughput with many flows, for
+ * different numbers of IP receive workers.
+ *
+ * We accept NR_FLOWS connections on PORT, then read from all of them, one
+ * thread per flow.  The senders are on another machine, e.g.:
+ *
+ * 	iperf -c AKAROS_IP -p PORT -P NR_FLOWS -t 600
+ *
+ * Once every flow is up, we step through a few settings of the interface's
+ * "rxqueues" ctl, which says how many per-core workers the ethernet medium
+ * spreads IPv4 receive processing over.  0 is the old behavior, where one
+ * ktask does all of it.  For each setting, we report the throughput over SECS.
+ * The senders need to keep sending for the whole run.  Most workers are on CG
+ * cores, which MCPs would get, so at the end we go back to the default.
+ *
+ * IFC is the interface's directory, e.g. /net/ipifc/0.
+ *
+ * Usage: tcp_rx_scale IFC [NR_FLOWS] [SECS] [PORT] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <iplib/iplib.h>
+
+#define READ_SZ (64 * 1024)
+
+static unsigned int rxq_settings[] = {0, 1, 2, 4, 8, 16};
+static unsigned long total_bytes;
+
+static void *reader(void *arg)
+{
+	int fd = (int)(long)arg;
+	char *buf = malloc(READ_SZ);
+	ssize_t amt;
+
+	if (!buf)
+		return NULL;
+	while ((amt = read(fd, buf, READ_SZ)) > 0)
+		__sync_fetch_and_add(&total_bytes, amt);
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static int set_rxqueues(char *ifc, char *val)
+{
+	char path[128], buf[32];
+	int fd, len, ret;
+
+	snprintf(path, sizeof(path), "%s/ctl", ifc);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	len = snprintf(buf, sizeof(buf), "rxqueues %s", val);
+	ret = write(fd, buf, len);
+	close(fd);
+	return ret == len ? 0 : -1;
+}
+
+/* Returns 0 if we accepted another flow. */
+static int accept_one(char *adir)
+{
+	char ldir[40];
+	int lcfd, dfd;
+	pthread_t thread;
+
+	lcfd = listen9(adir, ldir, 0);
+	if (lcfd < 0)
+		return -1;
+	dfd = accept9(lcfd, ldir);
+	close(lcfd);
+	if (dfd < 0)
+		return -1;
+	if (pthread_create(&thread, NULL, reader, (void*)(long)dfd)) {
+		close(dfd);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/* Returns the receive throughput in MB/s over secs. */
+static unsigned long measure(int secs)
+{
+	unsigned long bytes;
+	uint64_t start, nsec;
+
+	bytes = __sync_fetch_and_add(&total_bytes, 0);
+	start = read_tsc();
+	sleep(secs);
+	bytes = __sync_fetch_and_add(&total_bytes, 0) - bytes;
+	nsec = tsc2nsec(read_tsc() - start);
+	return bytes * 1000 / nsec;
+}
+
+int main(int argc, char **argv)
+{
+	char *ifc;
+	int nr_flows = 64;
+	int secs = 5;
+	int port = 5001;
+	char adir[40], addr[64], val[16];
+	int afd, i;
+
+	if (argc < 2) {
+		printf("Usage: %s IFC [NR_FLOWS] [SECS] [PORT]\n", argv[0]);
+		exit(-1);
+	}
+	ifc = argv[1];
+	if (argc > 2)
+		nr_flows = atoi(argv[2]);
+	if (argc > 3)
+		secs = atoi(argv[3]);
+	if (argc > 4)
+		port = atoi(argv[4]);
+	if (nr_flows < 1 || secs < 1) {
+		printf("Usage: %s IFC [NR_FLOWS] [SECS] [PORT]\n", argv[0]);
+		exit(-1);
+	}
+
+	snprintf(addr, sizeof(addr), "tcp!*!%d", port);
+	afd = announce9(addr, adir, 0);
+	if (afd < 0) {
+		perror("announce");
+		exit(-1);
+	}
+	printf("Waiting for %d flows on port %d\n", nr_flows, port);
+	for (i = 0; i < nr_flows; i++) {
+		if (accept_one(adir)) {
+			printf("Stopped after %d flows\n", i);
+			break;
+		}
+	}
+	if (!i)
+		exit(-1);
+
+	printf("%10s %15s   (%d flows)\n", "rxqueues", "MB/s", i);
+	for (i = 0; i < COUNT_OF(rxq_settings); i++) {
+		snprintf(val, sizeof(val), "%u", rxq_settings[i]);
+		if (set_rxqueues(ifc, val)) {
+			printf("Can't set rxqueues %u, skipping\n",
+			       rxq_settings[i]);
+			continue;
+		}
+		/* Let the flows settle after moving between workers */
+		sleep(1);
+		printf("%10u %15lu\n", rxq_settings[i], measure(secs));
+	}
+	set_rxqueues(ifc, "default");
+	return 0;
+}
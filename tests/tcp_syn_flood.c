@@ -0,0 +1,330 @@
+/* tcp_syn_flood: floods a local TCP listener with SYNs from made up addresses,
+ * to check that SYN cookies kick in once limbo is full, and that the ACKs to
+ * cookie SYN ACKs turn into connections.
+ *
+ * We make an IP interface on the "pkt" medium, which hands the packets it is
+ * given to IP input, and hands us everything routed out of it.  Then we send
+ * NR_SYNS SYNs to a listener on PORT, each from a different address behind
+ * that interface, with the MSS, window scale, SACK and timestamp options.  A
+ * reader thread collects the SYN ACKs, and ACKs every ACK_EVERY'th one to
+ * complete the handshake.  With more SYNs than fit in limbo (see Maxlimbo),
+ * most of the SYN ACKs are cookies.
+ *
+ * At the end, we print how fast we handled SYNs and the limbo and cookie
+ * stats from /net/tcp/stats.  We also check that no SYN ACK's TS val is ahead
+ * of the kernel's clock, which would make the other side's PAWS drop the data
+ * that follows it.
+ *
+ * Usage: tcp_syn_flood [NR_SYNS] [ACK_EVERY] [PORT] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <iplib/iplib.h>
+
+#define STATS_FILE "/net/tcp/stats"
+#define IFC_ADDR "10.254.0.1"
+#define IFC_MASK "255.255.0.0"
+/* SYNs we let get ahead of the SYN ACKs, so we don't overrun the ifc's queue */
+#define MAX_IN_FLIGHT 256
+
+#define IP_HLEN 20
+#define TCP_HLEN 20
+#define TCP_ACK 0x10
+#define TCP_SYN 0x02
+
+static const char *stat_names[] = {
+	"LimboOverflows",
+	"SynCookiesSent",
+	"SynCookiesAccepted",
+	"SynCookiesFailed",
+	"PassiveOpens",
+};
+
+static uint8_t ifc_addr[IPv4addrlen];
+static int data_fd;
+static int ack_every = 25;
+static unsigned long nr_synacks, nr_acks, nr_future_ts;
+
+static uint16_t csum_add(uint32_t sum, uint8_t *p, int len)
+{
+	for (; len > 1; p += 2, len -= 2)
+		sum += p[0] << 8 | p[1];
+	if (len)
+		sum += p[0] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* Sends an IPv4 TCP segment with options opt, of optlen bytes, and no data,
+ * from src!sport to our interface. */
+static int send_seg(uint8_t *src, uint16_t sport, uint16_t dport,
+		    uint32_t seq, uint32_t ack, uint8_t flags, uint8_t *opt,
+		    int optlen)
+{
+	uint8_t pkt[IP_HLEN + TCP_HLEN + 40];
+	uint8_t *ip = pkt, *th = pkt + IP_HLEN;
+	int tcplen = TCP_HLEN + optlen;
+	uint8_t ph[12];
+	uint16_t sum;
+
+	memset(pkt, 0, sizeof(pkt));
+	ip[0] = 0x45;
+	hnputs(ip + 2, IP_HLEN + tcplen);
+	ip[8] = 64;
+	ip[9] = IP_TCPPROTO;
+	memcpy(ip + 12, src, IPv4addrlen);
+	memcpy(ip + 16, ifc_addr, IPv4addrlen);
+	hnputs(ip + 10, ~csum_add(0, ip, IP_HLEN));
+
+	hnputs(th, sport);
+	hnputs(th + 2, dport);
+	hnputl(th + 4, seq);
+	hnputl(th + 8, ack);
+	th[12] = (tcplen / 4) << 4;
+	th[13] = flags;
+	hnputs(th + 14, 65535);
+	memcpy(th + TCP_HLEN, opt, optlen);
+
+	memcpy(ph, ip + 12, 8);
+	ph[8] = 0;
+	ph[9] = IP_TCPPROTO;
+	hnputs(ph + 10, tcplen);
+	sum = csum_add(csum_add(0, ph, sizeof(ph)), th, tcplen);
+	hnputs(th + 16, ~sum);
+
+	if (write(data_fd, pkt, IP_HLEN + tcplen) != IP_HLEN + tcplen)
+		return -1;
+	return 0;
+}
+
+static void fake_addr(uint8_t *a, int i)
+{
+	a[0] = 10;
+	a[1] = 254;
+	a[2] = 1 + (i / 250) % 254;
+	a[3] = 1 + i % 250;
+}
+
+static uint16_t fake_port(int i)
+{
+	return 10000 + i % 50000;
+}
+
+static int send_syn(int i, uint16_t port)
+{
+	uint8_t opt[20], src[IPv4addrlen];
+
+	/* MSS, SACK_OK, TS, NOP, WS */
+	opt[0] = 2;
+	opt[1] = 4;
+	hnputs(opt + 2, 1460);
+	opt[4] = 4;
+	opt[5] = 2;
+	opt[6] = 8;
+	opt[7] = 10;
+	hnputl(opt + 8, 1 + i);
+	hnputl(opt + 12, 0);
+	opt[16] = 1;
+	opt[17] = 3;
+	opt[18] = 3;
+	opt[19] = 7;
+	fake_addr(src, i);
+	return send_seg(src, fake_port(i), port, i * 1000, 0, TCP_SYN, opt,
+			sizeof(opt));
+}
+
+/* Returns the TS val in the options of th, or 0. */
+static uint32_t get_tsval(uint8_t *th)
+{
+	int hlen = (th[12] >> 4) * 4;
+	uint8_t *opt = th + TCP_HLEN, *end = th + hlen;
+
+	while (opt < end && *opt) {
+		if (*opt == 1) {
+			opt++;
+			continue;
+		}
+		if (opt + 1 >= end || opt[1] < 2)
+			break;
+		if (*opt == 8 && opt[1] == 10)
+			return nhgetl(opt + 2);
+		opt += opt[1];
+	}
+	return 0;
+}
+
+/* Completes the handshake for a SYN ACK, echoing its TS val. */
+static void send_ack(uint8_t *ip, uint8_t *th)
+{
+	uint8_t opt[12];
+
+	opt[0] = 1;
+	opt[1] = 1;
+	opt[2] = 8;
+	opt[3] = 10;
+	hnputl(opt + 4, 1);
+	hnputl(opt + 8, get_tsval(th));
+	if (!send_seg(ip + 16, nhgets(th + 2), nhgets(th), nhgetl(th + 8),
+		      nhgetl(th + 4) + 1, TCP_ACK, opt, sizeof(opt)))
+		__sync_fetch_and_add(&nr_acks, 1);
+}
+
+static void *reader(void *arg)
+{
+	uint8_t buf[4096];
+	uint8_t *th;
+	ssize_t amt;
+	unsigned long n;
+	uint32_t now;
+
+	while ((amt = read(data_fd, buf, sizeof(buf))) > 0) {
+		if (amt < IP_HLEN + TCP_HLEN || buf[0] != 0x45 ||
+		    buf[9] != IP_TCPPROTO)
+			continue;
+		th = buf + IP_HLEN;
+		if ((th[13] & (TCP_SYN | TCP_ACK)) != (TCP_SYN | TCP_ACK))
+			continue;
+		/* The kernel's TS clock is milliseconds of the TSC */
+		now = tsc2msec(read_tsc());
+		if ((int32_t)(get_tsval(th) - now) > 0)
+			__sync_fetch_and_add(&nr_future_ts, 1);
+		n = __sync_fetch_and_add(&nr_synacks, 1);
+		if (ack_every && n % ack_every == 0)
+			send_ack(buf, th);
+	}
+	return NULL;
+}
+
+/* Makes a pkt interface, returning the FD for its data. */
+static int setup_ifc(void)
+{
+	char buf[64], path[64];
+	int cfd, n;
+
+	cfd = open("/net/ipifc/clone", O_RDWR);
+	if (cfd < 0)
+		return -1;
+	n = read(cfd, buf, sizeof(buf) - 1);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+	snprintf(path, sizeof(path), "/net/ipifc/%d/data", atoi(buf));
+	if (write(cfd, "bind pkt", 8) != 8)
+		return -1;
+	n = snprintf(buf, sizeof(buf), "add %s %s", IFC_ADDR, IFC_MASK);
+	if (write(cfd, buf, n) != n)
+		return -1;
+	/* Leak cfd: the ifc goes away when we close it */
+	return open(path, O_RDWR);
+}
+
+static void read_stats(unsigned long *vals)
+{
+	char buf[4096];
+	int fd = open(STATS_FILE, O_RDONLY);
+	ssize_t amt;
+	char *p;
+
+	memset(vals, 0, sizeof(unsigned long) * COUNT_OF(stat_names));
+	if (fd < 0)
+		return;
+	amt = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (amt <= 0)
+		return;
+	buf[amt] = 0;
+	for (int i = 0; i < COUNT_OF(stat_names); i++) {
+		p = strstr(buf, stat_names[i]);
+		if (p)
+			p = strchr(p, ':');
+		vals[i] = p ? strtoul(p + 1, 0, 0) : 0;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int nr_syns = 5000;
+	int port = 7779;
+	unsigned long before[COUNT_OF(stat_names)];
+	unsigned long after[COUNT_OF(stat_names)];
+	char adir[40], addr[64];
+	pthread_t thread;
+	uint64_t start, nsec;
+	int afd;
+
+	if (argc > 1)
+		nr_syns = atoi(argv[1]);
+	if (argc > 2)
+		ack_every = atoi(argv[2]);
+	if (argc > 3)
+		port = atoi(argv[3]);
+	if (nr_syns < 1 || ack_every < 0) {
+		printf("Usage: %s [NR_SYNS] [ACK_EVERY] [PORT]\n", argv[0]);
+		exit(-1);
+	}
+
+	snprintf(addr, sizeof(addr), "tcp!*!%d", port);
+	afd = announce9(addr, adir, 0);
+	if (afd < 0) {
+		perror("announce");
+		exit(-1);
+	}
+	v4parseip(ifc_addr, IFC_ADDR);
+	data_fd = setup_ifc();
+	if (data_fd < 0) {
+		perror("pkt ifc");
+		exit(-1);
+	}
+	if (pthread_create(&thread, NULL, reader, NULL)) {
+		perror("reader");
+		exit(-1);
+	}
+	pthread_detach(thread);
+
+	read_stats(before);
+	start = read_tsc();
+	for (int i = 0; i < nr_syns; i++) {
+		while (i > __sync_fetch_and_add(&nr_synacks, 0) + MAX_IN_FLIGHT)
+			sched_yield();
+		if (send_syn(i, port)) {
+			perror("send SYN");
+			exit(-1);
+		}
+	}
+	nsec = tsc2nsec(read_tsc() - start);
+	/* Let the last SYN ACKs and ACKs get through */
+	sleep(1);
+	read_stats(after);
+
+	printf("%d SYNs in %lu usec, %lu SYNs/s\n", nr_syns, nsec / 1000,
+	       nsec ? nr_syns * 1000000000UL / nsec : 0);
+	printf("%lu SYN ACKs, %lu ACKs sent\n",
+	       __sync_fetch_and_add(&nr_synacks, 0),
+	       __sync_fetch_and_add(&nr_acks, 0));
+	for (int i = 0; i < COUNT_OF(stat_names); i++)
+		printf("%20s: %lu\n", stat_names[i], after[i] - before[i]);
+
+	if (__sync_fetch_and_add(&nr_synacks, 0) < nr_syns) {
+		printf("FAILED: some SYNs got no SYN ACK\n");
+		exit(-1);
+	}
+	if (after[0] != before[0] && ack_every && after[2] == before[2]) {
+		printf("FAILED: no cookies were accepted\n");
+		exit(-1);
+	}
+	if (nr_future_ts) {
+		printf("FAILED: %lu SYN ACKs had TS vals from the future\n",
+		       nr_future_ts);
+		exit(-1);
+	}
+	return 0;
+}
@@ -0,0 +1,105 @@
+/* vmr_fault_lat: measures anonymous page fault latency as the number of VMRs
+ * in the address space grows.
+ *
+ * For each step, we add filler VMRs (one page each, alternating prots so they
+ * don't merge), then have every thread fault in its own region, one page at a
+ * time.  With a linear VMR lookup, the cost per fault grows with the number of
+ * VMRs.  With more than one thread, faults on different vcores also compete
+ * for whatever locks the fault path takes.
+ *
+ * Usage: vmr_fault_lat [MAX_VMRS] [NR_THREADS] [NR_PGS] */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+
+static size_t nr_pgs = 1024;
+static int nr_threads = 1;
+static pthread_barrier_t barrier;
+static uint64_t *fault_ticks;
+
+static void *fault_thread(void *arg)
+{
+	long id = (long)arg;
+	uint64_t start;
+	char *region;
+
+	region = mmap(0, nr_pgs * PGSIZE, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) {
+		perror("mmap region");
+		exit(-1);
+	}
+	pthread_barrier_wait(&barrier);
+	start = read_tsc();
+	for (size_t i = 0; i < nr_pgs; i++)
+		region[i * PGSIZE] = 1;
+	fault_ticks[id] = read_tsc() - start;
+	pthread_barrier_wait(&barrier);
+	munmap(region, nr_pgs * PGSIZE);
+	return 0;
+}
+
+static void add_filler_vmrs(size_t nr)
+{
+	static int nr_filler;
+	void *addr;
+
+	for (size_t i = 0; i < nr; i++, nr_filler++) {
+		addr = mmap(0, PGSIZE, nr_filler % 2 ? PROT_READ :
+			    PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED) {
+			perror("mmap filler");
+			exit(-1);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t max_vmrs = 16384;
+	size_t nr_vmrs = 0;
+	pthread_t *threads;
+	uint64_t total;
+
+	if (argc > 1)
+		max_vmrs = atol(argv[1]);
+	if (argc > 2)
+		nr_threads = atoi(argv[2]);
+	if (argc > 3)
+		nr_pgs = atol(argv[3]);
+	if (nr_threads < 1 || !nr_pgs) {
+		printf("Usage: %s [MAX_VMRS] [NR_THREADS] [NR_PGS]\n", argv[0]);
+		exit(-1);
+	}
+	threads = malloc(sizeof(pthread_t) * nr_threads);
+	fault_ticks = malloc(sizeof(uint64_t) * nr_threads);
+	assert(threads && fault_ticks);
+
+	printf("%10s %10s %14s\n", "VMRs", "threads", "ns/fault");
+	for (size_t step = 1; ; step *= 4) {
+		add_filler_vmrs(step - nr_vmrs);
+		nr_vmrs = step;
+		pthread_barrier_init(&barrier, NULL, nr_threads);
+		for (long i = 0; i < nr_threads; i++)
+			pthread_create(&threads[i], NULL, fault_thread,
+				       (void*)i);
+		total = 0;
+		for (int i = 0; i < nr_threads; i++) {
+			pthread_join(threads[i], NULL);
+			total += fault_ticks[i];
+		}
+		pthread_barrier_destroy(&barrier);
+		printf("%10lu %10d %14lu\n", nr_vmrs, nr_threads,
+		       tsc2nsec(total) / (nr_pgs * nr_threads));
+		if (step >= max_vmrs)
+			break;
+	}
+	return 0;
+}
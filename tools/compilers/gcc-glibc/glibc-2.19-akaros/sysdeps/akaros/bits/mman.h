@@ -66,6 +66,11 @@
 # define MAP_STACK	0x20000		/* Allocation is for a stack.  */
 #endif
 
+/* These are Akaros-specific.  */
+#ifdef __USE_MISC
+# define MAP_JUMBO	0x40000		/* Back with jumbo pages if possible.  */
+#endif
+
 /* Flags to `msync'.  */
 #define MS_ASYNC	1		/* Sync memory asynchronously.  */
 #define MS_SYNC		4		/* Synchronous memory sync.  */